@@ -0,0 +1,535 @@
+// Microbenchmarks for the parser, cache, response buffer and file_share
+// primitives.
+//
+// Results are written one JSON object per line so they can be kept as a
+// baseline and compared against later runs:
+//
+//   ./bench/microbench --out bench/baseline.jsonl
+//   ./bench/microbench --compare bench/baseline.jsonl --threshold 10
+//
+// The modules under test log every operation with printf, so stdout is
+// pointed at /dev/null while benchmarks run and the report is written to a
+// duplicate of the original stdout.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "proxy_parse.h"
+#include "cache.h"
+#include "file_share.h"
+#include "buffer_chain.h"
+
+#define MAX_RESULTS 256
+#define MAX_SIZES 16
+#define MAX_THREAD_COUNTS 16
+#define CACHE_VALUE_SIZE 64
+#define DEFAULT_RUN_MS 200
+#define DEFAULT_THRESHOLD 10.0
+
+struct bench_result {
+    char name[96];
+    double ns_per_op;
+    long ops;
+};
+
+static struct bench_result results[MAX_RESULTS];
+static int result_count = 0;
+
+static int run_ms = DEFAULT_RUN_MS;
+static int sizes[MAX_SIZES] = {1000, 10000};
+static int size_count = 2;
+static int thread_counts[MAX_THREAD_COUNTS] = {1, 4, 16, 64};
+static int thread_count_n = 4;
+static const char* filter = NULL;
+static FILE* report = NULL;
+
+static double now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int selected(const char* name){
+    return !filter || strstr(name, filter) != NULL;
+}
+
+static void record(const char* name, double elapsed_ns, long ops){
+    if(result_count >= MAX_RESULTS || ops <= 0) return;
+    struct bench_result* r = &results[result_count++];
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->ns_per_op = elapsed_ns / ops;
+    r->ops = ops;
+    fprintf(report, "%-44s %14.1f ns/op %12ld ops\n", r->name, r->ns_per_op, r->ops);
+    fflush(report);
+}
+
+// ---------------------------------------------------------------------------
+// Parser
+// ---------------------------------------------------------------------------
+
+static const char* corpus_names[] = {"curl", "browser", "proxy_absolute", "large_cookie"};
+
+static char corpus_large[8192];
+
+static const char* corpus[] = {
+    "GET /find/test.txt HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "User-Agent: curl/7.88.1\r\n"
+    "Accept: */*\r\n"
+    "\r\n",
+
+    "GET /static/js/app.3f9c2a.js HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Accept: */*\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Dest: script\r\n"
+    "Referer: https://www.example.com/\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "If-None-Match: \"5f3a-17c0b2\"\r\n"
+    "\r\n",
+
+    "GET http://origin.example.net:8000/api/v1/items?page=3&limit=50 HTTP/1.1\r\n"
+    "Host: origin.example.net:8000\r\n"
+    "User-Agent: ProxyClient/2.1\r\n"
+    "Accept: application/json\r\n"
+    "Proxy-Connection: keep-alive\r\n"
+    "\r\n",
+
+    corpus_large
+};
+
+#define CORPUS_COUNT ((int)(sizeof(corpus_names) / sizeof(corpus_names[0])))
+
+static void build_large_corpus(){
+    int n = snprintf(corpus_large, sizeof(corpus_large),
+        "GET /dashboard/reports/2024/summary HTTP/1.1\r\n"
+        "Host: intranet.example.org\r\n"
+        "Cookie: ");
+    for(int i = 0; i < 40 && n < (int)sizeof(corpus_large) - 200; i++) {
+        n += snprintf(corpus_large + n, sizeof(corpus_large) - n,
+                      "%ssession_attr_%02d=%08x%08x", i ? "; " : "", i, i * 2654435761u, i * 40503u);
+    }
+    n += snprintf(corpus_large + n, sizeof(corpus_large) - n, "\r\n");
+    for(int i = 0; i < 30 && n < (int)sizeof(corpus_large) - 100; i++) {
+        n += snprintf(corpus_large + n, sizeof(corpus_large) - n,
+                      "X-Trace-Header-%02d: value-%d-abcdefghijklmnop\r\n", i, i);
+    }
+    snprintf(corpus_large + n, sizeof(corpus_large) - n, "\r\n");
+}
+
+static void bench_parser(){
+    char name[96];
+    char out[16384];
+
+    for(int c = 0; c < CORPUS_COUNT; c++) {
+        const char* buf = corpus[c];
+        int len = strlen(buf);
+
+        snprintf(name, sizeof(name), "parse/%s", corpus_names[c]);
+        if(selected(name)) {
+            long ops = 0;
+            double start = now_ns(), deadline = start + run_ms * 1e6, end;
+            do {
+                for(int i = 0; i < 256; i++) {
+                    struct ParsedRequest* req = ParsedRequest_create();
+                    ParsedRequest_parse(req, buf, len);
+                    ParsedRequest_destroy(req);
+                }
+                ops += 256;
+            } while((end = now_ns()) < deadline);
+            record(name, end - start, ops);
+        }
+
+        snprintf(name, sizeof(name), "unparse/%s", corpus_names[c]);
+        if(selected(name)) {
+            struct ParsedRequest* req = ParsedRequest_create();
+            ParsedRequest_parse(req, buf, len);
+            long ops = 0;
+            double start = now_ns(), deadline = start + run_ms * 1e6, end;
+            do {
+                for(int i = 0; i < 256; i++) {
+                    ParsedRequest_unparse(req, out, sizeof(out));
+                }
+                ops += 256;
+            } while((end = now_ns()) < deadline);
+            ParsedRequest_destroy(req);
+            record(name, end - start, ops);
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Cache
+// ---------------------------------------------------------------------------
+
+enum cache_op { OP_FIND_HIT, OP_FIND_MISS, OP_ADD_UPDATE };
+
+struct cache_worker {
+    pthread_t tid;
+    enum cache_op op;
+    int entries;
+    unsigned int seed;
+    double deadline;
+    long ops;
+};
+
+static void cache_key(char* key, int len, int i){
+    snprintf(key, len, "bench.example.com:80/objects/%d/item.bin", i);
+}
+
+static void cache_fill(int entries){
+    char key[128];
+    char value[CACHE_VALUE_SIZE];
+    memset(value, 'x', sizeof(value));
+
+    cache_clear();
+    for(int i = 0; i < entries; i++) {
+        cache_key(key, sizeof(key), i);
+        cache_add(value, sizeof(value), key);
+    }
+}
+
+static void* cache_worker_fn(void* arg){
+    struct cache_worker* w = arg;
+    char key[128];
+    char value[CACHE_VALUE_SIZE];
+    memset(value, 'y', sizeof(value));
+
+    do {
+        for(int i = 0; i < 16; i++) {
+            int k = rand_r(&w->seed) % w->entries;
+            switch(w->op) {
+                case OP_FIND_HIT:
+                    cache_key(key, sizeof(key), k);
+                    cache_release(cache_find(key));
+                    break;
+                case OP_FIND_MISS:
+                    cache_key(key, sizeof(key), w->entries + k);
+                    cache_release(cache_find(key));
+                    break;
+                case OP_ADD_UPDATE:
+                    cache_key(key, sizeof(key), k);
+                    cache_add(value, sizeof(value), key);
+                    break;
+            }
+        }
+        w->ops += 16;
+    } while(now_ns() < w->deadline);
+    return NULL;
+}
+
+static void bench_cache_op(const char* op_name, enum cache_op op, int entries, int threads){
+    char name[96];
+    snprintf(name, sizeof(name), "cache/%s/n=%d/t=%d", op_name, entries, threads);
+    if(!selected(name)) return;
+
+    struct cache_worker* workers = calloc(threads, sizeof(*workers));
+    if(!workers) return;
+
+    double start = now_ns();
+    for(int t = 0; t < threads; t++) {
+        workers[t].op = op;
+        workers[t].entries = entries;
+        workers[t].seed = 0x9e3779b9u * (t + 1);
+        workers[t].deadline = start + run_ms * 1e6;
+        pthread_create(&workers[t].tid, NULL, cache_worker_fn, &workers[t]);
+    }
+
+    long ops = 0;
+    for(int t = 0; t < threads; t++) {
+        pthread_join(workers[t].tid, NULL);
+        ops += workers[t].ops;
+    }
+    record(name, now_ns() - start, ops);
+    free(workers);
+}
+
+static void bench_cache_evict(int entries){
+    char name[96];
+    snprintf(name, sizeof(name), "cache/evict/n=%d", entries);
+    if(!selected(name)) return;
+
+    // Evict a tenth of the entries so the scan length stays close to n
+    int evictions = entries / 10 > 0 ? entries / 10 : 1;
+    double start = now_ns();
+    for(int i = 0; i < evictions; i++) {
+        cache_remove();
+    }
+    record(name, now_ns() - start, evictions);
+}
+
+static void bench_cache(){
+    for(int s = 0; s < size_count; s++) {
+        int entries = sizes[s];
+        cache_fill(entries);
+
+        for(int t = 0; t < thread_count_n; t++) {
+            bench_cache_op("find_hit", OP_FIND_HIT, entries, thread_counts[t]);
+            bench_cache_op("find_miss", OP_FIND_MISS, entries, thread_counts[t]);
+            bench_cache_op("add_update", OP_ADD_UPDATE, entries, thread_counts[t]);
+        }
+        bench_cache_evict(entries);
+    }
+    cache_clear();
+}
+
+// ---------------------------------------------------------------------------
+// Response accumulation: realloc growth against pooled segment chains, both
+// fed in 4 KB reads the way upstream responses arrive
+// ---------------------------------------------------------------------------
+
+#define READ_SIZE 4096
+
+static const int response_sizes[] = {64 << 10, 1 << 20, 16 << 20};
+
+static void bench_buffers(){
+    static char input[READ_SIZE];
+    memset(input, 'r', sizeof(input));
+    char name[96];
+
+    for(size_t r = 0; r < sizeof(response_sizes) / sizeof(response_sizes[0]); r++) {
+        int size = response_sizes[r];
+
+        snprintf(name, sizeof(name), "buffer/realloc/%dKB", size >> 10);
+        if(selected(name)) {
+            long ops = 0;
+            double start = now_ns(), deadline = start + run_ms * 1e6, end;
+            do {
+                char* data = malloc(1);
+                int len = 0;
+                while(data && len < size) {
+                    char* grown = realloc(data, len + READ_SIZE + 1);
+                    if(!grown) break;
+                    data = grown;
+                    memcpy(data + len, input, READ_SIZE);
+                    len += READ_SIZE;
+                }
+                free(data);
+                ops++;
+            } while((end = now_ns()) < deadline);
+            record(name, end - start, ops);
+        }
+
+        snprintf(name, sizeof(name), "buffer/chain/%dKB", size >> 10);
+        if(selected(name)) {
+            long ops = 0;
+            double start = now_ns(), deadline = start + run_ms * 1e6, end;
+            do {
+                struct buffer_chain chain;
+                chain_init(&chain);
+                while(chain.len < size) {
+                    int space;
+                    char* into = chain_reserve(&chain, &space);
+                    if(!into) break;
+                    int n = space < READ_SIZE ? space : READ_SIZE;
+                    memcpy(into, input, n);
+                    chain_commit(&chain, n);
+                }
+                chain_release(&chain);
+                ops++;
+            } while((end = now_ns()) < deadline);
+            record(name, end - start, ops);
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// File share
+// ---------------------------------------------------------------------------
+
+static const int file_sizes[] = {1 << 10, 64 << 10, 1 << 20, 16 << 20};
+
+static void bench_files(){
+    char dir[] = "/tmp/microbench.XXXXXX";
+    if(!mkdtemp(dir)) {
+        perror("[BENCH] mkdtemp failed");
+        return;
+    }
+
+    char path[256];
+    char name[96];
+    snprintf(path, sizeof(path), "%s/data.bin", dir);
+
+    for(size_t f = 0; f < sizeof(file_sizes) / sizeof(file_sizes[0]); f++) {
+        int size = file_sizes[f];
+        char* data = malloc(size);
+        if(!data) continue;
+        for(int i = 0; i < size; i++) data[i] = (char)(i * 31);
+
+        snprintf(name, sizeof(name), "file/save/%dKB", size >> 10);
+        if(selected(name)) {
+            long ops = 0;
+            double start = now_ns(), deadline = start + run_ms * 1e6, end;
+            do {
+                save_file(path, data, size);
+                ops++;
+            } while((end = now_ns()) < deadline);
+            record(name, end - start, ops);
+        }
+
+        snprintf(name, sizeof(name), "file/read/%dKB", size >> 10);
+        if(selected(name)) {
+            save_file(path, data, size);
+            long ops = 0;
+            double start = now_ns(), deadline = start + run_ms * 1e6, end;
+            do {
+                char* contents;
+                int contents_size;
+                if(read_file(path, &contents, &contents_size) == 0) free(contents);
+                ops++;
+            } while((end = now_ns()) < deadline);
+            record(name, end - start, ops);
+        }
+        free(data);
+    }
+
+    unlink(path);
+    rmdir(dir);
+}
+
+// ---------------------------------------------------------------------------
+// Baseline files
+// ---------------------------------------------------------------------------
+
+static int write_results(const char* path){
+    FILE* fp = fopen(path, "w");
+    if(!fp) {
+        fprintf(report, "[BENCH] Failed to open %s for writing\n", path);
+        return -1;
+    }
+    for(int i = 0; i < result_count; i++) {
+        fprintf(fp, "{\"name\": \"%s\", \"ns_per_op\": %.2f, \"ops\": %ld}\n",
+                results[i].name, results[i].ns_per_op, results[i].ops);
+    }
+    fclose(fp);
+    fprintf(report, "[BENCH] Wrote %d results to %s\n", result_count, path);
+    return 0;
+}
+
+// Returns the number of benchmarks slower than the baseline by more than
+// threshold percent, or -1 if the baseline cannot be read.
+static int compare_results(const char* path, double threshold){
+    FILE* fp = fopen(path, "r");
+    if(!fp) {
+        fprintf(report, "[BENCH] Failed to open baseline %s\n", path);
+        return -1;
+    }
+
+    int regressions = 0, matched = 0;
+    char line[512];
+    fprintf(report, "\n%-44s %12s %12s %9s\n", "benchmark", "baseline", "current", "change");
+    while(fgets(line, sizeof(line), fp)) {
+        char name[96];
+        double base_ns;
+        long base_ops;
+        if(sscanf(line, " {\"name\": \"%95[^\"]\", \"ns_per_op\": %lf, \"ops\": %ld}",
+                  name, &base_ns, &base_ops) != 3) {
+            continue;
+        }
+        for(int i = 0; i < result_count; i++) {
+            if(strcmp(results[i].name, name) != 0) continue;
+            double change = (results[i].ns_per_op - base_ns) * 100.0 / base_ns;
+            int regressed = change > threshold;
+            fprintf(report, "%-44s %12.1f %12.1f %+8.1f%%%s\n",
+                    name, base_ns, results[i].ns_per_op, change, regressed ? "  REGRESSION" : "");
+            regressions += regressed;
+            matched++;
+            break;
+        }
+    }
+    fclose(fp);
+    fprintf(report, "[BENCH] %d benchmarks compared, %d regressed beyond %.1f%%\n",
+            matched, regressions, threshold);
+    return regressions;
+}
+
+static int parse_int_list(const char* arg, int* out, int max){
+    int n = 0;
+    char* copy = strdup(arg);
+    if(!copy) return 0;
+    for(char* tok = strtok(copy, ","); tok && n < max; tok = strtok(NULL, ",")) {
+        int v = atoi(tok);
+        if(v > 0) out[n++] = v;
+    }
+    free(copy);
+    return n;
+}
+
+static void usage(const char* prog){
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  --out FILE          Write results as JSON lines to FILE\n"
+        "  --compare FILE      Compare results against baseline FILE\n"
+        "  --threshold PCT     Regression threshold in percent (default %.0f)\n"
+        "  --sizes N,N,...     Cache entry counts (default 1000,10000)\n"
+        "  --threads N,N,...   Cache thread counts (default 1,4,16,64)\n"
+        "  --time MS           Run time per benchmark in ms (default %d)\n"
+        "  --filter STR        Only run benchmarks whose name contains STR\n"
+        "  --shared-cache MB   Benchmark the shared-memory cache (prefork mode)\n",
+        prog, DEFAULT_THRESHOLD, DEFAULT_RUN_MS);
+}
+
+int main(int argc, char** argv){
+    const char* out_path = NULL;
+    const char* compare_path = NULL;
+    double threshold = DEFAULT_THRESHOLD;
+    long shared_cache_mb = 0;
+
+    for(int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* val = i + 1 < argc ? argv[i + 1] : NULL;
+        if(strcmp(arg, "--out") == 0 && val) { out_path = val; i++; }
+        else if(strcmp(arg, "--compare") == 0 && val) { compare_path = val; i++; }
+        else if(strcmp(arg, "--threshold") == 0 && val) { threshold = atof(val); i++; }
+        else if(strcmp(arg, "--sizes") == 0 && val) { size_count = parse_int_list(val, sizes, MAX_SIZES); i++; }
+        else if(strcmp(arg, "--threads") == 0 && val) { thread_count_n = parse_int_list(val, thread_counts, MAX_THREAD_COUNTS); i++; }
+        else if(strcmp(arg, "--time") == 0 && val) { run_ms = atoi(val); i++; }
+        else if(strcmp(arg, "--filter") == 0 && val) { filter = val; i++; }
+        else if(strcmp(arg, "--shared-cache") == 0 && val) { shared_cache_mb = atol(val); i++; }
+        else { usage(argv[0]); return 2; }
+    }
+    if(run_ms <= 0) run_ms = DEFAULT_RUN_MS;
+
+    // Keep the report on the real stdout and silence module logging
+    fflush(stdout);
+    int report_fd = dup(STDOUT_FILENO);
+    report = report_fd >= 0 ? fdopen(report_fd, "w") : stderr;
+    int devnull = open("/dev/null", O_WRONLY);
+    if(devnull >= 0) {
+        dup2(devnull, STDOUT_FILENO);
+        close(devnull);
+    }
+
+    if(shared_cache_mb > 0 && cache_init_shared(shared_cache_mb << 20) < 0) {
+        fprintf(report, "[BENCH] Failed to create shared cache\n");
+        return 1;
+    }
+
+    build_large_corpus();
+    bench_parser();
+    bench_cache();
+    bench_buffers();
+    bench_files();
+    fflush(stdout);
+
+    int status = 0;
+    if(out_path && write_results(out_path) < 0) status = 1;
+    if(compare_path) {
+        int regressions = compare_results(compare_path, threshold);
+        if(regressions != 0) status = 1;
+    }
+    return status;
+}
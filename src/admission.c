@@ -0,0 +1,241 @@
+#include "admission.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+struct pending_conn {
+    int fd;
+    long long queued_ns;
+};
+
+// Bounded ring of accepted connections waiting for a worker
+static struct pending_conn* queue = NULL;
+static int queue_capacity = 0;
+static int queue_head = 0;
+static int queue_count = 0;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+static int busy = 0;                     // Workers handling a connection
+static long long queue_budget_ns = 0;
+static int overload_retry_after = 1;
+static connection_handler handle_connection = NULL;
+
+static long long monotonic_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+struct lane_state {
+    const char* name;
+    int limit;                   // 0 = unlimited
+    int queue_size;
+    int active;
+    int waiting;
+    long admitted;
+    long shed;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;         // Signalled when a slot frees up
+};
+
+static struct lane_state lanes[LANE_COUNT] = {
+    [LANE_LOCAL_READ] = { .name = "local_read" },
+    [LANE_LOCAL_WRITE] = { .name = "local_write" },
+    [LANE_UPSTREAM_CACHEABLE] = { .name = "upstream_cacheable" },
+    [LANE_UPSTREAM_PASSTHROUGH] = { .name = "upstream_passthrough" },
+};
+
+void admission_reject(int clientSocket, int status, int retry_after){
+    const char* status_text = status == 429 ? "Too Many Requests" : "Service Unavailable";
+    const char* body = status == 429 ? "Rate limit exceeded\n" : "Server overloaded, retry later\n";
+    char response[256];
+    int len = snprintf(response, sizeof(response),
+        "HTTP/1.1 %d %s\r\n"
+        "Retry-After: %d\r\n"
+        "Content-Type: text/plain\r\n"
+        "Content-Length: %zu\r\n"
+        "Connection: close\r\n"
+        "\r\n%s",
+        status, status_text, retry_after, strlen(body), body);
+
+    // Never block the caller on a slow client; a dropped rejection is fine
+    send(clientSocket, response, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(clientSocket);
+}
+
+static void* worker_fn(void* arg){
+    (void)arg;
+    for(;;) {
+        pthread_mutex_lock(&queue_lock);
+        while(queue_count == 0) {
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        }
+        struct pending_conn conn = queue[queue_head];
+        queue_head = (queue_head + 1) % queue_capacity;
+        queue_count--;
+        pthread_mutex_unlock(&queue_lock);
+
+        long long waited = monotonic_ns() - conn.queued_ns;
+        if(queue_budget_ns > 0 && waited > queue_budget_ns) {
+            printf("[ADMISSION] Connection waited %lld ms in queue, shedding\n", waited / 1000000);
+            admission_reject(conn.fd, 503, overload_retry_after);
+            continue;
+        }
+        pthread_mutex_lock(&queue_lock);
+        busy++;
+        pthread_mutex_unlock(&queue_lock);
+        handle_connection(conn.fd, conn.queued_ns);
+        pthread_mutex_lock(&queue_lock);
+        busy--;
+        pthread_mutex_unlock(&queue_lock);
+    }
+    return NULL;
+}
+
+int admission_init(int workers, int queue_size, int budget_ms, int retry_after,
+                   connection_handler handler){
+    if(workers <= 0 || queue_size <= 0 || !handler) return -1;
+
+    queue = calloc(queue_size, sizeof(*queue));
+    if(!queue) {
+        perror("[ADMISSION] Failed to allocate pending queue");
+        return -1;
+    }
+    queue_capacity = queue_size;
+    queue_budget_ns = (long long)budget_ms * 1000000LL;
+    overload_retry_after = retry_after > 0 ? retry_after : 1;
+    handle_connection = handler;
+
+    int started = 0;
+    for(int i = 0; i < workers; i++) {
+        pthread_t tid;
+        if(pthread_create(&tid, NULL, worker_fn, NULL) != 0) {
+            perror("[ADMISSION] Worker creation failed");
+            break;
+        }
+        pthread_detach(tid);
+        started++;
+    }
+    if(started == 0) return -1;
+
+    printf("[ADMISSION] %d workers, queue of %d, queue-time budget %d ms\n",
+           started, queue_size, budget_ms);
+    return 0;
+}
+
+int admission_submit(int clientSocket){
+    pthread_mutex_lock(&queue_lock);
+    if(queue_count == queue_capacity) {
+        pthread_mutex_unlock(&queue_lock);
+        printf("[ADMISSION] Pending queue full, rejecting connection\n");
+        admission_reject(clientSocket, 503, overload_retry_after);
+        return -1;
+    }
+    struct pending_conn* slot = &queue[(queue_head + queue_count) % queue_capacity];
+    slot->fd = clientSocket;
+    slot->queued_ns = monotonic_ns();
+    queue_count++;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+    return 0;
+}
+
+int admission_pending(void){
+    pthread_mutex_lock(&queue_lock);
+    int pending = queue_count + busy;
+    pthread_mutex_unlock(&queue_lock);
+    return pending;
+}
+
+int admission_lane_init(enum lane lane, int limit, int queue_size){
+    if((unsigned)lane >= LANE_COUNT) return -1;
+    struct lane_state* l = &lanes[lane];
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&l->lock, NULL);
+    pthread_cond_init(&l->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    l->limit = limit > 0 ? limit : 0;
+    l->queue_size = queue_size > 0 ? queue_size : 0;
+    if(l->limit > 0) {
+        printf("[ADMISSION] Lane %s: %d concurrent, %d waiting\n", l->name, l->limit, l->queue_size);
+    } else {
+        printf("[ADMISSION] Lane %s: unlimited\n", l->name);
+    }
+    return 0;
+}
+
+int admission_lane_enter(enum lane lane){
+    struct lane_state* l = &lanes[lane];
+    pthread_mutex_lock(&l->lock);
+    // Waiters go first; a newcomer only takes a free slot if none is queued
+    if(l->limit == 0 || (l->active < l->limit && l->waiting == 0)) {
+        l->active++;
+        l->admitted++;
+        pthread_mutex_unlock(&l->lock);
+        return 0;
+    }
+    if(l->waiting >= l->queue_size) {
+        l->shed++;
+        pthread_mutex_unlock(&l->lock);
+        printf("[ADMISSION] Lane %s full (%d active, %d waiting), shedding\n", l->name, l->active, l->waiting);
+        return -1;
+    }
+
+    struct timespec until;
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    long long budget = queue_budget_ns > 0 ? queue_budget_ns : 3600 * 1000000000LL;
+    until.tv_sec += budget / 1000000000LL;
+    until.tv_nsec += budget % 1000000000LL;
+    if(until.tv_nsec >= 1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+    }
+    l->waiting++;
+    int rc = 0;
+    while(l->active >= l->limit && rc != ETIMEDOUT) {
+        rc = pthread_cond_timedwait(&l->cond, &l->lock, &until);
+    }
+    l->waiting--;
+    if(l->active >= l->limit) {
+        l->shed++;
+        pthread_mutex_unlock(&l->lock);
+        printf("[ADMISSION] Waited over budget for lane %s, shedding\n", l->name);
+        return -1;
+    }
+    l->active++;
+    l->admitted++;
+    pthread_mutex_unlock(&l->lock);
+    return 0;
+}
+
+void admission_lane_leave(enum lane lane){
+    struct lane_state* l = &lanes[lane];
+    pthread_mutex_lock(&l->lock);
+    l->active--;
+    if(l->waiting > 0) pthread_cond_signal(&l->cond);
+    pthread_mutex_unlock(&l->lock);
+}
+
+int admission_lane_stats(char* out, size_t len){
+    size_t used = 0;
+    used += snprintf(out + used, len - used, "{");
+    for(int i = 0; i < LANE_COUNT && used < len; i++) {
+        struct lane_state* l = &lanes[i];
+        pthread_mutex_lock(&l->lock);
+        used += snprintf(out + used, len - used,
+            "%s\n  \"%s\": {\"limit\": %d, \"queue\": %d, \"active\": %d, \"waiting\": %d, "
+            "\"admitted\": %ld, \"shed\": %ld}",
+            i ? "," : "", l->name, l->limit, l->queue_size, l->active, l->waiting, l->admitted, l->shed);
+        pthread_mutex_unlock(&l->lock);
+    }
+    if(used < len) used += snprintf(out + used, len - used, "\n}\n");
+    return used < len ? (int)used : -1;
+}
@@ -0,0 +1,49 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <stddef.h>
+
+// Called on a worker thread for each admitted connection. queued_ns is the
+// CLOCK_MONOTONIC time at which the connection was accepted.
+typedef void (*connection_handler)(int clientSocket, long long queued_ns);
+
+// Start a fixed pool of workers fed by a bounded queue of accepted sockets.
+// Connections that wait longer than budget_ms are answered with 503.
+int admission_init(int workers, int queue_size, int budget_ms, int retry_after,
+                   connection_handler handler);
+
+// Queue an accepted connection; when the queue is full the client gets an
+// immediate 503 and the socket is closed. Returns 0 if queued.
+int admission_submit(int clientSocket);
+
+// Send a short rejection with Retry-After and close the socket
+void admission_reject(int clientSocket, int status, int retry_after);
+
+// Connections queued or being handled
+int admission_pending(void);
+
+// Request lanes. Once a request has been read it is classified and has to
+// take a slot in its lane before it is handled. Each lane has its own
+// concurrency limit and its own bounded wait queue, so slow upstreams can
+// tie up at most their lanes' slots and queues; the remaining workers stay
+// free for local files and cache hits.
+enum lane {
+    LANE_LOCAL_READ,             // /find/, FIND, admin and cache hits
+    LANE_LOCAL_WRITE,            // PUT
+    LANE_UPSTREAM_CACHEABLE,     // GET and HEAD misses
+    LANE_UPSTREAM_PASSTHROUGH,   // POST and anything else sent upstream
+    LANE_COUNT,
+    LANE_NONE = LANE_COUNT       // Not admitted through a lane
+};
+
+// Set a lane's concurrency limit (0 = unlimited) and how many requests may
+// wait for a slot. Waits are bounded by the admission queue-time budget.
+int admission_lane_init(enum lane lane, int limit, int queue_size);
+// Take a slot in lane. Returns 0, or -1 if the lane's queue is full or the
+// wait ran over budget; the request should then be shed.
+int admission_lane_enter(enum lane lane);
+void admission_lane_leave(enum lane lane);
+// Lane occupancy and counters as JSON
+int admission_lane_stats(char* out, size_t len);
+
+#endif
@@ -0,0 +1,358 @@
+#include "backend.h"
+#include "config.h"
+#include "upstream.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#define EWMA_MIN_SAMPLES 5               // Samples before a backend can be ejected
+#define EJECT_FLOOR_US 10000             // Slower than this before latency ejects
+#define MAX_EJECT_MULTIPLIER 10
+#define HEALTH_TIMEOUT_MS 2000
+
+struct backend {
+    char host[256];
+    int port;
+    char name[272];                  // "host:port"
+    int outstanding;
+    long long ewma_us;               // Smoothed time to first byte; 0 = no samples
+    int samples;
+    int failures;                    // Consecutive failed requests or checks
+    int down;
+    long long down_since_ms;
+    int ejections;                   // Latency ejections in a row
+    long long ejected_until_ms;      // 0 = not ejected
+    long requests;
+    long failed;
+};
+
+struct route {
+    char prefix[256];
+    size_t prefix_len;
+    struct backend backends[MAX_BACKENDS];
+    int count;
+    unsigned int next;               // Rotates ties for BALANCE_LEAST
+};
+
+static struct route routes[MAX_ROUTES];
+static int route_count = 0;
+static pthread_mutex_t backend_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int balance_mode = BALANCE_LEAST;
+static int unhealthy_after = 3;
+static int eject_factor = 0;
+static int eject_time_ms = 0;
+static int health_interval = 0;
+static char health_path[256] = "/";
+
+static __thread unsigned int pick_seed = 0;
+
+static long long now_us(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static int parse_backend(const char* spec, size_t len, struct backend* b){
+    const char* colon = NULL;
+    for(size_t i = 0; i < len; i++) {
+        if(spec[i] == ':') colon = spec + i;
+    }
+    if(!colon || colon == spec || (size_t)(colon - spec) >= sizeof(b->host)) return -1;
+    int port = atoi(colon + 1);
+    if(port <= 0 || port > 65535) return -1;
+    memset(b, 0, sizeof(*b));
+    memcpy(b->host, spec, colon - spec);
+    b->port = port;
+    snprintf(b->name, sizeof(b->name), "%s:%d", b->host, port);
+    return 0;
+}
+
+static int parse_route(const char* spec, struct route* r){
+    const char* eq = strchr(spec, '=');
+    if(spec[0] != '/' || !eq || (size_t)(eq - spec) >= sizeof(r->prefix)) return -1;
+    memset(r, 0, sizeof(*r));
+    memcpy(r->prefix, spec, eq - spec);
+    r->prefix_len = eq - spec;
+
+    const char* item = eq + 1;
+    while(*item) {
+        size_t len = strcspn(item, ",");
+        if(r->count >= MAX_BACKENDS || parse_backend(item, len, &r->backends[r->count]) < 0) return -1;
+        r->count++;
+        item += len;
+        if(*item == ',') item++;
+    }
+    return r->count > 0 ? 0 : -1;
+}
+
+int backend_init(char specs[][512], int count, int balance, int failures, int factor, int eject_time){
+    if(count <= 0) return 0;
+    for(int i = 0; i < count && i < MAX_ROUTES; i++) {
+        if(parse_route(specs[i], &routes[i]) < 0) {
+            printf("[BACKEND] Invalid route: %s\n", specs[i]);
+            return -1;
+        }
+        printf("[BACKEND] Route %s -> %d backend(s)\n", routes[i].prefix, routes[i].count);
+    }
+    route_count = count < MAX_ROUTES ? count : MAX_ROUTES;
+    balance_mode = balance;
+    unhealthy_after = failures > 0 ? failures : 1;
+    eject_factor = factor > 0 ? factor : 0;
+    eject_time_ms = eject_time > 0 ? eject_time * 1000 : 1000;
+    printf("[BACKEND] Reverse proxy mode, %s balancing\n",
+           balance == BALANCE_P2C ? "power-of-two-choices" : "least outstanding");
+    return 0;
+}
+
+int backend_enabled(void){
+    return route_count > 0;
+}
+
+// The route with the longest prefix of path
+static int match_route(const char* path){
+    int best = -1;
+    for(int i = 0; i < route_count; i++) {
+        if(strncmp(path, routes[i].prefix, routes[i].prefix_len) != 0) continue;
+        if(best < 0 || routes[i].prefix_len > routes[best].prefix_len) best = i;
+    }
+    return best;
+}
+
+// Whether b can take requests, bringing it back once its time out is over
+// (lock held)
+static int usable(struct backend* b, long long now_ms){
+    if(b->ejected_until_ms && now_ms >= b->ejected_until_ms) {
+        // Relearned from scratch, so the old average cannot eject it again at once
+        printf("[BACKEND] %s back from ejection\n", b->name);
+        b->ejected_until_ms = 0;
+        b->ewma_us = 0;
+        b->samples = 0;
+    }
+    if(b->down && health_interval == 0 && now_ms - b->down_since_ms >= eject_time_ms) {
+        // Without active checks real requests find out; one more failure takes it out again
+        printf("[BACKEND] Retrying %s\n", b->name);
+        b->down = 0;
+        b->failures = unhealthy_after - 1;
+    }
+    return !b->down && !b->ejected_until_ms;
+}
+
+// Whether a is a better pick than b. Latency is left to ejection, so a
+// pool at rest still spreads requests over every backend.
+static int better(const struct backend* a, const struct backend* b){
+    return a->outstanding < b->outstanding;
+}
+
+int backend_pick(const char* path, const struct backend_choice* exclude, struct backend_choice* out){
+    int route = match_route(path);
+    if(route < 0) return 0;
+    struct route* r = &routes[route];
+    long long now = now_us();
+
+    pthread_mutex_lock(&backend_lock);
+    int candidates[MAX_BACKENDS];
+    int n = 0;
+    for(int i = 0; i < r->count; i++) {
+        if(exclude && exclude->route == route && exclude->index == i) continue;
+        if(usable(&r->backends[i], now / 1000)) candidates[n++] = i;
+    }
+    if(n == 0) {
+        pthread_mutex_unlock(&backend_lock);
+        return -1;
+    }
+
+    int chosen;
+    if(balance_mode == BALANCE_P2C && n > 2) {
+        if(pick_seed == 0) pick_seed = (unsigned int)now ^ (unsigned int)(uintptr_t)&pick_seed;
+        int a = rand_r(&pick_seed) % n;
+        int b = rand_r(&pick_seed) % (n - 1);
+        if(b >= a) b++;
+        chosen = better(&r->backends[candidates[b]], &r->backends[candidates[a]]) ? candidates[b] : candidates[a];
+    } else {
+        // Ties go round the pool rather than always to the first backend
+        int start = r->next++ % n;
+        chosen = candidates[start];
+        for(int k = 1; k < n; k++) {
+            int c = candidates[(start + k) % n];
+            if(better(&r->backends[c], &r->backends[chosen])) chosen = c;
+        }
+    }
+    struct backend* b = &r->backends[chosen];
+    b->outstanding++;
+    b->requests++;
+    out->route = route;
+    out->index = chosen;
+    memcpy(out->host, b->host, sizeof(out->host));
+    out->port = b->port;
+    out->picked_us = now;
+    pthread_mutex_unlock(&backend_lock);
+    return 1;
+}
+
+// A failed request or check (lock held)
+static void record_failure(struct backend* b){
+    b->failures++;
+    b->failed++;
+    if(!b->down && b->failures >= unhealthy_after) {
+        printf("[BACKEND] %s marked down after %d failure(s)\n", b->name, b->failures);
+        b->down = 1;
+        b->down_since_ms = now_us() / 1000;
+    }
+}
+
+// Eject b if it is much slower than the fastest backend of r (lock held)
+static void maybe_eject(struct route* r, struct backend* b){
+    if(eject_factor == 0 || b->samples < EWMA_MIN_SAMPLES || b->ewma_us < EJECT_FLOOR_US) return;
+    long long now = now_us() / 1000;
+    const struct backend* fastest = NULL;
+    int ejected = 0;
+    for(int i = 0; i < r->count; i++) {
+        const struct backend* o = &r->backends[i];
+        if(o->ejected_until_ms) ejected++;
+        if(o == b || o->down || o->ejected_until_ms || o->samples < EWMA_MIN_SAMPLES) continue;
+        if(!fastest || o->ewma_us < fastest->ewma_us) fastest = o;
+    }
+    if(!fastest || b->ewma_us <= fastest->ewma_us * eject_factor) {
+        b->ejections = 0;
+        return;
+    }
+    // The rest of the pool has to be able to carry the load
+    if((ejected + 1) * 2 > r->count) return;
+    if(b->ejections < MAX_EJECT_MULTIPLIER) b->ejections++;
+    long long out_ms = (long long)eject_time_ms * b->ejections;
+    b->ejected_until_ms = now + out_ms;
+    printf("[BACKEND] Ejecting %s for %llds: %.1f ms to first byte, %s takes %.1f ms\n",
+           b->name, out_ms / 1000, b->ewma_us / 1000.0, fastest->name, fastest->ewma_us / 1000.0);
+}
+
+void backend_observe(const struct backend_choice* c, int status){
+    long long latency = now_us() - c->picked_us;
+    struct route* r = &routes[c->route];
+    struct backend* b = &r->backends[c->index];
+    pthread_mutex_lock(&backend_lock);
+    if(status >= 500) {
+        record_failure(b);
+    } else {
+        b->failures = 0;
+        // Same smoothing as the upstream connect SRTT: 7/8 old, 1/8 new
+        b->ewma_us = b->ewma_us ? (b->ewma_us * 7 + latency) / 8 : latency;
+        if(b->ewma_us == 0) b->ewma_us = 1;
+        b->samples++;
+        maybe_eject(r, b);
+    }
+    pthread_mutex_unlock(&backend_lock);
+}
+
+void backend_failure(const struct backend_choice* c){
+    pthread_mutex_lock(&backend_lock);
+    record_failure(&routes[c->route].backends[c->index]);
+    pthread_mutex_unlock(&backend_lock);
+}
+
+void backend_release(const struct backend_choice* c){
+    pthread_mutex_lock(&backend_lock);
+    routes[c->route].backends[c->index].outstanding--;
+    pthread_mutex_unlock(&backend_lock);
+}
+
+// One active check: any 2xx or 3xx answer to GET health_path passes
+static int check_backend(const struct backend* b){
+    int sock = upstream_connect(b->host, b->port, HEALTH_TIMEOUT_MS);
+    if(sock < 0) return 0;
+    struct timeval timeout = { HEALTH_TIMEOUT_MS / 1000, 0 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    char request[512];
+    int request_len = snprintf(request, sizeof(request),
+        "GET %s HTTP/1.1\r\n"
+        "Host: %s\r\n"
+        "Connection: close\r\n"
+        "User-Agent: ProxyServer/1.0\r\n"
+        "\r\n",
+        health_path, b->host);
+    char reply[64];
+    int got = 0;
+    if(request_len < (int)sizeof(request) && send(sock, request, request_len, MSG_NOSIGNAL) == request_len) {
+        while(got < 12) {
+            int n = recv(sock, reply + got, sizeof(reply) - 1 - got, 0);
+            if(n <= 0) break;
+            got += n;
+        }
+    }
+    close(sock);
+    if(got < 12 || strncmp(reply, "HTTP/1.", 7) != 0) return 0;
+    reply[got] = '\0';
+    int status = atoi(reply + 9);
+    return status >= 200 && status < 400;
+}
+
+static void* health_fn(void* arg){
+    (void)arg;
+    for(;;) {
+        sleep(health_interval);
+        for(int i = 0; i < route_count; i++) {
+            struct route* r = &routes[i];
+            for(int j = 0; j < r->count; j++) {
+                // Names and ports never change, so the check runs unlocked
+                struct backend* b = &r->backends[j];
+                int passed = check_backend(b);
+                pthread_mutex_lock(&backend_lock);
+                if(!passed) {
+                    record_failure(b);
+                } else {
+                    if(b->down) printf("[BACKEND] %s passed a health check, marked up\n", b->name);
+                    b->down = 0;
+                    b->failures = 0;
+                }
+                pthread_mutex_unlock(&backend_lock);
+            }
+        }
+    }
+    return NULL;
+}
+
+int backend_health_start(int interval, const char* path){
+    if(route_count == 0 || interval <= 0) return 0;
+    health_interval = interval;
+    snprintf(health_path, sizeof(health_path), "%s", path);
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, health_fn, NULL) != 0) {
+        perror("[BACKEND] Failed to start health checks");
+        health_interval = 0;
+        return -1;
+    }
+    pthread_detach(thread);
+    printf("[BACKEND] Checking %s on every backend every %ds\n", health_path, interval);
+    return 0;
+}
+
+int backend_stats(char* out, size_t len){
+    size_t used = 0;
+    used += snprintf(out + used, len - used, "{");
+    pthread_mutex_lock(&backend_lock);
+    long long now = now_us() / 1000;
+    for(int i = 0; i < route_count && used < len; i++) {
+        struct route* r = &routes[i];
+        used += snprintf(out + used, len - used, "%s\n  \"%s\": [", i ? "," : "", r->prefix);
+        for(int j = 0; j < r->count && used < len; j++) {
+            struct backend* b = &r->backends[j];
+            const char* state = b->down ? "down" : b->ejected_until_ms > now ? "ejected" : "up";
+            used += snprintf(out + used, len - used,
+                "%s\n    {\"backend\": \"%s\", \"state\": \"%s\", \"outstanding\": %d, "
+                "\"ewma_ms\": %.2f, \"requests\": %ld, \"failures\": %ld}",
+                j ? "," : "", b->name, state, b->outstanding, b->ewma_us / 1000.0, b->requests, b->failed);
+        }
+        if(used < len) used += snprintf(out + used, len - used, "\n  ]");
+    }
+    pthread_mutex_unlock(&backend_lock);
+    if(used < len) used += snprintf(out + used, len - used, "\n}\n");
+    return used < len ? (int)used : -1;
+}
@@ -0,0 +1,62 @@
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include <stddef.h>
+
+// Reverse-proxy mode. Each --route maps a path prefix to a pool of
+// backends; upstream requests go to a backend of the pool with the longest
+// matching prefix instead of to the host the request names. The request's
+// Host and path still make up the cache key, so caching works as before.
+//
+// A backend leaves its pool for either of two reasons:
+// - Health: --unhealthy-after failures in a row, from active checks of
+//   --health-path every --health-interval seconds or from real requests
+//   (connect failures, timeouts, 5xx). It comes back when an active check
+//   passes, or after --eject-time when active checks are off.
+// - Latency: once its EWMA time to first byte is more than --eject-factor
+//   times that of the pool's fastest backend, it is ejected for
+//   --eject-time, longer each time in a row. At most half of a pool is
+//   ejected for latency.
+//
+// State is per process, like the upstream address stats.
+
+#define MAX_BACKENDS 16                  // Per route
+
+enum backend_balance {
+    BALANCE_LEAST,               // Fewest outstanding requests
+    BALANCE_P2C,                 // Fewer outstanding of two picked at random
+};
+
+// A backend handed out by backend_pick
+struct backend_choice {
+    int route;
+    int index;
+    char host[256];
+    int port;
+    long long picked_us;
+};
+
+// Parse "PREFIX=HOST:PORT[,HOST:PORT...]" routes. eject_factor 0 disables
+// latency ejection.
+int backend_init(char routes[][512], int route_count, int balance, int unhealthy_after,
+                 int eject_factor, int eject_time);
+int backend_enabled(void);
+
+// Check every backend every interval seconds from a background thread
+int backend_health_start(int interval, const char* path);
+
+// Pick a backend for path, skipping the one in *exclude unless it is NULL.
+// Returns 1 and counts a request outstanding until backend_release; 0 if
+// no route matches; -1 if the route has no usable backend.
+int backend_pick(const char* path, const struct backend_choice* exclude, struct backend_choice* out);
+// The backend answered with status
+void backend_observe(const struct backend_choice* c, int status);
+// The backend could not be reached or did not answer
+void backend_failure(const struct backend_choice* c);
+void backend_release(const struct backend_choice* c);
+
+// Pools and backends as JSON for /_admin/backends. Returns the length, or
+// -1 if out is too small.
+int backend_stats(char* out, size_t len);
+
+#endif
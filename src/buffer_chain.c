@@ -0,0 +1,212 @@
+#include "buffer_chain.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define POOL_MAX_SEGMENTS 1024           // 16 MB of idle segments kept for reuse
+
+static struct chain_segment* pool = NULL;
+static int pool_count = 0;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct chain_segment* segment_get(void){
+    pthread_mutex_lock(&pool_lock);
+    struct chain_segment* seg = pool;
+    if(seg) {
+        pool = seg->next;
+        pool_count--;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    if(!seg && posix_memalign((void**)&seg, CHAIN_SEGMENT_ALIGN, sizeof(*seg)) != 0) seg = NULL;
+    if(seg) {
+        seg->next = NULL;
+        seg->len = 0;
+    }
+    return seg;
+}
+
+// Return a list of segments to the pool, freeing what exceeds the cap
+static void segments_put(struct chain_segment* seg){
+    struct chain_segment* excess = NULL;
+    pthread_mutex_lock(&pool_lock);
+    while(seg) {
+        struct chain_segment* next = seg->next;
+        if(pool_count < POOL_MAX_SEGMENTS) {
+            seg->next = pool;
+            pool = seg;
+            pool_count++;
+        } else {
+            seg->next = excess;
+            excess = seg;
+        }
+        seg = next;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    while(excess) {
+        struct chain_segment* next = excess->next;
+        free(excess);
+        excess = next;
+    }
+}
+
+void chain_init(struct buffer_chain* chain){
+    memset(chain, 0, sizeof(*chain));
+}
+
+char* chain_reserve(struct buffer_chain* chain, int* space){
+    struct chain_segment* tail = chain->tail;
+    if(!tail || tail->len == CHAIN_SEGMENT_SIZE) {
+        tail = segment_get();
+        if(!tail) return NULL;
+        if(chain->tail) chain->tail->next = tail;
+        else chain->head = tail;
+        chain->tail = tail;
+        chain->segments++;
+    }
+    *space = CHAIN_SEGMENT_SIZE - tail->len;
+    return tail->data + tail->len;
+}
+
+void chain_commit(struct buffer_chain* chain, int bytes){
+    chain->tail->len += bytes;
+    chain->len += bytes;
+}
+
+void chain_consume(struct buffer_chain* chain, long bytes){
+    if(bytes >= chain->len) {
+        chain_release(chain);
+        return;
+    }
+    chain->len -= bytes;
+    while(bytes > 0) {
+        struct chain_segment* head = chain->head;
+        long left = head->len - chain->start;
+        if(bytes < left) {
+            chain->start += bytes;
+            break;
+        }
+        bytes -= left;
+        chain->head = head->next;
+        chain->start = 0;
+        chain->segments--;
+        head->next = NULL;
+        segments_put(head);
+    }
+}
+
+void chain_truncate(struct buffer_chain* chain, long len){
+    if(len >= chain->len) return;
+    if(len <= 0) {
+        chain_release(chain);
+        return;
+    }
+    chain->len = len;
+    struct chain_segment* seg = chain->head;
+    long offset = chain->start;
+    int count = 1;
+    while(len > seg->len - offset) {
+        len -= seg->len - offset;
+        offset = 0;
+        seg = seg->next;
+        count++;
+    }
+    seg->len = offset + len;
+    segments_put(seg->next);
+    seg->next = NULL;
+    chain->tail = seg;
+    chain->segments = count;
+}
+
+int chain_move(struct buffer_chain* to, struct buffer_chain* from, long len){
+    while(len > 0 && from->head) {
+        struct chain_segment* seg = from->head;
+        int start = from->start;
+        long avail = seg->len - start;
+        // A consumed prefix can only be kept as the head of an empty chain
+        if(avail <= len && (start == 0 || !to->head)) {
+            from->head = seg->next;
+            if(!from->head) from->tail = NULL;
+            from->start = 0;
+            from->segments--;
+            from->len -= avail;
+            seg->next = NULL;
+            if(to->tail) {
+                to->tail->next = seg;
+            } else {
+                to->head = seg;
+                to->start = start;
+            }
+            to->tail = seg;
+            to->segments++;
+            to->len += avail;
+            len -= avail;
+            continue;
+        }
+        long n = avail < len ? avail : len;
+        for(long copied = 0; copied < n; ) {
+            int space;
+            char* into = chain_reserve(to, &space);
+            if(!into) return -1;
+            if(space > n - copied) space = n - copied;
+            memcpy(into, seg->data + start + copied, space);
+            chain_commit(to, space);
+            copied += space;
+        }
+        chain_consume(from, n);
+        len -= n;
+    }
+    return 0;
+}
+
+long chain_copy(const struct buffer_chain* chain, long offset, char* dst, long len){
+    long copied = 0;
+    int start = chain->start;
+    for(const struct chain_segment* seg = chain->head; seg && copied < len; seg = seg->next) {
+        long avail = seg->len - start;
+        if(offset >= avail) {
+            offset -= avail;
+        } else {
+            long n = avail - offset;
+            if(n > len - copied) n = len - copied;
+            memcpy(dst + copied, seg->data + start + offset, n);
+            copied += n;
+            offset = 0;
+        }
+        start = 0;
+    }
+    return copied;
+}
+
+int chain_iov(const struct buffer_chain* chain, const struct chain_segment** next,
+              struct iovec* iov, int max){
+    int count = 0;
+    const struct chain_segment* seg = *next;
+    while(seg && count < max) {
+        int start = seg == chain->head ? chain->start : 0;
+        iov[count].iov_base = (void*)(seg->data + start);
+        iov[count].iov_len = seg->len - start;
+        count++;
+        seg = seg->next;
+    }
+    *next = seg;
+    return count;
+}
+
+void chain_release(struct buffer_chain* chain){
+    segments_put(chain->head);
+    chain_init(chain);
+}
+
+struct buffer_chain* chain_adopt(struct buffer_chain* from){
+    struct buffer_chain* chain = malloc(sizeof(*chain));
+    if(!chain) return NULL;
+    *chain = *from;
+    chain_init(from);
+    return chain;
+}
+
+void chain_free(struct buffer_chain* chain){
+    if(!chain) return;
+    chain_release(chain);
+    free(chain);
+}
@@ -0,0 +1,66 @@
+#ifndef BUFFER_CHAIN_H
+#define BUFFER_CHAIN_H
+
+#include <sys/uio.h>
+
+// Growable byte buffer made of fixed-size segments. Appending never moves
+// data that is already stored, so a response of any size is received with
+// no realloc copies: recv writes straight into the tail segment, the same
+// bytes are forwarded to the client, and the cache adopts the finished
+// chain as is. Readers send it with a single gathered write per IOV_MAX
+// segments.
+//
+// Segments come from a process-wide pool; released segments are kept for
+// reuse up to a cap, so steady-state traffic does not touch malloc.
+
+#define CHAIN_SEGMENT_SIZE (16 * 1024)
+#define CHAIN_SEGMENT_ALIGN 64           // Misaligned copy targets halve memcpy throughput
+
+struct chain_segment {
+    struct chain_segment* next;
+    int len;                     // Bytes used in data
+    char data[CHAIN_SEGMENT_SIZE] __attribute__((aligned(CHAIN_SEGMENT_ALIGN)));
+};
+
+struct buffer_chain {
+    struct chain_segment* head;
+    struct chain_segment* tail;
+    int start;                   // Bytes consumed from the head segment
+    int segments;
+    long len;
+};
+
+void chain_init(struct buffer_chain* chain);
+
+// Free space at the end of the chain, adding a segment if the tail is full.
+// Write up to *space bytes there and chain_commit what was written.
+// Returns NULL if no segment could be allocated.
+char* chain_reserve(struct buffer_chain* chain, int* space);
+void chain_commit(struct buffer_chain* chain, int bytes);
+
+// Drop bytes from the front / keep only the first len bytes
+void chain_consume(struct buffer_chain* chain, long bytes);
+void chain_truncate(struct buffer_chain* chain, long len);
+
+// Move the first len bytes of from to the end of to. Whole segments are
+// relinked; only a segment straddling the cut has its bytes copied.
+// Returns 0, or -1 if a segment could not be allocated.
+int chain_move(struct buffer_chain* to, struct buffer_chain* from, long len);
+
+// Copy up to len bytes starting at offset into dst. Returns bytes copied.
+long chain_copy(const struct buffer_chain* chain, long offset, char* dst, long len);
+
+// Fill iov with up to max segments starting at *next, which the caller sets
+// to chain->head and which advances past the ones returned (NULL at the
+// end). Returns the count.
+int chain_iov(const struct buffer_chain* chain, const struct chain_segment** next,
+              struct iovec* iov, int max);
+
+// Return every segment to the pool and leave the chain empty
+void chain_release(struct buffer_chain* chain);
+
+// Move the contents of from into a new heap chain; from is left empty
+struct buffer_chain* chain_adopt(struct buffer_chain* from);
+void chain_free(struct buffer_chain* chain);
+
+#endif
@@ -1,4 +1,7 @@
 #include "cache.h"
+#include "shm_cache.h"
+#include "buffer_chain.h"
+#include "trace.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,15 +15,51 @@ static cache_element* head = NULL;
 static int cache_size = 0;
 static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 
+// Move the cache into a shared memory segment so forked workers share it
+int cache_init_shared(long segment_bytes){
+    return shm_cache_init(segment_bytes, MAX_SIZE, MAX_ELEMENT_SIZE);
+}
+
+static void free_element(cache_element* element){
+    free(element->data);
+    chain_free(element->body);
+    free(element->url);
+    free(element);
+}
+
+// Memory a body pins: an adopted chain keeps its segments whole
+static long body_bytes(const struct buffer_chain* body){
+    return body ? (long)body->segments * CHAIN_SEGMENT_SIZE : 0;
+}
+
+// Bytes an element counts against the cache size
+static int element_bytes(const cache_element* element){
+    return element->len + body_bytes(element->body) + sizeof(cache_element) + strlen(element->url) + 1;
+}
+
+// Drop an unlinked element now, or when its last reader releases it
+static void retire_element(cache_element* element){
+    if(element->refs > 0) {
+        element->evicted = 1;
+    } else {
+        free_element(element);
+    }
+}
+
 // Find a cached element by URL
 cache_element* cache_find(char* url){
     if(!url) return NULL;
+    if(shm_cache_enabled()) return shm_cache_find(url);
     
+    trace_begin(TRACE_CACHE_LOCK);
     pthread_mutex_lock(&lock);
+    trace_end(TRACE_CACHE_LOCK);
     cache_element* site = head;
     while(site){
         if(strcmp(site->url, url) == 0){
             site->lru_time_track = time(NULL); // Update LRU timestamp
+            site->refs++;
+            site->hits++;
             printf("[CACHE] Found URL: %s, updated LRU time\n", url);
             pthread_mutex_unlock(&lock);
             return site;
@@ -32,8 +71,37 @@ cache_element* cache_find(char* url){
     return NULL;
 }
 
+int cache_contains(char* url){
+    if(!url) return 0;
+    if(shm_cache_enabled()) return shm_cache_contains(url);
+    pthread_mutex_lock(&lock);
+    cache_element* site = head;
+    while(site && strcmp(site->url, url) != 0) site = site->next;
+    pthread_mutex_unlock(&lock);
+    return site != NULL;
+}
+
+// Release an element returned by cache_find
+void cache_release(cache_element* element){
+    if(!element) return;
+    if(element->shared) {
+        shm_cache_release(element);
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    element->refs--;
+    if(element->refs == 0 && element->evicted) {
+        free_element(element);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
 // Remove the least recently used element
 void cache_remove(){
+    if(shm_cache_enabled()) {
+        shm_cache_remove();
+        return;
+    }
     pthread_mutex_lock(&lock);
     if(!head){
         pthread_mutex_unlock(&lock);
@@ -60,49 +128,49 @@ void cache_remove(){
         head = lru->next;
     }
 
-    int element_size = lru->len + sizeof(cache_element) + strlen(lru->url) + 1;
+    int element_size = element_bytes(lru);
     cache_size -= element_size;
     
     printf("[CACHE] Removing URL from cache: %s, freed %d bytes\n", lru->url, element_size);
     
-    free(lru->data);
-    free(lru->url);
-    free(lru);
+    retire_element(lru);
 
     pthread_mutex_unlock(&lock);
 }
 
-// Add a new element to cache
-int cache_add(char* data, int size, char* url){
-    if(!data || !url || size <= 0) return 0;
-    
+// Link a new element holding data and, if set, the adopted body chain. A
+// body shorter than one segment is copied in after data instead, so it
+// does not pin a whole segment.
+static int add_element(char* data, int size, struct buffer_chain* body, char* url){
+    long body_len = body ? body->len : 0;
+    struct buffer_chain* tail = NULL;
+    if(body_len < CHAIN_SEGMENT_SIZE) {
+        tail = body;
+        body = NULL;
+    }
+    long tail_len = tail ? tail->len : 0;
+    trace_begin(TRACE_CACHE_LOCK);
     pthread_mutex_lock(&lock);
+    trace_end(TRACE_CACHE_LOCK);
 
-    // Check if URL already exists in cache
-    cache_element* existing = head;
+    // Replace an existing entry; readers may still hold the old element
+    cache_element *prev = NULL, *existing = head;
     while(existing) {
         if(strcmp(existing->url, url) == 0) {
-            // Update existing entry
-            free(existing->data);
-            existing->data = malloc(size + 1);
-            if(!existing->data) {
-                pthread_mutex_unlock(&lock);
-                return 0;
-            }
-            memcpy(existing->data, data, size);
-            existing->data[size] = '\0';
-            existing->len = size;
-            existing->lru_time_track = time(NULL);
-            printf("[CACHE] Updated existing URL in cache: %s\n", url);
-            pthread_mutex_unlock(&lock);
-            return 1;
+            if(prev) prev->next = existing->next;
+            else head = existing->next;
+            cache_size -= element_bytes(existing);
+            printf("[CACHE] Updating existing URL in cache: %s\n", url);
+            retire_element(existing);
+            break;
         }
+        prev = existing;
         existing = existing->next;
     }
 
-    int element_size = size + strlen(url) + 1 + sizeof(cache_element);
+    long element_size = size + tail_len + body_bytes(body) + strlen(url) + 1 + sizeof(cache_element);
     if(element_size > MAX_ELEMENT_SIZE){
-        printf("[CACHE] Element size exceeds maximum (%d bytes), skipping cache: %s\n", element_size, url);
+        printf("[CACHE] Element size exceeds maximum (%ld bytes), skipping cache: %s\n", element_size, url);
         pthread_mutex_unlock(&lock);
         return 0;
     }
@@ -121,15 +189,16 @@ int cache_add(char* data, int size, char* url){
         return 0;
     }
 
-    element->data = malloc(size + 1);
+    element->data = malloc(size + tail_len + 1);
     if(!element->data){
         perror("[CACHE] Failed to allocate memory for data");
         free(element);
         pthread_mutex_unlock(&lock);
         return 0;
     }
-    memcpy(element->data, data, size);
-    element->data[size] = '\0';
+    if(size > 0) memcpy(element->data, data, size);
+    if(tail_len > 0) chain_copy(tail, 0, element->data + size, tail_len);
+    element->data[size + tail_len] = '\0';
 
     element->url = malloc(strlen(url) + 1);
     if(!element->url){
@@ -142,26 +211,96 @@ int cache_add(char* data, int size, char* url){
     strcpy(element->url, url);
 
     element->lru_time_track = time(NULL);
-    element->len = size;
+    element->len = size + tail_len;
+    element->refs = 0;
+    element->evicted = 0;
+    element->shared = NULL;
+    element->hits = 0;
+    element->body = NULL;
+    if(body) {
+        element->body = chain_adopt(body);
+        if(!element->body) {
+            free(element->url);
+            free(element->data);
+            free(element);
+            pthread_mutex_unlock(&lock);
+            return 0;
+        }
+    }
     element->next = head;
     head = element;
 
     cache_size += element_size;
-    printf("[CACHE] Added URL to cache: %s, size: %d bytes, total cache: %d bytes\n", url, size, cache_size);
+    printf("[CACHE] Added URL to cache: %s, size: %ld bytes, total cache: %d bytes\n",
+           url, size + body_len, cache_size);
 
     pthread_mutex_unlock(&lock);
     return 1;
 }
 
+// Add a new element to cache
+int cache_add(char* data, int size, char* url){
+    if(!data || !url || size <= 0) return 0;
+    if(shm_cache_enabled()) return shm_cache_add(data, size, url);
+    return add_element(data, size, NULL, url);
+}
+
+int cache_add_chain(char* data, int size, struct buffer_chain* body, char* url){
+    int added = 0;
+    if(!url || size < 0 || (size > 0 && !data) || size + body->len <= 0) {
+        // Nothing to store
+    } else if(shm_cache_enabled()) {
+        // The shared segment needs its own copy; gather it in one pass
+        struct iovec* iov = malloc((body->segments + 1) * sizeof(*iov));
+        if(iov) {
+            const struct chain_segment* next = body->head;
+            iov[0].iov_base = data;
+            iov[0].iov_len = size;
+            int count = 1 + chain_iov(body, &next, iov + 1, body->segments);
+            added = shm_cache_addv(iov, count, url);
+            free(iov);
+        }
+    } else {
+        added = add_element(data, size, body, url);
+    }
+    chain_release(body);
+    return added;
+}
+
+// Remove url's element; 1 if there was one
+int cache_delete(char* url){
+    if(!url) return 0;
+    if(shm_cache_enabled()) return shm_cache_delete(url);
+    pthread_mutex_lock(&lock);
+    cache_element *prev = NULL, *site = head;
+    while(site && strcmp(site->url, url) != 0) {
+        prev = site;
+        site = site->next;
+    }
+    if(site) {
+        if(prev) prev->next = site->next;
+        else head = site->next;
+        cache_size -= element_bytes(site);
+        retire_element(site);
+    }
+    pthread_mutex_unlock(&lock);
+    return site != NULL;
+}
+
 // Print all cache contents
 void cache_print(){
+    if(shm_cache_enabled()) {
+        shm_cache_print();
+        return;
+    }
     pthread_mutex_lock(&lock);
     cache_element* site = head;
     printf("-----CACHE CONTENTS-----\n");
     printf("Total cache size: %d bytes\n", cache_size);
     int count = 0;
     while(site){
-        printf("%d. URL: %s, Size: %d, LRU: %ld\n", ++count, site->url, site->len, site->lru_time_track);
+        printf("%d. URL: %s, Size: %ld, LRU: %ld\n", ++count, site->url,
+               site->len + (site->body ? site->body->len : 0), site->lru_time_track);
         site = site->next;
     }
     printf("------------------------\n");
@@ -170,6 +309,7 @@ void cache_print(){
 
 // Get current cache size
 int cache_get_size(){
+    if(shm_cache_enabled()) return shm_cache_get_size();
     pthread_mutex_lock(&lock);
     int size = cache_size;
     pthread_mutex_unlock(&lock);
@@ -178,15 +318,66 @@ int cache_get_size(){
 
 // Clear all cache
 void cache_clear(){
+    if(shm_cache_enabled()) {
+        shm_cache_clear();
+        return;
+    }
     pthread_mutex_lock(&lock);
     while(head){
         cache_element* temp = head;
         head = head->next;
-        free(temp->data);
-        free(temp->url);
-        free(temp);
+        retire_element(temp);
     }
     cache_size = 0;
     printf("[CACHE] Cache cleared\n");
     pthread_mutex_unlock(&lock);
 }
+
+static int compare_lru(const void* a, const void* b){
+    time_t x = (*(cache_element* const*)a)->lru_time_track;
+    time_t y = (*(cache_element* const*)b)->lru_time_track;
+    return (x > y) - (x < y);
+}
+
+// Visit every element, least recently used first
+void cache_foreach(cache_visitor visit, void* arg){
+    if(shm_cache_enabled()) {
+        shm_cache_foreach(visit, arg);
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    int count = 0;
+    for(cache_element* site = head; site; site = site->next) count++;
+    cache_element** order = malloc((count ? count : 1) * sizeof(*order));
+    if(order) {
+        int i = 0;
+        for(cache_element* site = head; site; site = site->next) order[i++] = site;
+        qsort(order, count, sizeof(*order), compare_lru);
+        for(i = 0; i < count; i++) visit(order[i], arg);
+        free(order);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+// Add hits recorded before a restart to a cached element
+void cache_credit_hits(char* url, long hits){
+    if(!url || hits <= 0) return;
+    if(shm_cache_enabled()) {
+        shm_cache_credit_hits(url, hits);
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    for(cache_element* site = head; site; site = site->next) {
+        if(strcmp(site->url, url) == 0) {
+            site->hits += hits;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+// Handles are per process only in a shared segment; the heap cache dies
+// with its process
+void cache_reap(pid_t pid){
+    if(shm_cache_enabled()) shm_cache_reap(pid);
+}
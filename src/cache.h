@@ -2,23 +2,46 @@
 #define CACHE_H
 
 #include <time.h>
+#include <sys/types.h>
 
 typedef struct cache_element cache_element;
+struct buffer_chain;
 
 struct cache_element{
-    char* data;              // Response data
+    char* data;              // Response data (the head only if body is set)
     int len;                 // Length of data
     char* url;               // URL key
     time_t lru_time_track;   // LRU timestamp
     cache_element* next;     // Next element in linked list
+    int refs;                // Readers pinning the element
+    int evicted;             // Unlinked from the cache, freed on last release
+    void* shared;            // Shared-segment handle, NULL for heap elements
+    long hits;               // Lookups that found the element
+    struct buffer_chain* body; // Rest of the data, adopted from the fetch; NULL if inline
 };
 
+// Called for each element by cache_foreach with the cache locked; must not
+// call back into the cache
+typedef void (*cache_visitor)(const cache_element* element, void* arg);
+
 // Cache functions
-cache_element* cache_find(char* url);
+int cache_init_shared(long segment_bytes); // Use a shared segment (call before fork)
+cache_element* cache_find(char* url);      // Pins the element; call cache_release
+void cache_release(cache_element* element);
+int cache_contains(char* url);             // Lookup that counts no hit and leaves LRU alone
 int cache_add(char* data, int size, char* url);
+// Store data (size may be 0) followed by the bytes of body. The cache takes
+// the chain's segments without copying them (a shared segment copies once,
+// and so does a body shorter than one segment); body is left empty either
+// way.
+int cache_add_chain(char* data, int size, struct buffer_chain* body, char* url);
 void cache_remove();
+int cache_delete(char* url);   // Drop url if cached; readers keep their pins
 void cache_print();     // For debugging
 int cache_get_size();   // Get current cache size
 void cache_clear();     // Clear all cache
+void cache_foreach(cache_visitor visit, void* arg); // Least recently used first
+void cache_credit_hits(char* url, long hits);      // Carry hits over a restart
+void cache_reap(pid_t pid);                        // A worker exited; drop its pins
 
 #endif
\ No newline at end of file
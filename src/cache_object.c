@@ -0,0 +1,345 @@
+#include "cache_object.h"
+#include "response.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <strings.h>
+
+#define OBJECT_MAGIC 0x314A424FU         // "OBJ1"
+#define OBJECT_MAX_HEADERS 64
+#define OBJECT_HEAD_RESERVE 256          // Head room left beside the kept headers
+#define OBJECT_SLICED 1U                 // Body lives in slice entries
+
+// Fixed part at the start of every blob; all offsets are from the blob start
+struct object_prefix {
+    uint32_t magic;
+    int32_t status;
+    int64_t last_modified;
+    int64_t body_len;
+    uint32_t reason_off, reason_len;
+    uint32_t headers_off, headers_len;
+    uint32_t index_off, header_count;
+    uint32_t etag_off, etag_len;
+    uint32_t body_off;
+    uint32_t flags;              // OBJECT_SLICED
+};
+
+struct index_entry {
+    uint32_t name_off, name_len;
+    uint32_t value_off, value_len;
+};
+
+struct header_span {
+    const char* name;
+    int name_len;
+    const char* value;
+    int value_len;
+};
+
+// Headers that describe this hop or the framing, not the object
+static const char* const dropped_headers[] = {
+    "Connection", "Keep-Alive", "Proxy-Connection", "Transfer-Encoding", "Content-Length",
+    "TE", "Trailer", "Upgrade", "Proxy-Authenticate",
+};
+
+static int cacheable_status(int status){
+    switch(status) {
+        case 200: case 203: case 204: case 300: case 301: case 308:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static int name_is(const struct header_span* h, const char* name){
+    return (size_t)h->name_len == strlen(name) && strncasecmp(h->name, name, h->name_len) == 0;
+}
+
+static time_t parse_http_date(const char* value, int len){
+    char buf[64];
+    if(len <= 0 || len >= (int)sizeof(buf)) return -1;
+    memcpy(buf, value, len);
+    buf[len] = '\0';
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    const char* end = strptime(buf, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    if(!end) return -1;
+    return timegm(&tm);
+}
+
+// Decode a chunked body into a new buffer
+static char* dechunk(const char* p, const char* end, long* out_len){
+    char* body = malloc(end - p + 1);
+    if(!body) return NULL;
+    long n = 0;
+    for(;;) {
+        const char* eol = memmem(p, end - p, "\r\n", 2);
+        if(!eol) goto bad;
+        char* stop;
+        long size = strtol(p, &stop, 16);
+        if(stop == p || size < 0) goto bad;
+        p = eol + 2;
+        if(size == 0) break;          // Trailers are not kept
+        if(end - p < size + 2) goto bad;
+        memcpy(body + n, p, size);
+        n += size;
+        p += size + 2;
+    }
+    *out_len = n;
+    return body;
+
+bad:
+    free(body);
+    return NULL;
+}
+
+// Encode the object; with detached set, raw holds only the first avail
+// bytes of the response and the body is left out of the blob
+static int encode_object(const char* raw, long avail, long raw_len, int detached,
+                         char** out, int* out_len, long* body_start_out, long* body_len_out){
+    const char* head_end = memmem(raw, avail, "\r\n\r\n", 4);
+    if(!head_end) return -1;
+    const char* line_end = memmem(raw, head_end - raw + 2, "\r\n", 2);
+    if(!line_end || strncmp(raw, "HTTP/1.", 7) != 0 || line_end - raw < 12) return -1;
+
+    // Status line: "HTTP/1.x SSS reason"
+    int status = atoi(raw + 9);
+    if(!cacheable_status(status)) return -1;
+    const char* reason = raw + 12;
+    while(reason < line_end && *reason == ' ') reason++;
+    int reason_len = line_end - reason;
+
+    struct header_span kept[OBJECT_MAX_HEADERS];
+    int kept_count = 0;
+    long content_length = -1;
+    int chunked = 0;
+    const char* etag = NULL;
+    int etag_len = 0;
+    time_t last_modified = -1;
+
+    for(const char* p = line_end + 2; p < head_end + 2; ) {
+        const char* eol = memmem(p, head_end + 2 - p, "\r\n", 2);
+        const char* colon = memchr(p, ':', eol - p);
+        if(!colon) return -1;
+        struct header_span h = { p, (int)(colon - p), colon + 1, 0 };
+        while(h.value < eol && (*h.value == ' ' || *h.value == '\t')) h.value++;
+        const char* value_end = eol;
+        while(value_end > h.value && (value_end[-1] == ' ' || value_end[-1] == '\t')) value_end--;
+        h.value_len = value_end - h.value;
+        p = eol + 2;
+
+        if(name_is(&h, "Cache-Control")) {
+            char directives[256];
+            snprintf(directives, sizeof(directives), "%.*s", h.value_len, h.value);
+            if(strcasestr(directives, "no-store") || strcasestr(directives, "private")) return -1;
+        }
+        if(name_is(&h, "Transfer-Encoding")) chunked = strncasecmp(h.value, "chunked", 7) == 0;
+        if(name_is(&h, "Content-Length")) content_length = atol(h.value);
+
+        int dropped = 0;
+        for(size_t i = 0; i < sizeof(dropped_headers) / sizeof(dropped_headers[0]); i++) {
+            if(name_is(&h, dropped_headers[i])) dropped = 1;
+        }
+        if(dropped) continue;
+        if(kept_count == OBJECT_MAX_HEADERS) return -1;
+        kept[kept_count++] = h;
+    }
+
+    // Body, un-chunked; a short body means the transfer was cut off
+    const char* body_start = head_end + 4;
+    if(raw_len < 0 && (chunked || content_length < 0)) return chunked && detached ? 1 : -1;
+    long available = raw_len >= 0 ? raw + raw_len - body_start : content_length;
+    char* dechunked = NULL;
+    const char* body = body_start;
+    long body_len = available;
+    if(chunked && detached) {
+        return 1;
+    } else if(chunked) {
+        dechunked = dechunk(body_start, raw + raw_len, &body_len);
+        if(!dechunked) return -1;
+        body = dechunked;
+    } else if(content_length >= 0) {
+        if(available < content_length) return -1;
+        body_len = content_length;
+    }
+
+    // Lay out the blob
+    uint32_t index_off = sizeof(struct object_prefix);
+    uint32_t reason_off = index_off + kept_count * sizeof(struct index_entry);
+    uint32_t headers_off = reason_off + reason_len;
+    uint32_t headers_len = 0;
+    for(int i = 0; i < kept_count; i++) headers_len += kept[i].name_len + 2 + kept[i].value_len + 2;
+    // A hit replays the kept headers into one response head, which also
+    // needs room for the status line, Content-Length and Connection
+    if(headers_len > RESPONSE_HEAD_MAX - OBJECT_HEAD_RESERVE) {
+        free(dechunked);
+        return -1;
+    }
+    uint32_t body_off = headers_off + headers_len;
+    long total = body_off + (detached ? 0 : body_len);
+    if(total > INT32_MAX) {
+        free(dechunked);
+        return -1;
+    }
+
+    char* blob = malloc(total);
+    if(!blob) {
+        free(dechunked);
+        return -1;
+    }
+    struct object_prefix prefix;
+    memset(&prefix, 0, sizeof(prefix));
+    prefix.magic = OBJECT_MAGIC;
+    prefix.status = status;
+    prefix.body_len = body_len;
+    prefix.reason_off = reason_off;
+    prefix.reason_len = reason_len;
+    prefix.headers_off = headers_off;
+    prefix.headers_len = headers_len;
+    prefix.index_off = index_off;
+    prefix.header_count = kept_count;
+    prefix.body_off = body_off;
+    memcpy(blob + reason_off, reason, reason_len);
+
+    char* w = blob + headers_off;
+    for(int i = 0; i < kept_count; i++) {
+        struct index_entry entry;
+        entry.name_off = w - blob;
+        entry.name_len = kept[i].name_len;
+        memcpy(w, kept[i].name, kept[i].name_len);
+        w += kept[i].name_len;
+        memcpy(w, ": ", 2);
+        w += 2;
+        entry.value_off = w - blob;
+        entry.value_len = kept[i].value_len;
+        memcpy(w, kept[i].value, kept[i].value_len);
+        w += kept[i].value_len;
+        memcpy(w, "\r\n", 2);
+        w += 2;
+        memcpy(blob + index_off + i * sizeof(struct index_entry), &entry, sizeof(entry));
+
+        if(name_is(&kept[i], "ETag")) {
+            etag = blob + entry.value_off;
+            etag_len = entry.value_len;
+        } else if(name_is(&kept[i], "Last-Modified")) {
+            last_modified = parse_http_date(kept[i].value, kept[i].value_len);
+        }
+    }
+    if(etag) {
+        prefix.etag_off = etag - blob;
+        prefix.etag_len = etag_len;
+    }
+    prefix.last_modified = last_modified;
+    memcpy(blob, &prefix, sizeof(prefix));
+    if(!detached) memcpy(blob + body_off, body, body_len);
+    free(dechunked);
+
+    *out = blob;
+    *out_len = (int)total;
+    if(body_start_out) *body_start_out = body_start - raw;
+    if(body_len_out) *body_len_out = body_len;
+    return 0;
+}
+
+int cache_object_encode(const char* raw, long raw_len, char** out, int* out_len){
+    return encode_object(raw, raw_len, raw_len, 0, out, out_len, NULL, NULL);
+}
+
+int cache_object_encode_head(const char* raw, long avail, long raw_len, char** out, int* out_len,
+                             long* body_start, long* body_len){
+    return encode_object(raw, avail, raw_len, 1, out, out_len, body_start, body_len);
+}
+
+static int decode_object(const char* data, int len, int detached, struct cache_object* obj){
+    struct object_prefix prefix;
+    if(!data || len < (int)sizeof(prefix)) return -1;
+    memcpy(&prefix, data, sizeof(prefix));
+    if(prefix.magic != OBJECT_MAGIC || prefix.body_off > (uint32_t)len) return -1;
+    if(prefix.flags & OBJECT_SLICED) detached = 1;
+    if(detached ? prefix.body_off != (uint32_t)len
+                : prefix.body_len != len - (int64_t)prefix.body_off) return -1;
+
+    obj->status = prefix.status;
+    obj->reason = data + prefix.reason_off;
+    obj->reason_len = prefix.reason_len;
+    obj->headers = data + prefix.headers_off;
+    obj->headers_len = prefix.headers_len;
+    obj->body = detached ? NULL : data + prefix.body_off;
+    obj->body_len = prefix.body_len;
+    obj->etag = prefix.etag_len ? data + prefix.etag_off : NULL;
+    obj->etag_len = prefix.etag_len;
+    obj->last_modified = prefix.last_modified;
+    obj->header_count = prefix.header_count;
+    obj->index = data + prefix.index_off;
+    obj->sliced = (prefix.flags & OBJECT_SLICED) != 0;
+    return 0;
+}
+
+void cache_object_mark_sliced(char* blob){
+    struct object_prefix prefix;
+    memcpy(&prefix, blob, sizeof(prefix));
+    prefix.flags |= OBJECT_SLICED;
+    memcpy(blob, &prefix, sizeof(prefix));
+}
+
+int cache_object_decode(const char* data, int len, struct cache_object* obj){
+    return decode_object(data, len, 0, obj);
+}
+
+int cache_object_decode_head(const char* data, int len, struct cache_object* obj){
+    return decode_object(data, len, 1, obj);
+}
+
+const char* cache_object_header(const struct cache_object* obj, const char* name, int* value_len){
+    // Offsets in the index are from the blob start, which the prefix precedes
+    const char* blob = obj->index - sizeof(struct object_prefix);
+    size_t name_len = strlen(name);
+    for(int i = 0; i < obj->header_count; i++) {
+        struct index_entry entry;
+        memcpy(&entry, obj->index + i * sizeof(entry), sizeof(entry));
+        if(entry.name_len == name_len && strncasecmp(blob + entry.name_off, name, name_len) == 0) {
+            if(value_len) *value_len = entry.value_len;
+            return blob + entry.value_off;
+        }
+    }
+    return NULL;
+}
+
+// Weak comparison (RFC 9110 13.1.2): W/ prefixes are ignored
+static int etag_listed(const char* list, const char* etag, int etag_len){
+    if(etag_len > 2 && strncmp(etag, "W/", 2) == 0) {
+        etag += 2;
+        etag_len -= 2;
+    }
+    const char* p = list;
+    while(*p) {
+        while(*p == ' ' || *p == '\t' || *p == ',') p++;
+        if(strncmp(p, "W/", 2) == 0) p += 2;
+        const char* end = p;
+        if(*p == '"') {
+            end = strchr(p + 1, '"');
+            end = end ? end + 1 : p + strlen(p);
+        } else {
+            while(*end && *end != ',') end++;
+        }
+        if(end - p == etag_len && strncmp(p, etag, etag_len) == 0) return 1;
+        p = end;
+    }
+    return 0;
+}
+
+int cache_object_not_modified(const struct cache_object* obj, const char* if_none_match,
+                              const char* if_modified_since){
+    if(obj->status != 200) return 0;
+    // If-None-Match wins over If-Modified-Since when both are sent
+    if(if_none_match) {
+        if(strcmp(if_none_match, "*") == 0) return 1;
+        return obj->etag && etag_listed(if_none_match, obj->etag, obj->etag_len);
+    }
+    if(if_modified_since && obj->last_modified >= 0) {
+        time_t since = parse_http_date(if_modified_since, strlen(if_modified_since));
+        return since >= 0 && obj->last_modified <= since;
+    }
+    return 0;
+}
@@ -0,0 +1,65 @@
+#ifndef CACHE_OBJECT_H
+#define CACHE_OBJECT_H
+
+#include <time.h>
+
+// Parsed form of a cached upstream response. The cache, the shared segment
+// and cluster peers all store opaque bytes, so the object is encoded as one
+// position-independent blob:
+//
+//   [prefix][header index][reason][header block][body]
+//
+// The header block holds the end-to-end headers as "Name: value\r\n" lines;
+// hop-by-hop and framing headers (Connection, Transfer-Encoding,
+// Content-Length, ...) are dropped so the response can be re-framed for any
+// connection. A hit is answered from these pieces without re-parsing, and
+// HEAD and 304 replies never touch the body.
+
+struct cache_object {
+    int status;
+    const char* reason;
+    int reason_len;
+    const char* headers;         // Header block
+    int headers_len;
+    const char* body;
+    long body_len;
+    const char* etag;            // NULL if the response had none
+    int etag_len;
+    time_t last_modified;        // -1 if absent or unparsable
+    int header_count;
+    const char* index;           // Entries for cache_object_header
+    int sliced;                  // Body is cached in slices (see slice_cache.h)
+};
+
+// Parse a complete raw upstream response into a new blob. Returns 0, or -1
+// if the response is malformed, truncated or not cacheable (status,
+// Cache-Control: no-store/private, headers too large to replay).
+int cache_object_encode(const char* raw, long raw_len, char** out, int* out_len);
+
+// Encode only the object head; the body stays where it is. raw holds the
+// first avail bytes of a raw_len byte response, at least its header. The
+// blob ends where the body would start, so the head followed by the body
+// bytes [*body_start, *body_start + *body_len) of the response is a complete
+// blob. A raw_len < 0 means the rest has not arrived yet; the body length
+// then comes from Content-Length. Returns 0, -1 as above, or 1 if the body
+// is chunked and has to be decoded by cache_object_encode.
+int cache_object_encode_head(const char* raw, long avail, long raw_len, char** out, int* out_len,
+                             long* body_start, long* body_len);
+
+// View an encoded blob; the object points into data. Returns 0 or -1.
+int cache_object_decode(const char* data, int len, struct cache_object* obj);
+// View a blob made by cache_object_encode_head; obj->body is NULL
+int cache_object_decode_head(const char* data, int len, struct cache_object* obj);
+
+// Flag a blob from cache_object_encode_head as the manifest of a sliced
+// object. Decoding it always gives obj->sliced set and obj->body NULL.
+void cache_object_mark_sliced(char* blob);
+
+// Value of a stored header, or NULL
+const char* cache_object_header(const struct cache_object* obj, const char* name, int* value_len);
+
+// 1 if the client's validators match, so a 304 can be sent. Either may be NULL.
+int cache_object_not_modified(const struct cache_object* obj, const char* if_none_match,
+                              const char* if_modified_since);
+
+#endif
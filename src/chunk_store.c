@@ -0,0 +1,466 @@
+#include "chunk_store.h"
+#include "sha256.h"
+#include "egress.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/xattr.h>
+
+#define CHUNK_MIN (2 * 1024)
+#define CHUNK_MAX (64 * 1024)
+#define GEAR_WINDOW 64                  // Bytes that influence the top hash bits
+// Cut when the top 13 bits are zero: ~8KB average past the minimum
+#define CHUNK_MASK (0x1FFFULL << 51)
+#define MANIFEST_MAGIC "\0CMF1 "
+#define MANIFEST_MAGIC_LEN 6
+#define MANIFEST_MAX (64L << 20)
+#define MANIFEST_XATTR "user.chunk_manifest"  // Set only on manifests this store wrote
+#define SEND_BATCH 64                   // Chunks mapped per writev
+#define GC_GRACE_SEC 600                // Younger chunks may belong to uploads in progress
+
+static char chunk_dir[256] = "./.chunks";
+static int store_enabled = 0;
+static unsigned long long gear_table[256];
+static volatile unsigned char fanout_ready[256];  // Subdirectories known to exist
+static unsigned long temp_seq = 0;
+
+int chunk_store_init(const char* dir, int enabled){
+    snprintf(chunk_dir, sizeof(chunk_dir), "%s", dir);
+
+    // Fixed seed: the same bytes must cut at the same places on every run
+    unsigned long long seed = 0x9E3779B97F4A7C15ULL;
+    for(int i = 0; i < 256; i++) {
+        unsigned long long z = (seed += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        gear_table[i] = z ^ (z >> 31);
+    }
+
+    if(!enabled) return 0;
+    if(mkdir(chunk_dir, 0755) != 0 && errno != EEXIST) {
+        printf("[CHUNK] Cannot create %s: %s\n", chunk_dir, strerror(errno));
+        return -1;
+    }
+    // Manifests cannot be told from uploads without the mark
+    if(setxattr(chunk_dir, MANIFEST_XATTR, "1", 1, 0) != 0) {
+        printf("[CHUNK] %s does not support extended attributes: %s\n", chunk_dir, strerror(errno));
+        return -1;
+    }
+    removexattr(chunk_dir, MANIFEST_XATTR);
+    store_enabled = 1;
+    printf("[CHUNK] Deduplicating uploads into %s\n", chunk_dir);
+    return 0;
+}
+
+int chunk_store_enabled(void){
+    return store_enabled;
+}
+
+static int hex_value(char c){
+    if(c >= '0' && c <= '9') return c - '0';
+    if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+static void chunk_path(const char* hash, char* out, size_t out_len){
+    snprintf(out, out_len, "%s/%c%c/%s", chunk_dir, hash[0], hash[1], hash);
+}
+
+// ---------------------------------------------------------------------------
+// Writing
+// ---------------------------------------------------------------------------
+
+int chunk_writer_open(struct chunk_writer* writer){
+    memset(writer, 0, sizeof(*writer));
+    writer->pending = malloc(CHUNK_MAX);
+    return writer->pending ? 0 : -1;
+}
+
+static int append_ref(struct chunk_writer* writer, const char* hash, int len){
+    struct chunk_manifest* m = &writer->manifest;
+    if(m->count == writer->capacity) {
+        int capacity = writer->capacity ? writer->capacity * 2 : 64;
+        struct chunk_ref* grown = realloc(m->chunks, capacity * sizeof(struct chunk_ref));
+        if(!grown) return -1;
+        m->chunks = grown;
+        writer->capacity = capacity;
+    }
+    memcpy(m->chunks[m->count].hash, hash, 65);
+    m->chunks[m->count].len = len;
+    m->count++;
+    m->size += len;
+    return 0;
+}
+
+// Store one chunk unless an identical one exists; either way it joins the manifest
+static int store_chunk(struct chunk_writer* writer, const char* data, size_t len){
+    char hash[65], path[512];
+    sha256_hex(data, len, hash);
+    chunk_path(hash, path, sizeof(path));
+
+    int fanout = hex_value(hash[0]) * 16 + hex_value(hash[1]);
+    if(!fanout_ready[fanout]) {
+        char dir[300];
+        snprintf(dir, sizeof(dir), "%s/%c%c", chunk_dir, hash[0], hash[1]);
+        if(mkdir(dir, 0755) != 0 && errno != EEXIST) return -1;
+        fanout_ready[fanout] = 1;
+    }
+
+    // An existing chunk gets a fresh mtime so the collector leaves it alone
+    if(utimensat(AT_FDCWD, path, NULL, 0) == 0) return append_ref(writer, hash, len);
+
+    char temp[560];
+    unsigned long seq = __atomic_add_fetch(&temp_seq, 1, __ATOMIC_RELAXED);
+    snprintf(temp, sizeof(temp), "%s/%c%c/.tmp-%d-%lu", chunk_dir, hash[0], hash[1], (int)getpid(), seq);
+    int fd = open(temp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if(fd < 0) return -1;
+    size_t done = 0;
+    while(done < len) {
+        ssize_t n = write(fd, data + done, len - done);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) {
+            close(fd);
+            unlink(temp);
+            return -1;
+        }
+        done += n;
+    }
+    close(fd);
+    // Content-addressed: a concurrent writer of the same chunk wrote the same bytes
+    if(rename(temp, path) != 0) {
+        unlink(temp);
+        return -1;
+    }
+    writer->new_chunks++;
+    writer->new_bytes += len;
+    return append_ref(writer, hash, len);
+}
+
+static int cut_chunk(struct chunk_writer* writer, size_t len){
+    if(store_chunk(writer, writer->pending, len) < 0) return -1;
+    writer->pending_len -= len;
+    memmove(writer->pending, writer->pending + len, writer->pending_len);
+    writer->scanned = 0;
+    writer->gear = 0;
+    return 0;
+}
+
+int chunk_writer_write(struct chunk_writer* writer, const char* data, size_t len){
+    while(len > 0) {
+        size_t space = CHUNK_MAX - writer->pending_len;
+        size_t n = len < space ? len : space;
+        memcpy(writer->pending + writer->pending_len, data, n);
+        writer->pending_len += n;
+        data += n;
+        len -= n;
+
+        // Look for cut points; bytes before the minimum size (less the hash
+        // window) can never end a chunk, so they are not hashed at all
+        for(;;) {
+            if(writer->scanned < CHUNK_MIN - GEAR_WINDOW) {
+                writer->scanned = writer->pending_len < CHUNK_MIN - GEAR_WINDOW ? writer->pending_len : CHUNK_MIN - GEAR_WINDOW;
+            }
+            size_t cut = 0;
+            unsigned long long gear = writer->gear;
+            size_t i = writer->scanned;
+            for(; i < writer->pending_len; i++) {
+                gear = (gear << 1) + gear_table[(unsigned char)writer->pending[i]];
+                if((i + 1 >= CHUNK_MIN && (gear & CHUNK_MASK) == 0) || i + 1 == CHUNK_MAX) {
+                    cut = i + 1;
+                    break;
+                }
+            }
+            writer->gear = gear;
+            writer->scanned = cut ? cut : i;
+            if(!cut) break;
+            if(cut_chunk(writer, cut) < 0) return -1;
+        }
+    }
+    return 0;
+}
+
+int chunk_writer_commit(struct chunk_writer* writer, const char* path){
+    if(writer->pending_len > 0 && cut_chunk(writer, writer->pending_len) < 0) goto fail;
+
+    // New chunks must be on disk before a manifest can point at them
+    if(writer->new_chunks > 0) {
+        int dir_fd = open(chunk_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if(dir_fd < 0) goto fail;
+        int synced = durable_sync_fs(dir_fd);
+        close(dir_fd);
+        if(synced != 0) goto fail;
+    }
+
+    struct chunk_manifest* m = &writer->manifest;
+    struct durable_file file;
+    if(durable_open(&file, path, 0) < 0) goto fail;
+    // The temp file carries the mark, so the rename publishes both at once
+    if(fsetxattr(file.fd, MANIFEST_XATTR, "1", 1, 0) != 0) {
+        printf("[CHUNK] Cannot mark manifest %s: %s\n", path, strerror(errno));
+        durable_abort(&file);
+        goto fail;
+    }
+    char line[128];
+    int len = snprintf(line, sizeof(line), "%ld %d\n", m->size, m->count);
+    int failed = durable_write(&file, MANIFEST_MAGIC, MANIFEST_MAGIC_LEN) < 0 ||
+                 durable_write(&file, line, len) < 0;
+    for(int i = 0; !failed && i < m->count; i++) {
+        len = snprintf(line, sizeof(line), "%s %d\n", m->chunks[i].hash, m->chunks[i].len);
+        failed = durable_write(&file, line, len) < 0;
+    }
+    if(failed) durable_abort(&file);
+    if(failed || durable_commit(&file) < 0) goto fail;
+
+    printf("[CHUNK] %s: %ld bytes in %d chunks, %d new (%ld bytes written)\n",
+           path, m->size, m->count, writer->new_chunks, writer->new_bytes);
+    chunk_writer_abort(writer);
+    return 0;
+
+fail:
+    chunk_writer_abort(writer);
+    return -1;
+}
+
+void chunk_writer_abort(struct chunk_writer* writer){
+    free(writer->pending);
+    free(writer->manifest.chunks);
+    writer->pending = NULL;
+    writer->manifest.chunks = NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Reading
+// ---------------------------------------------------------------------------
+
+int chunk_manifest_marked(int fd){
+    char mark;
+    return fgetxattr(fd, MANIFEST_XATTR, &mark, sizeof(mark)) == 1 && mark == '1';
+}
+
+int chunk_manifest_marked_at(const char* path){
+    char mark;
+    return getxattr(path, MANIFEST_XATTR, &mark, sizeof(mark)) == 1 && mark == '1';
+}
+
+void chunk_manifest_free(struct chunk_manifest* manifest){
+    if(!manifest) return;
+    free(manifest->chunks);
+    free(manifest);
+}
+
+static struct chunk_manifest* parse_manifest(char* text, size_t text_len){
+    if(text_len < MANIFEST_MAGIC_LEN || memcmp(text, MANIFEST_MAGIC, MANIFEST_MAGIC_LEN) != 0) return NULL;
+    text[text_len] = '\0';
+    char* p = text + MANIFEST_MAGIC_LEN;
+
+    struct chunk_manifest* m = calloc(1, sizeof(struct chunk_manifest));
+    if(!m) return NULL;
+    int count = 0;
+    if(sscanf(p, "%ld %d", &m->size, &count) != 2 || m->size < 0 || count < 0) goto bad;
+    m->chunks = calloc(count + 1, sizeof(struct chunk_ref));
+    if(!m->chunks) goto bad;
+
+    // A marked file that does not parse is damaged; it is served as it is
+    long total = 0;
+    p = strchr(p, '\n');
+    for(int i = 0; i < count; i++) {
+        if(!p) goto bad;
+        p++;
+        char* end = strchr(p, '\n');
+        if(!end || end - p < 66 || p[64] != ' ') goto bad;
+        for(int j = 0; j < 64; j++) if(hex_value(p[j]) < 0) goto bad;
+        memcpy(m->chunks[i].hash, p, 64);
+        m->chunks[i].hash[64] = '\0';
+        m->chunks[i].len = atoi(p + 65);
+        if(m->chunks[i].len <= 0 || m->chunks[i].len > CHUNK_MAX) goto bad;
+        total += m->chunks[i].len;
+        p = end;
+    }
+    if(total != m->size || !p || p[1] != '\0') goto bad;
+    m->count = count;
+    return m;
+
+bad:
+    chunk_manifest_free(m);
+    return NULL;
+}
+
+struct chunk_manifest* chunk_manifest_load(const char* path){
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) return NULL;
+    struct stat st;
+    if(fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size > MANIFEST_MAX || !chunk_manifest_marked(fd)) {
+        close(fd);
+        return NULL;
+    }
+    char* text = malloc(st.st_size + 1);
+    ssize_t n = text ? pread(fd, text, st.st_size, 0) : -1;
+    close(fd);
+    struct chunk_manifest* m = n == st.st_size ? parse_manifest(text, n) : NULL;
+    free(text);
+    return m;
+}
+
+static int writev_all(int sock, struct iovec* iov, int count){
+    while(count > 0) {
+        ssize_t n = egress_send(sock, iov, count);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return -1;
+        while(count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if(count > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+long chunk_manifest_send(int sock, const struct chunk_manifest* manifest, const char* prefix, int prefix_len){
+    struct iovec iov[SEND_BATCH + 1];
+    void* maps[SEND_BATCH];
+    long sent = 0;
+    int next = 0;
+    int first = 1;
+
+    while(first || next < manifest->count) {
+        int count = 0, mapped = 0, failed = 0;
+        if(first && prefix_len > 0) {
+            iov[count].iov_base = (void*)prefix;
+            iov[count].iov_len = prefix_len;
+            count++;
+        }
+        first = 0;
+
+        // Map the next batch of chunks and hand them to one writev
+        for(; mapped < SEND_BATCH && next < manifest->count; next++) {
+            const struct chunk_ref* ref = &manifest->chunks[next];
+            char path[512];
+            chunk_path(ref->hash, path, sizeof(path));
+            int fd = open(path, O_RDONLY | O_CLOEXEC);
+            void* map = fd >= 0 ? mmap(NULL, ref->len, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+            if(fd >= 0) close(fd);
+            if(map == MAP_FAILED) {
+                printf("[CHUNK] Missing chunk %s\n", ref->hash);
+                failed = 1;
+                break;
+            }
+            maps[mapped++] = map;
+            iov[count].iov_base = map;
+            iov[count].iov_len = ref->len;
+            count++;
+        }
+
+        long batch_bytes = 0;
+        for(int i = 0; i < mapped; i++) batch_bytes += manifest->chunks[next - mapped + i].len;
+        if(!failed && writev_all(sock, iov, count) < 0) failed = 1;
+        for(int i = 0; i < mapped; i++) munmap(maps[i], manifest->chunks[next - mapped + i].len);
+        if(failed) return -1;
+        sent += batch_bytes;
+    }
+    return sent;
+}
+
+// ---------------------------------------------------------------------------
+// Garbage collection
+// ---------------------------------------------------------------------------
+
+struct hash_set {
+    char (*hashes)[65];
+    int count;
+    int capacity;
+};
+
+// Add every chunk the manifests under dir refer to. Returns -1 if any
+// manifest may have been missed; a sweep against that set would delete
+// live chunks.
+static int collect_refs(const char* dir, struct hash_set* set){
+    DIR* d = opendir(dir);
+    if(!d) return errno == ENOENT ? 0 : -1;
+    int result = 0;
+    struct dirent* de;
+    while(result == 0 && (de = readdir(d)) != NULL) {
+        if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        char path[1024];
+        if(snprintf(path, sizeof(path), "%s/%s", dir, de->d_name) >= (int)sizeof(path)) {
+            result = -1;
+            break;
+        }
+        if(de->d_type == DT_DIR) {
+            result = collect_refs(path, set);
+            continue;
+        }
+        if(!chunk_manifest_marked_at(path)) continue;
+        struct chunk_manifest* m = chunk_manifest_load(path);
+        if(!m) {
+            result = -1;
+            break;
+        }
+        for(int i = 0; i < m->count; i++) {
+            if(set->count == set->capacity) {
+                int capacity = set->capacity ? set->capacity * 2 : 1024;
+                char (*grown)[65] = realloc(set->hashes, capacity * sizeof(*grown));
+                if(!grown) {
+                    result = -1;
+                    break;
+                }
+                set->hashes = grown;
+                set->capacity = capacity;
+            }
+            memcpy(set->hashes[set->count++], m->chunks[i].hash, 65);
+        }
+        chunk_manifest_free(m);
+    }
+    closedir(d);
+    return result;
+}
+
+static int compare_hashes(const void* a, const void* b){
+    return memcmp(a, b, 64);
+}
+
+int chunk_store_gc(const char** roots, int root_count){
+    struct hash_set set = { NULL, 0, 0 };
+    for(int i = 0; i < root_count; i++) {
+        if(collect_refs(roots[i], &set) < 0) {
+            printf("[CHUNK] Could not read every manifest under %s, skipping collection\n", roots[i]);
+            free(set.hashes);
+            return -1;
+        }
+    }
+    if(set.count > 0) qsort(set.hashes, set.count, sizeof(*set.hashes), compare_hashes);
+
+    int removed = 0;
+    time_t cutoff = time(NULL) - GC_GRACE_SEC;
+    for(int f = 0; f < 256; f++) {
+        char dir[300];
+        snprintf(dir, sizeof(dir), "%s/%02x", chunk_dir, f);
+        DIR* d = opendir(dir);
+        if(!d) continue;
+        struct dirent* de;
+        while((de = readdir(d)) != NULL) {
+            if(de->d_name[0] == '.' && strncmp(de->d_name, ".tmp-", 5) != 0) continue;
+            if(de->d_name[0] != '.' && set.count > 0 &&
+               bsearch(de->d_name, set.hashes, set.count, sizeof(*set.hashes), compare_hashes)) continue;
+            char path[600];
+            snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+            struct stat st;
+            if(stat(path, &st) == 0 && st.st_mtime < cutoff && unlink(path) == 0) removed++;
+        }
+        closedir(d);
+    }
+    free(set.hashes);
+    printf("[CHUNK] Collected %d unreferenced chunks\n", removed);
+    return removed;
+}
@@ -0,0 +1,62 @@
+#ifndef CHUNK_STORE_H
+#define CHUNK_STORE_H
+
+#include <stddef.h>
+#include "durable.h"
+
+// Optional deduplicating storage for uploaded files. Bodies are split into
+// content-defined chunks with a gear rolling hash; each unique chunk is
+// stored once under its SHA-256, and the file itself becomes a manifest
+// listing its chunks. A manifest is marked with an extended attribute that
+// only chunk_writer_commit sets, so an upload whose bytes merely look like
+// one is served as it is. Marked manifests are recognised on read
+// regardless of mode.
+
+struct chunk_ref {
+    char hash[65];               // SHA-256, hex
+    int len;
+};
+
+struct chunk_manifest {
+    long size;                   // Size of the reassembled file
+    int count;
+    struct chunk_ref* chunks;
+};
+
+// Streaming writer for one file; memory stays bounded by the max chunk size
+struct chunk_writer {
+    char* pending;               // Bytes not yet cut into a chunk
+    size_t pending_len;
+    size_t scanned;              // Prefix of pending already fed to the hash
+    unsigned long long gear;     // Rolling hash state
+    struct chunk_manifest manifest;
+    int capacity;
+    int new_chunks;              // Chunks not already in the store
+    long new_bytes;
+};
+
+int chunk_store_init(const char* dir, int enabled);
+int chunk_store_enabled(void);
+
+int chunk_writer_open(struct chunk_writer* writer);
+int chunk_writer_write(struct chunk_writer* writer, const char* data, size_t len);
+// Store the remaining chunk and atomically write the manifest to path
+int chunk_writer_commit(struct chunk_writer* writer, const char* path);
+void chunk_writer_abort(struct chunk_writer* writer);
+
+// Load path as a manifest; NULL if it is a regular file or unreadable
+struct chunk_manifest* chunk_manifest_load(const char* path);
+// 1 if the open file, or the file at path, carries the manifest mark
+int chunk_manifest_marked(int fd);
+int chunk_manifest_marked_at(const char* path);
+void chunk_manifest_free(struct chunk_manifest* manifest);
+
+// Send prefix followed by the reassembled file using writev over mapped
+// chunks. Returns bytes of file content sent, or -1.
+long chunk_manifest_send(int sock, const struct chunk_manifest* manifest, const char* prefix, int prefix_len);
+
+// Remove chunks no manifest under roots refers to; returns chunks removed,
+// or -1 (removing nothing) if some manifest could not be read
+int chunk_store_gc(const char** roots, int root_count);
+
+#endif
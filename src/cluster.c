@@ -0,0 +1,523 @@
+#include "cluster.h"
+#include "cache.h"
+#include "config.h"
+#include "response.h"
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#define MAX_IDLE_CONNS 8              // Idle connections kept per peer
+#define IDLE_REUSE_MS 30000           // Older idle connections are dropped (server idles out at 60s)
+#define PEER_TIMEOUT_SEC 5            // Connect/send/recv timeout towards peers
+#define SERVE_IDLE_SEC 60             // Idle timeout on incoming peer connections
+#define MAX_OBJECT_SIZE (50 * 1024 * 1024)
+#define HEADER_MAX 8192
+
+struct idle_conn {
+    int fd;
+    long long since_ms;
+};
+
+struct cluster_node {
+    char name[128];                   // "host:port", hashed onto the ring
+    struct sockaddr_in addr;
+    int is_self;
+
+    pthread_mutex_t lock;
+    struct idle_conn idle[MAX_IDLE_CONNS];
+    int idle_count;
+    int failures;                     // Consecutive connect/request failures
+    long long down_until_ms;          // Skipped on the ring until then
+};
+
+struct ring_point {
+    uint32_t hash;
+    int node;
+};
+
+static struct cluster_node nodes[MAX_PEERS + 1];
+static int node_count = 0;
+static struct ring_point* ring = NULL;
+static int ring_size = 0;
+static int enabled = 0;
+
+static long long now_ms(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// FNV-1a with a murmur3 finalizer so similar names ("node#1", "node#2")
+// land far apart on the ring
+static uint32_t ring_hash(const char* s){
+    uint32_t h = 2166136261u;
+    while(*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static int compare_points(const void* a, const void* b){
+    const struct ring_point* pa = a;
+    const struct ring_point* pb = b;
+    if(pa->hash != pb->hash) return pa->hash < pb->hash ? -1 : 1;
+    // Ties broken by name so every node builds the same ring
+    return strcmp(nodes[pa->node].name, nodes[pb->node].name);
+}
+
+static int resolve_node(const char* spec, struct cluster_node* node){
+    char host[128];
+    const char* colon = strrchr(spec, ':');
+    if(!colon || colon == spec || (size_t)(colon - spec) >= sizeof(host)) return -1;
+    int port = atoi(colon + 1);
+    if(port <= 0 || port > 65535) return -1;
+    memcpy(host, spec, colon - spec);
+    host[colon - spec] = '\0';
+
+    struct addrinfo hints, *res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo(host, NULL, &hints, &res) != 0 || !res) return -1;
+    memcpy(&node->addr, res->ai_addr, sizeof(node->addr));
+    node->addr.sin_port = htons(port);
+    freeaddrinfo(res);
+
+    snprintf(node->name, sizeof(node->name), "%s", spec);
+    pthread_mutex_init(&node->lock, NULL);
+    return 0;
+}
+
+int cluster_init(const char* self, char peers[][128], int peer_count, int vnodes){
+    if(peer_count <= 0) return 0;
+    if(vnodes <= 0) vnodes = 1;
+
+    if(resolve_node(self, &nodes[0]) < 0) {
+        printf("[CLUSTER] Invalid self address: %s\n", self);
+        return -1;
+    }
+    nodes[0].is_self = 1;
+    node_count = 1;
+
+    for(int i = 0; i < peer_count && node_count <= MAX_PEERS; i++) {
+        // The same peer list can be handed to every node; skip ourselves
+        if(strcmp(peers[i], self) == 0) continue;
+        if(resolve_node(peers[i], &nodes[node_count]) < 0) {
+            printf("[CLUSTER] Invalid peer address: %s\n", peers[i]);
+            return -1;
+        }
+        node_count++;
+    }
+    if(node_count == 1) {
+        printf("[CLUSTER] No peers besides self, cluster mode disabled\n");
+        return 0;
+    }
+
+    // Each node owns vnodes points; adding or removing a node only moves
+    // the keys between its points and their predecessors
+    ring_size = node_count * vnodes;
+    ring = malloc(ring_size * sizeof(struct ring_point));
+    if(!ring) {
+        perror("[CLUSTER] Memory allocation failed");
+        return -1;
+    }
+    int n = 0;
+    for(int i = 0; i < node_count; i++) {
+        for(int v = 0; v < vnodes; v++) {
+            char label[160];
+            snprintf(label, sizeof(label), "%s#%d", nodes[i].name, v);
+            ring[n].hash = ring_hash(label);
+            ring[n].node = i;
+            n++;
+        }
+    }
+    qsort(ring, ring_size, sizeof(struct ring_point), compare_points);
+
+    enabled = 1;
+    printf("[CLUSTER] Ring of %d nodes x %d vnodes, self %s\n", node_count, vnodes, self);
+    return 0;
+}
+
+int cluster_enabled(void){
+    return enabled;
+}
+
+static int node_available(int index, long long now){
+    struct cluster_node* node = &nodes[index];
+    if(node->is_self) return 1;
+    pthread_mutex_lock(&node->lock);
+    int up = node->down_until_ms <= now;
+    pthread_mutex_unlock(&node->lock);
+    return up;
+}
+
+// First point clockwise from the key's hash whose node is reachable. A
+// peer marked down only hands its own keys to the next node on the ring.
+static int owner_of(const char* key){
+    uint32_t h = ring_hash(key);
+    int lo = 0, hi = ring_size;
+    while(lo < hi) {
+        int mid = (lo + hi) / 2;
+        if(ring[mid].hash < h) lo = mid + 1;
+        else hi = mid;
+    }
+    long long now = now_ms();
+    for(int i = 0; i < ring_size; i++) {
+        int node = ring[(lo + i) % ring_size].node;
+        if(node_available(node, now)) return node;
+    }
+    return 0;
+}
+
+int cluster_is_local(const char* key){
+    if(!enabled || !key) return 1;
+    return nodes[owner_of(key)].is_self;
+}
+
+// ---------------------------------------------------------------------------
+// Outgoing peer connections
+// ---------------------------------------------------------------------------
+
+static void mark_result(struct cluster_node* node, int ok){
+    pthread_mutex_lock(&node->lock);
+    if(ok) {
+        node->failures = 0;
+        node->down_until_ms = 0;
+    } else {
+        // Back off 500ms, 1s, 2s ... up to 32s before trying the peer again
+        int shift = node->failures < 6 ? node->failures : 6;
+        node->failures++;
+        node->down_until_ms = now_ms() + (500LL << shift);
+        printf("[CLUSTER] Peer %s unreachable, skipping for %lldms\n", node->name, 500LL << shift);
+    }
+    pthread_mutex_unlock(&node->lock);
+}
+
+static int peer_connect(struct cluster_node* node){
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if(sock < 0) return -1;
+
+    struct timeval timeout = { PEER_TIMEOUT_SEC, 0 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if(connect(sock, (struct sockaddr*)&node->addr, sizeof(node->addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+// Reuse an idle connection if a fresh enough one exists. *reused tells the
+// caller whether a failure may just mean the peer closed it meanwhile.
+static int peer_acquire(struct cluster_node* node, int* reused){
+    long long now = now_ms();
+    pthread_mutex_lock(&node->lock);
+    while(node->idle_count > 0) {
+        struct idle_conn conn = node->idle[--node->idle_count];
+        if(now - conn.since_ms < IDLE_REUSE_MS) {
+            pthread_mutex_unlock(&node->lock);
+            *reused = 1;
+            return conn.fd;
+        }
+        close(conn.fd);
+    }
+    pthread_mutex_unlock(&node->lock);
+    *reused = 0;
+    return peer_connect(node);
+}
+
+static void peer_release(struct cluster_node* node, int sock){
+    pthread_mutex_lock(&node->lock);
+    if(node->idle_count < MAX_IDLE_CONNS) {
+        node->idle[node->idle_count].fd = sock;
+        node->idle[node->idle_count].since_ms = now_ms();
+        node->idle_count++;
+        sock = -1;
+    }
+    pthread_mutex_unlock(&node->lock);
+    if(sock >= 0) close(sock);
+}
+
+static int send_all(int sock, const char* data, long len){
+    long sent = 0;
+    while(sent < len) {
+        ssize_t n = send(sock, data + sent, len - sent, MSG_NOSIGNAL);
+        if(n <= 0) return -1;
+        sent += n;
+    }
+    return 0;
+}
+
+static int recv_all(int sock, char* data, long len){
+    long got = 0;
+    while(got < len) {
+        ssize_t n = recv(sock, data + got, len - got, 0);
+        if(n <= 0) return -1;
+        got += n;
+    }
+    return 0;
+}
+
+// Read until the end of the header block. buf may already hold *filled
+// bytes. Returns the header length (including the blank line), 0 if the
+// connection closed before any new message started, or -1.
+static int recv_headers(int sock, char* buf, int cap, int* filled){
+    for(;;) {
+        buf[*filled] = '\0';
+        char* end = strstr(buf, "\r\n\r\n");
+        if(end) return (int)(end - buf) + 4;
+        if(*filled >= cap - 1) return -1;
+        ssize_t n = recv(sock, buf + *filled, cap - 1 - *filled, 0);
+        if(n <= 0) return *filled == 0 ? 0 : -1;
+        *filled += n;
+    }
+}
+
+// Case-insensitive header lookup within a header block; copies the value
+static int header_value(const char* head, int head_len, const char* name, char* out, int out_len){
+    size_t name_len = strlen(name);
+    const char* line = strstr(head, "\r\n");
+    while(line && line < head + head_len) {
+        line += 2;
+        if(strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            const char* value = line + name_len + 1;
+            while(*value == ' ') value++;
+            const char* end = strstr(value, "\r\n");
+            if(!end) return -1;
+            int len = (int)(end - value);
+            if(len >= out_len) return -1;
+            memcpy(out, value, len);
+            out[len] = '\0';
+            return len;
+        }
+        line = strstr(line, "\r\n");
+    }
+    return -1;
+}
+
+static long content_length(const char* head, int head_len){
+    char value[32];
+    if(header_value(head, head_len, "Content-Length", value, sizeof(value)) < 0) return 0;
+    return atol(value);
+}
+
+// One request/response exchange on sock. Returns the HTTP status, or -1 if
+// the connection failed; on 200, *data and *len hold the body.
+static int peer_exchange(int sock, const char* request, int request_len,
+                         const char* body, int body_len, char** data, int* len){
+    if(send_all(sock, request, request_len) < 0) return -1;
+    if(body_len > 0 && send_all(sock, body, body_len) < 0) return -1;
+
+    char head[HEADER_MAX];
+    int filled = 0;
+    int head_len = recv_headers(sock, head, sizeof(head), &filled);
+    if(head_len <= 0) return -1;
+
+    int status = 0;
+    if(sscanf(head, "HTTP/1.%*d %d", &status) != 1) return -1;
+    long length = content_length(head, head_len);
+    if(length < 0 || length > MAX_OBJECT_SIZE) return -1;
+
+    char* payload = malloc(length + 1);
+    if(!payload) return -1;
+    long extra = filled - head_len;
+    if(extra > length) extra = length;
+    memcpy(payload, head + head_len, extra);
+    if(recv_all(sock, payload + extra, length - extra) < 0) {
+        free(payload);
+        return -1;
+    }
+    payload[length] = '\0';
+
+    if(status == 200 && data) {
+        *data = payload;
+        *len = (int)length;
+    } else {
+        free(payload);
+    }
+    return status;
+}
+
+// Send one request to the owner of key, retrying once on a fresh
+// connection if a pooled one turns out to have been closed by the peer
+static int peer_request(const char* key, const char* request, int request_len,
+                        const char* body, int body_len, char** data, int* len){
+    struct cluster_node* node = &nodes[owner_of(key)];
+    if(node->is_self) return -1;
+
+    for(int attempt = 0; attempt < 2; attempt++) {
+        int reused = 0;
+        int sock = peer_acquire(node, &reused);
+        if(sock < 0) break;
+
+        int status = peer_exchange(sock, request, request_len, body, body_len, data, len);
+        if(status > 0) {
+            peer_release(node, sock);
+            mark_result(node, 1);
+            return status;
+        }
+        close(sock);
+        if(!reused) break;
+    }
+    mark_result(node, 0);
+    return -1;
+}
+
+int cluster_fetch(const char* key, char** data, int* len){
+    if(!enabled || !key) return 0;
+    char request[HEADER_MAX];
+    int request_len = snprintf(request, sizeof(request),
+        "GET /_cluster/get HTTP/1.1\r\n"
+        "Host: cluster\r\n"
+        "X-Cache-Key: %s\r\n"
+        "Connection: keep-alive\r\n"
+        "\r\n", key);
+    if(request_len >= (int)sizeof(request)) return 0;
+
+    trace_begin(TRACE_PEER);
+    int status = peer_request(key, request, request_len, NULL, 0, data, len);
+    trace_end(TRACE_PEER);
+    if(status < 0) return -1;
+    if(status == 200) {
+        printf("[CLUSTER] Peer hit for %s (%d bytes)\n", key, *len);
+        return 1;
+    }
+    return 0;
+}
+
+int cluster_store(const char* key, const char* data, int len){
+    if(!enabled || !key || !data || len <= 0) return -1;
+    char request[HEADER_MAX];
+    int request_len = snprintf(request, sizeof(request),
+        "PUT /_cluster/put HTTP/1.1\r\n"
+        "Host: cluster\r\n"
+        "X-Cache-Key: %s\r\n"
+        "Content-Length: %d\r\n"
+        "Connection: keep-alive\r\n"
+        "\r\n", key, len);
+    if(request_len >= (int)sizeof(request)) return -1;
+
+    int status = peer_request(key, request, request_len, data, len, NULL, NULL);
+    return status == 200 || status == 204 ? 0 : -1;
+}
+
+// ---------------------------------------------------------------------------
+// Incoming peer requests
+// ---------------------------------------------------------------------------
+
+static int peer_allowed(int clientSocket){
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    if(getpeername(clientSocket, (struct sockaddr*)&addr, &addr_len) < 0) return 0;
+    if((ntohl(addr.sin_addr.s_addr) >> 24) == 127) return 1;
+    for(int i = 1; i < node_count; i++) {
+        if(nodes[i].addr.sin_addr.s_addr == addr.sin_addr.s_addr) return 1;
+    }
+    return 0;
+}
+
+static int send_status(int clientSocket, int status, const char* status_text){
+    char response[128];
+    int len = snprintf(response, sizeof(response),
+        "HTTP/1.1 %d %s\r\nContent-Length: 0\r\n\r\n", status, status_text);
+    return send_all(clientSocket, response, len);
+}
+
+// Peers only ever read and write this node's cache; a request is never
+// forwarded again, so a disagreement about ring membership cannot loop
+void cluster_serve(int clientSocket, const char* raw, int raw_len){
+    if(!enabled || !peer_allowed(clientSocket)) {
+        send_status(clientSocket, 403, "Forbidden");
+        return;
+    }
+
+    struct timeval timeout = { SERVE_IDLE_SEC, 0 };
+    setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    int one = 1;
+    setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    char buf[HEADER_MAX];
+    int filled = raw_len < (int)sizeof(buf) - 1 ? raw_len : (int)sizeof(buf) - 1;
+    memcpy(buf, raw, filled);
+
+    for(;;) {
+        int head_len = recv_headers(clientSocket, buf, sizeof(buf), &filled);
+        if(head_len <= 0) break;
+
+        char method[16], path[64], key[HEADER_MAX];
+        if(sscanf(buf, "%15s %63s", method, path) != 2 ||
+           header_value(buf, head_len, "X-Cache-Key", key, sizeof(key)) <= 0) {
+            send_status(clientSocket, 400, "Bad Request");
+            break;
+        }
+        long length = content_length(buf, head_len);
+        if(length < 0 || length > MAX_OBJECT_SIZE) {
+            send_status(clientSocket, 413, "Payload Too Large");
+            break;
+        }
+
+        // Collect the body; part of it may already be buffered
+        char* body = NULL;
+        long extra = filled - head_len;
+        if(extra > length) extra = length;
+        if(length > 0) {
+            body = malloc(length);
+            if(!body) break;
+            memcpy(body, buf + head_len, extra);
+            if(recv_all(clientSocket, body + extra, length - extra) < 0) {
+                free(body);
+                break;
+            }
+        }
+        // Keep any pipelined bytes for the next request
+        filled -= head_len + extra;
+        memmove(buf, buf + head_len + extra, filled);
+
+        int ok;
+        if(strcmp(method, "GET") == 0 && strcmp(path, "/_cluster/get") == 0) {
+            cache_element* cached = cache_find(key);
+            if(cached) {
+                // Peers get the whole blob: the head followed by any body chain
+                struct response response;
+                response_start(&response, clientSocket, 200);
+                response.keep_alive = 1;
+                if(cached->body) {
+                    ok = response_send_chain(&response, cached->data, cached->len, cached->body) == 0;
+                } else {
+                    response_body(&response, cached->data, cached->len);
+                    ok = response_send(&response) == 0;
+                }
+                cache_release(cached);
+            } else {
+                ok = send_status(clientSocket, 404, "Not Found") == 0;
+            }
+        } else if(strcmp(method, "PUT") == 0 && strcmp(path, "/_cluster/put") == 0 && body) {
+            cache_add(body, (int)length, key);
+            printf("[CLUSTER] Stored %s for a peer (%ld bytes)\n", key, length);
+            ok = send_status(clientSocket, 204, "No Content") == 0;
+        } else {
+            ok = send_status(clientSocket, 404, "Not Found") == 0;
+        }
+        free(body);
+        if(!ok) break;
+    }
+}
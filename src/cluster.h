@@ -0,0 +1,26 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+// Optional peer cache cluster. Every node places itself and its static
+// peers on a consistent-hash ring with virtual nodes; the node owning a
+// cache key is the only one that stores it. Other nodes ask the owner over
+// persistent internal connections before going to the origin.
+int cluster_init(const char* self, char peers[][128], int peer_count, int vnodes);
+int cluster_enabled(void);
+
+// 1 if this node owns key (always 1 when clustering is off)
+int cluster_is_local(const char* key);
+
+// Ask the owner of key for it. Returns 1 with *data (malloc'd) and *len on
+// a hit, 0 on a miss, and -1 if the owner could not be reached.
+int cluster_fetch(const char* key, char** data, int* len);
+
+// Hand an object fetched from the origin to its owner for caching
+int cluster_store(const char* key, const char* data, int len);
+
+// Serve /_cluster/ requests from a peer on an accepted connection. The
+// first request is already in raw/raw_len; the connection stays open for
+// further requests until the peer closes it or goes idle.
+void cluster_serve(int clientSocket, const char* raw, int raw_len);
+
+#endif
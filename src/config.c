@@ -0,0 +1,564 @@
+#include "config.h"
+#include "io_backend.h"
+#include "durable.h"
+#include "backend.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+struct proxy_config config = {
+    .port = DEFAULT_PORT,
+    .workers = MAX_CLIENTS,
+    .queue_size = 1024,
+    .queue_budget_ms = 2000,
+    .retry_after = 1,
+    .lane_read = 96,
+    .lane_write = 32,
+    .lane_cacheable = 128,
+    .lane_passthrough = 64,
+    .lane_queue = 32,
+    .rate_limit = 0.0,
+    .rate_burst = 20,
+    .rate_table_size = 4096,
+    .keepalive_timeout = 5,
+    .keepalive_requests = 100,
+    .header_timeout = 10,
+    .body_timeout = 30,
+    .connect_timeout = 5,
+    .ttfb_timeout = 30,
+    .processes = 1,
+    .shm_cache_mb = 256,
+    .cluster_peer_count = 0,
+    .cluster_vnodes = 128,
+    .route_count = 0,
+    .balance = BALANCE_LEAST,
+    .health_interval = 5,
+    .health_path = "/",
+    .unhealthy_after = 3,
+    .eject_factor = 3,
+    .eject_time = 30,
+    .egress_rate_kb = 0,
+    .egress_conn_rate_kb = 0,
+    .egress_ip_rate_kb = 0,
+    .egress_burst_kb = 256,
+    .egress_quantum_kb = 64,
+    .io_backend = IO_BACKEND_AUTO,
+    .file_cache_entries = 1024,
+    .file_cache_ram_mb = 64,
+    .file_cache_small_kb = 256,
+    .find_index_content_kb = 16,
+    .find_rescan_sec = 300,
+    .durability = DURABILITY_DATA,
+    .commit_delay_us = 0,
+    .dedup = 0,
+    .chunk_dir = "./.chunks",
+    .slice_kb = 1024,
+    .slice_threshold_kb = 8192,
+    .negative_ttl = 10,
+    .dns_negative_ttl = 30,
+    .breaker_failures = 5,
+    .breaker_open = 10,
+    .prefetch = 0,
+    .prefetch_workers = 2,
+    .prefetch_queue = 256,
+    .prefetch_rate_kb = 512,
+    .warmup_log = "",
+    .warmup_log_interval = 60,
+    .warmup_top = 1000,
+    .warmup_workers = 4,
+    .warmup_rate = 50,
+    .snapshot = "",
+    .upgrade_socket = "",
+    .upgrade_from = "",
+    .drain_timeout = 30,
+    .trace_sample_rate = 0.0,
+    .trace_buffer = 1024,
+    .trace_file = "proxy_trace.json",
+};
+
+enum {
+    OPT_WORKERS = 256,
+    OPT_QUEUE_SIZE,
+    OPT_QUEUE_BUDGET,
+    OPT_RETRY_AFTER,
+    OPT_LANE_READ,
+    OPT_LANE_WRITE,
+    OPT_LANE_CACHEABLE,
+    OPT_LANE_PASSTHROUGH,
+    OPT_LANE_QUEUE,
+    OPT_RATE_LIMIT,
+    OPT_RATE_BURST,
+    OPT_RATE_TABLE,
+    OPT_KEEPALIVE_TIMEOUT,
+    OPT_KEEPALIVE_REQUESTS,
+    OPT_HEADER_TIMEOUT,
+    OPT_BODY_TIMEOUT,
+    OPT_CONNECT_TIMEOUT,
+    OPT_TTFB_TIMEOUT,
+    OPT_PROCESSES,
+    OPT_SHM_CACHE,
+    OPT_PEER,
+    OPT_CLUSTER_SELF,
+    OPT_VNODES,
+    OPT_ROUTE,
+    OPT_BALANCE,
+    OPT_HEALTH_INTERVAL,
+    OPT_HEALTH_PATH,
+    OPT_UNHEALTHY_AFTER,
+    OPT_EJECT_FACTOR,
+    OPT_EJECT_TIME,
+    OPT_EGRESS_RATE,
+    OPT_EGRESS_CONN_RATE,
+    OPT_EGRESS_IP_RATE,
+    OPT_EGRESS_BURST,
+    OPT_EGRESS_QUANTUM,
+    OPT_IO_BACKEND,
+    OPT_FILE_CACHE,
+    OPT_FILE_CACHE_RAM,
+    OPT_FILE_CACHE_SMALL,
+    OPT_INDEX_CONTENT,
+    OPT_INDEX_RESCAN,
+    OPT_DURABILITY,
+    OPT_COMMIT_DELAY,
+    OPT_DEDUP,
+    OPT_CHUNK_DIR,
+    OPT_SLICE_SIZE,
+    OPT_SLICE_THRESHOLD,
+    OPT_NEGATIVE_TTL,
+    OPT_DNS_NEGATIVE_TTL,
+    OPT_BREAKER_FAILURES,
+    OPT_BREAKER_OPEN,
+    OPT_PREFETCH,
+    OPT_PREFETCH_WORKERS,
+    OPT_PREFETCH_QUEUE,
+    OPT_PREFETCH_RATE,
+    OPT_WARMUP_LOG,
+    OPT_WARMUP_INTERVAL,
+    OPT_WARMUP_TOP,
+    OPT_WARMUP_WORKERS,
+    OPT_WARMUP_RATE,
+    OPT_SNAPSHOT,
+    OPT_UPGRADE_SOCKET,
+    OPT_UPGRADE_FROM,
+    OPT_DRAIN_TIMEOUT,
+    OPT_TRACE_SAMPLE,
+    OPT_TRACE_BUFFER,
+    OPT_TRACE_FILE,
+};
+
+static const struct option long_options[] = {
+    {"port",         required_argument, NULL, 'p'},
+    {"workers",      required_argument, NULL, OPT_WORKERS},
+    {"queue-size",   required_argument, NULL, OPT_QUEUE_SIZE},
+    {"queue-budget", required_argument, NULL, OPT_QUEUE_BUDGET},
+    {"retry-after",  required_argument, NULL, OPT_RETRY_AFTER},
+    {"lane-read",    required_argument, NULL, OPT_LANE_READ},
+    {"lane-write",   required_argument, NULL, OPT_LANE_WRITE},
+    {"lane-cacheable", required_argument, NULL, OPT_LANE_CACHEABLE},
+    {"lane-passthrough", required_argument, NULL, OPT_LANE_PASSTHROUGH},
+    {"lane-queue",   required_argument, NULL, OPT_LANE_QUEUE},
+    {"rate-limit",   required_argument, NULL, OPT_RATE_LIMIT},
+    {"rate-burst",   required_argument, NULL, OPT_RATE_BURST},
+    {"rate-table",   required_argument, NULL, OPT_RATE_TABLE},
+    {"keepalive-timeout", required_argument, NULL, OPT_KEEPALIVE_TIMEOUT},
+    {"keepalive-requests", required_argument, NULL, OPT_KEEPALIVE_REQUESTS},
+    {"header-timeout", required_argument, NULL, OPT_HEADER_TIMEOUT},
+    {"body-timeout", required_argument, NULL, OPT_BODY_TIMEOUT},
+    {"connect-timeout", required_argument, NULL, OPT_CONNECT_TIMEOUT},
+    {"ttfb-timeout", required_argument, NULL, OPT_TTFB_TIMEOUT},
+    {"processes",    required_argument, NULL, OPT_PROCESSES},
+    {"shm-cache-mb", required_argument, NULL, OPT_SHM_CACHE},
+    {"peer",         required_argument, NULL, OPT_PEER},
+    {"cluster-self", required_argument, NULL, OPT_CLUSTER_SELF},
+    {"vnodes",       required_argument, NULL, OPT_VNODES},
+    {"route",        required_argument, NULL, OPT_ROUTE},
+    {"balance",      required_argument, NULL, OPT_BALANCE},
+    {"health-interval", required_argument, NULL, OPT_HEALTH_INTERVAL},
+    {"health-path",  required_argument, NULL, OPT_HEALTH_PATH},
+    {"unhealthy-after", required_argument, NULL, OPT_UNHEALTHY_AFTER},
+    {"eject-factor", required_argument, NULL, OPT_EJECT_FACTOR},
+    {"eject-time",   required_argument, NULL, OPT_EJECT_TIME},
+    {"egress-rate",  required_argument, NULL, OPT_EGRESS_RATE},
+    {"egress-conn-rate", required_argument, NULL, OPT_EGRESS_CONN_RATE},
+    {"egress-ip-rate", required_argument, NULL, OPT_EGRESS_IP_RATE},
+    {"egress-burst", required_argument, NULL, OPT_EGRESS_BURST},
+    {"egress-quantum", required_argument, NULL, OPT_EGRESS_QUANTUM},
+    {"io-backend",   required_argument, NULL, OPT_IO_BACKEND},
+    {"file-cache",   required_argument, NULL, OPT_FILE_CACHE},
+    {"file-cache-mb", required_argument, NULL, OPT_FILE_CACHE_RAM},
+    {"file-cache-small-kb", required_argument, NULL, OPT_FILE_CACHE_SMALL},
+    {"index-content-kb", required_argument, NULL, OPT_INDEX_CONTENT},
+    {"index-rescan", required_argument, NULL, OPT_INDEX_RESCAN},
+    {"durability",   required_argument, NULL, OPT_DURABILITY},
+    {"commit-delay", required_argument, NULL, OPT_COMMIT_DELAY},
+    {"dedup",        no_argument,       NULL, OPT_DEDUP},
+    {"chunk-dir",    required_argument, NULL, OPT_CHUNK_DIR},
+    {"slice-size",   required_argument, NULL, OPT_SLICE_SIZE},
+    {"slice-threshold", required_argument, NULL, OPT_SLICE_THRESHOLD},
+    {"negative-ttl", required_argument, NULL, OPT_NEGATIVE_TTL},
+    {"dns-negative-ttl", required_argument, NULL, OPT_DNS_NEGATIVE_TTL},
+    {"breaker-failures", required_argument, NULL, OPT_BREAKER_FAILURES},
+    {"breaker-open", required_argument, NULL, OPT_BREAKER_OPEN},
+    {"prefetch",     no_argument,       NULL, OPT_PREFETCH},
+    {"prefetch-workers", required_argument, NULL, OPT_PREFETCH_WORKERS},
+    {"prefetch-queue", required_argument, NULL, OPT_PREFETCH_QUEUE},
+    {"prefetch-rate", required_argument, NULL, OPT_PREFETCH_RATE},
+    {"warmup-log",   required_argument, NULL, OPT_WARMUP_LOG},
+    {"warmup-interval", required_argument, NULL, OPT_WARMUP_INTERVAL},
+    {"warmup-top",   required_argument, NULL, OPT_WARMUP_TOP},
+    {"warmup-workers", required_argument, NULL, OPT_WARMUP_WORKERS},
+    {"warmup-rate",  required_argument, NULL, OPT_WARMUP_RATE},
+    {"snapshot",     required_argument, NULL, OPT_SNAPSHOT},
+    {"upgrade-socket", required_argument, NULL, OPT_UPGRADE_SOCKET},
+    {"upgrade-from", required_argument, NULL, OPT_UPGRADE_FROM},
+    {"drain-timeout", required_argument, NULL, OPT_DRAIN_TIMEOUT},
+    {"trace-sample", required_argument, NULL, OPT_TRACE_SAMPLE},
+    {"trace-buffer", required_argument, NULL, OPT_TRACE_BUFFER},
+    {"trace-file",   required_argument, NULL, OPT_TRACE_FILE},
+    {"help",         no_argument,       NULL, 'h'},
+    {NULL, 0, NULL, 0}
+};
+
+static int parse_positive(const char* arg, int fallback){
+    int value = atoi(arg);
+    return value > 0 ? value : fallback;
+}
+
+static int parse_port(const char* arg){
+    int port = atoi(arg);
+    if(port <= 0 || port > 65535) {
+        printf("[MAIN] Invalid port number. Using default port %d\n", DEFAULT_PORT);
+        return DEFAULT_PORT;
+    }
+    return port;
+}
+
+void config_usage(const char* prog){
+    printf("Usage: %s [options] [port]\n"
+           "  -p, --port PORT          Listening port (default %d)\n"
+           "      --workers N          Connection worker threads (default %d)\n"
+           "      --queue-size N       Pending connections before 503 (default 1024)\n"
+           "      --queue-budget MS    Max queue wait before 503 (default 2000, 0 = none)\n"
+           "      --retry-after SEC    Retry-After sent with 503 (default 1)\n"
+           "      --lane-read N        Concurrent /find/ reads and cache hits (default 96, 0 = unlimited)\n"
+           "      --lane-write N       Concurrent PUTs (default 32, 0 = unlimited)\n"
+           "      --lane-cacheable N   Concurrent upstream GET/HEAD misses (default 128, 0 = unlimited)\n"
+           "      --lane-passthrough N Concurrent POSTs and other upstream requests (default 64, 0 = unlimited)\n"
+           "      --lane-queue N       Requests waiting for a slot in each lane (default 32)\n"
+           "      --rate-limit RPS     Requests/s per client IP (default 0 = off)\n"
+           "      --rate-burst N       Burst allowance per client IP (default 20)\n"
+           "      --rate-table N       Client IPs tracked by the rate limiter (default 4096)\n"
+           "      --keepalive-timeout SEC  Idle time before a kept-alive connection closes (default 5, 0 = off)\n"
+           "      --keepalive-requests N   Requests per kept-alive connection (default 100)\n"
+           "      --header-timeout SEC     Time to receive request headers (default 10, 0 = off)\n"
+           "      --body-timeout SEC       Max stall while receiving a request body (default 30, 0 = off)\n"
+           "      --connect-timeout SEC    Upstream connect timeout (default 5, 0 = system default)\n"
+           "      --ttfb-timeout SEC       Wait for the first upstream response byte (default 30, 0 = off)\n"
+           "      --processes N        Prefork N worker processes sharing one cache (default 1)\n"
+           "      --shm-cache-mb N     Shared cache segment size in prefork mode (default 256)\n"
+           "      --peer HOST:PORT     Cluster node sharing the cache; repeat per node\n"
+           "      --cluster-self HOST:PORT  This node's name on the ring (default 127.0.0.1:PORT)\n"
+           "      --vnodes N           Ring points per cluster node (default 128)\n"
+           "      --route PREFIX=HOST:PORT[,HOST:PORT...]  Reverse proxy paths under PREFIX to a backend pool; repeat per route\n"
+           "      --balance MODE       Backend choice: least or p2c (default least)\n"
+           "      --health-interval SEC  Active backend health checks (default 5, 0 = off)\n"
+           "      --health-path PATH   Path requested by health checks (default /)\n"
+           "      --unhealthy-after N  Failures in a row that take a backend out (default 3)\n"
+           "      --eject-factor N     Eject backends N times slower than the fastest (default 3, 0 = off)\n"
+           "      --eject-time SEC     Time an ejected backend stays out (default 30)\n"
+           "      --egress-rate KB     Response bandwidth shared by all clients and workers in KB/s (default 0 = unlimited)\n"
+           "      --egress-conn-rate KB  Response bandwidth per connection in KB/s (default 0 = unlimited)\n"
+           "      --egress-ip-rate KB  Response bandwidth per client address across workers in KB/s (default 0 = unlimited)\n"
+           "      --egress-burst KB    Bytes a client may send at full speed before shaping (default 256)\n"
+           "      --egress-quantum KB  Bytes per grant and per round-robin turn (default 64)\n"
+           "      --io-backend MODE    auto, uring or posix (default auto)\n"
+           "      --file-cache N       Open /find/ files cached (default 1024, 0 = off)\n"
+           "      --file-cache-mb N    Memory for small /find/ files (default 64)\n"
+           "      --file-cache-small-kb N  Files up to this size are kept in memory (default 256)\n"
+           "      --index-content-kb N Index contents of text files up to N KB (default 16, 0 = off)\n"
+           "      --index-rescan SEC   Rebuild the /find/ index every SEC seconds (default 300)\n"
+           "      --durability MODE    PUT durability: none, data or full (default data)\n"
+           "      --commit-delay US    Wait for more writers before a group sync (default 0)\n"
+           "      --dedup              Store uploads as deduplicated chunks\n"
+           "      --chunk-dir PATH     Chunk store for --dedup (default ./.chunks)\n"
+           "      --slice-size KB      Slice size for large cached objects (default 1024, max 8192)\n"
+           "      --slice-threshold KB Cache bodies over this size in slices (default 8192, 0 = off)\n"
+           "      --negative-ttl SEC   Replay 404/410/5xx responses for SEC seconds (default 10, 0 = off)\n"
+           "      --dns-negative-ttl SEC  Do not retry a failed name lookup for SEC seconds (default 30)\n"
+           "      --breaker-failures N Open an origin's circuit after N failures in a row (default 5, 0 = off)\n"
+           "      --breaker-open SEC   Probe an origin with an open circuit every SEC seconds (default 10)\n"
+           "      --prefetch           Warm same-origin sub-resources of cached HTML pages\n"
+           "      --prefetch-workers N Concurrent prefetches (default 2)\n"
+           "      --prefetch-queue N   Pages and resources waiting to be prefetched (default 256)\n"
+           "      --prefetch-rate KB   Prefetch bandwidth budget in KB/s (default 512, 0 = unlimited)\n"
+           "      --warmup-log PATH    Log of cache keys and hits, replayed at startup\n"
+           "      --warmup-interval SEC  Rewrite the warm-up log every SEC seconds (default 60)\n"
+           "      --warmup-top N       Hottest logged keys fetched at startup (default 1000)\n"
+           "      --warmup-workers N   Parallel warm-up fetches (default 4)\n"
+           "      --warmup-rate N      Warm-up fetches per second (default 50, 0 = unlimited)\n"
+           "      --snapshot PATH      Save the cache here at shutdown and load it at boot\n"
+           "      --upgrade-socket PATH  Hand the listener and cache to a successor here (SIGUSR2 starts one)\n"
+           "      --upgrade-from PATH  Take the listener and cache over from the process on PATH\n"
+           "      --drain-timeout SEC  Time a replaced process gives its connections (default 30)\n"
+           "      --trace-sample RATE  Fraction of requests to trace, 0..1 (default 0)\n"
+           "      --trace-buffer N     Completed traces kept for export (default 1024)\n"
+           "      --trace-file PATH    Chrome trace file written on SIGUSR1\n"
+           "  -h, --help               Show this help\n",
+           prog, DEFAULT_PORT, MAX_CLIENTS);
+}
+
+int config_parse(int argc, char** argv){
+    int opt;
+    while((opt = getopt_long(argc, argv, "p:h", long_options, NULL)) != -1) {
+        switch(opt) {
+            case 'p':
+                config.port = parse_port(optarg);
+                break;
+            case OPT_WORKERS:
+                config.workers = parse_positive(optarg, MAX_CLIENTS);
+                break;
+            case OPT_QUEUE_SIZE:
+                config.queue_size = parse_positive(optarg, config.queue_size);
+                break;
+            case OPT_QUEUE_BUDGET:
+                config.queue_budget_ms = atoi(optarg) < 0 ? 0 : atoi(optarg);
+                break;
+            case OPT_RETRY_AFTER:
+                config.retry_after = parse_positive(optarg, config.retry_after);
+                break;
+            case OPT_LANE_READ:
+                config.lane_read = atoi(optarg) < 0 ? 0 : atoi(optarg);
+                break;
+            case OPT_LANE_WRITE:
+                config.lane_write = atoi(optarg) < 0 ? 0 : atoi(optarg);
+                break;
+            case OPT_LANE_CACHEABLE:
+                config.lane_cacheable = atoi(optarg) < 0 ? 0 : atoi(optarg);
+                break;
+            case OPT_LANE_PASSTHROUGH:
+                config.lane_passthrough = atoi(optarg) < 0 ? 0 : atoi(optarg);
+                break;
+            case OPT_LANE_QUEUE:
+                config.lane_queue = atoi(optarg) < 0 ? 0 : atoi(optarg);
+                break;
+            case OPT_RATE_LIMIT:
+                config.rate_limit = atof(optarg) < 0 ? 0 : atof(optarg);
+                break;
+            case OPT_RATE_BURST:
+                config.rate_burst = parse_positive(optarg, config.rate_burst);
+                break;
+            case OPT_RATE_TABLE:
+                config.rate_table_size = parse_positive(optarg, config.rate_table_size);
+                break;
+            case OPT_KEEPALIVE_TIMEOUT:
+                config.keepalive_timeout = atoi(optarg) < 0 ? 0 : atoi(optarg);
+                break;
+            case OPT_KEEPALIVE_REQUESTS:
+                config.keepalive_requests = parse_positive(optarg, config.keepalive_requests);
+                break;
+            case OPT_HEADER_TIMEOUT:
+                config.header_timeout = atoi(optarg) < 0 ? 0 : atoi(optarg);
+                break;
+            case OPT_BODY_TIMEOUT:
+                config.body_timeout = atoi(optarg) < 0 ? 0 : atoi(optarg);
+                break;
+            case OPT_CONNECT_TIMEOUT:
+                config.connect_timeout = atoi(optarg) < 0 ? 0 : atoi(optarg);
+                break;
+            case OPT_TTFB_TIMEOUT:
+                config.ttfb_timeout = atoi(optarg) < 0 ? 0 : atoi(optarg);
+                break;
+            case OPT_PROCESSES:
+                config.processes = parse_positive(optarg, 1);
+                break;
+            case OPT_SHM_CACHE:
+                config.shm_cache_mb = parse_positive(optarg, config.shm_cache_mb);
+                break;
+            case OPT_PEER:
+                if(config.cluster_peer_count >= MAX_PEERS) {
+                    printf("[MAIN] Too many peers (max %d)\n", MAX_PEERS);
+                    return -1;
+                }
+                snprintf(config.cluster_peers[config.cluster_peer_count++], sizeof(config.cluster_peers[0]), "%s", optarg);
+                break;
+            case OPT_CLUSTER_SELF:
+                snprintf(config.cluster_self, sizeof(config.cluster_self), "%s", optarg);
+                break;
+            case OPT_VNODES:
+                config.cluster_vnodes = parse_positive(optarg, config.cluster_vnodes);
+                break;
+            case OPT_ROUTE:
+                if(config.route_count >= MAX_ROUTES) {
+                    printf("[MAIN] Too many routes (max %d)\n", MAX_ROUTES);
+                    return -1;
+                }
+                snprintf(config.routes[config.route_count++], sizeof(config.routes[0]), "%s", optarg);
+                break;
+            case OPT_BALANCE:
+                if(strcmp(optarg, "least") == 0) config.balance = BALANCE_LEAST;
+                else if(strcmp(optarg, "p2c") == 0) config.balance = BALANCE_P2C;
+                else {
+                    printf("[MAIN] Unknown balancing mode: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_HEALTH_INTERVAL:
+                config.health_interval = atoi(optarg) < 0 ? 0 : atoi(optarg);
+                break;
+            case OPT_HEALTH_PATH:
+                snprintf(config.health_path, sizeof(config.health_path), "%s", optarg);
+                break;
+            case OPT_UNHEALTHY_AFTER:
+                config.unhealthy_after = parse_positive(optarg, config.unhealthy_after);
+                break;
+            case OPT_EJECT_FACTOR:
+                config.eject_factor = atoi(optarg) < 0 ? 0 : atoi(optarg);
+                break;
+            case OPT_EJECT_TIME:
+                config.eject_time = parse_positive(optarg, config.eject_time);
+                break;
+            case OPT_EGRESS_RATE:
+                config.egress_rate_kb = atoi(optarg) < 0 ? 0 : atoi(optarg);
+                break;
+            case OPT_EGRESS_CONN_RATE:
+                config.egress_conn_rate_kb = atoi(optarg) < 0 ? 0 : atoi(optarg);
+                break;
+            case OPT_EGRESS_IP_RATE:
+                config.egress_ip_rate_kb = atoi(optarg) < 0 ? 0 : atoi(optarg);
+                break;
+            case OPT_EGRESS_BURST:
+                config.egress_burst_kb = parse_positive(optarg, config.egress_burst_kb);
+                break;
+            case OPT_EGRESS_QUANTUM:
+                config.egress_quantum_kb = parse_positive(optarg, config.egress_quantum_kb);
+                break;
+            case OPT_IO_BACKEND:
+                if(strcmp(optarg, "uring") == 0) config.io_backend = IO_BACKEND_URING;
+                else if(strcmp(optarg, "posix") == 0) config.io_backend = IO_BACKEND_POSIX;
+                else if(strcmp(optarg, "auto") == 0) config.io_backend = IO_BACKEND_AUTO;
+                else {
+                    printf("[MAIN] Unknown I/O backend: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_FILE_CACHE:
+                config.file_cache_entries = atoi(optarg) < 0 ? 0 : atoi(optarg);
+                break;
+            case OPT_FILE_CACHE_RAM:
+                config.file_cache_ram_mb = atoi(optarg) < 0 ? 0 : atoi(optarg);
+                break;
+            case OPT_FILE_CACHE_SMALL:
+                config.file_cache_small_kb = atoi(optarg) < 0 ? 0 : atoi(optarg);
+                break;
+            case OPT_INDEX_CONTENT:
+                config.find_index_content_kb = atoi(optarg) < 0 ? 0 : atoi(optarg);
+                break;
+            case OPT_INDEX_RESCAN:
+                config.find_rescan_sec = atoi(optarg) < 0 ? 0 : atoi(optarg);
+                break;
+            case OPT_DURABILITY:
+                if(strcmp(optarg, "none") == 0) config.durability = DURABILITY_NONE;
+                else if(strcmp(optarg, "data") == 0) config.durability = DURABILITY_DATA;
+                else if(strcmp(optarg, "full") == 0) config.durability = DURABILITY_FULL;
+                else {
+                    printf("[MAIN] Unknown durability mode: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_COMMIT_DELAY:
+                config.commit_delay_us = atoi(optarg) < 0 ? 0 : atoi(optarg);
+                break;
+            case OPT_DEDUP:
+                config.dedup = 1;
+                break;
+            case OPT_CHUNK_DIR:
+                snprintf(config.chunk_dir, sizeof(config.chunk_dir), "%s", optarg);
+                break;
+            case OPT_SLICE_SIZE:
+                config.slice_kb = parse_positive(optarg, config.slice_kb);
+                // A slice has to fit in one cache element
+                if(config.slice_kb > 8192) config.slice_kb = 8192;
+                break;
+            case OPT_SLICE_THRESHOLD:
+                config.slice_threshold_kb = atoi(optarg) < 0 ? 0 : atoi(optarg);
+                break;
+            case OPT_NEGATIVE_TTL:
+                config.negative_ttl = atoi(optarg) < 0 ? 0 : atoi(optarg);
+                break;
+            case OPT_DNS_NEGATIVE_TTL:
+                config.dns_negative_ttl = atoi(optarg) < 0 ? 0 : atoi(optarg);
+                break;
+            case OPT_BREAKER_FAILURES:
+                config.breaker_failures = atoi(optarg) < 0 ? 0 : atoi(optarg);
+                break;
+            case OPT_BREAKER_OPEN:
+                config.breaker_open = parse_positive(optarg, config.breaker_open);
+                break;
+            case OPT_PREFETCH:
+                config.prefetch = 1;
+                break;
+            case OPT_PREFETCH_WORKERS:
+                config.prefetch_workers = parse_positive(optarg, config.prefetch_workers);
+                break;
+            case OPT_PREFETCH_QUEUE:
+                config.prefetch_queue = parse_positive(optarg, config.prefetch_queue);
+                break;
+            case OPT_PREFETCH_RATE:
+                config.prefetch_rate_kb = atoi(optarg) < 0 ? 0 : atoi(optarg);
+                break;
+            case OPT_WARMUP_LOG:
+                snprintf(config.warmup_log, sizeof(config.warmup_log), "%s", optarg);
+                break;
+            case OPT_WARMUP_INTERVAL:
+                config.warmup_log_interval = atoi(optarg) < 0 ? 0 : atoi(optarg);
+                break;
+            case OPT_WARMUP_TOP:
+                config.warmup_top = atoi(optarg) < 0 ? 0 : atoi(optarg);
+                break;
+            case OPT_WARMUP_WORKERS:
+                config.warmup_workers = parse_positive(optarg, config.warmup_workers);
+                break;
+            case OPT_WARMUP_RATE:
+                config.warmup_rate = atoi(optarg) < 0 ? 0 : atoi(optarg);
+                break;
+            case OPT_SNAPSHOT:
+                snprintf(config.snapshot, sizeof(config.snapshot), "%s", optarg);
+                break;
+            case OPT_UPGRADE_SOCKET:
+                snprintf(config.upgrade_socket, sizeof(config.upgrade_socket), "%s", optarg);
+                break;
+            case OPT_UPGRADE_FROM:
+                snprintf(config.upgrade_from, sizeof(config.upgrade_from), "%s", optarg);
+                break;
+            case OPT_DRAIN_TIMEOUT:
+                config.drain_timeout = atoi(optarg) < 0 ? 0 : atoi(optarg);
+                break;
+            case OPT_TRACE_SAMPLE:
+                config.trace_sample_rate = atof(optarg);
+                if(config.trace_sample_rate < 0) config.trace_sample_rate = 0;
+                if(config.trace_sample_rate > 1) config.trace_sample_rate = 1;
+                break;
+            case OPT_TRACE_BUFFER:
+                config.trace_buffer = atoi(optarg);
+                if(config.trace_buffer <= 0) config.trace_buffer = 1;
+                break;
+            case OPT_TRACE_FILE:
+                snprintf(config.trace_file, sizeof(config.trace_file), "%s", optarg);
+                break;
+            case 'h':
+            default:
+                config_usage(argv[0]);
+                return -1;
+        }
+    }
+
+    // Positional port kept for compatibility with "proxy_server 8888"
+    if(optind < argc) {
+        config.port = parse_port(argv[optind]);
+    }
+    if(config.cluster_self[0] == '\0') {
+        snprintf(config.cluster_self, sizeof(config.cluster_self), "127.0.0.1:%d", config.port);
+    }
+    return 0;
+}
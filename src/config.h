@@ -0,0 +1,112 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#define DEFAULT_PORT 8080
+#define MAX_CLIENTS 400
+#define MAX_PEERS 32
+#define MAX_ROUTES 16
+
+struct proxy_config {
+    int port;                    // Listening port
+
+    // Admission control
+    int workers;                 // Connection worker threads
+    int queue_size;              // Accepted connections waiting for a worker
+    int queue_budget_ms;         // Max queue wait before shedding with 503
+    int retry_after;             // Retry-After seconds sent when shedding
+    int lane_read;               // Concurrent local reads and cache hits (0 = unlimited)
+    int lane_write;              // Concurrent PUTs (0 = unlimited)
+    int lane_cacheable;          // Concurrent upstream GET/HEAD misses (0 = unlimited)
+    int lane_passthrough;        // Concurrent POSTs and other upstream requests (0 = unlimited)
+    int lane_queue;              // Requests that may wait for a slot, per lane
+    double rate_limit;           // Requests per second per client IP (0 disables)
+    int rate_burst;              // Token bucket size per client IP
+    int rate_table_size;         // Client IPs tracked by the rate limiter
+    int keepalive_timeout;       // Idle seconds before a kept-alive connection closes (0 disables)
+    int keepalive_requests;      // Requests served per connection
+    int header_timeout;          // Seconds to receive request headers (0 disables)
+    int body_timeout;            // Seconds without progress on a request body (0 disables)
+    int connect_timeout;         // Seconds to connect upstream (0 = system default)
+    int ttfb_timeout;            // Seconds to the first upstream response byte (0 disables)
+
+    // Prefork
+    int processes;               // Worker processes (1 = single process)
+    int shm_cache_mb;            // Shared cache segment size in prefork mode
+
+    // Peer cache cluster
+    char cluster_peers[MAX_PEERS][128]; // host:port of every cluster node
+    int cluster_peer_count;      // 0 disables cluster mode
+    char cluster_self[128];      // This node as listed in the peers' --peer options
+    int cluster_vnodes;          // Ring points per node
+
+    // Reverse proxy
+    char routes[MAX_ROUTES][512]; // "PREFIX=HOST:PORT[,HOST:PORT...]"
+    int route_count;             // 0 forwards to the host each request names
+    int balance;                 // enum backend_balance
+    int health_interval;         // Seconds between active health checks (0 disables)
+    char health_path[256];       // Path GET by active health checks
+    int unhealthy_after;         // Failures in a row that take a backend out
+    int eject_factor;            // Eject backends this many times slower than the fastest (0 disables)
+    int eject_time;              // Seconds an ejected or failed backend stays out
+
+    // Egress shaping
+    int egress_rate_kb;          // Response bandwidth shared by all clients in KB/s (0 = unlimited)
+    int egress_conn_rate_kb;     // Per connection in KB/s (0 = unlimited)
+    int egress_ip_rate_kb;       // Per client address in KB/s (0 = unlimited)
+    int egress_burst_kb;         // Bucket depth; responses this small are never delayed
+    int egress_quantum_kb;       // Largest single grant and DRR quantum
+
+    // I/O
+    int io_backend;              // enum io_backend_mode
+    int file_cache_entries;      // Open files cached for /find/ (0 disables)
+    int file_cache_ram_mb;       // Memory for small file contents
+    int file_cache_small_kb;     // Files up to this size are kept in memory
+    int find_index_content_kb;   // Text files up to this size are searchable by content
+    int find_rescan_sec;         // Full index rebuild interval (0 = startup only)
+    int durability;              // enum durability for PUT
+    int commit_delay_us;         // Group commit wait for more writers
+    int dedup;                   // Uploads become manifests over a chunk store
+    char chunk_dir[256];         // Where deduplicated chunks live
+
+    // Large objects
+    int slice_kb;                // Slice size for objects cached in slices
+    int slice_threshold_kb;      // Bodies over this are cached in slices (0 disables)
+
+    // Upstream failures
+    int negative_ttl;            // Seconds 404/410/5xx responses are replayed (0 disables)
+    int dns_negative_ttl;        // Seconds a failed name lookup is not retried (0 disables)
+    int breaker_failures;        // Consecutive origin failures that open its breaker (0 disables)
+    int breaker_open;            // Seconds between probes of an origin whose breaker is open
+
+    // Prefetch
+    int prefetch;                // Warm sub-resources of cached HTML pages
+    int prefetch_workers;        // Concurrent prefetches
+    int prefetch_queue;          // Pages and resources waiting to be prefetched
+    int prefetch_rate_kb;        // Prefetch bandwidth budget in KB/s (0 = unlimited)
+
+    // Warm restarts
+    char warmup_log[256];        // Key/hit-count log replayed at startup ("" disables)
+    int warmup_log_interval;     // Seconds between log rewrites (0 = shutdown only)
+    int warmup_top;              // Hottest log keys fetched at startup
+    int warmup_workers;          // Parallel warm-up fetches
+    int warmup_rate;             // Warm-up fetches per second (0 = unlimited)
+    char snapshot[256];          // Cache snapshot saved at shutdown, loaded at boot ("" disables)
+
+    // Upgrades
+    char upgrade_socket[108];    // Unix socket successors take the listener over on ("" disables)
+    char upgrade_from[108];      // Take the listener and cache over from this socket at startup
+    int drain_timeout;           // Seconds a retiring process lets its connections finish
+
+    // Tracing
+    double trace_sample_rate;    // Fraction of requests traced (0 disables)
+    int trace_buffer;            // Completed traces kept for export
+    char trace_file[256];        // Chrome trace JSON written on SIGUSR1
+};
+
+extern struct proxy_config config;
+
+// Parse command line options into config; returns -1 on bad usage
+int config_parse(int argc, char** argv);
+void config_usage(const char* prog);
+
+#endif
@@ -0,0 +1,241 @@
+#include "durable.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <libgen.h>
+#include <sys/stat.h>
+
+#define DURABLE_CHUNK (1 << 20)       // Flush unit; offsets stay chunk-aligned
+#define DURABLE_ALIGN 4096
+
+// One sync waiting for the commit thread
+struct sync_request {
+    int fd;
+    dev_t dev;                   // Filesystem of fd; one syncfs covers only one
+    int whole_fs;                // Needs every file on the filesystem synced
+    int grouped;                 // Already covered by a flush of this batch
+    int result;
+    int done;
+    struct sync_request* next;
+};
+
+static enum durability durability_mode = DURABILITY_DATA;
+static int commit_delay = 0;
+static int commit_thread_running = 0;
+static unsigned long temp_seq = 0;
+
+static struct sync_request* pending = NULL;
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t commit_cond = PTHREAD_COND_INITIALIZER;   // Work arrived
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;     // A batch finished
+
+// Sync every fd queued since the last batch, one flush per filesystem in
+// it. A filesystem with a single request gets its own fdatasync; several
+// requests, or one asking for the whole filesystem, are covered by one
+// syncfs, so the number of flushes grows with the number of batches (and
+// mounts) rather than with writers.
+static void* commit_thread_fn(void* arg){
+    (void)arg;
+    for(;;) {
+        pthread_mutex_lock(&commit_lock);
+        while(!pending) pthread_cond_wait(&commit_cond, &commit_lock);
+        pthread_mutex_unlock(&commit_lock);
+
+        // Optionally linger so more writers join this batch
+        if(commit_delay > 0) usleep(commit_delay);
+
+        pthread_mutex_lock(&commit_lock);
+        struct sync_request* batch = pending;
+        pending = NULL;
+        pthread_mutex_unlock(&commit_lock);
+
+        for(struct sync_request* r = batch; r; r = r->next) {
+            if(r->grouped) continue;
+            int count = 0, whole_fs = 0;
+            for(struct sync_request* q = r; q; q = q->next) {
+                if(q->grouped || q->dev != r->dev) continue;
+                count++;
+                whole_fs |= q->whole_fs;
+            }
+
+            int result;
+            if(count == 1 && !whole_fs) {
+                result = fdatasync(r->fd) == 0 ? 0 : -errno;
+            } else {
+                result = syncfs(r->fd) == 0 ? 0 : -errno;
+            }
+            for(struct sync_request* q = r; q; q = q->next) {
+                if(q->grouped || q->dev != r->dev) continue;
+                q->result = result;
+                q->grouped = 1;
+            }
+        }
+
+        pthread_mutex_lock(&commit_lock);
+        for(struct sync_request* r = batch; r; r = r->next) r->done = 1;
+        pthread_cond_broadcast(&done_cond);
+        pthread_mutex_unlock(&commit_lock);
+    }
+    return NULL;
+}
+
+// Queue fd for the next batch and wait until it is on disk
+static int group_sync(int fd, int whole_fs){
+    if(!commit_thread_running) return whole_fs ? syncfs(fd) : fdatasync(fd);
+
+    struct stat st;
+    if(fstat(fd, &st) != 0) return -1;
+    struct sync_request request = { fd, st.st_dev, whole_fs, 0, 0, 0, NULL };
+    pthread_mutex_lock(&commit_lock);
+    request.next = pending;
+    pending = &request;
+    pthread_cond_signal(&commit_cond);
+    while(!request.done) pthread_cond_wait(&done_cond, &commit_lock);
+    pthread_mutex_unlock(&commit_lock);
+
+    if(request.result < 0) {
+        errno = -request.result;
+        return -1;
+    }
+    return 0;
+}
+
+int durable_init(enum durability mode, int commit_delay_us){
+    durability_mode = mode;
+    commit_delay = commit_delay_us > 0 ? commit_delay_us : 0;
+    if(mode == DURABILITY_NONE) return 0;
+
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, commit_thread_fn, NULL) != 0) {
+        perror("[PUT] Failed to start commit thread, syncing inline");
+        return -1;
+    }
+    pthread_detach(thread);
+    commit_thread_running = 1;
+    return 0;
+}
+
+int durable_sync_fs(int fd){
+    if(durability_mode == DURABILITY_NONE) return 0;
+    return group_sync(fd, 1);
+}
+
+int durable_sync(int fd){
+    if(durability_mode == DURABILITY_NONE) return 0;
+    return group_sync(fd, durability_mode == DURABILITY_FULL);
+}
+
+int durable_open(struct durable_file* file, const char* path, long expected){
+    memset(file, 0, sizeof(*file));
+    file->fd = -1;
+    snprintf(file->path, sizeof(file->path), "%s", path);
+
+    // The temp file must share the target's directory for rename to be atomic
+    char dir_buf[1024], name_buf[1024];
+    snprintf(dir_buf, sizeof(dir_buf), "%s", path);
+    snprintf(name_buf, sizeof(name_buf), "%s", path);
+    unsigned long seq = __atomic_add_fetch(&temp_seq, 1, __ATOMIC_RELAXED);
+    snprintf(file->temp_path, sizeof(file->temp_path), "%s/" DURABLE_TEMP_PREFIX "%d-%lu-%s",
+             dirname(dir_buf), (int)getpid(), seq, basename(name_buf));
+
+    if(posix_memalign((void**)&file->chunk, DURABLE_ALIGN, DURABLE_CHUNK) != 0) {
+        file->chunk = NULL;
+        return -1;
+    }
+    file->fd = open(file->temp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if(file->fd < 0) {
+        free(file->chunk);
+        file->chunk = NULL;
+        return -1;
+    }
+
+    // Reserve the blocks up front: no allocation work per chunk and less
+    // fragmentation. Filesystems without fallocate just skip this.
+    if(expected > 0) {
+        file->expected = expected;
+        if(fallocate(file->fd, 0, 0, expected) != 0 && errno != EOPNOTSUPP) {
+            int saved = errno;
+            durable_abort(file);
+            errno = saved;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int flush_chunk(struct durable_file* file){
+    size_t done = 0;
+    while(done < file->buffered) {
+        ssize_t n = pwrite(file->fd, file->chunk + done, file->buffered - done, file->written + done);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return -1;
+        done += n;
+    }
+    file->written += file->buffered;
+    file->buffered = 0;
+    return 0;
+}
+
+int durable_write(struct durable_file* file, const char* data, size_t len){
+    while(len > 0) {
+        size_t space = DURABLE_CHUNK - file->buffered;
+        size_t n = len < space ? len : space;
+        memcpy(file->chunk + file->buffered, data, n);
+        file->buffered += n;
+        data += n;
+        len -= n;
+        if(file->buffered == DURABLE_CHUNK && flush_chunk(file) < 0) return -1;
+    }
+    return 0;
+}
+
+static int sync_directory(const char* path){
+    char dir_buf[1024];
+    snprintf(dir_buf, sizeof(dir_buf), "%s", path);
+    int dir_fd = open(dirname(dir_buf), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(dir_fd < 0) return -1;
+    int result = group_sync(dir_fd, 0);
+    close(dir_fd);
+    return result;
+}
+
+int durable_commit(struct durable_file* file){
+    if(flush_chunk(file) < 0) goto fail;
+    // Drop preallocated space the body did not fill
+    if(file->expected != file->written && ftruncate(file->fd, file->written) != 0) goto fail;
+    if(durability_mode != DURABILITY_NONE && group_sync(file->fd, 0) != 0) goto fail;
+
+    close(file->fd);
+    file->fd = -1;
+    if(rename(file->temp_path, file->path) != 0) goto fail;
+    free(file->chunk);
+    file->chunk = NULL;
+
+    if(durability_mode == DURABILITY_FULL && sync_directory(file->path) != 0) {
+        perror("[PUT] Directory sync failed");
+        return -1;
+    }
+    return 0;
+
+fail:
+    {
+        int saved = errno;
+        durable_abort(file);
+        errno = saved;
+    }
+    return -1;
+}
+
+void durable_abort(struct durable_file* file){
+    if(file->fd >= 0) {
+        close(file->fd);
+        file->fd = -1;
+    }
+    if(file->temp_path[0]) unlink(file->temp_path);
+    free(file->chunk);
+    file->chunk = NULL;
+}
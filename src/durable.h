@@ -0,0 +1,48 @@
+#ifndef DURABLE_H
+#define DURABLE_H
+
+#include <stddef.h>
+
+// Atomic file replacement for PUT. Data goes to a preallocated temp file
+// next to the target in large aligned chunks and is renamed into place, so
+// readers see either the old file or the complete new one. Syncs are
+// handed to a group-commit thread that covers many concurrent writers with
+// one flush.
+enum durability {
+    DURABILITY_NONE,   // Atomic rename only
+    DURABILITY_DATA,   // Contents on disk before the rename
+    DURABILITY_FULL,   // Contents and the rename on disk before returning
+};
+
+// Temp files are named DURABLE_TEMP_PREFIX "<pid>-<seq>-<name>"
+#define DURABLE_TEMP_PREFIX ".put-"
+
+struct durable_file {
+    int fd;
+    char path[1024];
+    char temp_path[1100];
+    long expected;               // Preallocated size, 0 if unknown
+    long written;                // Bytes flushed to the file
+    char* chunk;                 // Aligned staging buffer
+    size_t buffered;
+};
+
+int durable_init(enum durability mode, int commit_delay_us);
+
+// Create the temp file for path, preallocating expected bytes when known
+int durable_open(struct durable_file* file, const char* path, long expected);
+int durable_write(struct durable_file* file, const char* data, size_t len);
+// Flush, sync as configured and rename over path; the file is closed either way
+int durable_commit(struct durable_file* file);
+// Discard the temp file
+void durable_abort(struct durable_file* file);
+
+// Sync everything written to fd's filesystem, unless durability is none.
+// For writers that create many files before one durable_commit.
+int durable_sync_fs(int fd);
+// Sync a file written in place, unless durability is none. Batched with
+// the commits above; with full durability the whole filesystem is synced,
+// so a file just created is on disk under its name too.
+int durable_sync(int fd);
+
+#endif
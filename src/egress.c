@@ -0,0 +1,322 @@
+#include "egress.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+
+#define IP_SLOTS 1024                    // Client addresses with buckets
+#define PROBE_LIMIT 8
+
+struct ip_bucket {
+    uint32_t addr;               // Network byte order; 0 = free
+    int transfers;               // Active transfers; the slot is kept while > 0
+    double tokens;               // Bytes; negative while in debt
+    long long stamp_us;
+    long long bytes;
+};
+
+// The transfer this thread is sending
+struct flow {
+    int depth;                   // Nested egress_begin calls; 0 = not shaped
+    int sock;
+    uint32_t addr;
+    uint16_t port;
+    double tokens;               // Connection bucket, kept across keep-alive requests
+    long long stamp_us;
+    struct ip_bucket* ip;        // NULL when the table had no room
+    int cond_ready;
+    pthread_cond_t turn;         // Signalled when the flow reaches the queue head
+    struct flow* next;
+};
+
+// Buckets and counters charged by every process. The mapping is made
+// before the prefork workers are forked, so the link and client rates hold
+// for the server as a whole.
+struct egress_shared {
+    pthread_mutex_t lock;        // Process-shared, robust
+    double link_tokens;
+    long long link_stamp_us;
+    struct ip_bucket table[IP_SLOTS];
+    int active;
+    long long shaped_bytes;
+    long long delayed_us;
+};
+
+static int enabled = 0;
+static double link_rate = 0, conn_rate = 0, ip_rate = 0;   // Bytes per second
+static double burst = 0;
+static long quantum = 0;
+static struct egress_shared* shared = NULL;
+
+// This process's link queue; a flow takes link tokens only at its head
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct flow* queue_head = NULL;
+static struct flow* queue_tail = NULL;
+static int queued = 0;
+
+static __thread struct flow flow;
+
+static long long now_us(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static void refill(double* tokens, long long* stamp_us, double rate, long long now){
+    *tokens += (now - *stamp_us) * rate / 1000000.0;
+    if(*tokens > burst) *tokens = burst;
+    *stamp_us = now;
+}
+
+static void shared_lock(void){
+    if(pthread_mutex_lock(&shared->lock) == EOWNERDEAD) {
+        // Only counters were being updated; they are still usable
+        pthread_mutex_consistent(&shared->lock);
+    }
+}
+
+static void shared_unlock(void){
+    pthread_mutex_unlock(&shared->lock);
+}
+
+int egress_init(int link_kb, int conn_kb, int ip_kb, int burst_kb, int quantum_kb){
+    if(link_kb <= 0 && conn_kb <= 0 && ip_kb <= 0) return 0;
+    shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(shared == MAP_FAILED) {
+        perror("[EGRESS] mmap failed");
+        shared = NULL;
+        return -1;
+    }
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&shared->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    link_rate = link_kb * 1024.0;
+    conn_rate = conn_kb * 1024.0;
+    ip_rate = ip_kb * 1024.0;
+    quantum = (quantum_kb > 0 ? quantum_kb : 64) * 1024L;
+    // A bucket must hold at least one grant, or a full grant never fits
+    burst = burst_kb * 1024.0 > quantum ? burst_kb * 1024.0 : quantum;
+    shared->link_tokens = burst;
+    shared->link_stamp_us = now_us();
+    enabled = 1;
+    printf("[EGRESS] Shaping responses: link %d KB/s, connection %d KB/s, client %d KB/s "
+           "(0 = unlimited), burst %.0f KB, quantum %ld KB\n",
+           link_kb, conn_kb, ip_kb, burst / 1024, quantum / 1024);
+    return 0;
+}
+
+// Bucket for addr, claimed for a transfer. Caller holds the shared lock.
+static struct ip_bucket* claim_ip(uint32_t addr, long long now){
+    unsigned start = (addr * 2654435761u) >> 22;
+    struct ip_bucket* stalest = NULL;
+    for(int i = 0; i < PROBE_LIMIT; i++) {
+        struct ip_bucket* b = &shared->table[(start + i) % IP_SLOTS];
+        if(b->addr == addr) {
+            b->transfers++;
+            return b;
+        }
+        if(b->transfers == 0 && (!stalest || b->addr == 0 || b->stamp_us < stalest->stamp_us)) {
+            if(!stalest || stalest->addr != 0) stalest = b;
+        }
+    }
+    if(!stalest) return NULL;
+    memset(stalest, 0, sizeof(*stalest));
+    stalest->addr = addr;
+    stalest->transfers = 1;
+    stalest->tokens = burst;
+    stalest->stamp_us = now;
+    return stalest;
+}
+
+void egress_begin(int sock){
+    if(!enabled || flow.depth++ > 0) return;
+    struct sockaddr_in peer;
+    socklen_t peer_len = sizeof(peer);
+    uint32_t addr = 0;
+    uint16_t port = 0;
+    if(getpeername(sock, (struct sockaddr*)&peer, &peer_len) == 0 && peer.sin_family == AF_INET) {
+        addr = peer.sin_addr.s_addr;
+        port = peer.sin_port;
+    }
+    long long now = now_us();
+    // A keep-alive connection keeps its bucket from one request to the next
+    if(sock != flow.sock || addr != flow.addr || port != flow.port || flow.stamp_us == 0) {
+        flow.sock = sock;
+        flow.addr = addr;
+        flow.port = port;
+        flow.tokens = burst;
+        flow.stamp_us = now;
+    }
+    if(!flow.cond_ready) {
+        pthread_cond_init(&flow.turn, NULL);
+        flow.cond_ready = 1;
+    }
+    shared_lock();
+    flow.ip = ip_rate > 0 && addr != 0 ? claim_ip(addr, now) : NULL;
+    shared->active++;
+    shared_unlock();
+}
+
+void egress_end(void){
+    if(!enabled || flow.depth == 0 || --flow.depth > 0) return;
+    shared_lock();
+    if(flow.ip) flow.ip->transfers--;
+    shared->active--;
+    shared_unlock();
+    flow.ip = NULL;
+}
+
+int egress_shaped(int sock){
+    return enabled && flow.depth > 0 && flow.sock == sock;
+}
+
+// Wait for this flow's turn on the link and take n bytes of it. Every
+// grant fits in one quantum, so deficit round robin comes down to one grant
+// per waiting transfer per round, with no credit to carry over. Each
+// process keeps its own queue; the heads of the queues share the tokens.
+static void link_turn(size_t n){
+    pthread_mutex_lock(&queue_lock);
+    flow.next = NULL;
+    if(queue_tail) queue_tail->next = &flow;
+    else queue_head = &flow;
+    queue_tail = &flow;
+    queued++;
+    while(queue_head != &flow) pthread_cond_wait(&flow.turn, &queue_lock);
+    pthread_mutex_unlock(&queue_lock);
+
+    // At the head, wait out the link's debt
+    shared_lock();
+    for(;;) {
+        long long now = now_us();
+        refill(&shared->link_tokens, &shared->link_stamp_us, link_rate, now);
+        if(shared->link_tokens >= 0) break;
+        long long wait = (long long)(-shared->link_tokens * 1000000.0 / link_rate) + 1;
+        shared->delayed_us += wait;
+        shared_unlock();
+        usleep(wait);
+        shared_lock();
+    }
+    shared->link_tokens -= n;
+    shared_unlock();
+
+    pthread_mutex_lock(&queue_lock);
+    queue_head = flow.next;
+    if(!queue_head) queue_tail = NULL;
+    queued--;
+    if(queue_head) pthread_cond_signal(&queue_head->turn);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+size_t egress_grant(int sock, size_t want){
+    if(!egress_shaped(sock) || want == 0) return want;
+    size_t n = want < (size_t)quantum ? want : (size_t)quantum;
+
+    // The connection and client buckets go into debt for the grant, and the
+    // transfer sleeps it off before taking a turn on the link
+    long long now = now_us();
+    double wait = 0;
+    if(conn_rate > 0) {
+        refill(&flow.tokens, &flow.stamp_us, conn_rate, now);
+        flow.tokens -= n;
+        if(flow.tokens < 0) wait = -flow.tokens / conn_rate;
+    }
+    shared_lock();
+    if(flow.ip) {
+        refill(&flow.ip->tokens, &flow.ip->stamp_us, ip_rate, now);
+        flow.ip->tokens -= n;
+        if(flow.ip->tokens < 0 && -flow.ip->tokens / ip_rate > wait) wait = -flow.ip->tokens / ip_rate;
+    }
+    if(wait > 0) shared->delayed_us += (long long)(wait * 1000000);
+    shared_unlock();
+    if(wait > 0) usleep((useconds_t)(wait * 1000000));
+
+    if(link_rate > 0) link_turn(n);
+    return n;
+}
+
+void egress_settle(int sock, size_t granted, size_t used){
+    if(!egress_shaped(sock)) return;
+    double unused = used < granted ? (double)(granted - used) : 0;
+    if(conn_rate > 0) flow.tokens += unused;
+    shared_lock();
+    if(link_rate > 0) shared->link_tokens += unused;
+    if(flow.ip) {
+        flow.ip->tokens += unused;
+        flow.ip->bytes += used;
+    }
+    shared->shaped_bytes += used;
+    shared_unlock();
+}
+
+ssize_t egress_send(int sock, struct iovec* iov, int count){
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    if(!egress_shaped(sock)) {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        return sendmsg(sock, &msg, MSG_NOSIGNAL);
+    }
+
+    size_t total = 0;
+    for(int i = 0; i < count; i++) total += iov[i].iov_len;
+    size_t granted = egress_grant(sock, total);
+
+    // The leading granted bytes of iov
+    struct iovec clipped[EGRESS_MAX_IOV];
+    int n = 0;
+    size_t left = granted;
+    for(int i = 0; i < count && left > 0 && n < EGRESS_MAX_IOV; i++) {
+        clipped[n] = iov[i];
+        if(clipped[n].iov_len > left) clipped[n].iov_len = left;
+        left -= clipped[n].iov_len;
+        n++;
+    }
+    msg.msg_iov = clipped;
+    msg.msg_iovlen = n;
+    ssize_t sent = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    int saved = errno;
+    egress_settle(sock, granted, sent > 0 ? (size_t)sent : 0);
+    errno = saved;
+    return sent;
+}
+
+int egress_stats(char* out, size_t len){
+    size_t used = 0;
+    if(!shared) {
+        used = snprintf(out, len, "{\"enabled\": false}\n");
+        return used < len ? (int)used : -1;
+    }
+    pthread_mutex_lock(&queue_lock);
+    int waiting = queued;
+    pthread_mutex_unlock(&queue_lock);
+    shared_lock();
+    used += snprintf(out + used, len - used,
+        "{\"enabled\": true, \"link_kbps\": %.0f, \"conn_kbps\": %.0f, \"client_kbps\": %.0f, "
+        "\"active\": %d, \"waiting_for_link\": %d, \"bytes\": %lld, \"delayed_ms\": %lld, \"clients\": [",
+        link_rate / 1024, conn_rate / 1024, ip_rate / 1024,
+        shared->active, waiting, shared->shaped_bytes, shared->delayed_us / 1000);
+    int listed = 0;
+    for(int i = 0; i < IP_SLOTS && used < len; i++) {
+        struct ip_bucket* b = &shared->table[i];
+        if(b->addr == 0 || b->transfers == 0) continue;
+        char ip[INET_ADDRSTRLEN];
+        struct in_addr a = { b->addr };
+        inet_ntop(AF_INET, &a, ip, sizeof(ip));
+        used += snprintf(out + used, len - used, "%s\n  {\"ip\": \"%s\", \"transfers\": %d, \"bytes\": %lld}",
+                         listed++ ? "," : "", ip, b->transfers, b->bytes);
+    }
+    shared_unlock();
+    if(used < len) used += snprintf(out + used, len - used, "%s]}\n", listed ? "\n" : "");
+    return used < len ? (int)used : -1;
+}
@@ -0,0 +1,53 @@
+#ifndef EGRESS_H
+#define EGRESS_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Egress shaping for response bodies. A handler marks the thread's client
+// socket as a transfer with egress_begin; from then on every write to that
+// socket from the response, file cache, chunk store and I/O backend send
+// paths asks for a grant of at most one quantum first. Grants are charged to:
+//
+// - the connection's token bucket (--egress-conn-rate);
+// - the client address's bucket, shared by all of its connections
+//   (--egress-ip-rate);
+// - the link (--egress-rate), which transfers waiting for it take turns
+//   on in deficit round robin, one grant of up to --egress-quantum bytes
+//   per transfer per round. A small response waits one round at most.
+//
+// Buckets hold --egress-burst bytes, so a small response goes out at once;
+// a transfer that has used its burst sleeps off its debt before the next
+// grant. Writes to other sockets (the upstream side) are never shaped.
+// The link and client buckets are mapped shared by egress_init, which runs
+// before the prefork workers are forked, so those rates cover all workers
+// together. Connection buckets and the link queue are per process.
+
+#define EGRESS_MAX_IOV 64                // Segments per shaped write
+
+// Rates in KB/s, 0 = unlimited. Shaping is off when all three are 0.
+// Call before forking workers. Returns 0, or -1 if the shared state could
+// not be mapped.
+int egress_init(int link_kb, int conn_kb, int ip_kb, int burst_kb, int quantum_kb);
+
+// Shape writes to sock until the matching egress_end. Calls nest.
+void egress_begin(int sock);
+void egress_end(void);
+// 1 if writes to sock from this thread are shaped
+int egress_shaped(int sock);
+
+// Wait until up to want bytes may be written to sock; returns how many
+// (want itself if sock is not shaped)
+size_t egress_grant(int sock, size_t want);
+// used of the granted bytes were written; the rest is refunded
+void egress_settle(int sock, size_t granted, size_t used);
+
+// One sendmsg of iov, clipped to a grant when sock is shaped
+ssize_t egress_send(int sock, struct iovec* iov, int count);
+
+// Rates, transfers and clients as JSON for /_admin/egress. Returns the
+// length, or -1 if out is too small.
+int egress_stats(char* out, size_t len);
+
+#endif
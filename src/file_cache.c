@@ -0,0 +1,579 @@
+#include "file_cache.h"
+#include "egress.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/inotify.h>
+
+#define FILE_CACHE_BUCKETS 1024
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | \
+                    IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+struct watch {
+    int wd;
+    char path[512];
+};
+
+static char root_path[256];
+static int root_len = 0;
+static int enabled = 0;
+static int max_entries = 0;
+static long ram_budget = 0;
+static long small_max = 0;
+
+static file_entry* buckets[FILE_CACHE_BUCKETS];
+static file_entry* lru_head = NULL;
+static file_entry* lru_tail = NULL;
+static int entry_count = 0;
+static long ram_used = 0;
+// Bumped by every invalidation; a lookup that raced with one is not cached
+static unsigned long invalidations = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int inotify_fd = -1;
+static struct watch* watches = NULL;
+static int watch_count = 0;
+static int watch_capacity = 0;
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static void (*change_listener)(const char* path) = NULL;
+
+static unsigned hash_path(const char* s){
+    unsigned h = 2166136261u;
+    while(*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h % FILE_CACHE_BUCKETS;
+}
+
+// Collapse "//" and "/./" so one file maps to one key. Returns -1 for paths
+// outside the root or containing "..", which are served without caching.
+static int normalize(const char* in, char* out, size_t out_len){
+    size_t n = 0;
+    const char* p = in;
+    while(*p) {
+        if(*p == '/' && n > 0 && out[n - 1] == '/') { p++; continue; }
+        if(*p == '.' && n > 0 && out[n - 1] == '/' && (p[1] == '/' || p[1] == '\0')) { p++; continue; }
+        if(*p == '.' && p[1] == '.' && (n == 0 || out[n - 1] == '/') && (p[2] == '/' || p[2] == '\0')) return -1;
+        if(n + 1 >= out_len) return -1;
+        out[n++] = *p++;
+    }
+    while(n > 1 && out[n - 1] == '/') n--;
+    out[n] = '\0';
+    if(strncmp(out, root_path, root_len) != 0 || (out[root_len] != '/' && out[root_len] != '\0')) return -1;
+    return 0;
+}
+
+static void free_entry(file_entry* entry){
+    io_file_close(&entry->file);
+    free(entry->data);
+    chunk_manifest_free(entry->manifest);
+    free(entry->path);
+    free(entry);
+}
+
+static void lru_unlink(file_entry* entry){
+    if(entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+    else lru_head = entry->lru_next;
+    if(entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+    else lru_tail = entry->lru_prev;
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_push(file_entry* entry){
+    entry->lru_next = lru_head;
+    entry->lru_prev = NULL;
+    if(lru_head) lru_head->lru_prev = entry;
+    lru_head = entry;
+    if(!lru_tail) lru_tail = entry;
+}
+
+// Unlink an entry (lock held); pinned entries are freed by their last release
+static void remove_entry(file_entry* entry){
+    file_entry** link = &buckets[hash_path(entry->path)];
+    while(*link && *link != entry) link = &(*link)->hash_next;
+    if(*link) *link = entry->hash_next;
+    lru_unlink(entry);
+    entry_count--;
+    if(entry->data) ram_used -= entry->file.size;
+
+    if(entry->refs > 0) {
+        entry->detached = 1;
+    } else {
+        free_entry(entry);
+    }
+}
+
+static file_entry* lookup(const char* key){
+    file_entry* entry = buckets[hash_path(key)];
+    while(entry && strcmp(entry->path, key) != 0) entry = entry->hash_next;
+    return entry;
+}
+
+// Invalidate key, or every entry under it when prefix is set (lock held)
+static void invalidate_locked(const char* key, int prefix){
+    invalidations++;
+    if(!prefix) {
+        file_entry* entry = lookup(key);
+        if(entry) remove_entry(entry);
+        return;
+    }
+    size_t len = strlen(key);
+    for(int i = 0; i < FILE_CACHE_BUCKETS; i++) {
+        file_entry* entry = buckets[i];
+        while(entry) {
+            file_entry* next = entry->hash_next;
+            if(strncmp(entry->path, key, len) == 0 && (entry->path[len] == '/' || entry->path[len] == '\0')) {
+                remove_entry(entry);
+            }
+            entry = next;
+        }
+    }
+}
+
+void file_cache_invalidate(const char* path){
+    if(!enabled || !path) return;
+    char key[512];
+    if(normalize(path, key, sizeof(key)) < 0) return;
+    pthread_mutex_lock(&lock);
+    invalidate_locked(key, 0);
+    pthread_mutex_unlock(&lock);
+}
+
+void file_cache_etag(const struct stat* st, char* out, size_t len){
+    snprintf(out, len, "\"%lx-%lx-%llx\"", (unsigned long)st->st_ino, (unsigned long)st->st_size,
+             st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec);
+}
+
+// Fill a new entry from the filesystem (no lock held)
+static file_entry* load_entry(const char* key){
+    file_entry* entry = calloc(1, sizeof(file_entry));
+    if(!entry) return NULL;
+    entry->path = strdup(key);
+    entry->file.fd = -1;
+    entry->file.slot = -1;
+    snprintf(entry->file.path, sizeof(entry->file.path), "%s", key);
+    if(!entry->path) {
+        free(entry);
+        return NULL;
+    }
+
+    struct stat st;
+    entry->file.fd = open(key, O_RDONLY | O_CLOEXEC);
+    if(entry->file.fd < 0 || fstat(entry->file.fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        io_file_close(&entry->file);
+        entry->missing = 1;
+        return entry;
+    }
+    entry->file.size = st.st_size;
+    entry->mtime_ns = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    file_cache_etag(&st, entry->etag, sizeof(entry->etag));
+
+    // Deduplicated uploads are served from their chunks
+    if(chunk_manifest_marked(entry->file.fd)) {
+        entry->manifest = chunk_manifest_load(key);
+        if(entry->manifest) {
+            entry->file.size = entry->manifest->size;
+            io_file_close(&entry->file);
+            return entry;
+        }
+    }
+
+    // Small files are read once and served from memory
+    if(st.st_size <= small_max) {
+        char* data = malloc(st.st_size + 1);
+        if(data && pread(entry->file.fd, data, st.st_size, 0) == st.st_size) {
+            entry->data = data;
+            io_file_close(&entry->file);
+        } else {
+            free(data);
+        }
+    }
+    return entry;
+}
+
+// Evict least recently used entries until the new one fits (lock held)
+static void make_room(long data_bytes){
+    while(lru_tail && (entry_count >= max_entries || ram_used + data_bytes > ram_budget)) {
+        remove_entry(lru_tail);
+    }
+}
+
+void file_cache_update_range(const char* path, int fd, long offset, long len, const struct stat* st){
+    if(!enabled || !path) return;
+    char key[512];
+    if(normalize(path, key, sizeof(key)) < 0) return;
+
+    // Only the changed range is read, and before locking
+    char* region = NULL;
+    if(st->st_size <= small_max) {
+        region = malloc(len > 0 ? len : 1);
+        if(region && pread(fd, region, len, offset) != len) {
+            free(region);
+            region = NULL;
+        }
+    }
+
+    file_entry* entry = calloc(1, sizeof(file_entry));
+    if(entry) {
+        entry->file.fd = -1;
+        entry->file.slot = -1;
+        entry->path = strdup(key);
+    }
+
+    pthread_mutex_lock(&lock);
+    // Readers may be sending the old entry, so it is replaced, never patched
+    file_entry* old = lookup(key);
+    int patched = 0;
+    if(entry && entry->path && old && !old->missing && !old->manifest) {
+        if(old->data && region) {
+            // Unchanged bytes come from the old copy; a gap past its end reads as zeros
+            entry->data = malloc(st->st_size + 1);
+            if(entry->data) {
+                long keep = old->file.size < st->st_size ? old->file.size : st->st_size;
+                memcpy(entry->data, old->data, keep);
+                memset(entry->data + keep, 0, st->st_size - keep);
+                memcpy(entry->data + offset, region, len);
+                patched = 1;
+            }
+        } else if(!old->data && old->file.fd >= 0 && old->file.slot < 0) {
+            // The descriptor already reads the new bytes
+            entry->file.fd = dup(old->file.fd);
+            patched = entry->file.fd >= 0;
+        }
+    }
+    if(!patched) {
+        // Loads under way may have read the old contents
+        invalidate_locked(key, 0);
+        pthread_mutex_unlock(&lock);
+        if(entry) free_entry(entry);
+        free(region);
+        return;
+    }
+
+    snprintf(entry->file.path, sizeof(entry->file.path), "%s", key);
+    entry->file.size = st->st_size;
+    entry->mtime_ns = st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+    file_cache_etag(st, entry->etag, sizeof(entry->etag));
+    entry->updated = 1;
+    invalidate_locked(key, 0);
+    long data_bytes = entry->data ? entry->file.size : 0;
+    make_room(data_bytes);
+    unsigned bucket = hash_path(key);
+    entry->hash_next = buckets[bucket];
+    buckets[bucket] = entry;
+    lru_push(entry);
+    entry_count++;
+    ram_used += data_bytes;
+    pthread_mutex_unlock(&lock);
+    free(region);
+}
+
+// Whether a range write by this process left an entry for path that still
+// describes the file on disk. Range writes set fine-grained mtimes, so an
+// outside write cannot leave the same validator (no lock held).
+static int entry_current(const char* path){
+    struct stat st;
+    if(stat(path, &st) != 0) return 0;
+    char etag[48];
+    file_cache_etag(&st, etag, sizeof(etag));
+    pthread_mutex_lock(&lock);
+    file_entry* entry = lookup(path);
+    int current = entry && entry->updated && strcmp(entry->etag, etag) == 0;
+    pthread_mutex_unlock(&lock);
+    return current;
+}
+
+file_entry* file_cache_open(const char* path){
+    if(!path) return NULL;
+    char key[512];
+    if(!enabled || normalize(path, key, sizeof(key)) < 0) {
+        // Uncached: a private entry opened through the I/O backend
+        file_entry* entry = calloc(1, sizeof(file_entry));
+        if(!entry) return NULL;
+        if(io_file_open(path, &entry->file) != 0) {
+            free(entry);
+            return NULL;
+        }
+        entry->manifest = chunk_manifest_marked(entry->file.fd) ? chunk_manifest_load(path) : NULL;
+        if(entry->manifest) entry->file.size = entry->manifest->size;
+        entry->refs = 1;
+        entry->detached = 1;
+        return entry;
+    }
+
+    pthread_mutex_lock(&lock);
+    file_entry* entry = lookup(key);
+    if(entry) {
+        lru_unlink(entry);
+        lru_push(entry);
+        if(entry->missing) {
+            pthread_mutex_unlock(&lock);
+            return NULL;
+        }
+        entry->refs++;
+        pthread_mutex_unlock(&lock);
+        return entry;
+    }
+    unsigned long seen = invalidations;
+    pthread_mutex_unlock(&lock);
+
+    entry = load_entry(key);
+    if(!entry) return NULL;
+
+    pthread_mutex_lock(&lock);
+    file_entry* existing = lookup(key);
+    if(existing || invalidations != seen || (entry->data && entry->file.size > ram_budget)) {
+        // Another thread cached it first, or the file changed meanwhile
+        entry->detached = 1;
+    } else {
+        long data_bytes = entry->data ? entry->file.size : 0;
+        make_room(data_bytes);
+        unsigned bucket = hash_path(key);
+        entry->hash_next = buckets[bucket];
+        buckets[bucket] = entry;
+        lru_push(entry);
+        entry_count++;
+        ram_used += data_bytes;
+    }
+    if(entry->missing) {
+        if(entry->detached) free_entry(entry);
+        pthread_mutex_unlock(&lock);
+        return NULL;
+    }
+    entry->refs++;
+    pthread_mutex_unlock(&lock);
+    return entry;
+}
+
+void file_cache_release(file_entry* entry){
+    if(!entry) return;
+    pthread_mutex_lock(&lock);
+    entry->refs--;
+    int done = entry->refs == 0 && entry->detached;
+    pthread_mutex_unlock(&lock);
+    if(done) free_entry(entry);
+}
+
+long file_cache_send(int sock, file_entry* entry, const char* prefix, int prefix_len){
+    if(entry->manifest) return chunk_manifest_send(sock, entry->manifest, prefix, prefix_len);
+    if(!entry->data) return io_file_send(sock, &entry->file, prefix, prefix_len);
+
+    // Headers and contents in one writev, continuing after partial writes
+    struct iovec iov[2] = {
+        { (void*)prefix, prefix_len },
+        { entry->data, entry->file.size },
+    };
+    struct iovec* cur = iov;
+    int count = 2;
+    long remaining = prefix_len + entry->file.size;
+    while(remaining > 0) {
+        ssize_t n = egress_send(sock, cur, count);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return -1;
+        remaining -= n;
+        while(count > 0 && (size_t)n >= cur->iov_len) {
+            n -= cur->iov_len;
+            cur++;
+            count--;
+        }
+        if(count > 0) {
+            cur->iov_base = (char*)cur->iov_base + n;
+            cur->iov_len -= n;
+        }
+    }
+    return entry->file.size;
+}
+
+// ---------------------------------------------------------------------------
+// inotify watcher
+// ---------------------------------------------------------------------------
+
+static void add_watch(const char* dir){
+    int wd = inotify_add_watch(inotify_fd, dir, WATCH_MASK);
+    if(wd < 0) {
+        printf("[FCACHE] Cannot watch %s: %s\n", dir, strerror(errno));
+        return;
+    }
+    pthread_mutex_lock(&watch_lock);
+    for(int i = 0; i < watch_count; i++) {
+        if(watches[i].wd == wd) {
+            // Same directory reached under a new name (moved back in)
+            snprintf(watches[i].path, sizeof(watches[0].path), "%s", dir);
+            pthread_mutex_unlock(&watch_lock);
+            return;
+        }
+    }
+    if(watch_count == watch_capacity) {
+        int capacity = watch_capacity ? watch_capacity * 2 : 64;
+        struct watch* grown = realloc(watches, capacity * sizeof(struct watch));
+        if(!grown) {
+            pthread_mutex_unlock(&watch_lock);
+            return;
+        }
+        watches = grown;
+        watch_capacity = capacity;
+    }
+    watches[watch_count].wd = wd;
+    snprintf(watches[watch_count].path, sizeof(watches[0].path), "%s", dir);
+    watch_count++;
+    pthread_mutex_unlock(&watch_lock);
+
+    // Watch subdirectories too; inotify is not recursive
+    DIR* d = opendir(dir);
+    if(!d) return;
+    struct dirent* de;
+    while((de = readdir(d)) != NULL) {
+        if(de->d_type != DT_DIR || strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        char sub[512];
+        if(snprintf(sub, sizeof(sub), "%s/%s", dir, de->d_name) < (int)sizeof(sub)) add_watch(sub);
+    }
+    closedir(d);
+}
+
+static int watch_path(int wd, char* out, size_t out_len){
+    int found = -1;
+    pthread_mutex_lock(&watch_lock);
+    for(int i = 0; i < watch_count; i++) {
+        if(watches[i].wd == wd) {
+            snprintf(out, out_len, "%s", watches[i].path);
+            found = i;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&watch_lock);
+    return found;
+}
+
+static void remove_watch(int wd){
+    pthread_mutex_lock(&watch_lock);
+    for(int i = 0; i < watch_count; i++) {
+        if(watches[i].wd == wd) {
+            watches[i] = watches[--watch_count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&watch_lock);
+}
+
+// A directory moved away keeps its watches under the old name; drop them
+// so events are not mapped to paths that no longer exist
+static void remove_watches_under(const char* dir){
+    size_t len = strlen(dir);
+    pthread_mutex_lock(&watch_lock);
+    for(int i = 0; i < watch_count; ) {
+        if(strncmp(watches[i].path, dir, len) == 0 && (watches[i].path[len] == '/' || watches[i].path[len] == '\0')) {
+            inotify_rm_watch(inotify_fd, watches[i].wd);
+            watches[i] = watches[--watch_count];
+        } else {
+            i++;
+        }
+    }
+    pthread_mutex_unlock(&watch_lock);
+}
+
+static void handle_event(const struct inotify_event* ev){
+    if(ev->mask & IN_Q_OVERFLOW) {
+        // Events were lost; nothing cached can be trusted
+        printf("[FCACHE] inotify queue overflow, dropping all entries\n");
+        pthread_mutex_lock(&lock);
+        invalidate_locked(root_path, 1);
+        pthread_mutex_unlock(&lock);
+        if(change_listener) change_listener(root_path);
+        return;
+    }
+
+    char dir[512];
+    if(watch_path(ev->wd, dir, sizeof(dir)) < 0) return;
+    if(ev->mask & IN_IGNORED) {
+        remove_watch(ev->wd);
+        return;
+    }
+
+    char path[1024];
+    if(ev->len > 0) snprintf(path, sizeof(path), "%s/%s", dir, ev->name);
+    else snprintf(path, sizeof(path), "%s", dir);
+
+    int is_dir = (ev->mask & IN_ISDIR) || (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF));
+    // Writes to a file's contents may be range writes already applied to its entry
+    int in_place = !is_dir && !(ev->mask & ~(IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB));
+    if(!in_place || !entry_current(path)) {
+        pthread_mutex_lock(&lock);
+        invalidate_locked(path, is_dir);
+        pthread_mutex_unlock(&lock);
+    }
+
+    if((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO))) {
+        add_watch(path);
+    } else if((ev->mask & IN_ISDIR) && (ev->mask & IN_MOVED_FROM)) {
+        remove_watches_under(path);
+    }
+    if(change_listener && !(ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF))) change_listener(path);
+}
+
+static void* watcher_fn(void* arg){
+    (void)arg;
+    char buf[16384] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for(;;) {
+        ssize_t n = read(inotify_fd, buf, sizeof(buf));
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) break;
+        for(char* p = buf; p < buf + n; ) {
+            const struct inotify_event* ev = (const struct inotify_event*)p;
+            handle_event(ev);
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    printf("[FCACHE] Watcher stopped, disabling file cache\n");
+    pthread_mutex_lock(&lock);
+    enabled = 0;
+    invalidate_locked(root_path, 1);
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+void file_cache_set_listener(void (*listener)(const char* path)){
+    change_listener = listener;
+}
+
+int file_cache_init(const char* root, int entries, long ram_bytes, long small_file_max){
+    if(entries <= 0) return 0;
+    snprintf(root_path, sizeof(root_path), "%s", root);
+    root_len = strlen(root_path);
+    max_entries = entries;
+    ram_budget = ram_bytes;
+    small_max = small_file_max;
+
+    // Without a watcher the cache could serve stale files, so stay disabled
+    mkdir(root_path, 0755);
+    inotify_fd = inotify_init1(IN_CLOEXEC);
+    if(inotify_fd < 0) {
+        perror("[FCACHE] inotify_init1 failed, file cache disabled");
+        return -1;
+    }
+    add_watch(root_path);
+    if(watch_count == 0) {
+        close(inotify_fd);
+        inotify_fd = -1;
+        return -1;
+    }
+
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, watcher_fn, NULL) != 0) {
+        perror("[FCACHE] Failed to start watcher thread");
+        return -1;
+    }
+    pthread_detach(thread);
+    enabled = 1;
+    printf("[FCACHE] Watching %s (%d directories), %d entries, %ldKB in memory\n",
+           root_path, watch_count, max_entries, ram_budget >> 10);
+    return 0;
+}
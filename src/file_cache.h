@@ -0,0 +1,58 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include "io_backend.h"
+#include "chunk_store.h"
+#include <stddef.h>
+#include <sys/stat.h>
+
+// Metadata and open-descriptor cache for the ./find/ store. Hot files stay
+// open (small ones are kept in memory), so repeat reads make no filesystem
+// syscalls. Entries are invalidated by an inotify watcher thread and by
+// writers through file_cache_invalidate.
+typedef struct file_entry file_entry;
+
+struct file_entry {
+    char* path;                  // Normalized path, e.g. "./find/a/b.txt"
+    struct io_file file;         // Open descriptor and size; fd is -1 when data is set
+    long long mtime_ns;
+    char etag[48];               // Validator for the file as cached; "" if unknown
+    char* data;                  // Whole file for small files, else NULL
+    struct chunk_manifest* manifest;  // Set for deduplicated files; file.size is the logical size
+    int missing;                 // Cached lookup failure (not a regular file)
+    int updated;                 // Built by file_cache_update_range
+
+    int refs;
+    int detached;                // Unlinked; freed by the last release
+    file_entry* hash_next;
+    file_entry* lru_prev;
+    file_entry* lru_next;
+};
+
+// Watch root and start the invalidation thread. max_entries 0 disables
+// caching; lookups then open the file on every call.
+int file_cache_init(const char* root, int max_entries, long ram_bytes, long small_file_max);
+
+// Look up and pin a regular file; NULL if it does not exist
+file_entry* file_cache_open(const char* path);
+void file_cache_release(file_entry* entry);
+
+// Send prefix followed by the file. Returns bytes of file content sent, or -1.
+long file_cache_send(int sock, file_entry* entry, const char* prefix, int prefix_len);
+
+// Drop the cached state for path after writing it
+void file_cache_invalidate(const char* path);
+
+// A range write through fd changed [offset, offset + len) of path and left
+// it as st describes. The entry is replaced by one that rereads only that
+// range: small files keep the rest of their contents in memory, others
+// keep their descriptor. The watcher then ignores the write's own events.
+void file_cache_update_range(const char* path, int fd, long offset, long len, const struct stat* st);
+
+// Strong validator for the file st describes: inode, size and mtime
+void file_cache_etag(const struct stat* st, char* out, size_t len);
+
+// Called from the watcher thread with each path that changed on disk
+void file_cache_set_listener(void (*listener)(const char* path));
+
+#endif
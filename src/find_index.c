@@ -0,0 +1,544 @@
+#include "find_index.h"
+#include "durable.h"
+#include "chunk_store.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define PATH_BUCKETS 65536
+#define TRIGRAM_BUCKETS 65536
+#define CONTENT_BUDGET (32L << 20)      // Memory for indexed file contents
+#define MAX_PAGE 1000
+
+struct doc {
+    char* name;                  // Relative to the root, e.g. "sub/a.txt"
+    long size;                   // Logical size; a manifest reports its file's
+    long stored_size;            // Bytes on disk, for change detection
+    long mtime_ns;
+    char* content;               // Small text files only
+    int content_len;
+    int live;                    // 0 once replaced or deleted
+    int path_next;               // Next doc in the same path bucket
+};
+
+// Sorted list of doc ids containing a trigram
+struct posting {
+    uint32_t trigram;
+    int count;
+    int capacity;
+    int* ids;
+    struct posting* next;
+};
+
+struct index {
+    struct doc* docs;
+    int doc_count;
+    int doc_capacity;
+    int live_count;
+    long content_bytes;
+    int path_buckets[PATH_BUCKETS];
+    struct posting* name_grams[TRIGRAM_BUCKETS];
+    struct posting* content_grams[TRIGRAM_BUCKETS];
+};
+
+static char root_path[256];
+static int root_len = 0;
+static long content_max = 0;
+static int rescan_interval = 0;
+
+static struct index* current = NULL;
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Paths changed while a rebuild was scanning; replayed into the new index
+static char** dirty = NULL;
+static int dirty_count = 0;
+static int dirty_capacity = 0;
+static int rebuilding = 0;
+static pthread_mutex_t dirty_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned hash_string(const char* s){
+    unsigned h = 2166136261u;
+    while(*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static uint32_t make_trigram(const char* p){
+    unsigned char a = p[0], b = p[1], c = p[2];
+    if(a >= 'A' && a <= 'Z') a += 32;
+    if(b >= 'A' && b <= 'Z') b += 32;
+    if(c >= 'A' && c <= 'Z') c += 32;
+    return ((uint32_t)a << 16) | ((uint32_t)b << 8) | c;
+}
+
+static unsigned trigram_bucket(uint32_t trigram){
+    return (trigram * 2654435761u) >> 16;
+}
+
+static struct index* index_create(){
+    struct index* idx = calloc(1, sizeof(struct index));
+    if(!idx) return NULL;
+    for(int i = 0; i < PATH_BUCKETS; i++) idx->path_buckets[i] = -1;
+    return idx;
+}
+
+static void free_postings(struct posting** table){
+    for(int i = 0; i < TRIGRAM_BUCKETS; i++) {
+        struct posting* p = table[i];
+        while(p) {
+            struct posting* next = p->next;
+            free(p->ids);
+            free(p);
+            p = next;
+        }
+    }
+}
+
+static void index_free(struct index* idx){
+    if(!idx) return;
+    for(int i = 0; i < idx->doc_count; i++) {
+        free(idx->docs[i].name);
+        free(idx->docs[i].content);
+    }
+    free(idx->docs);
+    free_postings(idx->name_grams);
+    free_postings(idx->content_grams);
+    free(idx);
+}
+
+static struct posting* find_posting(struct posting** table, uint32_t trigram){
+    struct posting* p = table[trigram_bucket(trigram)];
+    while(p && p->trigram != trigram) p = p->next;
+    return p;
+}
+
+// Doc ids only grow, so appending keeps every posting list sorted
+static void add_postings(struct posting** table, const char* text, int len, int id){
+    for(int i = 0; i + 3 <= len; i++) {
+        uint32_t trigram = make_trigram(text + i);
+        struct posting* p = find_posting(table, trigram);
+        if(!p) {
+            p = calloc(1, sizeof(struct posting));
+            if(!p) return;
+            p->trigram = trigram;
+            unsigned bucket = trigram_bucket(trigram);
+            p->next = table[bucket];
+            table[bucket] = p;
+        }
+        if(p->count > 0 && p->ids[p->count - 1] == id) continue;
+        if(p->count == p->capacity) {
+            int capacity = p->capacity ? p->capacity * 2 : 4;
+            int* grown = realloc(p->ids, capacity * sizeof(int));
+            if(!grown) return;
+            p->ids = grown;
+            p->capacity = capacity;
+        }
+        p->ids[p->count++] = id;
+    }
+}
+
+static int lookup_doc(struct index* idx, const char* name){
+    int id = idx->path_buckets[hash_string(name) % PATH_BUCKETS];
+    while(id >= 0 && strcmp(idx->docs[id].name, name) != 0) id = idx->docs[id].path_next;
+    return id;
+}
+
+static void remove_doc(struct index* idx, int id){
+    int* link = &idx->path_buckets[hash_string(idx->docs[id].name) % PATH_BUCKETS];
+    while(*link >= 0 && *link != id) link = &idx->docs[*link].path_next;
+    if(*link == id) *link = idx->docs[id].path_next;
+    idx->docs[id].live = 0;
+    idx->live_count--;
+    if(idx->docs[id].content) {
+        idx->content_bytes -= idx->docs[id].content_len;
+        free(idx->docs[id].content);
+        idx->docs[id].content = NULL;
+    }
+}
+
+// Read a small file's contents if it looks like text
+static char* read_text(const char* path, long size, int* len){
+    if(size <= 0 || size > content_max) return NULL;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) return NULL;
+    char* data = malloc(size + 1);
+    ssize_t n = data ? pread(fd, data, size, 0) : -1;
+    close(fd);
+    if(n <= 0 || memchr(data, '\0', n)) {
+        free(data);
+        return NULL;
+    }
+    data[n] = '\0';
+    *len = (int)n;
+    return data;
+}
+
+// Add or refresh one file (write lock held, or idx not yet published)
+static void index_file(struct index* idx, const char* name, const char* path, const struct stat* st){
+    long mtime_ns = (long)st->st_mtim.tv_sec * 1000000000L + st->st_mtim.tv_nsec;
+    int old = lookup_doc(idx, name);
+    if(old >= 0) {
+        if(idx->docs[old].stored_size == st->st_size && idx->docs[old].mtime_ns == mtime_ns) return;
+        remove_doc(idx, old);
+    }
+
+    if(idx->doc_count == idx->doc_capacity) {
+        int capacity = idx->doc_capacity ? idx->doc_capacity * 2 : 256;
+        struct doc* grown = realloc(idx->docs, capacity * sizeof(struct doc));
+        if(!grown) return;
+        idx->docs = grown;
+        idx->doc_capacity = capacity;
+    }
+    int id = idx->doc_count;
+    struct doc* d = &idx->docs[id];
+    memset(d, 0, sizeof(*d));
+    d->name = strdup(name);
+    if(!d->name) return;
+    d->size = st->st_size;
+    d->stored_size = st->st_size;
+    d->mtime_ns = mtime_ns;
+    d->live = 1;
+    idx->doc_count++;
+    idx->live_count++;
+
+    unsigned bucket = hash_string(name) % PATH_BUCKETS;
+    d->path_next = idx->path_buckets[bucket];
+    idx->path_buckets[bucket] = id;
+
+    add_postings(idx->name_grams, name, strlen(name), id);
+    // Only marked files are opened as manifests
+    struct chunk_manifest* manifest = chunk_manifest_marked_at(path) ? chunk_manifest_load(path) : NULL;
+    if(manifest) {
+        // Deduplicated file: report its real size, leave its contents unindexed
+        d->size = manifest->size;
+        chunk_manifest_free(manifest);
+    } else if(content_max > 0 && idx->content_bytes + st->st_size <= CONTENT_BUDGET) {
+        d->content = read_text(path, st->st_size, &d->content_len);
+        if(d->content) {
+            idx->content_bytes += d->content_len;
+            add_postings(idx->content_grams, d->content, d->content_len, id);
+        }
+    }
+}
+
+// Drop name and everything below it (write lock held)
+static void remove_tree(struct index* idx, const char* name){
+    size_t len = strlen(name);
+    for(int i = 0; i < idx->doc_count; i++) {
+        struct doc* d = &idx->docs[i];
+        if(!d->live) continue;
+        if(len == 0 || (strncmp(d->name, name, len) == 0 && (d->name[len] == '/' || d->name[len] == '\0'))) {
+            remove_doc(idx, i);
+        }
+    }
+}
+
+// In-progress PUT temp files never show up in results
+static int is_temp_name(const char* name){
+    const char* base = strrchr(name, '/');
+    base = base ? base + 1 : name;
+    return strncmp(base, DURABLE_TEMP_PREFIX, strlen(DURABLE_TEMP_PREFIX)) == 0;
+}
+
+static void scan_dir(struct index* idx, const char* dir){
+    DIR* d = opendir(dir);
+    if(!d) return;
+    struct dirent* de;
+    while((de = readdir(d)) != NULL) {
+        if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        char path[1024];
+        if(snprintf(path, sizeof(path), "%s/%s", dir, de->d_name) >= (int)sizeof(path)) continue;
+        struct stat st;
+        if(stat(path, &st) != 0) continue;
+        if(S_ISDIR(st.st_mode)) {
+            scan_dir(idx, path);
+        } else if(S_ISREG(st.st_mode) && !is_temp_name(de->d_name)) {
+            index_file(idx, path + root_len + 1, path, &st);
+        }
+    }
+    closedir(d);
+}
+
+// Relative name of path under the root, or NULL if it is outside it
+static const char* relative_name(const char* path){
+    if(strncmp(path, root_path, root_len) != 0) return NULL;
+    if(path[root_len] == '\0') return path + root_len;
+    // Odd spellings of a path are left to the watcher and the next rescan
+    if(path[root_len] != '/' || strstr(path, "/../") || strstr(path, "/./") || strstr(path + root_len, "//")) return NULL;
+    return path + root_len + 1;
+}
+
+static void apply_update(struct index* idx, const char* path){
+    const char* name = relative_name(path);
+    if(!name) return;
+    struct stat st;
+    if(stat(path, &st) != 0) {
+        remove_tree(idx, name);
+    } else if(S_ISREG(st.st_mode)) {
+        if(!is_temp_name(name)) index_file(idx, name, path, &st);
+    } else if(S_ISDIR(st.st_mode)) {
+        // A directory appeared or was moved in; drop entries no longer on disk
+        remove_tree(idx, name);
+        scan_dir(idx, path);
+    }
+}
+
+void find_index_update(const char* path){
+    if(!path) return;
+    pthread_mutex_lock(&dirty_lock);
+    if(rebuilding) {
+        if(dirty_count == dirty_capacity) {
+            int capacity = dirty_capacity ? dirty_capacity * 2 : 64;
+            char** grown = realloc(dirty, capacity * sizeof(char*));
+            if(grown) {
+                dirty = grown;
+                dirty_capacity = capacity;
+            }
+        }
+        if(dirty_count < dirty_capacity) dirty[dirty_count++] = strdup(path);
+    }
+    pthread_mutex_unlock(&dirty_lock);
+
+    pthread_rwlock_wrlock(&index_lock);
+    if(current) apply_update(current, path);
+    pthread_rwlock_unlock(&index_lock);
+}
+
+// Build a fresh index off-lock and swap it in. Rebuilding also compacts
+// the doc ids and postings left behind by replaced files.
+static void rebuild(){
+    pthread_mutex_lock(&dirty_lock);
+    rebuilding = 1;
+    pthread_mutex_unlock(&dirty_lock);
+
+    struct index* fresh = index_create();
+    if(fresh) scan_dir(fresh, root_path);
+
+    pthread_rwlock_wrlock(&index_lock);
+    pthread_mutex_lock(&dirty_lock);
+    struct index* old = NULL;
+    if(fresh) {
+        for(int i = 0; i < dirty_count; i++) {
+            if(dirty[i]) apply_update(fresh, dirty[i]);
+        }
+        old = current;
+        current = fresh;
+    }
+    for(int i = 0; i < dirty_count; i++) free(dirty[i]);
+    dirty_count = 0;
+    rebuilding = 0;
+    pthread_mutex_unlock(&dirty_lock);
+    pthread_rwlock_unlock(&index_lock);
+
+    index_free(old);
+    if(fresh) {
+        printf("[INDEX] Indexed %d files under %s (%ldKB of text)\n",
+               fresh->live_count, root_path, fresh->content_bytes >> 10);
+    }
+}
+
+static void* index_thread_fn(void* arg){
+    (void)arg;
+    for(;;) {
+        rebuild();
+        if(rescan_interval <= 0) break;
+        sleep(rescan_interval);
+    }
+    return NULL;
+}
+
+int find_index_init(const char* root, long max_content, int rescan_sec){
+    snprintf(root_path, sizeof(root_path), "%s", root);
+    root_len = strlen(root_path);
+    content_max = max_content;
+    rescan_interval = rescan_sec;
+
+    // Start with an empty index so updates and queries work during the scan
+    current = index_create();
+    if(!current) return -1;
+
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, index_thread_fn, NULL) != 0) {
+        perror("[INDEX] Failed to start index thread");
+        return -1;
+    }
+    pthread_detach(thread);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Queries
+// ---------------------------------------------------------------------------
+
+// Intersect the postings of every trigram in each literal. Returns a
+// malloc'd sorted id list, or NULL with *count -1 when nothing narrows the
+// search (all literals shorter than three characters).
+static int* candidates(struct posting** table, const char** literals, const int* lengths, int literal_count, int* count){
+    int* result = NULL;
+    int result_count = -1;
+    for(int l = 0; l < literal_count; l++) {
+        for(int i = 0; i + 3 <= lengths[l]; i++) {
+            struct posting* p = find_posting(table, make_trigram(literals[l] + i));
+            if(!p) {
+                free(result);
+                *count = 0;
+                return NULL;
+            }
+            if(result_count < 0) {
+                result = malloc((p->count + 1) * sizeof(int));
+                if(!result) {
+                    *count = 0;
+                    return NULL;
+                }
+                memcpy(result, p->ids, p->count * sizeof(int));
+                result_count = p->count;
+                continue;
+            }
+            // Merge-intersect two sorted lists in place
+            int a = 0, b = 0, n = 0;
+            while(a < result_count && b < p->count) {
+                if(result[a] < p->ids[b]) a++;
+                else if(result[a] > p->ids[b]) b++;
+                else { result[n++] = result[a]; a++; b++; }
+            }
+            result_count = n;
+        }
+    }
+    *count = result_count;
+    return result;
+}
+
+static int glob_literals(const char* pattern, const char** literals, int* lengths, int max){
+    int count = 0;
+    const char* p = pattern;
+    while(*p && count < max) {
+        while(*p == '*' || *p == '?') p++;
+        if(*p == '[') {
+            while(*p && *p != ']') p++;
+            if(*p) p++;
+            continue;
+        }
+        const char* start = p;
+        while(*p && *p != '*' && *p != '?' && *p != '[' && *p != '\\') p++;
+        if(p > start) {
+            literals[count] = start;
+            lengths[count] = (int)(p - start);
+            count++;
+        }
+        if(*p == '\\') p += p[1] ? 2 : 1;
+    }
+    return count;
+}
+
+static int matches(const struct doc* d, enum find_mode mode, const char* pattern, size_t pattern_len, const char* scope){
+    if(!d->live) return 0;
+    // The scope is a directory: "docs" holds docs/a but not docs2/a
+    size_t scope_len = strlen(scope);
+    const char* rest = d->name + scope_len;
+    if(scope_len && strncmp(d->name, scope, scope_len) != 0) return 0;
+    if(scope_len && scope[scope_len - 1] != '/') {
+        if(*rest != '/' && *rest != '\0') return 0;
+        if(*rest == '/') rest++;
+    }
+    switch(mode) {
+        case FIND_PREFIX:
+            return strncasecmp(rest, pattern, pattern_len) == 0;
+        case FIND_SUBSTRING:
+            return strcasestr(d->name, pattern) != NULL;
+        case FIND_GLOB:
+            return fnmatch(pattern, d->name, FNM_CASEFOLD) == 0;
+        case FIND_CONTENT:
+            return d->content && strcasestr(d->content, pattern) != NULL;
+    }
+    return 0;
+}
+
+static int compare_names(const void* a, const void* b, void* arg){
+    const struct index* idx = arg;
+    return strcmp(idx->docs[*(const int*)a].name, idx->docs[*(const int*)b].name);
+}
+
+static void json_string(FILE* out, const char* s){
+    fputc('"', out);
+    for(; *s; s++) {
+        unsigned char c = *s;
+        if(c == '"' || c == '\\') fprintf(out, "\\%c", c);
+        else if(c < 0x20) fprintf(out, "\\u%04x", c);
+        else fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+int find_index_search(enum find_mode mode, const char* pattern, const char* scope,
+                      int offset, int limit, FILE* out){
+    if(!pattern || !out) return -1;
+    if(!scope) scope = "";
+    if(offset < 0) offset = 0;
+    if(limit <= 0 || limit > MAX_PAGE) limit = limit <= 0 ? 100 : MAX_PAGE;
+    size_t pattern_len = strlen(pattern);
+
+    const char* literals[32];
+    int lengths[32];
+    int literal_count = 0;
+    if(mode == FIND_GLOB) {
+        literal_count = glob_literals(pattern, literals, lengths, 32);
+    } else {
+        literals[0] = pattern;
+        lengths[0] = (int)pattern_len;
+        literal_count = 1;
+    }
+
+    pthread_rwlock_rdlock(&index_lock);
+    struct index* idx = current;
+    int candidate_count = -1;
+    int* ids = candidates(mode == FIND_CONTENT ? idx->content_grams : idx->name_grams,
+                          literals, lengths, literal_count, &candidate_count);
+    if(candidate_count < 0) {
+        // Pattern too short for trigrams; check every document
+        ids = malloc((idx->doc_count + 1) * sizeof(int));
+        candidate_count = 0;
+        for(int i = 0; ids && i < idx->doc_count; i++) ids[candidate_count++] = i;
+    }
+
+    int total = 0;
+    for(int i = 0; ids && i < candidate_count; i++) {
+        if(matches(&idx->docs[ids[i]], mode, pattern, pattern_len, scope)) ids[total++] = ids[i];
+    }
+
+    // Name order keeps pages stable between requests
+    if(ids) qsort_r(ids, total, sizeof(int), compare_names, idx);
+
+    // limit is at most MAX_PAGE, so with offset capped at total the end of
+    // the page cannot overflow
+    if(offset > total) offset = total;
+    int end = offset + limit < total ? offset + limit : total;
+
+    static const char* mode_names[] = { "prefix", "substring", "glob", "content" };
+    fprintf(out, "{\"mode\": \"%s\", \"query\": ", mode_names[mode]);
+    json_string(out, pattern);
+    fprintf(out, ", \"total\": %d, \"offset\": %d, \"limit\": %d, \"results\": [", total, offset, limit);
+    for(int i = offset; i < end; i++) {
+        const struct doc* d = &idx->docs[ids[i]];
+        fprintf(out, "%s\n  {\"path\": ", i == offset ? "" : ",");
+        char path[1100];
+        snprintf(path, sizeof(path), "/find/%s", d->name);
+        json_string(out, path);
+        fprintf(out, ", \"size\": %ld, \"mtime\": %ld}", d->size, d->mtime_ns / 1000000000L);
+    }
+    fprintf(out, "\n]");
+    if(end < total) fprintf(out, ", \"next_offset\": %d", end);
+    fprintf(out, "}\n");
+    pthread_rwlock_unlock(&index_lock);
+
+    free(ids);
+    return total;
+}
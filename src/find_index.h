@@ -0,0 +1,21 @@
+#ifndef FIND_INDEX_H
+#define FIND_INDEX_H
+
+#include <stdio.h>
+
+// Searchable index of the ./find/ store: every file's name, size and mtime,
+// with trigram postings over names and over the contents of small text
+// files. Kept current by find_index_update and rebuilt in the background.
+enum find_mode { FIND_PREFIX, FIND_SUBSTRING, FIND_GLOB, FIND_CONTENT };
+
+int find_index_init(const char* root, long content_max, int rescan_sec);
+
+// Re-read path (a file or directory under root) after it changed
+void find_index_update(const char* path);
+
+// Write one page of matches as JSON; scope restricts results to names
+// under that directory. Returns the total number of matches, or -1.
+int find_index_search(enum find_mode mode, const char* pattern, const char* scope,
+                      int offset, int limit, FILE* out);
+
+#endif
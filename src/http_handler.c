@@ -11,6 +11,26 @@
 #include "http_handler.h"
 #include "cache.h"
 #include "file_share.h"
+#include "trace.h"
+#include "io_backend.h"
+#include "cluster.h"
+#include "file_cache.h"
+#include "find_index.h"
+#include "durable.h"
+#include "chunk_store.h"
+#include "response.h"
+#include "cache_object.h"
+#include "config.h"
+#include "timer_wheel.h"
+#include "upstream.h"
+#include "prefetch.h"
+#include "buffer_chain.h"
+#include "slice_cache.h"
+#include "negative_cache.h"
+#include "admission.h"
+#include "backend.h"
+#include "multipart.h"
+#include "egress.h"
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <sys/socket.h>
@@ -18,53 +38,109 @@
 #include <sys/types.h>
 #include <errno.h>
 #include <fcntl.h> 
+#include <ctype.h>
+#include <stdint.h>
 
 
 #define MAX_BYTES 4096
 #define MAX_RESPONSE_SIZE (50 * 1024 * 1024) // 50MB max response size
 #define UPLOAD_DIR "./uploads"  // directory where files will be saved
-#define MAX_FILE_SIZE (10 * 1024 * 1024) // 10MB
+#define MAX_PUT_SIZE (1024L * 1024 * 1024) // 1GB per PUT body
+#define MAX_UPLOAD_PARTS 64 // parts per multipart upload
+#define MAX_HEAD_SCAN (64 * 1024) // Upstream header bytes searched for the blank line
 
 
-static int connect_remote_server(const char* host, int port){
-    if(!host || port <= 0 || port > 65535) return -1;
-    
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
-    if(sock < 0) {
-        perror("[HTTP] Socket creation failed");
-        return -1;
-    }
-
-    // Set socket timeout
+static void set_upstream_timeouts(int sock){
     struct timeval timeout;
     timeout.tv_sec = 30; // 30 seconds
     timeout.tv_usec = 0;
     setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
     setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+static int connect_remote_server(const char* host, int port){
+    if(!host || port <= 0 || port > 65535) return -1;
 
-    struct hostent* he = gethostbyname(host);
-    if(!he) {
-        printf("[HTTP] Failed to resolve host: %s\n", host);
-        close(sock);
+    // Recent failures are answered without the resolver or the network
+    enum origin_verdict verdict = negative_origin_check(host, port);
+    if(verdict != ORIGIN_ALLOW) {
+        printf("[HTTP] Not contacting %s:%d - %s\n", host, port,
+               verdict == ORIGIN_UNRESOLVED ? "name did not resolve recently" : "circuit open");
+        errno = verdict == ORIGIN_UNRESOLVED ? ENXIO : EAGAIN;
         return -1;
     }
 
-    struct sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    memcpy(&server_addr.sin_addr, he->h_addr, he->h_length);
-
-    if(connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        printf("[HTTP] Failed to connect to %s:%d - %s\n", host, port, strerror(errno));
-        close(sock);
+    // Races every resolved address; bounded as a whole by --connect-timeout
+    int sock = upstream_connect(host, port, deadline_timeout(DEADLINE_CONNECT));
+    if(sock < 0) {
+        int err = errno;
+        printf("[HTTP] Failed to connect to %s:%d - %s\n", host, port, strerror(err));
+        negative_origin_failure(host, port, err == ENXIO ? ORIGIN_FAIL_DNS : ORIGIN_FAIL_CONNECT);
+        errno = err;
         return -1;
     }
 
+    set_upstream_timeouts(sock);
     printf("[HTTP] Connected to %s:%d\n", host, port);
     return sock;
 }
 
+// Where an upstream request goes: the origin the request names, or in
+// reverse-proxy mode a backend of the pool its path maps to
+struct upstream_target {
+    const char* host;
+    int port;
+    int routed;                      // backend is in use
+    struct backend_choice backend;
+};
+
+// Connect for a request to host:port path. In reverse-proxy mode a backend
+// that cannot be reached is retried once on another. Returns the socket,
+// or -1 with errno set (ENOENT: no route, EHOSTUNREACH: no usable backend).
+static int connect_upstream(const char* host, int port, const char* path, struct upstream_target* target){
+    target->host = host;
+    target->port = port;
+    target->routed = 0;
+    if(!backend_enabled()) return connect_remote_server(host, port);
+
+    struct backend_choice failed;
+    for(int attempt = 0; attempt < 2; attempt++) {
+        int picked = backend_pick(path, attempt ? &failed : NULL, &target->backend);
+        if(picked <= 0) {
+            if(attempt > 0) break;
+            printf("[HTTP] %s for %s\n", picked == 0 ? "No route" : "No usable backend", path);
+            errno = picked == 0 ? ENOENT : EHOSTUNREACH;
+            return -1;
+        }
+        struct backend_choice* b = &target->backend;
+        int sock = upstream_connect(b->host, b->port, deadline_timeout(DEADLINE_CONNECT));
+        if(sock >= 0) {
+            set_upstream_timeouts(sock);
+            printf("[HTTP] Connected to backend %s:%d for %s\n", b->host, b->port, path);
+            target->routed = 1;
+            return sock;
+        }
+        printf("[HTTP] Failed to connect to backend %s:%d - %s\n", b->host, b->port, strerror(errno));
+        backend_failure(b);
+        backend_release(b);
+        failed = *b;
+    }
+    errno = ECONNREFUSED;
+    return -1;
+}
+
+// The upstream connection is closed
+static void upstream_done(struct upstream_target* target) {
+    if(target->routed) backend_release(&target->backend);
+    target->routed = 0;
+}
+
+// The upstream connected but never answered
+static void upstream_failed(struct upstream_target* target) {
+    if(target->routed) backend_failure(&target->backend);
+    else negative_origin_failure(target->host, target->port, ORIGIN_FAIL_RESPONSE);
+}
+
 static char* create_cache_key(struct ParsedRequest* request) {
     if(!request || !request->host || !request->path) return NULL;
     
@@ -79,35 +155,496 @@ static char* create_cache_key(struct ParsedRequest* request) {
     return key;
 }
 
-static int send_error_response(int clientSocket, int status_code, const char* message) {
-    char response[1024];
-    const char* status_text;
-    
-    switch(status_code) {
-        case 400: status_text = "Bad Request"; break;
-        case 404: status_text = "Not Found"; break;
-        case 405: status_text = "Method Not Allowed"; break;
-        case 500: status_text = "Internal Server Error"; break;
-        case 502: status_text = "Bad Gateway"; break;
-        case 504: status_text = "Gateway Timeout"; break;
-        default: status_text = "Error"; break;
-    }
-    
-    int response_len = snprintf(response, sizeof(response),
-        "HTTP/1.1 %d %s\r\n"
-        "Content-Type: text/html\r\n"
-        "Content-Length: %d\r\n"
-        "Connection: close\r\n"
-        "\r\n"
+int http_is_cached(struct ParsedRequest* request) {
+    char* key = create_cache_key(request);
+    if(!key) return 0;
+    int cached = cluster_is_local(key) && cache_contains(key);
+    free(key);
+    return cached;
+}
+
+// Error page, with a Retry-After header unless retry_after is 0
+static int send_error_retry(int clientSocket, int status_code, const char* message, int retry_after) {
+    const char* status_text = response_status_text(status_code);
+    char body[1024];
+    int body_len = snprintf(body, sizeof(body),
         "<html><head><title>%d %s</title></head>"
         "<body><h1>%d %s</h1><p>%s</p></body></html>",
-        status_code, status_text, (int)(strlen(message) + 100),
         status_code, status_text, status_code, status_text, message);
-    
-    return send(clientSocket, response, response_len, 0);
+    if (body_len >= (int)sizeof(body)) body_len = sizeof(body) - 1;
+
+    struct response response;
+    response_start(&response, clientSocket, status_code);
+    response_header(&response, "Content-Type", "text/html");
+    if (retry_after > 0) response_header(&response, "Retry-After", "%d", retry_after);
+    response_body(&response, body, body_len);
+    return response_send(&response);
 }
 
-int handle_get(int clientSocket, struct ParsedRequest* request, char* raw_request){
+static int send_error_response(int clientSocket, int status_code, const char* message) {
+    return send_error_retry(clientSocket, status_code, message, 0);
+}
+
+// Tell the client why connect_upstream failed, going by the errno it left
+static int send_connect_error(int clientSocket, const struct upstream_target* target) {
+    if (errno == EAGAIN) {
+        return send_error_retry(clientSocket, 503, "Upstream server is failing",
+                                negative_origin_retry_after(target->host, target->port));
+    }
+    if (errno == ENOENT) return send_error_response(clientSocket, 404, "No route for this path");
+    if (errno == EHOSTUNREACH) {
+        return send_error_retry(clientSocket, 503, "No healthy backend", config.retry_after);
+    }
+    if (errno == ENXIO) return send_error_response(clientSocket, 502, "Could not resolve remote server");
+    return send_error_response(clientSocket, 502, "Failed to connect to remote server");
+}
+
+// Feed the origin's breaker, or the backend's health and latency, from the
+// start of its response. Returns the status, or 0 if data does not begin
+// with a status line.
+static int note_upstream_status(struct upstream_target* target, const char* data, int len) {
+    int status = len >= 12 && strncmp(data, "HTTP/1.", 7) == 0 ? atoi(data + 9) : 0;
+    if (target->routed) {
+        if (status > 0) backend_observe(&target->backend, status);
+        else backend_failure(&target->backend);
+    } else if (status >= 500) {
+        negative_origin_failure(target->host, target->port, ORIGIN_FAIL_RESPONSE);
+    } else if (status > 0) {
+        negative_origin_success(target->host, target->port);
+    }
+    return status;
+}
+
+// Whether the client lets this connection carry another request
+static int client_keep_alive(struct ParsedRequest* request) {
+    if (config.keepalive_timeout <= 0) return 0;
+    const char* connection = ParsedRequest_header(request, "Connection");
+    if (request->version && strcmp(request->version, "HTTP/1.1") == 0) {
+        return !connection || strncasecmp(connection, "close", 5) != 0;
+    }
+    return connection && strncasecmp(connection, "keep-alive", 10) == 0;
+}
+
+static int send_sliced_object(int clientSocket, struct ParsedRequest* request, const char* cache_key,
+                              const struct cache_object* obj, int keep_alive);
+
+// Answer from a cached object: 304 when the client's validators match,
+// headers only for HEAD, else headers and body in gathered writes. body is
+// the chain holding the object's body, or NULL if data is the whole blob.
+// Returns the handler result, or 0 if data is not a valid object.
+static int send_cached_object(int clientSocket, struct ParsedRequest* request, const char* cache_key,
+                              const char* data, int len, const struct buffer_chain* body) {
+    struct cache_object obj;
+    int decoded = body ? cache_object_decode_head(data, len, &obj) : cache_object_decode(data, len, &obj);
+    if (decoded < 0) return 0;
+
+    int keep_alive = client_keep_alive(request);
+    int head = strcmp(request->method, "HEAD") == 0;
+    struct response response;
+    int sent;
+    trace_begin(TRACE_CLIENT_SEND);
+    if (cache_object_not_modified(&obj, ParsedRequest_header(request, "If-None-Match"),
+                                  ParsedRequest_header(request, "If-Modified-Since"))) {
+        // Only the validators and caching headers go with a 304
+        static const char* const kept[] = { "ETag", "Last-Modified", "Cache-Control", "Expires", "Vary", "Date" };
+        response_start(&response, clientSocket, 304);
+        for (size_t i = 0; i < sizeof(kept) / sizeof(kept[0]); i++) {
+            int value_len = 0;
+            const char* value = cache_object_header(&obj, kept[i], &value_len);
+            if (value) response_header(&response, kept[i], "%.*s", value_len, value);
+        }
+        response.keep_alive = keep_alive;
+        sent = response_send_headers(&response, -1);
+        printf("[HTTP] Cache hit answered with 304\n");
+    } else if (obj.sliced && !head) {
+        sent = send_sliced_object(clientSocket, request, cache_key, &obj, keep_alive);
+    } else {
+        response_start(&response, clientSocket, obj.status);
+        response_header_block(&response, obj.headers, obj.headers_len);
+        response.keep_alive = keep_alive;
+        if (response.truncated) {
+            // Headers too large for one response head, as in an object
+            // stored by an older build or a peer; fetch it again instead
+            trace_end(TRACE_CLIENT_SEND);
+            return 0;
+        }
+        if (head) {
+            sent = response_send_headers(&response, obj.body_len);
+        } else if (body) {
+            sent = response_send_chain(&response, NULL, 0, body);
+        } else {
+            response_body(&response, obj.body, obj.body_len);
+            sent = response_send(&response);
+        }
+        printf("[HTTP] Sending cached response (%ld bytes%s)\n", obj.body_len, head ? ", headers only" : "");
+    }
+    trace_end(TRACE_CLIENT_SEND);
+    if (sent < 0) return -1;
+    return keep_alive ? HANDLER_KEEP_ALIVE : 1;
+}
+
+// Replay an error response remembered by the negative cache
+static int send_negative_response(int clientSocket, struct ParsedRequest* request,
+                                  const struct negative_response* neg) {
+    printf("[HTTP] Negative cache hit: %d (%ds left)\n", neg->status, neg->ttl);
+    int keep_alive = client_keep_alive(request);
+    int head = strcmp(request->method, "HEAD") == 0;
+    if (neg->body_len < 0 && !head) {
+        // The body was not kept; stand in a generic page
+        send_error_response(clientSocket, neg->status, "Upstream error (cached)");
+        return 1;
+    }
+    struct response response;
+    response_start(&response, clientSocket, neg->status);
+    if (neg->content_type[0]) response_header(&response, "Content-Type", "%s", neg->content_type);
+    response.keep_alive = keep_alive;
+    int sent;
+    if (head) {
+        sent = response_send_headers(&response, neg->body_len);
+    } else {
+        response_body(&response, neg->body, neg->body_len);
+        sent = response_send(&response);
+    }
+    if (sent < 0) return -1;
+    return keep_alive ? HANDLER_KEEP_ALIVE : 1;
+}
+
+// Contiguous view of the start of a raw response that holds its whole
+// header, or NULL if the header is not complete (or too large). The header
+// almost always sits in the first segment; else it is gathered into
+// *gathered, which the caller frees.
+static const char* raw_head(const struct buffer_chain* raw, char** gathered, long* avail) {
+    *gathered = NULL;
+    if(!raw->head) return NULL;
+    const char* head = raw->head->data + raw->start;
+    *avail = raw->head->len - raw->start;
+    if(memmem(head, *avail, "\r\n\r\n", 4)) return head;
+    if(raw->segments == 1) return NULL;
+
+    *avail = raw->len < MAX_HEAD_SCAN ? raw->len : MAX_HEAD_SCAN;
+    *gathered = malloc(*avail);
+    if(!*gathered) return NULL;
+    chain_copy(raw, 0, *gathered, *avail);
+    if(memmem(*gathered, *avail, "\r\n\r\n", 4)) return *gathered;
+    free(*gathered);
+    *gathered = NULL;
+    return NULL;
+}
+
+// Store an encoded object where its key lives
+static void store_object(char* cache_key, char* object, int object_len, struct buffer_chain* body) {
+    // Ownership is checked again: an unreachable owner hands its keys on
+    if(cluster_is_local(cache_key)) {
+        if(body) cache_add_chain(object, object_len, body, cache_key);
+        else cache_add(object, object_len, cache_key);
+        return;
+    }
+    if(!body) {
+        cluster_store(cache_key, object, object_len);
+        return;
+    }
+    // Peers take one contiguous blob
+    long total = object_len + body->len;
+    char* blob = total <= INT32_MAX ? malloc(total) : NULL;
+    if(blob) {
+        memcpy(blob, object, object_len);
+        chain_copy(body, 0, blob + object_len, body->len);
+        cluster_store(cache_key, blob, (int)total);
+        free(blob);
+    }
+    chain_release(body);
+}
+
+// Encode a complete upstream response and store it where its key lives.
+// The object head is encoded separately and the body segments of raw are
+// handed to the cache as they are; only a chunked body is decoded into a
+// new buffer. raw is consumed. A cached HTML page is handed to the
+// prefetcher when scan is set. Returns 1 if stored, 0 if the response was
+// not cacheable.
+static int store_response(char* cache_key, struct buffer_chain* raw,
+                          const char* host, int port, const char* path, int scan) {
+    char* gathered = NULL;
+    long head_avail = 0;
+    const char* head = raw_head(raw, &gathered, &head_avail);
+
+    char* object = NULL;
+    int object_len = 0;
+    long body_start = 0, body_len = 0;
+    int encoded = head ? cache_object_encode_head(head, head_avail, raw->len, &object, &object_len,
+                                                  &body_start, &body_len) : -1;
+    free(gathered);
+    if(encoded == 1) {
+        // Chunked: the decoded body is a new contiguous blob
+        char* flat = malloc(raw->len);
+        if(flat) {
+            chain_copy(raw, 0, flat, raw->len);
+            encoded = cache_object_encode(flat, raw->len, &object, &object_len);
+            free(flat);
+        } else {
+            encoded = -1;
+        }
+        chain_release(raw);
+        if(encoded < 0) return 0;
+    } else if(encoded < 0) {
+        chain_release(raw);
+        return 0;
+    } else {
+        chain_consume(raw, body_start);
+        chain_truncate(raw, body_len);
+    }
+
+    struct cache_object obj;
+    int type_len = 0;
+    const char* type = NULL;
+    int decoded = raw->len > 0 ? cache_object_decode_head(object, object_len, &obj)
+                               : cache_object_decode(object, object_len, &obj);
+    if(scan && decoded == 0 && obj.status == 200 &&
+       !cache_object_header(&obj, "Content-Encoding", NULL)) {
+        type = cache_object_header(&obj, "Content-Type", &type_len);
+    }
+    if(type && type_len >= 9 && strncasecmp(type, "text/html", 9) == 0) {
+        if(raw->len > 0) prefetch_page_chain(host, port, path, raw);
+        else prefetch_page(host, port, path, obj.body, obj.body_len);
+    }
+
+    store_object(cache_key, object, object_len, raw->len > 0 ? raw : NULL);
+    free(object);
+    return 1;
+}
+
+// Write bytes [offset, offset + len) of a cached slice. Heap slices keep
+// their bytes in the body chain, shared-segment slices inline.
+static int send_slice_range(int sock, const cache_element* slice, long offset, long len) {
+    if(offset < slice->len) {
+        long n = slice->len - offset < len ? slice->len - offset : len;
+        if(response_write_all(sock, slice->data + offset, n) < 0) return -1;
+        offset += n;
+        len -= n;
+    }
+    if(len == 0) return 0;
+    if(!slice->body) return -1;
+    return response_write_chain(sock, slice->body, offset - slice->len, len);
+}
+
+static long slice_bytes(const cache_element* slice) {
+    return slice->len + (slice->body ? slice->body->len : 0);
+}
+
+// Fetch slices [from, to) of a sliced object with one upstream Range
+// request, forward the part of them in [first, last] to the client and
+// cache them on the way through. Returns 0, or -1 if the fill failed.
+static int fill_slices(int clientSocket, struct ParsedRequest* request, const char* cache_key,
+                       const struct cache_object* obj, long slice_size, long from, long to,
+                       long first, long last) {
+    long start = from * slice_size;
+    long end = (to * slice_size < obj->body_len ? to * slice_size : obj->body_len) - 1;
+    int port = request->port ? atoi(request->port) : 80;
+    struct upstream_target target;
+    int remoteSock = connect_upstream(request->host, port, request->path, &target);
+    if(remoteSock < 0) return -1;
+
+    // If-Range keeps a changed object from being spliced into the old one
+    char validator[512] = "";
+    int value_len = 0;
+    const char* value = obj->etag ? obj->etag : cache_object_header(obj, "Last-Modified", &value_len);
+    if(obj->etag) value_len = obj->etag_len;
+    if(value && value_len < (int)sizeof(validator) - 16) {
+        snprintf(validator, sizeof(validator), "If-Range: %.*s\r\n", value_len, value);
+    }
+    char http_request[8192];
+    int request_len = snprintf(http_request, sizeof(http_request),
+        "GET %s HTTP/1.1\r\n"
+        "Host: %s\r\n"
+        "Range: bytes=%ld-%ld\r\n"
+        "%s"
+        "Connection: close\r\n"
+        "User-Agent: ProxyServer/1.0\r\n"
+        "\r\n",
+        request->path, request->host, start, end, validator);
+    if(request_len >= (int)sizeof(http_request) || response_write_all(remoteSock, http_request, request_len) < 0) {
+        close(remoteSock);
+        upstream_done(&target);
+        return -1;
+    }
+
+    struct buffer_chain chain;
+    chain_init(&chain);
+    struct slice_writer* writer = malloc(sizeof(*writer));
+    if(!writer) {
+        close(remoteSock);
+        upstream_done(&target);
+        return -1;
+    }
+    slice_writer_init(writer, cache_key, slice_size, obj->body_len, from);
+
+    long pos = -1;               // Body offset of the chain's first byte once the head is parsed
+    int done = 0;
+    for(;;) {
+        int space;
+        char* into = chain_reserve(&chain, &space);
+        if(!into) break;
+        int bytes = recv(remoteSock, into, space, 0);
+        if(bytes <= 0) break;
+        chain_commit(&chain, bytes);
+
+        long fresh = bytes;
+        if(pos < 0) {
+            char* gathered = NULL;
+            long avail = 0;
+            const char* head = raw_head(&chain, &gathered, &avail);
+            if(!head) {
+                if(chain.len > MAX_HEAD_SCAN) break;
+                continue;
+            }
+            int head_len = slice_parse_reply(head, avail, start, obj->etag, obj->etag_len, &pos);
+            free(gathered);
+            if(head_len == -2) {
+                // The client already has the old headers; drop the old
+                // version so its next request fetches the new one whole
+                printf("[HTTP] %s changed at the origin, dropping its slices\n", cache_key);
+                slice_drop(cache_key, obj->body_len, slice_size);
+                break;
+            }
+            if(head_len < 0) {
+                printf("[HTTP] Unusable reply to a slice fill for %s\n", cache_key);
+                break;
+            }
+            chain_consume(&chain, head_len);
+            fresh = chain.len;
+        }
+
+        // An origin that ignored Range sends the body from the start
+        if(pos < start) {
+            long skip = start - pos < chain.len ? start - pos : chain.len;
+            chain_consume(&chain, skip);
+            pos += skip;
+        }
+        chain_truncate(&chain, end + 1 - pos);
+        if(fresh > chain.len) fresh = chain.len;
+
+        // Forward the new bytes the client asked for
+        long fresh_at = pos + chain.len - fresh;
+        long lo = first > fresh_at ? first : fresh_at;
+        long hi = last + 1 < pos + chain.len ? last + 1 : pos + chain.len;
+        if(hi > lo && response_write_chain(clientSocket, &chain, lo - pos, hi - lo) < 0) break;
+
+        // Full slices are handed over whole so segments stay densely packed
+        done = pos + chain.len > end;
+        if(chain.len >= slice_size || done) {
+            long n = chain.len;
+            slice_writer_feed(writer, &chain);
+            pos += n;
+        }
+        if(done) break;
+    }
+    close(remoteSock);
+    upstream_done(&target);
+    chain_release(&chain);
+    printf("[HTTP] Filled slices %ld-%ld of %s from upstream (%d cached)\n", from, to - 1, cache_key, writer->stored);
+    slice_writer_close(writer);
+    free(writer);
+    return done ? 0 : -1;
+}
+
+// Answer a GET for a sliced object, whole or as one byte range. Present
+// slices are sent from the cache; each run of missing ones is filled from
+// the origin. Returns 0 or -1.
+static int send_sliced_object(int clientSocket, struct ParsedRequest* request, const char* cache_key,
+                              const struct cache_object* obj, int keep_alive) {
+    long total = obj->body_len;
+    long first = 0, last = total - 1;
+    int ranged = 0;
+    const char* range = ParsedRequest_header(request, "Range");
+    const char* if_range = ParsedRequest_header(request, "If-Range");
+    // A stale If-Range validator asks for the whole object instead
+    if(range && (!if_range || (obj->etag && (int)strlen(if_range) == obj->etag_len &&
+                               strncmp(if_range, obj->etag, obj->etag_len) == 0))) {
+        ranged = slice_parse_range(range, total, &first, &last);
+    }
+
+    struct response response;
+    if(ranged < 0) {
+        response_start(&response, clientSocket, 416);
+        response_header(&response, "Content-Range", "bytes */%ld", total);
+        response.keep_alive = keep_alive;
+        return response_send(&response);
+    }
+    response_start(&response, clientSocket, ranged ? 206 : obj->status);
+    response_header_block(&response, obj->headers, obj->headers_len);
+    if(!cache_object_header(obj, "Accept-Ranges", NULL)) response_header(&response, "Accept-Ranges", "bytes");
+    if(ranged) response_header(&response, "Content-Range", "bytes %ld-%ld/%ld", first, last, total);
+    response.keep_alive = keep_alive;
+
+    long slice_size = (long)config.slice_kb * 1024;
+    response_cork(clientSocket, 1);
+    int result = response_send_headers(&response, last - first + 1);
+    int hits = 0, filled = 0;
+    long index = first / slice_size;
+    while(result == 0 && index <= last / slice_size) {
+        long slice_start = index * slice_size;
+        long expected = total - slice_start < slice_size ? total - slice_start : slice_size;
+        cache_element* slice = slice_find(cache_key, index);
+        // A slice of the wrong size was cut with another --slice-size
+        if(slice && slice_bytes(slice) == expected) {
+            long lo = (first > slice_start ? first : slice_start) - slice_start;
+            long hi = (last + 1 < slice_start + expected ? last + 1 : slice_start + expected) - slice_start;
+            result = send_slice_range(clientSocket, slice, lo, hi - lo);
+            cache_release(slice);
+            hits++;
+            index++;
+            continue;
+        }
+        if(slice) cache_release(slice);
+
+        long run_end = index + 1;
+        char key[SLICE_KEY_MAX];
+        while(run_end <= last / slice_size) {
+            slice_key(key, sizeof(key), cache_key, run_end);
+            if(cache_contains(key)) break;
+            run_end++;
+        }
+        result = fill_slices(clientSocket, request, cache_key, obj, slice_size, index, run_end, first, last);
+        filled += run_end - index;
+        index = run_end;
+    }
+    response_cork(clientSocket, 0);
+    printf("[HTTP] Sent bytes %ld-%ld of sliced %s (%d slice hit(s), %d filled)\n",
+           first, last, cache_key, hits, filled);
+    return result;
+}
+
+// Decide from the response head whether the body is cached in slices.
+// Returns 0 while the head is incomplete, else 1; *writer and *manifest are
+// set when slicing, and the head is consumed from raw.
+static int begin_slices(const char* cache_key, struct buffer_chain* raw, struct slice_writer** writer,
+                        char** manifest, int* manifest_len) {
+    char* gathered = NULL;
+    long avail = 0;
+    const char* head = raw_head(raw, &gathered, &avail);
+    if(!head) return raw->len > MAX_HEAD_SCAN;
+
+    char* object = NULL;
+    int object_len = 0;
+    long body_start = 0, body_len = 0;
+    struct cache_object obj;
+    int encoded = cache_object_encode_head(head, avail, -1, &object, &object_len, &body_start, &body_len);
+    free(gathered);
+    if(encoded != 0) return 1;
+    if(body_len <= (long)config.slice_threshold_kb * 1024 || body_len > MAX_RESPONSE_SIZE ||
+       cache_object_decode_head(object, object_len, &obj) < 0 || obj.status != 200 ||
+       !(*writer = malloc(sizeof(**writer)))) {
+        free(object);
+        return 1;
+    }
+    slice_writer_init(*writer, cache_key, (long)config.slice_kb * 1024, body_len, 0);
+    cache_object_mark_sliced(object);
+    *manifest = object;
+    *manifest_len = object_len;
+    chain_consume(raw, body_start);
+    return 1;
+}
+
+static int get_request(int clientSocket, struct ParsedRequest* request, char* raw_request){
     // Suppress unused parameter warning
     (void)raw_request;
     
@@ -128,17 +665,44 @@ int handle_get(int clientSocket, struct ParsedRequest* request, char* raw_reques
     // Check cache first
     cache_element* cached = cache_find(cache_key);
     if(cached){
-        printf("[HTTP] Sending cached response (%d bytes)\n", cached->len);
-        int sent = send(clientSocket, cached->data, cached->len, 0);
+        int result = send_cached_object(clientSocket, request, cache_key, cached->data, cached->len, cached->body);
+        cache_release(cached);
+        if(result != 0) {
+            free(cache_key);
+            return result;
+        }
+    }
+
+    // In cluster mode, keys owned by another node are cached there
+    if(!cluster_is_local(cache_key)) {
+        char* peer_data = NULL;
+        int peer_len = 0;
+        if(cluster_fetch(cache_key, &peer_data, &peer_len) == 1) {
+            int result = send_cached_object(clientSocket, request, cache_key, peer_data, peer_len, NULL);
+            free(peer_data);
+            if(result != 0) {
+                free(cache_key);
+                return result;
+            }
+        }
+    }
+
+    // A recent error for this URL is replayed instead of asking again
+    struct negative_response* neg = malloc(sizeof(*neg));
+    if(neg && negative_lookup(cache_key, neg)) {
+        int result = send_negative_response(clientSocket, request, neg);
+        free(neg);
         free(cache_key);
-        return sent > 0 ? 1 : -1;
+        return result;
     }
+    free(neg);
 
     // Connect to remote server
     int port = request->port ? atoi(request->port) : 80;
-    int remoteSock = connect_remote_server(request->host, port);
+    struct upstream_target target;
+    int remoteSock = connect_upstream(request->host, port, request->path, &target);
     if(remoteSock < 0) {
-        send_error_response(clientSocket, 502, "Failed to connect to remote server");
+        send_connect_error(clientSocket, &target);
         free(cache_key);
         return -1;
     }
@@ -148,101 +712,198 @@ int handle_get(int clientSocket, struct ParsedRequest* request, char* raw_reques
     if(!http_request) {
         send_error_response(clientSocket, 500, "Memory allocation failed");
         close(remoteSock);
+        upstream_done(&target);
         free(cache_key);
         return -1;
     }
     
+    // A HEAD miss is passed through as HEAD and not cached
+    int head = strcmp(request->method, "HEAD") == 0;
     int request_len = snprintf(http_request, 8192,
-        "GET %s HTTP/1.1\r\n"
+        "%s %s HTTP/1.1\r\n"
         "Host: %s\r\n"
         "Connection: close\r\n"
         "User-Agent: ProxyServer/1.0\r\n"
         "\r\n",
-        request->path, request->host);
+        head ? "HEAD" : "GET", request->path, request->host);
 
-    if(send(remoteSock, http_request, request_len, 0) < 0) {
+    if(response_write_all(remoteSock, http_request, request_len) < 0) {
         printf("[HTTP] Failed to send request to remote server\n");
         send_error_response(clientSocket, 502, "Failed to send request to remote server");
+        upstream_failed(&target);
         close(remoteSock);
+        upstream_done(&target);
         free(http_request);
         free(cache_key);
         return -1;
     }
     free(http_request);
 
-    // Receive and forward response
+    // Receive into pooled segments and forward each read from where it landed
+    struct buffer_chain response;
+    chain_init(&response);
     char buffer[MAX_BYTES];
-    char* full_response = malloc(1);
-    int response_size = 0;
+    long response_size = 0;
+    int caching = !head;
+    int status = 0;
     int bytes;
-    
-    if(!full_response) {
-        send_error_response(clientSocket, 500, "Memory allocation failed");
-        close(remoteSock);
-        free(cache_key);
-        return -1;
-    }
-    full_response[0] = '\0';
 
-    while((bytes = recv(remoteSock, buffer, MAX_BYTES, 0)) > 0) {
+    // Bodies over --slice-threshold are cut into slices as they arrive
+    // instead of being buffered whole; a peer cluster caches objects whole
+    struct slice_writer* slicer = NULL;
+    char* manifest = NULL;
+    int manifest_len = 0;
+    int head_checked = !caching || config.slice_threshold_kb <= 0 || config.cluster_peer_count > 0;
+
+    struct deadline ttfb;
+    memset(&ttfb, 0, sizeof(ttfb));
+    deadline_arm(&ttfb, remoteSock, DEADLINE_TTFB);
+    trace_begin(TRACE_UPSTREAM_TTFB);
+    for(;;) {
+        int space = sizeof(buffer);
+        char* into = caching ? chain_reserve(&response, &space) : buffer;
+        if(!into) {
+            printf("[HTTP] Memory allocation failed, continuing without caching\n");
+            chain_release(&response);
+            caching = 0;
+            into = buffer;
+            space = sizeof(buffer);
+        }
+        bytes = recv(remoteSock, into, space, 0);
+        if(bytes <= 0) break;
+        trace_end(TRACE_UPSTREAM_TTFB);
+        if(response_size == 0) {
+            deadline_cancel(&ttfb);
+            status = note_upstream_status(&target, into, bytes);
+        }
+        response_size += bytes;
+
         // Forward data to client immediately
-        if(send(clientSocket, buffer, bytes, 0) < 0) {
+        trace_begin(TRACE_CLIENT_SEND);
+        int sent = response_write_all(clientSocket, into, bytes);
+        trace_end(TRACE_CLIENT_SEND);
+        if(sent < 0) {
             printf("[HTTP] Failed to send data to client\n");
             break;
         }
-
-        // Check if response is getting too large
-        if(response_size + bytes > MAX_RESPONSE_SIZE) {
+        if(!caching) continue;
+        chain_commit(&response, bytes);
+
+        if(!head_checked) head_checked = begin_slices(cache_key, &response, &slicer, &manifest, &manifest_len);
+        if(slicer) {
+            // Full slices only, so segments stay densely packed
+            if(response.len >= slicer->slice_size) slice_writer_feed(slicer, &response);
+        } else if(response.len > MAX_RESPONSE_SIZE) {
+            // Check if response is getting too large; keep forwarding without caching
             printf("[HTTP] Response too large, not caching\n");
-            // Continue forwarding but don't cache
-            while((bytes = recv(remoteSock, buffer, MAX_BYTES, 0)) > 0) {
-                send(clientSocket, buffer, bytes, 0);
-            }
-            close(remoteSock);
-            free(full_response);
-            free(cache_key);
-            return 1;
+            chain_release(&response);
+            caching = 0;
         }
-
-        // Store response for caching
-        char* temp = realloc(full_response, response_size + bytes + 1);
-        if(!temp) {
-            printf("[HTTP] Memory allocation failed, continuing without caching\n");
-            while((bytes = recv(remoteSock, buffer, MAX_BYTES, 0)) > 0) {
-                send(clientSocket, buffer, bytes, 0);
-            }
-            close(remoteSock);
-            free(full_response);
-            free(cache_key);
-            return 1;
-        }
-        full_response = temp;
-        
-        memcpy(full_response + response_size, buffer, bytes);
-        response_size += bytes;
-        full_response[response_size] = '\0';
     }
 
+    deadline_cancel(&ttfb);
     close(remoteSock);
+    if(response_size == 0) upstream_failed(&target);
+    upstream_done(&target);
+
+    if(slicer) {
+        // The manifest goes in last, once every slice has been offered
+        if(caching) slice_writer_feed(slicer, &response);
+        if(caching && !slicer->failed && slice_writer_offset(slicer) == slicer->total) {
+            cache_add(manifest, manifest_len, cache_key);
+            printf("[HTTP] Cached %s in %d slice(s)\n", cache_key, slicer->stored);
+        }
+        slice_writer_close(slicer);
+        free(slicer);
+        free(manifest);
+        caching = 0;
+    }
 
+    if(ttfb.expired && response_size == 0) {
+        send_error_response(clientSocket, 504, "Upstream did not respond in time");
+        chain_release(&response);
+        free(cache_key);
+        return -1;
+    }
     if(bytes < 0) {
         printf("[HTTP] Error receiving data from remote server\n");
-        free(full_response);
+        chain_release(&response);
         free(cache_key);
         return -1;
     }
 
-    // Cache the response if it's not too large
-    if(response_size > 0 && response_size < MAX_RESPONSE_SIZE) {
-        cache_add(full_response, response_size, cache_key);
+    // Cache the parsed response if it's complete and cacheable; the cache
+    // takes the segments over. Errors only go to the negative cache.
+    if(caching && response.len > 0 && negative_status(status)) {
+        if(bytes == 0) negative_store(cache_key, &response);
+    } else if(caching && response.len > 0) {
+        store_response(cache_key, &response, request->host, port, request->path, 1);
     }
 
-    free(full_response);
+    chain_release(&response);
     free(cache_key);
-    printf("[HTTP] GET request completed (%d bytes)\n", response_size);
+    printf("[HTTP] GET request completed (%ld bytes)\n", response_size);
     return 1;
 }
 
+int handle_get(int clientSocket, struct ParsedRequest* request, char* raw_request){
+    // Hits, slices and relayed misses all leave through the shaped writers
+    egress_begin(clientSocket);
+    int result = get_request(clientSocket, request, raw_request);
+    egress_end();
+    return result;
+}
+
+long http_prefetch(const char* host, int port, const char* path, long max_bytes){
+    struct upstream_target target;
+    int remoteSock = connect_upstream(host, port, path, &target);
+    if(remoteSock < 0) return -1;
+
+    char request[4096];
+    int request_len = snprintf(request, sizeof(request),
+        "GET %s HTTP/1.1\r\n"
+        "Host: %s\r\n"
+        "Connection: close\r\n"
+        "User-Agent: ProxyServer/1.0\r\n"
+        "Sec-Purpose: prefetch\r\n"
+        "\r\n",
+        path, host);
+    if(request_len >= (int)sizeof(request) || response_write_all(remoteSock, request, request_len) < 0) {
+        close(remoteSock);
+        upstream_done(&target);
+        return -1;
+    }
+
+    // Read the whole response; anything over max_bytes is not worth warming
+    struct buffer_chain raw;
+    chain_init(&raw);
+    int bytes = 0;
+    for(;;) {
+        int space;
+        char* into = chain_reserve(&raw, &space);
+        if(!into) {
+            bytes = -1;
+            break;
+        }
+        bytes = recv(remoteSock, into, space, 0);
+        if(bytes <= 0) break;
+        chain_commit(&raw, bytes);
+        if(raw.len > max_bytes) break;
+    }
+    close(remoteSock);
+    upstream_done(&target);
+    if(bytes != 0) {
+        chain_release(&raw);
+        return -1;
+    }
+
+    char key[4096];
+    snprintf(key, sizeof(key), "%s:%d%s", host, port, path);
+    long raw_len = raw.len;
+    int stored = store_response(key, &raw, host, port, path, 0);
+    return stored ? raw_len : 0;
+}
+
 // Basic POST handler: forwards to server without caching
 int handle_post(int clientSocket, struct ParsedRequest* request, char* raw_request){
     if(!request || !request->host || !request->path) {
@@ -253,17 +914,20 @@ int handle_post(int clientSocket, struct ParsedRequest* request, char* raw_reque
     printf("[HTTP] Handling POST request: %s%s\n", request->host, request->path);
 
     int port = request->port ? atoi(request->port) : 80;
-    int remoteSock = connect_remote_server(request->host, port);
+    struct upstream_target target;
+    int remoteSock = connect_upstream(request->host, port, request->path, &target);
     if(remoteSock < 0) {
-        send_error_response(clientSocket, 502, "Failed to connect to remote server");
+        send_connect_error(clientSocket, &target);
         return -1;
     }
 
     // Forward the original request
-    if(send(remoteSock, raw_request, strlen(raw_request), 0) < 0) {
+    if(response_write_all(remoteSock, raw_request, strlen(raw_request)) < 0) {
         printf("[HTTP] Failed to send POST request to remote server\n");
         send_error_response(clientSocket, 502, "Failed to send request to remote server");
+        upstream_failed(&target);
         close(remoteSock);
+        upstream_done(&target);
         return -1;
     }
 
@@ -272,107 +936,632 @@ int handle_post(int clientSocket, struct ParsedRequest* request, char* raw_reque
     int bytes;
     int total_bytes = 0;
 
+    struct deadline ttfb;
+    memset(&ttfb, 0, sizeof(ttfb));
+    deadline_arm(&ttfb, remoteSock, DEADLINE_TTFB);
+    trace_begin(TRACE_UPSTREAM_TTFB);
     while((bytes = recv(remoteSock, buffer, MAX_BYTES, 0)) > 0){
-        if(send(clientSocket, buffer, bytes, 0) < 0) {
+        trace_end(TRACE_UPSTREAM_TTFB);
+        if(total_bytes == 0) {
+            deadline_cancel(&ttfb);
+            note_upstream_status(&target, buffer, bytes);
+        }
+        trace_begin(TRACE_CLIENT_SEND);
+        int sent = response_write_all(clientSocket, buffer, bytes);
+        trace_end(TRACE_CLIENT_SEND);
+        if(sent < 0) {
             printf("[HTTP] Failed to send POST response to client\n");
             break;
         }
         total_bytes += bytes;
     }
     
+    deadline_cancel(&ttfb);
     close(remoteSock);
+    if(total_bytes == 0) upstream_failed(&target);
+    upstream_done(&target);
+    if(ttfb.expired && total_bytes == 0) {
+        send_error_response(clientSocket, 504, "Upstream did not respond in time");
+        return -1;
+    }
     printf("[HTTP] POST request completed (%d bytes)\n", total_bytes);
     return 1;
 }
 
-int handle_put(int clientSocket, struct ParsedRequest* request, char* raw_request) {
-    char filepath[1024];
+// Value of a request header within the raw header block, or NULL
+static const char* raw_header(const char* raw, int header_len, const char* name, int* value_len) {
+    size_t name_len = strlen(name);
+    const char* line = strstr(raw, "\r\n");
+    while (line && line < raw + header_len) {
+        line += 2;
+        if (strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            const char* value = line + name_len + 1;
+            while (*value == ' ') value++;
+            const char* end = strstr(value, "\r\n");
+            *value_len = end ? (int)(end - value) : (int)strlen(value);
+            return value;
+        }
+        line = strstr(line, "\r\n");
+    }
+    return NULL;
+}
+
+// Destination of an uploaded body: a durable temp file renamed into place,
+// or the chunk store plus a manifest when deduplication is on
+struct upload_sink {
+    int dedup;
+    struct durable_file file;
+    struct chunk_writer chunks;
+};
+
+static int sink_open(struct upload_sink* sink, const char* path, long expected) {
+    sink->dedup = chunk_store_enabled();
+    if (sink->dedup) return chunk_writer_open(&sink->chunks);
+    return durable_open(&sink->file, path, expected);
+}
+
+static int sink_write(struct upload_sink* sink, const char* data, size_t len) {
+    if (sink->dedup) return chunk_writer_write(&sink->chunks, data, len);
+    return durable_write(&sink->file, data, len);
+}
+
+static int sink_commit(struct upload_sink* sink, const char* path) {
+    if (sink->dedup) return chunk_writer_commit(&sink->chunks, path);
+    return durable_commit(&sink->file);
+}
+
+static void sink_abort(struct upload_sink* sink) {
+    if (sink->dedup) chunk_writer_abort(&sink->chunks);
+    else durable_abort(&sink->file);
+}
+
+static int sink_body_write(void* ctx, const char* data, size_t len) {
+    return sink_write(ctx, data, len);
+}
+
+// Feed a request body of content_length bytes to write: the buffered bytes
+// first, then the rest from the socket, answering Expect: 100-continue.
+// Returns 0, -1 if the client went away (logged under tag), or -2 if write
+// failed; *received counts the bytes read either way.
+static int receive_body(int clientSocket, const char* tag, const char* expect, const char* body,
+                        long buffered, long content_length,
+                        int (*write)(void* ctx, const char* data, size_t len), void* ctx, long* received) {
+    if (expect && buffered < content_length && strncasecmp(expect, "100-continue", 12) == 0) {
+        const char* cont = "HTTP/1.1 100 Continue\r\n\r\n";
+        response_write_all(clientSocket, cont, strlen(cont));
+    }
+
+    int failed = write(ctx, body, buffered) < 0;
+    *received = buffered;
+    char chunk[65536];
+    // The body deadline restarts on every read, so only a stalled upload expires
+    struct deadline deadline;
+    memset(&deadline, 0, sizeof(deadline));
+    while (!failed && *received < content_length) {
+        long want = content_length - *received;
+        deadline_arm(&deadline, clientSocket, DEADLINE_BODY);
+        int bytes = recv(clientSocket, chunk, want < (long)sizeof(chunk) ? want : (long)sizeof(chunk), 0);
+        if (bytes <= 0) {
+            deadline_cancel(&deadline);
+            printf("%s %s after %ld of %ld bytes\n", tag, deadline.expired ? "Body timed out" : "Client closed",
+                   *received, content_length);
+            return -1;
+        }
+        failed = write(ctx, chunk, bytes) < 0;
+        *received += bytes;
+    }
+    deadline_cancel(&deadline);
+    return failed ? -2 : 0;
+}
+
+// Local path under ./find/ for a request path, with or without its /find/
+// prefix. Returns -1 if a ".." segment could leave the store or the path
+// does not fit.
+static int find_path(const char* request_path, char* out, size_t len) {
+    const char* relative = request_path;
+    if (strncmp(relative, "/find/", 6) == 0) relative += 6;
+    for (const char* seg = relative; seg; ) {
+        const char* end = strchr(seg, '/');
+        size_t seg_len = end ? (size_t)(end - seg) : strlen(seg);
+        if (seg_len == 2 && seg[0] == '.' && seg[1] == '.') return -1;
+        seg = end ? end + 1 : NULL;
+    }
+    int n = snprintf(out, len, "./find/%s", relative);
+    return n < 0 || (size_t)n >= len ? -1 : 0;
+}
+
+// pwrite target of a range write
+struct range_sink {
+    int fd;
+    long offset;
+    long written;
+};
+
+static int range_body_write(void* ctx, const char* data, size_t len) {
+    struct range_sink* sink = ctx;
+    while (len > 0) {
+        ssize_t n = pwrite(sink->fd, data, len, sink->offset + sink->written);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+        sink->written += n;
+    }
+    return 0;
+}
+
+// Write-lock [start, start + len) of fd, waiting for overlapping writers;
+// len 0 runs past the end of the file. Open file description locks are
+// held until fd is closed and exclude other threads and prefork workers alike.
+static int lock_range(int fd, long start, long len) {
+    struct flock lock;
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = start;
+    lock.l_len = len;
+    while (fcntl(fd, F_OFD_SETLKW, &lock) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    return 0;
+}
+
+// 1 if the If-Match list names the file st describes ("*" names any)
+static int etag_matches(const char* list, int list_len, const struct stat* st) {
+    char etag[48];
+    file_cache_etag(st, etag, sizeof(etag));
+    size_t etag_len = strlen(etag);
+    const char* end = list + list_len;
+    for (const char* p = list; p < end; ) {
+        while (p < end && (*p == ' ' || *p == ',')) p++;
+        const char* token = p;
+        while (p < end && *p != ',') p++;
+        const char* token_end = p;
+        while (token_end > token && token_end[-1] == ' ') token_end--;
+        size_t token_len = token_end - token;
+        if (token_len == 1 && *token == '*') return 1;
+        // Strong comparison: weak validators never match
+        if (token_len == etag_len && memcmp(token, etag, etag_len) == 0) return 1;
+    }
+    return 0;
+}
+
+// Give the file an mtime no earlier write had, so its ETag changes even
+// when two writes land within one filesystem timestamp tick
+static void touch_unique(int fd, const struct stat* before) {
+    struct timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    clock_gettime(CLOCK_REALTIME, &times[1]);
+    long long now = (long long)times[1].tv_sec * 1000000000LL + times[1].tv_nsec;
+    long long last = (long long)before->st_mtim.tv_sec * 1000000000LL + before->st_mtim.tv_nsec;
+    if (now <= last) {
+        now = last + 1;
+        times[1].tv_sec = now / 1000000000LL;
+        times[1].tv_nsec = now % 1000000000LL;
+    }
+    futimens(fd, times);
+}
+
+// Write a request body into part of an existing file: at the offset of a
+// Content-Range ("bytes START-END/TOTAL" or ".../*"), or at the end of the
+// file when append is set and there is no range. Only the written bytes
+// are locked, so writers of disjoint ranges run in parallel; an If-Match
+// precondition or an append locks the whole file.
+static int write_range(int clientSocket, const char* tag, const char* filepath, const char* raw_request,
+                       int header_len, const char* body, long buffered, int append) {
+    int value_len = 0;
+    const char* value = raw_header(raw_request, header_len, "Content-Length", &value_len);
+    if (!value) {
+        response_send_status(clientSocket, 411);
+        return -1;
+    }
+    long content_length = atol(value);
+
+    long offset = 0;
+    const char* range = raw_header(raw_request, header_len, "Content-Range", &value_len);
+    if (range) {
+        long last = -1;
+        char total[32] = "";
+        if (sscanf(range, "bytes %ld-%ld/%31[0-9*]", &offset, &last, total) != 3 || offset < 0 ||
+            last < offset || last - offset + 1 != content_length ||
+            (total[0] != '*' && atol(total) <= last)) {
+            send_error_response(clientSocket, 400, "Bad Content-Range");
+            return -1;
+        }
+        append = 0;
+    } else if (!append) {
+        send_error_response(clientSocket, 400, "Expected Content-Range");
+        return -1;
+    }
+    if (content_length < 0 || content_length > MAX_PUT_SIZE || offset > MAX_PUT_SIZE - content_length) {
+        response_send_status(clientSocket, 413);
+        return -1;
+    }
+    if (buffered > content_length) buffered = content_length;
+
+    // Appends create the file unless the client expects it to exist
+    int if_match_len = 0;
+    const char* if_match = raw_header(raw_request, header_len, "If-Match", &if_match_len);
+    int flags = O_RDWR | O_CLOEXEC | (append && !if_match ? O_CREAT : 0);
+    int fd = open(filepath, flags, 0644);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            response_send_status(clientSocket, if_match ? 412 : 404);
+        } else {
+            printf("%s Cannot open %s: %s\n", tag, filepath, strerror(errno));
+            response_send_status(clientSocket, 500);
+        }
+        return -1;
+    }
 
-    // Remove /find/ prefix if present
-    const char* relative_path = request->path;
-    if (strncmp(request->path, "/find/", 6) == 0) {
-        relative_path = request->path + 6;
+    struct stat st;
+    int status = 0;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        status = 409;
+    } else if (chunk_manifest_marked(fd)) {
+        // A deduplicated file's bytes live in the chunk store; only a whole PUT replaces it
+        status = 409;
+    } else if (if_match || append ? lock_range(fd, append && !if_match ? st.st_size : 0, 0) < 0
+                                  : lock_range(fd, offset, content_length) < 0) {
+        printf("%s Failed to lock %s: %s\n", tag, filepath, strerror(errno));
+        status = 500;
+    } else if (fstat(fd, &st) < 0) {
+        status = 500;
+    } else if (if_match && !etag_matches(if_match, if_match_len, &st)) {
+        status = 412;
+    } else if (append) {
+        // Under the lock no other append can move the end of the file
+        offset = st.st_size;
+        if (offset > MAX_PUT_SIZE - content_length) status = 413;
+    }
+    if (status) {
+        close(fd);
+        response_send_status(clientSocket, status);
+        return -1;
     }
 
-    // Construct local file path
-    snprintf(filepath, sizeof(filepath), "./find/%s", relative_path);
+    const char* expect = raw_header(raw_request, header_len, "Expect", &value_len);
+    struct range_sink sink = { fd, offset, 0 };
+    long received = 0;
+    int result = receive_body(clientSocket, tag, expect, body, buffered, content_length,
+                              range_body_write, &sink, &received);
+    if (result == 0 && durable_sync(fd) < 0) result = -2;
+
+    // Whatever reached the file is visible to readers now, so the cache
+    // learns about a partial write too
+    if (sink.written > 0) {
+        touch_unique(fd, &st);
+        struct stat after;
+        if (fstat(fd, &after) == 0) {
+            file_cache_update_range(filepath, fd, offset, sink.written, &after);
+            st = after;
+        } else {
+            file_cache_invalidate(filepath);
+        }
+        find_index_update(filepath);
+    }
+    close(fd);
+    if (result == -1) return -1;
+    if (result < 0) {
+        printf("%s Failed to write %s: %s\n", tag, filepath, strerror(errno));
+        response_send_status(clientSocket, 500);
+        return -1;
+    }
+
+    char etag[48];
+    file_cache_etag(&st, etag, sizeof(etag));
+    struct response response;
+    response_start(&response, clientSocket, 204);
+    response_header(&response, "ETag", "%s", etag);
+    response_send(&response);
+    printf("%s Wrote %ld bytes at %ld to %s\n", tag, received, offset, filepath);
+    return 0;
+}
 
-    // Open file for writing (create if it doesn't exist)
-    int fd = open(filepath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if(fd < 0){
-        perror("[PUT] Failed to open file");
-        char resp[] = "HTTP/1.1 500 Internal Server Error\r\nContent-Length:0\r\n\r\n";
-        send(clientSocket, resp, strlen(resp), 0);
+int handle_put(int clientSocket, struct ParsedRequest* request, char* raw_request, int raw_len) {
+    char filepath[1024];
+    if (find_path(request->path, filepath, sizeof(filepath)) < 0) {
+        send_error_response(clientSocket, 400, "Invalid path");
         return -1;
     }
 
     // Calculate body start (skip HTTP headers)
     char* body = strstr(raw_request, "\r\n\r\n");
     if(!body){
-        close(fd);
-        char resp[] = "HTTP/1.1 400 Bad Request\r\nContent-Length:0\r\n\r\n";
-        send(clientSocket, resp, strlen(resp), 0);
+        response_send_status(clientSocket, 400);
         return -1;
     }
     body += 4; // skip "\r\n\r\n"
+    int header_len = body - raw_request;
+    long buffered = raw_len - header_len;
 
-    // Write body to file
-    write(fd, body, strlen(body));
-    close(fd);
+    // A Content-Range PUT updates part of the file in place
+    int value_len = 0;
+    if (raw_header(raw_request, header_len, "Content-Range", &value_len)) {
+        return write_range(clientSocket, "[PUT]", filepath, raw_request, header_len, body, buffered, 0);
+    }
+
+    // Stream Content-Length bytes; without one the body is what already arrived
+    const char* value = raw_header(raw_request, header_len, "Content-Length", &value_len);
+    long content_length = value ? atol(value) : buffered;
+    if (content_length < 0 || content_length > MAX_PUT_SIZE) {
+        response_send_status(clientSocket, 413);
+        return -1;
+    }
+    if (buffered > content_length) buffered = content_length;
+
+    struct upload_sink sink;
+    if (sink_open(&sink, filepath, content_length) < 0) {
+        perror("[PUT] Failed to create file");
+        response_send_status(clientSocket, 500);
+        return -1;
+    }
+
+    const char* expect = raw_header(raw_request, header_len, "Expect", &value_len);
+    long received = 0;
+    int result = receive_body(clientSocket, "[PUT]", expect, body, buffered, content_length,
+                              sink_body_write, &sink, &received);
+    if (result == -1) {
+        sink_abort(&sink);
+        return -1;
+    }
+    int failed = result < 0;
+
+    // Atomic replace: readers see the old file or the whole new one
+    if (failed) sink_abort(&sink);
+    if (failed || sink_commit(&sink, filepath) < 0) {
+        perror("[PUT] Failed to write file");
+        response_send_status(clientSocket, 500);
+        return -1;
+    }
+    // Readers must not be served the old descriptor or contents from here on
+    file_cache_invalidate(filepath);
+    find_index_update(filepath);
 
     // Send success response
-    char resp[] = "HTTP/1.1 201 Created\r\nContent-Length:0\r\n\r\n";
-    send(clientSocket, resp, strlen(resp), 0);
+    response_send_status(clientSocket, 201);
 
-    printf("[PUT] File saved: %s\n", filepath);
+    printf("[PUT] File saved: %s (%ld bytes)\n", filepath, received);
     return 0;
 }
 
+// PATCH /find/path: append the body, or write it at a Content-Range offset
+int handle_patch(int clientSocket, struct ParsedRequest* request, char* raw_request, int raw_len) {
+    char filepath[1024];
+    if (find_path(request->path, filepath, sizeof(filepath)) < 0) {
+        send_error_response(clientSocket, 400, "Invalid path");
+        return -1;
+    }
+
+    char* body = strstr(raw_request, "\r\n\r\n");
+    if (!body) {
+        response_send_status(clientSocket, 400);
+        return -1;
+    }
+    body += 4;
+    int header_len = body - raw_request;
+    return write_range(clientSocket, "[PATCH]", filepath, raw_request, header_len, body, raw_len - header_len, 1);
+}
+
 
 int handle_find(int clientSocket, struct ParsedRequest* request, char* raw_request) {
     char filepath[512];
-    struct stat st;
 
-    // Remove /find/ prefix for local file path
-    const char* relative_path = request->path;
-    if (strncmp(request->path, "/find/", 6) == 0) {
-        relative_path = request->path + 6;
+    // Cached descriptor or contents; only a cold lookup touches the filesystem
+    file_entry* file = find_path(request->path, filepath, sizeof(filepath)) == 0 ? file_cache_open(filepath) : NULL;
+    struct response response;
+    if (!file) {
+        const char* not_found = "File not found.\n";
+        response_start(&response, clientSocket, 404);
+        response_header(&response, "Content-Type", "text/plain");
+        response_body(&response, not_found, strlen(not_found));
+        response_send(&response);
+        return -1;
     }
 
-    // Construct local file path
-    snprintf(filepath, sizeof(filepath), "./find/%s", relative_path);
+    // Send HTTP header and file content together
+    response_start(&response, clientSocket, 200);
+    response_header(&response, "Content-Type", "text/plain");
+    if (file->etag[0]) response_header(&response, "ETag", "%s", file->etag);
+    trace_begin(TRACE_CLIENT_SEND);
+    egress_begin(clientSocket);
+    long sent = response_send_file(&response, file);
+    egress_end();
+    trace_end(TRACE_CLIENT_SEND);
+    file_cache_release(file);
+
+    return sent < 0 ? -1 : 0;
+}
 
-    // Check if file exists
-    if (stat(filepath, &st) != 0) {
-        const char* not_found = "HTTP/1.1 404 Not Found\r\n"
-                                "Content-Type: text/plain\r\n"
-                                "Connection: close\r\n\r\n"
-                                "File not found.\n";
-        send(clientSocket, not_found, strlen(not_found), 0);
+// Decode %XX and '+' in a query string value
+static void url_decode(const char* in, size_t in_len, char* out, size_t out_len){
+    size_t n = 0;
+    for(size_t i = 0; i < in_len && n + 1 < out_len; i++) {
+        if(in[i] == '%' && i + 2 < in_len && isxdigit((unsigned char)in[i + 1]) && isxdigit((unsigned char)in[i + 2])) {
+            char hex[3] = { in[i + 1], in[i + 2], '\0' };
+            out[n++] = (char)strtol(hex, NULL, 16);
+            i += 2;
+        } else {
+            out[n++] = in[i] == '+' ? ' ' : in[i];
+        }
+    }
+    out[n] = '\0';
+}
+
+// Search the ./find/ index: FIND /find/[dir/]?prefix=|q=|glob=|content=...
+// with optional offset= and limit= for paging
+int handle_search(int clientSocket, struct ParsedRequest* request) {
+    const char* query = strchr(request->path, '?');
+    if (!query) {
+        send_error_response(clientSocket, 400, "Missing search query");
         return -1;
     }
 
-    // Send HTTP header
-    const char* header = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nConnection: close\r\n\r\n";
-    send(clientSocket, header, strlen(header), 0);
+    // Anything between /find/ and '?' limits the search to that directory
+    char scope[512] = "";
+    const char* dir = request->path;
+    if (strncmp(dir, "/find/", 6) == 0) dir += 6;
+    else if (*dir == '/') dir++;
+    if (query > dir) url_decode(dir, query - dir, scope, sizeof(scope));
+
+    enum find_mode mode = FIND_SUBSTRING;
+    char pattern[512] = "";
+    int have_pattern = 0, offset = 0, limit = 100;
+    for (const char* p = query + 1; *p; ) {
+        const char* end = strchr(p, '&');
+        if (!end) end = p + strlen(p);
+        const char* eq = memchr(p, '=', end - p);
+        if (eq) {
+            size_t key_len = eq - p;
+            char value[512];
+            url_decode(eq + 1, end - eq - 1, value, sizeof(value));
+            int is_pattern = 1;
+            if (key_len == 6 && strncmp(p, "prefix", 6) == 0) mode = FIND_PREFIX;
+            else if (key_len == 1 && *p == 'q') mode = FIND_SUBSTRING;
+            else if (key_len == 4 && strncmp(p, "glob", 4) == 0) mode = FIND_GLOB;
+            else if (key_len == 7 && strncmp(p, "content", 7) == 0) mode = FIND_CONTENT;
+            else {
+                is_pattern = 0;
+                if (key_len == 6 && strncmp(p, "offset", 6) == 0) offset = atoi(value);
+                else if (key_len == 5 && strncmp(p, "limit", 5) == 0) limit = atoi(value);
+            }
+            if (is_pattern) {
+                snprintf(pattern, sizeof(pattern), "%s", value);
+                have_pattern = 1;
+            }
+        }
+        p = *end ? end + 1 : end;
+    }
+    if (!have_pattern) {
+        send_error_response(clientSocket, 400, "Expected prefix=, q=, glob= or content=");
+        return -1;
+    }
 
-    // Send file content
-    FILE* f = fopen(filepath, "rb");
-    if (!f) return -1;
+    char* json = NULL;
+    size_t json_len = 0;
+    FILE* mem = open_memstream(&json, &json_len);
+    if (!mem) {
+        send_error_response(clientSocket, 500, "Search failed");
+        return -1;
+    }
+    int total = find_index_search(mode, pattern, scope, offset, limit, mem);
+    fclose(mem);
+
+    struct response response;
+    response_start(&response, clientSocket, 200);
+    response_header(&response, "Content-Type", "application/json");
+    response_body(&response, json, json_len);
+    response_send(&response);
+    free(json);
+    printf("[FIND] Search for \"%s\" matched %d files\n", pattern, total);
+    return total < 0 ? -1 : 0;
+}
 
-    char buffer[1024];
-    size_t n;
-    while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
-        send(clientSocket, buffer, n, 0);
+static void json_string(FILE* out, const char* s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') fprintf(out, "\\%c", c);
+        else if (c < 0x20) fprintf(out, "\\u%04x", c);
+        else fputc(c, out);
     }
-    fclose(f);
+    fputc('"', out);
+}
 
+// One multipart upload while its body streams in
+struct upload_state {
+    struct multipart_parser parser;
+    struct upload_sink sink;
+    int saving;                  // sink holds the current part's file
+    int parts;
+    int status;                  // Set by a callback that stopped the parse
+    char path[512];
+    char name[128];
+    char filename[256];
+    long size;
+    long total;
+    FILE* report;                // JSON entry per part
+};
+
+static int upload_part_begin(void* ctx, const struct multipart_part* part) {
+    struct upload_state* up = ctx;
+    if (up->parts == MAX_UPLOAD_PARTS) {
+        up->status = 413;
+        return -1;
+    }
+    snprintf(up->name, sizeof(up->name), "%s", part->name);
+    up->filename[0] = '\0';
+    up->size = 0;
+    if (!part->filename[0]) return 0;   // A plain form field is counted, not saved
+
+    // Only the last component of what the browser sent names the file
+    const char* base = part->filename;
+    for (const char* c = part->filename; *c; c++) {
+        if (*c == '/' || *c == '\\') base = c + 1;
+    }
+    if (!*base || strcmp(base, ".") == 0 || strcmp(base, "..") == 0) {
+        up->status = 400;
+        return -1;
+    }
+    snprintf(up->filename, sizeof(up->filename), "%s", base);
+    snprintf(up->path, sizeof(up->path), "%s/%s", UPLOAD_DIR, base);
+    if (sink_open(&up->sink, up->path, 0) < 0) {
+        perror("[UPLOAD] Failed to create file");
+        up->status = 500;
+        return -1;
+    }
+    up->saving = 1;
     return 0;
 }
 
-// File upload handler
-int handle_file_upload(int clientSocket, struct ParsedRequest* request, char* body, int body_len) {
-    if (!request || !request->path || !body) {
+static int upload_part_data(void* ctx, const char* data, size_t len) {
+    struct upload_state* up = ctx;
+    up->size += len;
+    if (up->saving && sink_write(&up->sink, data, len) < 0) {
+        up->status = 500;
+        return -1;
+    }
+    return 0;
+}
+
+static int upload_part_end(void* ctx) {
+    struct upload_state* up = ctx;
+    if (up->saving) {
+        up->saving = 0;
+        if (sink_commit(&up->sink, up->path) < 0) {
+            perror("[UPLOAD] Failed to save file");
+            up->status = 500;
+            return -1;
+        }
+        printf("[UPLOAD] Saved %s (%ld bytes)\n", up->path, up->size);
+    }
+    fprintf(up->report, "%s\n  {\"name\": ", up->parts ? "," : "");
+    json_string(up->report, up->name);
+    if (up->filename[0]) {
+        fprintf(up->report, ", \"filename\": ");
+        json_string(up->report, up->filename);
+        fprintf(up->report, ", \"path\": ");
+        json_string(up->report, up->path);
+    }
+    fprintf(up->report, ", \"size\": %ld}", up->size);
+    up->parts++;
+    up->total += up->size;
+    return 0;
+}
+
+static int upload_body_write(void* ctx, const char* data, size_t len) {
+    struct upload_state* up = ctx;
+    return multipart_feed(&up->parser, data, len);
+}
+
+// POST /upload with a multipart/form-data body saves every file part to
+// UPLOAD_DIR as it streams in; POST /upload/NAME saves a raw body as NAME.
+// Answers with the size of each part.
+int handle_file_upload(int clientSocket, struct ParsedRequest* request, char* raw_request, int raw_len) {
+    if (!request || !request->path) {
         send_error_response(clientSocket, 400, "Invalid upload request");
         return -1;
     }
@@ -382,44 +1571,128 @@ int handle_file_upload(int clientSocket, struct ParsedRequest* request, char* bo
     // Ensure upload directory exists
     mkdir(UPLOAD_DIR, 0755);
 
-    // Parse filename from path
-    char* filename = strrchr(request->path, '/');
-    if (!filename) filename = request->path;
-    else filename++; // Skip '/'
-
-    if (strlen(filename) == 0) {
-        send_error_response(clientSocket, 400, "No filename specified");
+    char* body = strstr(raw_request, "\r\n\r\n");
+    if (!body) {
+        send_error_response(clientSocket, 400, "Invalid upload request");
         return -1;
     }
-
-    // Save file
-    char filepath[512];
-    snprintf(filepath, sizeof(filepath), "%s/%s", UPLOAD_DIR, filename);
-    FILE* fp = fopen(filepath, "wb");
-    if (!fp) {
-        send_error_response(clientSocket, 500, "Failed to save file");
+    body += 4;
+    int header_len = body - raw_request;
+    long buffered = raw_len - header_len;
+
+    int value_len = 0;
+    const char* value = raw_header(raw_request, header_len, "Content-Length", &value_len);
+    if (!value) {
+        response_send_status(clientSocket, 411);
         return -1;
     }
+    long content_length = atol(value);
+    if (content_length < 0 || content_length > MAX_PUT_SIZE) {
+        response_send_status(clientSocket, 413);
+        return -1;
+    }
+    if (buffered > content_length) buffered = content_length;
+    const char* expect = raw_header(raw_request, header_len, "Expect", &value_len);
+
+    char boundary[MULTIPART_BOUNDARY_MAX + 1];
+    const char* type = raw_header(raw_request, header_len, "Content-Type", &value_len);
+    if (!type || multipart_boundary(type, value_len, boundary, sizeof(boundary)) < 0) {
+        // Not a form: the body is the file, named by the path
+        const char* filename = strncmp(request->path, "/upload/", 8) == 0 ? request->path + 8 : "";
+        if (!*filename || strchr(filename, '/') || strcmp(filename, ".") == 0 || strcmp(filename, "..") == 0) {
+            send_error_response(clientSocket, 400, "No filename specified");
+            return -1;
+        }
+        char filepath[512];
+        snprintf(filepath, sizeof(filepath), "%s/%s", UPLOAD_DIR, filename);
+        struct upload_sink sink;
+        if (sink_open(&sink, filepath, content_length) < 0) {
+            send_error_response(clientSocket, 500, "Failed to save file");
+            return -1;
+        }
+        long received = 0;
+        int result = receive_body(clientSocket, "[UPLOAD]", expect, body, buffered, content_length,
+                                  sink_body_write, &sink, &received);
+        if (result == -1) {
+            sink_abort(&sink);
+            return -1;
+        }
+        if (result < 0) sink_abort(&sink);
+        if (result < 0 || sink_commit(&sink, filepath) < 0) {
+            send_error_response(clientSocket, 500, "Failed to save file");
+            return -1;
+        }
+        // Escaping can grow the name sixfold, so the reply is not bounded
+        char* json = NULL;
+        size_t json_len = 0;
+        FILE* out = open_memstream(&json, &json_len);
+        if (out) {
+            fprintf(out, "{\"parts\": [\n  {\"name\": \"\", \"filename\": ");
+            json_string(out, filename);
+            fprintf(out, ", \"path\": ");
+            json_string(out, filepath);
+            fprintf(out, ", \"size\": %ld}\n], \"bytes\": %ld}\n", received, received);
+            fclose(out);
+        }
+        struct response response;
+        response_start(&response, clientSocket, 200);
+        response_header(&response, "Content-Type", "application/json");
+        response_body(&response, json, out ? json_len : 0);
+        response_send(&response);
+        free(json);
+        printf("[UPLOAD] File saved as %s\n", filepath);
+        return 1;
+    }
 
-    int write_size = body_len;
-    if (write_size > MAX_FILE_SIZE) write_size = MAX_FILE_SIZE;
-    fwrite(body, 1, write_size, fp);
-    fclose(fp);
-
-    // Respond to client
-    char response[512];
-    int len = snprintf(response, sizeof(response),
-        "HTTP/1.1 200 OK\r\n"
-        "Content-Type: text/html\r\n"
-        "Content-Length: %ld\r\n"
-        "Connection: close\r\n"
-        "\r\n"
-        "<html><body><h1>File uploaded successfully: %s</h1></body></html>",
-        strlen(filename) + 44, filename);
-
-    send(clientSocket, response, len, 0);
-    printf("[UPLOAD] File saved as %s\n", filepath);
+    static const struct multipart_callbacks callbacks = {
+        upload_part_begin, upload_part_data, upload_part_end
+    };
+    struct upload_state* up = calloc(1, sizeof(*up));
+    char* json = NULL;
+    size_t json_len = 0;
+    if (up) up->report = open_memstream(&json, &json_len);
+    if (!up || !up->report) {
+        free(up);
+        send_error_response(clientSocket, 500, "Upload failed");
+        return -1;
+    }
+    multipart_init(&up->parser, boundary, &callbacks, up);
+
+    long received = 0;
+    int result = receive_body(clientSocket, "[UPLOAD]", expect, body, buffered, content_length,
+                              upload_body_write, up, &received);
+    if (result == 0 && !multipart_done(&up->parser)) result = -2;
+    if (result < 0 && up->saving) sink_abort(&up->sink);
+    fclose(up->report);
+    int status = up->status, parts = up->parts;
+    long total = up->total;
+    free(up);
+
+    if (result == -1) {
+        free(json);
+        return -1;
+    }
+    if (result < 0) {
+        free(json);
+        if (status == 413) send_error_response(clientSocket, 413, "Too many parts");
+        else if (status == 500) send_error_response(clientSocket, 500, "Failed to save file");
+        else send_error_response(clientSocket, 400, "Malformed multipart body");
+        // Parts after the failure were never read
+        return -1;
+    }
 
+    char tail[64];
+    int tail_len = snprintf(tail, sizeof(tail), "\n], \"bytes\": %ld}\n", total);
+    const char* head = "{\"parts\": [";
+    struct response response;
+    response_start(&response, clientSocket, 200);
+    response_header(&response, "Content-Type", "application/json");
+    response_body(&response, head, strlen(head));
+    response_body(&response, json, json_len);
+    response_body(&response, tail, tail_len);
+    response_send(&response);
+    free(json);
+    printf("[UPLOAD] Received %d part(s), %ld bytes\n", parts, total);
     return 1;
 }
 
@@ -437,24 +1710,27 @@ int handle_file_download(int clientSocket, struct ParsedRequest* request) {
     // Check if it's a local file request
     if (strncmp(request->path, "/files/", 7) == 0) {
         char* filename = request->path + 7; // skip "/files/"
-        char* file_data;
-        int file_size;
+        if (!*filename || strpbrk(filename, "/\\\"") || strcmp(filename, ".") == 0 || strcmp(filename, "..") == 0) {
+            send_error_response(clientSocket, 404, "File not found");
+            return -1;
+        }
 
-        if (read_file(filename, &file_data, &file_size) == 0) {
+        // Files saved by handle_file_upload; opened through the file cache
+        // so deduplicated files are reassembled
+        char filepath[512];
+        snprintf(filepath, sizeof(filepath), "%s/%s", UPLOAD_DIR, filename);
+        file_entry* file = file_cache_open(filepath);
+        if (file) {
             // Send file with headers
-            char headers[1024];
-            int header_len = snprintf(headers, sizeof(headers),
-                "HTTP/1.1 200 OK\r\n"
-                "Content-Type: application/octet-stream\r\n"
-                "Content-Disposition: attachment; filename=\"%s\"\r\n"
-                "Content-Length: %d\r\n"
-                "Connection: close\r\n"
-                "\r\n", filename, file_size);
-
-            send(clientSocket, headers, header_len, 0);
-            send(clientSocket, file_data, file_size, 0);
-            free(file_data);
-            return 1;
+            struct response response;
+            response_start(&response, clientSocket, 200);
+            response_header(&response, "Content-Type", "application/octet-stream");
+            response_header(&response, "Content-Disposition", "attachment; filename=\"%s\"", filename);
+            egress_begin(clientSocket);
+            long sent = response_send_file(&response, file);
+            egress_end();
+            file_cache_release(file);
+            return sent < 0 ? -1 : 1;
         } else {
             send_error_response(clientSocket, 404, "File not found");
             return -1;
@@ -466,4 +1742,100 @@ int handle_file_download(int clientSocket, struct ParsedRequest* request) {
     return handle_get(clientSocket, request, dummy_request);
 }
 
+// Admin endpoints, only answered for loopback clients
+int handle_admin(int clientSocket, struct ParsedRequest* request) {
+    struct sockaddr_in peer;
+    socklen_t peer_len = sizeof(peer);
+    if (getpeername(clientSocket, (struct sockaddr*)&peer, &peer_len) != 0 ||
+        peer.sin_family != AF_INET ||
+        (ntohl(peer.sin_addr.s_addr) >> 24) != 127) {
+        send_error_response(clientSocket, 404, "Not found");
+        return -1;
+    }
+
+    if (strcmp(request->path, "/_admin/trace") == 0) {
+        char* json = NULL;
+        size_t json_len = 0;
+        FILE* mem = open_memstream(&json, &json_len);
+        if (!mem) {
+            send_error_response(clientSocket, 500, "Failed to export traces");
+            return -1;
+        }
+        int count = trace_write_json(mem);
+        fclose(mem);
+
+        struct response response;
+        response_start(&response, clientSocket, 200);
+        response_header(&response, "Content-Type", "application/json");
+        response_body(&response, json, json_len);
+        response_send(&response);
+        free(json);
+        printf("[ADMIN] Exported %d request traces\n", count);
+        return 1;
+    }
+
+    if (strcmp(request->path, "/_admin/backends") == 0) {
+        char body[16384];
+        int body_len = backend_stats(body, sizeof(body));
+        if (body_len < 0) {
+            send_error_response(clientSocket, 500, "Failed to export backend stats");
+            return -1;
+        }
+        struct response response;
+        response_start(&response, clientSocket, 200);
+        response_header(&response, "Content-Type", "application/json");
+        response_body(&response, body, body_len);
+        response_send(&response);
+        return 1;
+    }
+
+    if (strcmp(request->path, "/_admin/egress") == 0) {
+        char body[65536];
+        int body_len = egress_stats(body, sizeof(body));
+        if (body_len < 0) {
+            send_error_response(clientSocket, 500, "Failed to export egress stats");
+            return -1;
+        }
+        struct response response;
+        response_start(&response, clientSocket, 200);
+        response_header(&response, "Content-Type", "application/json");
+        response_body(&response, body, body_len);
+        response_send(&response);
+        return 1;
+    }
+
+    if (strcmp(request->path, "/_admin/lanes") == 0) {
+        char body[1024];
+        int body_len = admission_lane_stats(body, sizeof(body));
+        if (body_len < 0) {
+            send_error_response(clientSocket, 500, "Failed to export lane stats");
+            return -1;
+        }
+        struct response response;
+        response_start(&response, clientSocket, 200);
+        response_header(&response, "Content-Type", "application/json");
+        response_body(&response, body, body_len);
+        response_send(&response);
+        return 1;
+    }
 
+    if (strcmp(request->path, "/_admin/chunk-gc") == 0) {
+        const char* roots[] = { "./find", UPLOAD_DIR };
+        int removed = chunk_store_gc(roots, 2);
+        if (removed < 0) {
+            send_error_response(clientSocket, 500, "Could not read every manifest; nothing collected");
+            return -1;
+        }
+        char body[64];
+        int body_len = snprintf(body, sizeof(body), "{\"removed\": %d}\n", removed);
+        struct response response;
+        response_start(&response, clientSocket, 200);
+        response_header(&response, "Content-Type", "application/json");
+        response_body(&response, body, body_len);
+        response_send(&response);
+        return 1;
+    }
+
+    send_error_response(clientSocket, 404, "Unknown admin endpoint");
+    return -1;
+}
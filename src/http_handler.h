@@ -3,13 +3,26 @@
 
 #include "proxy_parse.h"   // Ensure this defines struct ParsedRequest
 
+// Returned by a handler whose response was fully framed and kept the
+// connection open, so it can carry the client's next request
+#define HANDLER_KEEP_ALIVE 2
+
 // HTTP request handlers
 int handle_get(int clientSocket, struct ParsedRequest* request, char* raw_request);
 int handle_post(int clientSocket, struct ParsedRequest* request, char* raw_request);
-int handle_file_upload(int clientSocket, struct ParsedRequest* request, char* body, int body_len);
+int handle_file_upload(int clientSocket, struct ParsedRequest* request, char* raw_request, int raw_len);
 int handle_file_download(int clientSocket, struct ParsedRequest* request);
 int handle_find(int clientSocket, struct ParsedRequest* request, char* raw_request);
-int handle_put(int clientSocket, struct ParsedRequest* request, char* raw_request);
+int handle_put(int clientSocket, struct ParsedRequest* request, char* raw_request, int raw_len);
+int handle_patch(int clientSocket, struct ParsedRequest* request, char* raw_request, int raw_len);
+int handle_search(int clientSocket, struct ParsedRequest* request);
+int handle_admin(int clientSocket, struct ParsedRequest* request);
+
+// 1 if a GET for request would be answered from this node's cache
+int http_is_cached(struct ParsedRequest* request);
+
+// Fetch host:port/path into the cache without a client (prefetch_fetcher)
+long http_prefetch(const char* host, int port, const char* path, long max_bytes);
 
 
 #endif
\ No newline at end of file
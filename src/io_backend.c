@@ -0,0 +1,519 @@
+#include "io_backend.h"
+#include "egress.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define RING_ENTRIES 32
+#define IO_CHUNK (16 * 1024)      // Size of each registered buffer
+#define IO_CHUNKS 4               // Registered buffers per ring
+#define FIXED_FILES 4             // Direct descriptor slots per ring
+#define FILE_SLOT_READ 0
+
+struct uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned sqe_tail;            // Local tail, published on submit
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    char* buffers;                // IO_CHUNKS * IO_CHUNK bytes
+    int buffers_registered;
+    int files_registered;
+    int accept_armed;             // Multishot accept outstanding
+};
+
+static int uring_enabled = 0;
+static int multishot_accept = 0;
+static __thread struct uring* thread_ring = NULL;
+static __thread int thread_ring_failed = 0;
+
+// ---------------------------------------------------------------------------
+// Raw ring management
+// ---------------------------------------------------------------------------
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params* p){
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags){
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, const void* arg, unsigned nr_args){
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static struct uring* uring_create(){
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = sys_io_uring_setup(RING_ENTRIES, &p);
+    if(fd < 0) return NULL;
+    if(!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(fd);
+        return NULL;
+    }
+
+    struct uring* r = calloc(1, sizeof(*r));
+    if(!r) {
+        close(fd);
+        return NULL;
+    }
+
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ring_len = sq_len > cq_len ? sq_len : cq_len;
+    char* ring = mmap(NULL, ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if(ring == MAP_FAILED) {
+        close(fd);
+        free(r);
+        return NULL;
+    }
+    void* sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(sqes == MAP_FAILED) {
+        munmap(ring, ring_len);
+        close(fd);
+        free(r);
+        return NULL;
+    }
+
+    r->fd = fd;
+    r->sq_entries = p.sq_entries;
+    r->sq_head = (unsigned*)(ring + p.sq_off.head);
+    r->sq_tail = (unsigned*)(ring + p.sq_off.tail);
+    r->sq_mask = (unsigned*)(ring + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(ring + p.sq_off.array);
+    r->sqe_tail = *r->sq_tail;
+    r->cq_head = (unsigned*)(ring + p.cq_off.head);
+    r->cq_tail = (unsigned*)(ring + p.cq_off.tail);
+    r->cq_mask = (unsigned*)(ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(ring + p.cq_off.cqes);
+    r->sqes = sqes;
+
+    // Registered buffers and a sparse fixed-file table are optimisations;
+    // the ring still works without them (e.g. under a low RLIMIT_MEMLOCK)
+    r->buffers = aligned_alloc(4096, IO_CHUNKS * IO_CHUNK);
+    if(r->buffers) {
+        struct iovec iov[IO_CHUNKS];
+        for(int i = 0; i < IO_CHUNKS; i++) {
+            iov[i].iov_base = r->buffers + i * IO_CHUNK;
+            iov[i].iov_len = IO_CHUNK;
+        }
+        r->buffers_registered = sys_io_uring_register(fd, IORING_REGISTER_BUFFERS, iov, IO_CHUNKS) == 0;
+    }
+    int files[FIXED_FILES];
+    for(int i = 0; i < FIXED_FILES; i++) files[i] = -1;
+    r->files_registered = sys_io_uring_register(fd, IORING_REGISTER_FILES, files, FIXED_FILES) == 0;
+
+    return r;
+}
+
+static struct uring* get_ring(){
+    if(!uring_enabled || thread_ring_failed) return NULL;
+    if(!thread_ring) {
+        thread_ring = uring_create();
+        if(!thread_ring || !thread_ring->buffers) {
+            printf("[IO] io_uring ring setup failed on this thread, using syscalls\n");
+            thread_ring_failed = 1;
+            return NULL;
+        }
+    }
+    return thread_ring;
+}
+
+static struct io_uring_sqe* get_sqe(struct uring* r){
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if(r->sqe_tail - head >= r->sq_entries) return NULL;
+    unsigned idx = r->sqe_tail & *r->sq_mask;
+    struct io_uring_sqe* sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    r->sqe_tail++;
+    return sqe;
+}
+
+// Publish queued SQEs and wait for wait_nr completions in one syscall
+static int submit_and_wait(struct uring* r, unsigned wait_nr){
+    unsigned submitted = r->sqe_tail - *r->sq_tail;
+    __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+    int ret;
+    do {
+        ret = sys_io_uring_enter(r->fd, submitted, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+    } while(ret < 0 && errno == EINTR);
+    return ret;
+}
+
+static int peek_cqe(struct uring* r, struct io_uring_cqe* out){
+    unsigned head = *r->cq_head;
+    if(head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) return 0;
+    *out = r->cqes[head & *r->cq_mask];
+    __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static int wait_cqe(struct uring* r, struct io_uring_cqe* out){
+    while(!peek_cqe(r, out)) {
+        int ret = sys_io_uring_enter(r->fd, 0, 1, IORING_ENTER_GETEVENTS);
+        if(ret < 0 && errno != EINTR) return -1;
+    }
+    return 0;
+}
+
+// Collect count completions into results[] indexed by user_data
+static int collect(struct uring* r, int count, int* results, int max){
+    for(int i = 0; i < count; i++) {
+        struct io_uring_cqe cqe;
+        if(wait_cqe(r, &cqe) < 0) return -1;
+        if(cqe.user_data < (unsigned long long)max) results[cqe.user_data] = cqe.res;
+    }
+    return 0;
+}
+
+static void prep_openat(struct io_uring_sqe* sqe, struct uring* r, const char* path, int flags, mode_t mode, int slot){
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long)path;
+    sqe->len = mode;
+    // Direct descriptors are never inherited, and O_CLOEXEC is rejected for them
+    if(r->files_registered) sqe->file_index = slot + 1;
+    sqe->open_flags = r->files_registered ? flags : flags | O_CLOEXEC;
+}
+
+static void prep_close(struct io_uring_sqe* sqe, int slot){
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = slot + 1;
+}
+
+static void prep_rw(struct io_uring_sqe* sqe, int opcode, int fd, int fixed_file, const void* buf, unsigned len, long off){
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    sqe->off = off;
+    if(fixed_file) sqe->flags |= IOSQE_FIXED_FILE;
+}
+
+static void prep_send(struct io_uring_sqe* sqe, int sock, const void* buf, unsigned len){
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = sock;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+}
+
+// ---------------------------------------------------------------------------
+// Backend selection
+// ---------------------------------------------------------------------------
+
+int io_backend_init(enum io_backend_mode mode){
+    uring_enabled = 0;
+    if(mode == IO_BACKEND_POSIX) {
+        printf("[IO] Using syscall I/O backend\n");
+        return 0;
+    }
+
+    struct uring* r = uring_create();
+    if(!r) {
+        printf("[IO] io_uring unavailable (%s), using syscall I/O backend\n", strerror(errno));
+        return 0;
+    }
+
+    // Check the opcodes we rely on are implemented by this kernel
+    struct io_uring_probe* probe = calloc(1, sizeof(*probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op));
+    int supported = 0;
+    if(probe && sys_io_uring_register(r->fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0) {
+        int needed[] = {IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ_FIXED, IORING_OP_CLOSE,
+                        IORING_OP_SEND, IORING_OP_ACCEPT};
+        supported = 1;
+        for(size_t i = 0; i < sizeof(needed) / sizeof(needed[0]); i++) {
+            if(needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED)) {
+                supported = 0;
+            }
+        }
+    }
+    free(probe);
+
+    // Multishot accept (5.19+) is only detectable by trying it; do so on a
+    // throwaway listener so a rejection costs nothing
+    if(supported) {
+        int probe_sock = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if(probe_sock >= 0 && bind(probe_sock, (struct sockaddr*)&addr, sizeof(addr)) == 0 && listen(probe_sock, 1) == 0) {
+            struct io_uring_sqe* sqe = get_sqe(r);
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->fd = probe_sock;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->user_data = 1;
+            submit_and_wait(r, 0);
+            // An unsupported flag fails immediately; a supported one stays pending
+            struct io_uring_cqe cqe;
+            sys_io_uring_enter(r->fd, 0, 0, IORING_ENTER_GETEVENTS);
+            multishot_accept = !peek_cqe(r, &cqe) || cqe.res != -EINVAL;
+        }
+        if(probe_sock >= 0) close(probe_sock);
+    }
+
+    if(!supported) {
+        printf("[IO] io_uring lacks required opcodes, using syscall I/O backend\n");
+    } else {
+        uring_enabled = 1;
+        printf("[IO] Using io_uring backend (registered buffers: %s, fixed files: %s, multishot accept: %s)\n",
+               r->buffers_registered ? "yes" : "no", r->files_registered ? "yes" : "no",
+               multishot_accept ? "yes" : "no");
+    }
+
+    // The probe ring is discarded; closing it cancels the probe accept
+    close(r->fd);
+    free(r->buffers);
+    free(r);
+    return uring_enabled;
+}
+
+int io_backend_uring_active(void){
+    return uring_enabled;
+}
+
+// ---------------------------------------------------------------------------
+// Files
+// ---------------------------------------------------------------------------
+
+int io_file_open(const char* path, struct io_file* file){
+    memset(file, 0, sizeof(*file));
+    file->fd = -1;
+    file->slot = -1;
+    snprintf(file->path, sizeof(file->path), "%s", path);
+
+    struct uring* r = get_ring();
+    if(r && r->files_registered) {
+        // statx and openat submitted together: one syscall for both
+        struct statx stx;
+        int res[2] = {-1, -1};
+        struct io_uring_sqe* sqe = get_sqe(r);
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (unsigned long)file->path;
+        sqe->len = STATX_TYPE | STATX_SIZE;
+        sqe->off = (unsigned long)&stx;
+        sqe->user_data = 0;
+
+        sqe = get_sqe(r);
+        prep_openat(sqe, r, file->path, O_RDONLY, 0, FILE_SLOT_READ);
+        sqe->user_data = 1;
+
+        if(submit_and_wait(r, 2) < 0 || collect(r, 2, res, 2) < 0) return -1;
+        if(res[1] >= 0) file->slot = FILE_SLOT_READ;
+        if(res[0] < 0 || res[1] < 0 || !S_ISREG(stx.stx_mode)) {
+            io_file_close(file);
+            return -1;
+        }
+        file->size = (long)stx.stx_size;
+        return 0;
+    }
+
+    file->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(file->fd < 0) return -1;
+    struct stat st;
+    if(fstat(file->fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        io_file_close(file);
+        return -1;
+    }
+    file->size = st.st_size;
+    return 0;
+}
+
+// Finish a transfer with ordinary syscalls from offset
+static long send_rest(int sock, struct io_file* file, long offset){
+    int fd = file->fd >= 0 ? file->fd : open(file->path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) return offset;
+
+    off_t off = offset;
+    while(off < file->size) {
+        size_t granted = egress_grant(sock, file->size - off);
+        ssize_t n = sendfile(sock, fd, &off, granted);
+        egress_settle(sock, granted, n > 0 ? (size_t)n : 0);
+        if(n <= 0) break;
+    }
+    if(fd != file->fd) close(fd);
+    return off;
+}
+
+static int send_all(int sock, const char* data, int len){
+    int total = 0;
+    while(total < len) {
+        ssize_t n = send(sock, data + total, len - total, MSG_NOSIGNAL);
+        if(n <= 0) return -1;
+        total += n;
+    }
+    return 0;
+}
+
+long io_file_send(int sock, struct io_file* file, const char* prefix, int prefix_len){
+    struct uring* r = get_ring();
+    // A shaped transfer takes the sendfile path, which asks for a grant
+    // before each call; a linked chain would send a whole window at once
+    if(!r || file->slot < 0 || egress_shaped(sock)) {
+        if(prefix_len > 0) {
+            if(send(sock, prefix, prefix_len, MSG_NOSIGNAL | (file->size > 0 ? MSG_MORE : 0)) != prefix_len) return -1;
+        }
+        return send_rest(sock, file, 0);
+    }
+
+    // Each window is one linked chain: [send prefix] -> (read chunk -> send
+    // chunk) x IO_CHUNKS [-> close], submitted and reaped with one syscall
+    long offset = 0;
+    int first = 1;
+    while(first || offset < file->size) {
+        int res[2 * IO_CHUNKS + 2];
+        int lens[2 * IO_CHUNKS + 2];
+        int count = 0, chunks = 0;
+        int has_prefix = first && prefix_len > 0;
+        first = 0;
+
+        if(has_prefix) {
+            struct io_uring_sqe* sqe = get_sqe(r);
+            prep_send(sqe, sock, prefix, prefix_len);
+            sqe->flags |= IOSQE_IO_LINK;
+            sqe->user_data = count;
+            lens[count++] = prefix_len;
+        }
+
+        long window_end = offset;
+        for(; chunks < IO_CHUNKS && window_end < file->size; chunks++) {
+            unsigned n = file->size - window_end > IO_CHUNK ? IO_CHUNK : (unsigned)(file->size - window_end);
+            char* buf = r->buffers + chunks * IO_CHUNK;
+
+            struct io_uring_sqe* sqe = get_sqe(r);
+            prep_rw(sqe, r->buffers_registered ? IORING_OP_READ_FIXED : IORING_OP_READ,
+                    file->slot, 1, buf, n, window_end);
+            sqe->buf_index = chunks;
+            sqe->flags |= IOSQE_IO_LINK;
+            sqe->user_data = count;
+            lens[count++] = n;
+
+            sqe = get_sqe(r);
+            prep_send(sqe, sock, buf, n);
+            sqe->flags |= IOSQE_IO_LINK;
+            sqe->user_data = count;
+            lens[count++] = n;
+
+            window_end += n;
+        }
+
+        int close_index = -1;
+        if(window_end >= file->size) {
+            struct io_uring_sqe* sqe = get_sqe(r);
+            prep_close(sqe, file->slot);
+            sqe->user_data = count;
+            close_index = count;
+            lens[count++] = 0;
+        } else {
+            // Terminate the chain at the last send
+            r->sqes[(r->sqe_tail - 1) & *r->sq_mask].flags &= ~IOSQE_IO_LINK;
+        }
+
+        for(int i = 0; i < count; i++) res[i] = -ECANCELED;
+        if(submit_and_wait(r, count) < 0 || collect(r, count, res, count) < 0) {
+            return -1;
+        }
+        if(close_index >= 0 && res[close_index] >= 0) file->slot = -1;
+
+        // Walk the chain; a short or failed step cancels the rest of the
+        // chain, so the remainder is finished with ordinary syscalls
+        int i = 0;
+        if(has_prefix) {
+            if(res[0] != prefix_len) {
+                if(res[0] < 0 || send_all(sock, prefix + res[0], prefix_len - res[0]) < 0) {
+                    io_file_close(file);
+                    return -1;
+                }
+                io_file_close(file);
+                return send_rest(sock, file, offset);
+            }
+            i = 1;
+        }
+        for(int c = 0; c < chunks; c++, i += 2) {
+            if(res[i] != lens[i] || res[i + 1] != lens[i + 1]) {
+                long sent = offset + (res[i] == lens[i] && res[i + 1] > 0 ? res[i + 1] : 0);
+                io_file_close(file);
+                return send_rest(sock, file, sent);
+            }
+            offset += lens[i];
+        }
+    }
+    return offset;
+}
+
+void io_file_close(struct io_file* file){
+    if(file->fd >= 0) {
+        close(file->fd);
+        file->fd = -1;
+    }
+    if(file->slot >= 0) {
+        struct uring* r = get_ring();
+        if(r) {
+            int res = 0;
+            struct io_uring_sqe* sqe = get_sqe(r);
+            prep_close(sqe, file->slot);
+            sqe->user_data = 0;
+            if(submit_and_wait(r, 1) >= 0) collect(r, 1, &res, 1);
+        }
+        file->slot = -1;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Accept
+// ---------------------------------------------------------------------------
+
+int io_accept(int listen_fd, struct sockaddr_in* addr, socklen_t* addr_len){
+    struct uring* r = multishot_accept ? get_ring() : NULL;
+    if(!r) {
+        return accept(listen_fd, (struct sockaddr*)addr, addr_len);
+    }
+
+    // One multishot accept keeps producing a completion per connection;
+    // completions already queued are reaped without entering the kernel
+    if(!r->accept_armed) {
+        struct io_uring_sqe* sqe = get_sqe(r);
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = listen_fd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        if(submit_and_wait(r, 0) < 0) {
+            return accept(listen_fd, (struct sockaddr*)addr, addr_len);
+        }
+        r->accept_armed = 1;
+    }
+
+    struct io_uring_cqe cqe;
+    if(wait_cqe(r, &cqe) < 0) return -1;
+    if(!(cqe.flags & IORING_CQE_F_MORE)) r->accept_armed = 0;
+    if(cqe.res < 0) {
+        errno = -cqe.res;
+        return -1;
+    }
+
+    // Multishot completions carry no address; ask the socket instead
+    if(getpeername(cqe.res, (struct sockaddr*)addr, addr_len) != 0) {
+        memset(addr, 0, sizeof(*addr));
+    }
+    return cqe.res;
+}
@@ -0,0 +1,36 @@
+#ifndef IO_BACKEND_H
+#define IO_BACKEND_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+// File and socket I/O used by the handlers. When io_uring is available the
+// operations are batched into linked submissions on a per-thread ring;
+// otherwise they fall back to plain syscalls with the same results.
+
+enum io_backend_mode { IO_BACKEND_AUTO, IO_BACKEND_URING, IO_BACKEND_POSIX };
+
+// Probe the kernel; returns 1 if io_uring will be used
+int io_backend_init(enum io_backend_mode mode);
+int io_backend_uring_active(void);
+
+struct io_file {
+    int fd;          // Regular descriptor (posix backend)
+    int slot;        // Fixed file slot (io_uring backend), -1 if unused
+    long size;
+    char path[512];
+};
+
+// Open a regular file for reading and fetch its size (stat + open batched)
+int io_file_open(const char* path, struct io_file* file);
+
+// Send prefix (e.g. HTTP headers) followed by the whole file to sock.
+// Returns bytes of file content sent, or -1.
+long io_file_send(int sock, struct io_file* file, const char* prefix, int prefix_len);
+void io_file_close(struct io_file* file);
+
+// Accept the next connection, using multishot accept where supported
+int io_accept(int listen_fd, struct sockaddr_in* addr, socklen_t* addr_len);
+
+#endif
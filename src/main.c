@@ -1,108 +1,580 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
-#include <semaphore.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
 
 #include "proxy_parse.h"
 #include "cache.h"
 #include "http_handler.h"
+#include "config.h"
+#include "trace.h"
+#include "admission.h"
+#include "ratelimit.h"
+#include "io_backend.h"
+#include "cluster.h"
+#include "file_cache.h"
+#include "find_index.h"
+#include "durable.h"
+#include "chunk_store.h"
+#include "response.h"
+#include "timer_wheel.h"
+#include "prefetch.h"
+#include "warmup.h"
+#include "negative_cache.h"
+#include "upgrade.h"
+#include "backend.h"
+#include "egress.h"
 
-#define MAX_CLIENTS 400
+// Route one parsed request to its handler; returns the handler's result
+static int dispatch_request(int clientSocket, struct ParsedRequest* req, char* buffer, int bytes){
+    int result = 0;
+    if(strncmp(req->path, "/_cluster/", 10) == 0){
+        // Cache traffic from other cluster nodes; keeps the connection open
+        cluster_serve(clientSocket, buffer, bytes);
+    } else if(strcmp(req->method, "GET") == 0){
+        printf("[THREAD] Handling GET request for %s\n", req->path);
 
-sem_t semaphore;
-pthread_t tid[MAX_CLIENTS];
-int thread_count = 0;
-pthread_mutex_t thread_mutex = PTHREAD_MUTEX_INITIALIZER;
+        // Admin endpoints (trace export) are answered locally
+        if(strncmp(req->path, "/_admin/", 8) == 0){
+            result = handle_admin(clientSocket, req);
+        } else if(strncmp(req->path, "/find/", 6) == 0){
+            // If path starts with /find/, use handle_find to serve local files
+            result = handle_find(clientSocket, req, buffer);
+        } else if(strncmp(req->path, "/files/", 7) == 0){
+            result = handle_file_download(clientSocket, req);
+        } else {
+            // Otherwise, use existing GET proxy behavior
+            result = handle_get(clientSocket, req, buffer);
+        }
+    } else if(strcmp(req->method, "HEAD") == 0){
+        printf("[THREAD] Handling HEAD request for %s\n", req->path);
+        result = handle_get(clientSocket, req, buffer);
+    } else if(strcmp(req->method, "POST") == 0){
+        printf("[THREAD] Handling POST request for %s\n", req->path);
+        if(strcmp(req->path, "/upload") == 0 || strncmp(req->path, "/upload/", 8) == 0){
+            result = handle_file_upload(clientSocket, req, buffer, bytes);
+        } else {
+            result = handle_post(clientSocket, req, buffer);
+        }
+    } else if(strcmp(req->method, "FIND") == 0){
+        printf("[THREAD] Handling FIND request for %s\n", req->path);
+        // A query string searches the store; a bare path is an exact lookup
+        if(strchr(req->path, '?')){
+            result = handle_search(clientSocket, req);
+        } else {
+            result = handle_find(clientSocket, req, buffer);
+        }
+    } else if(strcmp(req->method, "PUT") == 0){
+        printf("[THREAD] Handling PUT request for %s\n", req->path);
+        result = handle_put(clientSocket, req, buffer, bytes);  // New function for PUT
+    } else if(strcmp(req->method, "PATCH") == 0){
+        printf("[THREAD] Handling PATCH request for %s\n", req->path);
+        result = handle_patch(clientSocket, req, buffer, bytes);
+    } else {
+        printf("[THREAD] Unsupported method: %s\n", req->method);
+        response_send_status(clientSocket, 405);
+    }
+    return result;
+}
+
+// Lane a request is admitted through; mirrors dispatch_request
+static enum lane classify_request(struct ParsedRequest* req){
+    // Cluster peers hold their connection for many lookups
+    if(strncmp(req->path, "/_cluster/", 10) == 0) return LANE_NONE;
+    if(strcmp(req->method, "PUT") == 0 || strcmp(req->method, "PATCH") == 0) return LANE_LOCAL_WRITE;
+    if(strcmp(req->method, "POST") == 0 &&
+       (strcmp(req->path, "/upload") == 0 || strncmp(req->path, "/upload/", 8) == 0)) {
+        return LANE_LOCAL_WRITE;
+    }
+    if(strcmp(req->method, "FIND") == 0) return LANE_LOCAL_READ;
+    if(strcmp(req->method, "GET") == 0 &&
+       (strncmp(req->path, "/_admin/", 8) == 0 || strncmp(req->path, "/find/", 6) == 0 ||
+        strncmp(req->path, "/files/", 7) == 0)) {
+        return LANE_LOCAL_READ;
+    }
+    if(strcmp(req->method, "GET") == 0 || strcmp(req->method, "HEAD") == 0) {
+        // A hit never waits on the origin, so it must not queue behind misses
+        return http_is_cached(req) ? LANE_LOCAL_READ : LANE_UPSTREAM_CACHEABLE;
+    }
+    return LANE_UPSTREAM_PASSTHROUGH;
+}
 
-void* thread_fn(void* arg){
-    int clientSocket = *(int*)arg;
-    free(arg);  // free memory allocated for client socket
+static char** saved_argv = NULL;         // For re-executing on SIGUSR2
 
-    sem_wait(&semaphore);
+// Draining: the accept loop stops, kept-alive connections close after their
+// current request, and the process exits once the rest have finished
+static volatile sig_atomic_t draining = 0;
+static volatile sig_atomic_t accept_stopped = 0;
+static pthread_t accept_thread;
+static int drain_started = 0;
 
-    char buffer[4096];
-    memset(buffer, 0, sizeof(buffer));
-    
-    int bytes = recv(clientSocket, buffer, sizeof(buffer) - 1, 0);
-    if(bytes <= 0){
-        printf("[THREAD] Client disconnected or error\n");
-        close(clientSocket);
-        sem_post(&semaphore);
-        return NULL;
-    }
+static void wake_accept(int sig){
+    (void)sig;
+}
 
-    buffer[bytes] = '\0'; // Ensure null termination
+static long long monotonic_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
 
-    struct ParsedRequest* req = ParsedRequest_create();
-    if(!req) {
-        printf("[THREAD] Failed to create ParsedRequest\n");
-        close(clientSocket);
-        sem_post(&semaphore);
-        return NULL;
-    }
+static void* drain_fn(void* arg){
+    int replaced = *(int*)arg;
+    free(arg);
+    printf("[MAIN] Draining: not accepting, giving connections up to %ds\n", config.drain_timeout);
+    draining = 1;
 
-    if(ParsedRequest_parse(req, buffer, bytes) < 0){
-        printf("[THREAD] Failed to parse request\n");
-        close(clientSocket);
-        ParsedRequest_destroy(req);
-        sem_post(&semaphore);
-        return NULL;
+    // A signal interrupts the blocking accept; resent in case it lands
+    // just before the call. A multishot accept cannot be interrupted, so
+    // the wait for it is bounded.
+    long long now = monotonic_ms();
+    long long until = now + 1000;
+    while(!accept_stopped && monotonic_ms() < until) {
+        pthread_kill(accept_thread, SIGALRM);
+        usleep(10000);
     }
 
-       if(strcmp(req->method, "GET") == 0){
-    printf("[THREAD] Handling GET request for %s\n", req->path);
+    until = monotonic_ms() + config.drain_timeout * 1000LL;
+    int pending;
+    while((pending = admission_pending()) > 0 && monotonic_ms() < until) usleep(20000);
+    if(pending > 0) printf("[MAIN] Drain timeout, closing %d connection(s)\n", pending);
+    else printf("[MAIN] Drained in %lld ms\n", monotonic_ms() - now);
 
-    // If path starts with /find/, use handle_find to serve local files
-    if(strncmp(req->path, "/find/", 6) == 0){
-        handle_find(clientSocket, req, buffer);
-    } else {
-        // Otherwise, use existing GET proxy behavior
-        handle_get(clientSocket, req, buffer);
+    // A successor owns the warm-up files from here on
+    if(!replaced && config.processes == 1) warmup_shutdown();
+    fflush(stdout);
+    exit(0);
+}
+
+// Start draining once; replaced says a successor took over
+static void start_drain(int replaced){
+    if(__sync_lock_test_and_set(&drain_started, 1)) return;
+    int* arg = malloc(sizeof(int));
+    pthread_t thread;
+    if(!arg) exit(0);
+    *arg = replaced;
+    if(pthread_create(&thread, NULL, drain_fn, arg) != 0) {
+        perror("[MAIN] Failed to start draining");
+        exit(0);
     }
+    pthread_detach(thread);
+}
 
-} else if(strcmp(req->method, "POST") == 0){
-    printf("[THREAD] Handling POST request for %s\n", req->path);
-    handle_post(clientSocket, req, buffer);
-} else if(strcmp(req->method, "FIND") == 0){
-    printf("[THREAD] Handling FIND request for %s\n", req->path);
-    handle_find(clientSocket, req, buffer);
-} else if(strcmp(req->method, "PUT") == 0){
-    printf("[THREAD] Handling PUT request for %s\n", req->path);
-    handle_put(clientSocket, req, buffer);  // New function for PUT
-} else {
-    printf("[THREAD] Unsupported method: %s\n", req->method);
-    char response[] = "HTTP/1.1 405 Method Not Allowed\r\nContent-Length: 0\r\n\r\n";
-    send(clientSocket, response, strlen(response), 0);
+static void retire_single(void){
+    start_drain(1);
 }
 
+static int headers_complete(const char* buffer, int bytes){
+    return memmem(buffer, bytes, "\r\n\r\n", 4) || memmem(buffer, bytes, "\n\n", 2);
+}
 
+// Runs on an admission worker thread for each admitted connection. Handlers
+// that answer with a fully framed response (cache hits) may keep the
+// connection open; it then serves further requests until the client closes
+// it, goes idle for --keepalive-timeout or reaches --keepalive-requests.
+//
+// Reads are bounded by wheel deadlines rather than socket timeouts: the
+// header deadline covers the whole request head, so a client trickling
+// bytes (slowloris) is cut off even though every single recv succeeds.
+static void handle_client(int clientSocket, long long queued_ns){
+    char buffer[4096];
+    int buffered = 0;   // Bytes of the next request already read (pipelining)
+    struct deadline deadline;
+    memset(&deadline, 0, sizeof(deadline));
+    struct sockaddr_in peer;
+    socklen_t peer_len = sizeof(peer);
+    uint32_t peer_ip = getpeername(clientSocket, (struct sockaddr*)&peer, &peer_len) == 0 &&
+                       peer.sin_family == AF_INET ? peer.sin_addr.s_addr : 0;
+
+    for(int served = 0; ; served++) {
+        trace_request_begin();
+        if(served == 0) trace_span_since(TRACE_QUEUE, queued_ns);
+
+        // Between requests only the idle deadline runs; the header deadline
+        // starts with the first byte of the next request
+        int bytes = buffered;
+        deadline_arm(&deadline, clientSocket, served > 0 && bytes == 0 ? DEADLINE_IDLE : DEADLINE_HEADER);
+        trace_begin(TRACE_RECV);
+        while(!headers_complete(buffer, bytes) && bytes < (int)sizeof(buffer) - 1) {
+            int n = recv(clientSocket, buffer + bytes, sizeof(buffer) - 1 - bytes, 0);
+            if(n <= 0) {
+                bytes = -1;
+                break;
+            }
+            if(bytes == 0 && served > 0) deadline_arm(&deadline, clientSocket, DEADLINE_HEADER);
+            bytes += n;
+        }
+        trace_end(TRACE_RECV);
+        deadline_cancel(&deadline);
+        if(bytes < 0){
+            if(served == 0 && !deadline.expired) printf("[THREAD] Client disconnected or error\n");
+            trace_request_end();
+            break;
+        }
+        buffer[bytes] = '\0'; // Ensure null termination
+
+        struct ParsedRequest* req = ParsedRequest_create();
+        if(!req) {
+            printf("[THREAD] Failed to create ParsedRequest\n");
+            trace_request_end();
+            break;
+        }
+
+        trace_begin(TRACE_PARSE);
+        int parsed = ParsedRequest_parse(req, buffer, bytes);
+        trace_end(TRACE_PARSE);
+        if(parsed < 0){
+            printf("[THREAD] Failed to parse request\n");
+            ParsedRequest_destroy(req);
+            trace_request_end();
+            break;
+        }
+        trace_request_label(req->method, req->path);
+
+        // The accept loop charged the connection's first request; each
+        // further request on a kept-alive connection is charged here
+        int retry_after = 0;
+        if(served > 0 && !ratelimit_allow(peer_ip, &retry_after)) {
+            printf("[THREAD] Rate limit exceeded for %s\n", inet_ntoa(peer.sin_addr));
+            struct response response;
+            response_start(&response, clientSocket, 429);
+            response_header(&response, "Retry-After", "%d", retry_after);
+            response_send(&response);
+            ParsedRequest_destroy(req);
+            trace_request_end();
+            break;
+        }
+
+        enum lane lane = classify_request(req);
+        trace_begin(TRACE_LANE);
+        int admitted = lane == LANE_NONE || admission_lane_enter(lane) == 0;
+        trace_end(TRACE_LANE);
+        if(!admitted) {
+            struct response response;
+            response_start(&response, clientSocket, 503);
+            response_header(&response, "Retry-After", "%d", config.retry_after);
+            response_send(&response);
+            ParsedRequest_destroy(req);
+            trace_request_end();
+            break;
+        }
 
+        int result = dispatch_request(clientSocket, req, buffer, bytes);
+        if(lane != LANE_NONE) admission_lane_leave(lane);
+        ParsedRequest_destroy(req);
+        trace_request_end();
+        if(result != HANDLER_KEEP_ALIVE || served + 1 >= config.keepalive_requests || draining) break;
+
+        // Only bodiless requests keep the connection, so anything after the
+        // headers is the start of the next request
+        char* end = memmem(buffer, bytes, "\r\n\r\n", 4);
+        buffered = end ? bytes - (int)(end + 4 - buffer) : 0;
+        if(buffered > 0) memmove(buffer, end + 4, buffered);
+    }
     close(clientSocket);
-    ParsedRequest_destroy(req);
-    sem_post(&semaphore);
+}
+
+// Handles process signals synchronously so handlers can do real work
+static void* signal_thread_fn(void* arg){
+    sigset_t* set = arg;
+    int sig;
+    while(sigwait(set, &sig) == 0){
+        if(sig == SIGTERM || sig == SIGINT){
+            // Prefork workers just exit; the supervisor saves the cache
+            if(config.processes == 1) {
+                printf("[MAIN] Signal %d received, shutting down\n", sig);
+                warmup_shutdown();
+            }
+            exit(0);
+        }
+        if(sig == SIGQUIT){
+            printf("[MAIN] SIGQUIT received, draining\n");
+            start_drain(0);
+        }
+        // Prefork workers leave upgrades to the supervisor
+        if(sig == SIGUSR2 && config.processes == 1){
+            printf("[MAIN] SIGUSR2 received, starting a successor\n");
+            upgrade_spawn(saved_argv);
+        }
+        if(sig == SIGUSR1){
+            printf("[MAIN] SIGUSR1 received, flushing traces\n");
+            // Prefork workers each write their own file
+            char path[300];
+            if(config.processes > 1) {
+                snprintf(path, sizeof(path), "%s.%d", config.trace_file, (int)getpid());
+            } else {
+                snprintf(path, sizeof(path), "%s", config.trace_file);
+            }
+            trace_flush_file(path);
+        }
+    }
     return NULL;
 }
 
-int main(int argc, char** argv){
-    int port = 8080;
-    if(argc == 2) {
-        port = atoi(argv[1]);
-        if(port <= 0 || port > 65535) {
-            printf("[MAIN] Invalid port number. Using default port 8080\n");
-            port = 8080;
+// Per-process setup and accept loop; every prefork worker runs this
+static void serve(int serverSocket){
+    // Block handled signals in every thread; the signal thread waits for them
+    static sigset_t signal_set;
+    sigemptyset(&signal_set);
+    sigaddset(&signal_set, SIGUSR1);
+    sigaddset(&signal_set, SIGTERM);
+    sigaddset(&signal_set, SIGINT);
+    sigaddset(&signal_set, SIGQUIT);
+    sigaddset(&signal_set, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &signal_set, NULL);
+
+    // No SA_RESTART, so SIGALRM sent by a drain breaks the accept loop's wait
+    struct sigaction wake_action;
+    memset(&wake_action, 0, sizeof(wake_action));
+    wake_action.sa_handler = wake_accept;
+    sigaction(SIGALRM, &wake_action, NULL);
+    accept_thread = pthread_self();
+    pthread_t signal_thread;
+    if(pthread_create(&signal_thread, NULL, signal_thread_fn, &signal_set) == 0) {
+        pthread_detach(signal_thread);
+    }
+
+    trace_init(config.trace_sample_rate, config.trace_buffer);
+    if(timer_wheel_init(10) < 0) {
+        exit(1);
+    }
+    deadline_configure(DEADLINE_HEADER, config.header_timeout * 1000);
+    deadline_configure(DEADLINE_BODY, config.body_timeout * 1000);
+    deadline_configure(DEADLINE_CONNECT, config.connect_timeout * 1000);
+    deadline_configure(DEADLINE_TTFB, config.ttfb_timeout * 1000);
+    deadline_configure(DEADLINE_IDLE, config.keepalive_timeout * 1000);
+    io_backend_init(config.io_backend);
+    // The index listens to the file cache's watcher, so register it first
+    file_cache_set_listener(find_index_update);
+    file_cache_init("./find", config.file_cache_entries, (long)config.file_cache_ram_mb << 20,
+                    (long)config.file_cache_small_kb << 10);
+    durable_init(config.durability, config.commit_delay_us);
+    if(chunk_store_init(config.chunk_dir, config.dedup) < 0) {
+        exit(1);
+    }
+    find_index_init("./find", (long)config.find_index_content_kb << 10, config.find_rescan_sec);
+    if(config.prefetch && prefetch_init(config.prefetch_workers, config.prefetch_queue,
+                                        (long)config.prefetch_rate_kb << 10, http_prefetch) < 0) {
+        exit(1);
+    }
+    // A single process replays the warm-up log itself; in prefork mode
+    // the supervisor does it once for all workers
+    if(config.processes == 1) {
+        warmup_start(config.warmup_log_interval, config.warmup_top, config.warmup_workers,
+                     config.warmup_rate, http_prefetch);
+    }
+    if(ratelimit_init(config.rate_limit, config.rate_burst, config.rate_table_size) < 0) {
+        exit(1);
+    }
+    // Health is tracked per process, so each worker checks for itself
+    if(backend_health_start(config.health_interval, config.health_path) < 0) {
+        exit(1);
+    }
+    negative_init(config.negative_ttl, config.dns_negative_ttl, config.breaker_failures, config.breaker_open);
+    admission_lane_init(LANE_LOCAL_READ, config.lane_read, config.lane_queue);
+    admission_lane_init(LANE_LOCAL_WRITE, config.lane_write, config.lane_queue);
+    admission_lane_init(LANE_UPSTREAM_CACHEABLE, config.lane_cacheable, config.lane_queue);
+    admission_lane_init(LANE_UPSTREAM_PASSTHROUGH, config.lane_passthrough, config.lane_queue);
+    // Local lanes are only isolated if the upstream ones cannot hold every worker
+    int upstream_threads = config.lane_cacheable + config.lane_passthrough + 2 * config.lane_queue;
+    if(config.lane_cacheable == 0 || config.lane_passthrough == 0 || upstream_threads >= config.workers) {
+        printf("[MAIN] Warning: upstream lanes can occupy all %d workers; local requests may wait on slow origins\n",
+               config.workers);
+    }
+    if(admission_init(config.workers, config.queue_size, config.queue_budget_ms,
+                      config.retry_after, handle_client) < 0) {
+        printf("[MAIN] Failed to start worker pool\n");
+        exit(1);
+    }
+
+    // A single process is its own supervisor for upgrades
+    if(config.processes == 1) {
+        upgrade_listen(config.upgrade_socket, serverSocket, retire_single);
+        upgrade_ready();
+    }
+
+    printf("[MAIN] Proxy server listening...\n");
+
+    // A multishot accept keeps accepting in the kernel even once this loop
+    // stops, so a listener that may be handed over is accepted from directly
+    int handoff = config.upgrade_socket[0] != '\0';
+    while(!draining){
+        struct sockaddr_in clientAddr;
+        socklen_t clientLen = sizeof(clientAddr);
+        int clientSocket = handoff ? accept4(serverSocket, (struct sockaddr*)&clientAddr, &clientLen, SOCK_CLOEXEC)
+                                   : io_accept(serverSocket, &clientAddr, &clientLen);
+        if(clientSocket < 0){
+            if(errno != EINTR) perror("[MAIN] Accept failed");
+            continue;
+        }
+
+        printf("[MAIN] Connection accepted from %s:%d\n",
+               inet_ntoa(clientAddr.sin_addr),
+               ntohs(clientAddr.sin_port));
+        response_socket_init(clientSocket);
+
+        // Per-client token bucket, checked before the connection takes a queue slot
+        int retry_after = 0;
+        if(!ratelimit_allow(clientAddr.sin_addr.s_addr, &retry_after)) {
+            printf("[MAIN] Rate limit exceeded for %s\n", inet_ntoa(clientAddr.sin_addr));
+            admission_reject(clientSocket, 429, retry_after);
+            continue;
         }
+
+        admission_submit(clientSocket);
     }
-    printf("[MAIN] Starting proxy server on port %d\n", port);
+    // The drain thread exits the process
+    accept_stopped = 1;
+    for(;;) pause();
+}
+
+// ---------------------------------------------------------------------------
+// Prefork supervisor
+// ---------------------------------------------------------------------------
+
+static pid_t* worker_pids = NULL;
+static volatile sig_atomic_t stopping = 0;
+static volatile sig_atomic_t upgrade_requested = 0;
+static volatile sig_atomic_t retiring = 0;
+
+static void request_stop(int sig){
+    (void)sig;
+    stopping = 1;
+}
+
+static void request_upgrade(int sig){
+    (void)sig;
+    upgrade_requested = 1;
+}
+
+static void forward_signal(int sig){
+    for(int i = 0; i < config.processes; i++) {
+        if(worker_pids[i] > 0) kill(worker_pids[i], sig);
+    }
+}
+
+// A successor has the listener: workers drain, and are not replaced
+static void retire_prefork(void){
+    retiring = 1;
+    printf("[MAIN] Draining %d workers\n", config.processes);
+    forward_signal(SIGQUIT);
+}
+
+static pid_t spawn_worker(int serverSocket, int index){
+    pid_t pid = fork();
+    if(pid == 0) {
+        // Workers exit with the supervisor rather than linger as orphans
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        signal(SIGUSR1, SIG_DFL);
+        printf("[MAIN] Worker %d started (pid %d)\n", index, (int)getpid());
+        serve(serverSocket);
+        _exit(0);
+    }
+    if(pid < 0) perror("[MAIN] Fork failed");
+    return pid;
+}
 
-    sem_init(&semaphore, 0, MAX_CLIENTS);
+// Keep config.processes workers accepting on the shared listener, and
+// restart any that crash. The cache lives in shared memory, so a restarted
+// worker comes back with everything the others have cached.
+static void run_prefork(int serverSocket){
+    worker_pids = calloc(config.processes, sizeof(pid_t));
+    if(!worker_pids) {
+        perror("[MAIN] Memory allocation failed");
+        exit(1);
+    }
+    signal(SIGUSR1, forward_signal);
+
+    // No SA_RESTART, so a stop request interrupts wait()
+    struct sigaction stop_action;
+    memset(&stop_action, 0, sizeof(stop_action));
+    stop_action.sa_handler = request_stop;
+    sigaction(SIGTERM, &stop_action, NULL);
+    sigaction(SIGINT, &stop_action, NULL);
+    stop_action.sa_handler = request_upgrade;
+    sigaction(SIGUSR2, &stop_action, NULL);
+
+    for(int i = 0; i < config.processes; i++) {
+        worker_pids[i] = spawn_worker(serverSocket, i);
+    }
+
+    // Helper threads start with these blocked, so the signals reach the
+    // thread sitting in wait()
+    sigset_t supervisor_signals;
+    sigemptyset(&supervisor_signals);
+    sigaddset(&supervisor_signals, SIGTERM);
+    sigaddset(&supervisor_signals, SIGINT);
+    sigaddset(&supervisor_signals, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &supervisor_signals, NULL);
+    warmup_start(config.warmup_log_interval, config.warmup_top, config.warmup_workers,
+                 config.warmup_rate, http_prefetch);
+    upgrade_listen(config.upgrade_socket, serverSocket, retire_prefork);
+    pthread_sigmask(SIG_UNBLOCK, &supervisor_signals, NULL);
+    upgrade_ready();
+
+    while(1) {
+        if(upgrade_requested && !retiring) {
+            upgrade_requested = 0;
+            printf("[MAIN] SIGUSR2 received, starting a successor\n");
+            upgrade_spawn(saved_argv);
+        }
+        if(stopping) {
+            // Workers finish first so the saved cache is final
+            printf("[MAIN] Stopping %d workers\n", config.processes);
+            forward_signal(SIGTERM);
+            while(wait(NULL) > 0 || errno == EINTR);
+            if(!retiring) warmup_shutdown();
+            exit(0);
+        }
+        int status;
+        pid_t pid = wait(&status);
+        if(pid < 0) {
+            if(errno == EINTR) continue;
+            perror("[MAIN] wait failed");
+            sleep(1);
+            continue;
+        }
+        cache_reap(pid);
+        // Children that are not workers are successors that failed to start
+        int live = 0;
+        for(int i = 0; i < config.processes; i++) {
+            if(worker_pids[i] == pid && retiring) worker_pids[i] = 0;
+            if(worker_pids[i] > 0) live++;
+        }
+        if(retiring) {
+            // The successor may be a child too; only the workers are waited for
+            if(live == 0) {
+                printf("[MAIN] Workers drained, exiting\n");
+                exit(0);
+            }
+            continue;
+        }
+        for(int i = 0; i < config.processes; i++) {
+            if(worker_pids[i] != pid) continue;
+            if(WIFSIGNALED(status)) {
+                printf("[MAIN] Worker %d (pid %d) killed by signal %d, restarting\n", i, (int)pid, WTERMSIG(status));
+            } else {
+                printf("[MAIN] Worker %d (pid %d) exited with status %d, restarting\n", i, (int)pid, WEXITSTATUS(status));
+            }
+            usleep(100000); // Avoid a tight loop if workers crash at startup
+            worker_pids[i] = spawn_worker(serverSocket, i);
+            break;
+        }
+    }
+}
 
-    // Create server socket
+// Create the server socket and start listening on port
+static int listen_on(int port){
     int serverSocket = socket(AF_INET, SOCK_STREAM, 0);
     if(serverSocket < 0){
         perror("[MAIN] Socket creation failed");
@@ -132,45 +604,59 @@ int main(int argc, char** argv){
         close(serverSocket);
         exit(1);
     }
+    return serverSocket;
+}
 
-    printf("[MAIN] Proxy server listening...\n");
-
-    while(1){
-        struct sockaddr_in clientAddr;
-        socklen_t clientLen = sizeof(clientAddr);
-        int* clientSocket = malloc(sizeof(int));
-        if(!clientSocket){
-            perror("[MAIN] Memory allocation failed");
-            continue;
-        }
+int main(int argc, char** argv){
+    if(config_parse(argc, argv) < 0) {
+        return 1;
+    }
+    int port = config.port;
+    printf("[MAIN] Starting proxy server on port %d\n", port);
 
-        *clientSocket = accept(serverSocket, (struct sockaddr*)&clientAddr, &clientLen);
-        if(*clientSocket < 0){
-            perror("[MAIN] Accept failed");
-            free(clientSocket);
-            continue;
-        }
+    saved_argv = argv;
 
-        printf("[MAIN] Connection accepted from %s:%d\n",
-               inet_ntoa(clientAddr.sin_addr),
-               ntohs(clientAddr.sin_port));
+    // An upgrade takes over the previous process's listener instead
+    int handoff_fd = -1;
+    int serverSocket = -1;
+    if(config.upgrade_from[0]) {
+        serverSocket = upgrade_receive(config.upgrade_from, &handoff_fd);
+        if(serverSocket < 0) exit(1);
+    } else {
+        serverSocket = listen_on(port);
+    }
 
-        pthread_mutex_lock(&thread_mutex);
-        int current_thread = thread_count % MAX_CLIENTS;
-        thread_count++;
-        pthread_mutex_unlock(&thread_mutex);
+    if(cluster_init(config.cluster_self, config.cluster_peers, config.cluster_peer_count,
+                    config.cluster_vnodes) < 0) {
+        exit(1);
+    }
+    if(backend_init(config.routes, config.route_count, config.balance, config.unhealthy_after,
+                    config.eject_factor, config.eject_time) < 0) {
+        exit(1);
+    }
+    // Before fork, so the workers share the link and client buckets
+    if(egress_init(config.egress_rate_kb, config.egress_conn_rate_kb, config.egress_ip_rate_kb,
+                   config.egress_burst_kb, config.egress_quantum_kb) < 0) {
+        exit(1);
+    }
 
-        if(pthread_create(&tid[current_thread], NULL, thread_fn, clientSocket) != 0) {
-            perror("[MAIN] Thread creation failed");
-            close(*clientSocket);
-            free(clientSocket);
-            continue;
+    if(config.processes > 1) {
+        // The shared cache must exist before fork so every worker maps it
+        if(cache_init_shared((long)config.shm_cache_mb << 20) < 0) {
+            printf("[MAIN] Failed to create shared cache\n");
+            exit(1);
         }
-        pthread_detach(tid[current_thread]); // detach to automatically reclaim resources
+        warmup_init(config.warmup_log, config.snapshot, handoff_fd);
+        if(handoff_fd >= 0) close(handoff_fd);
+        printf("[MAIN] Prefork mode with %d worker processes\n", config.processes);
+        fflush(stdout);
+        run_prefork(serverSocket);
+    } else {
+        warmup_init(config.warmup_log, config.snapshot, handoff_fd);
+        if(handoff_fd >= 0) close(handoff_fd);
+        serve(serverSocket);
     }
 
     close(serverSocket);
-    sem_destroy(&semaphore);
-    pthread_mutex_destroy(&thread_mutex);
     return 0;
 }
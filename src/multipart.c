@@ -0,0 +1,232 @@
+#include "multipart.h"
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+enum {
+    STATE_PREAMBLE,              // Before the first delimiter; discarded
+    STATE_DELIM_TAIL,            // "--" ends the body, CRLF starts a part
+    STATE_HEADERS,
+    STATE_BODY,
+    STATE_EPILOGUE,              // After the closing delimiter; discarded
+    STATE_ERROR,
+};
+
+// Value of parameter key in a header value such as
+// `form-data; name="file"; filename="a.txt"`, quoted or not. Backslashes
+// are kept: browsers do not escape with them, and old ones send Windows
+// paths.
+static void header_param(const char* s, const char* key, char* out, size_t out_len){
+    out[0] = '\0';
+    size_t key_len = strlen(key);
+    s = strchr(s, ';');
+    while(s && *s == ';') {
+        s++;
+        while(*s == ' ' || *s == '\t') s++;
+        const char* k = s;
+        while(*s && *s != '=' && *s != ';') s++;
+        if(*s != '=') continue;
+        int match = (size_t)(s - k) == key_len && strncasecmp(k, key, key_len) == 0;
+        s++;
+        size_t n = 0;
+        if(*s == '"') {
+            for(s++; *s && *s != '"'; s++) {
+                if(match && n + 1 < out_len) out[n++] = *s;
+            }
+            if(*s == '"') s++;
+        } else {
+            for(; *s && *s != ';' && *s != ' ' && *s != '\t'; s++) {
+                if(match && n + 1 < out_len) out[n++] = *s;
+            }
+        }
+        if(match) {
+            out[n] = '\0';
+            return;
+        }
+        s = strchr(s, ';');
+    }
+}
+
+int multipart_boundary(const char* content_type, size_t len, char* out, size_t out_len){
+    char value[512];
+    if(len >= sizeof(value)) return -1;
+    memcpy(value, content_type, len);
+    value[len] = '\0';
+    if(strncasecmp(value, "multipart/form-data", 19) != 0) return -1;
+    char boundary[MULTIPART_BOUNDARY_MAX + 2];
+    header_param(value, "boundary", boundary, sizeof(boundary));
+    size_t boundary_len = strlen(boundary);
+    if(boundary_len == 0 || boundary_len > MULTIPART_BOUNDARY_MAX || boundary_len >= out_len) return -1;
+    memcpy(out, boundary, boundary_len + 1);
+    return 0;
+}
+
+void multipart_init(struct multipart_parser* p, const char* boundary,
+                    const struct multipart_callbacks* cb, void* ctx){
+    p->state = STATE_PREAMBLE;
+    p->cb = cb;
+    p->ctx = ctx;
+    p->delim_len = snprintf(p->delim, sizeof(p->delim), "\r\n--%.*s", MULTIPART_BOUNDARY_MAX, boundary);
+    size_t n = p->delim_len;
+    memset(p->skip, (int)n, sizeof(p->skip));
+    for(size_t i = 0; i + 1 < n; i++) p->skip[(unsigned char)p->delim[i]] = n - 1 - i;
+    // The first delimiter has no CRLF of its own when there is no preamble
+    memcpy(p->held, "\r\n", 2);
+    p->held_len = 2;
+    p->after = 0;
+    p->header_len = 0;
+}
+
+int multipart_done(const struct multipart_parser* p){
+    return p->state == STATE_EPILOGUE;
+}
+
+static int emit(struct multipart_parser* p, const char* data, size_t len){
+    if(len == 0 || p->state != STATE_BODY) return 0;
+    return p->cb->part_data(p->ctx, data, len);
+}
+
+// Look for the delimiter in the held bytes followed by data, passing
+// everything before it on. Returns the bytes of data consumed, through the
+// delimiter if *found is set, or -1 if a callback failed.
+static long scan(struct multipart_parser* p, const char* data, size_t len, int* found){
+    const char* d = p->delim;
+    size_t n = p->delim_len;
+    *found = 0;
+
+    // A delimiter that started in the previous piece
+    for(size_t i = 0; i < p->held_len; i++) {
+        size_t in_held = p->held_len - i;
+        size_t rest = n - in_held;
+        size_t avail = len < rest ? len : rest;
+        if(memcmp(p->held + i, d, in_held) != 0 || memcmp(data, d + in_held, avail) != 0) continue;
+        if(emit(p, p->held, i) < 0) return -1;
+        if(avail < rest) {
+            // Still a prefix; it all stays held
+            memmove(p->held, p->held + i, in_held);
+            memcpy(p->held + in_held, data, len);
+            p->held_len = in_held + len;
+            return len;
+        }
+        p->held_len = 0;
+        *found = 1;
+        return rest;
+    }
+    if(emit(p, p->held, p->held_len) < 0) return -1;
+    p->held_len = 0;
+
+    // Horspool over this piece, comparing the last byte first
+    unsigned char last = (unsigned char)d[n - 1];
+    for(size_t pos = 0; pos + n <= len; ) {
+        unsigned char c = (unsigned char)data[pos + n - 1];
+        if(c == last && memcmp(data + pos, d, n - 1) == 0) {
+            if(emit(p, data, pos) < 0) return -1;
+            *found = 1;
+            return pos + n;
+        }
+        pos += p->skip[c];
+    }
+
+    // Hold back the shortest tail that could still begin a delimiter
+    size_t keep = len > n - 1 ? len - (n - 1) : 0;
+    while(keep < len) {
+        const char* cr = memchr(data + keep, '\r', len - keep);
+        if(!cr) {
+            keep = len;
+            break;
+        }
+        keep = cr - data;
+        if(memcmp(cr, d, len - keep) == 0) break;
+        keep++;
+    }
+    if(emit(p, data, keep) < 0) return -1;
+    memcpy(p->held, data + keep, len - keep);
+    p->held_len = len - keep;
+    return len;
+}
+
+// Headers of the part are complete in p->header
+static int begin_part(struct multipart_parser* p){
+    struct multipart_part part;
+    memset(&part, 0, sizeof(part));
+    p->header[p->header_len] = '\0';
+    char* line = p->header;
+    char* end;
+    while((end = strstr(line, "\r\n")) != NULL) {
+        *end = '\0';
+        if(strncasecmp(line, "Content-Disposition:", 20) == 0) {
+            header_param(line + 20, "name", part.name, sizeof(part.name));
+            header_param(line + 20, "filename", part.filename, sizeof(part.filename));
+        } else if(strncasecmp(line, "Content-Type:", 13) == 0) {
+            const char* value = line + 13;
+            while(*value == ' ' || *value == '\t') value++;
+            snprintf(part.content_type, sizeof(part.content_type), "%s", value);
+        }
+        line = end + 2;
+    }
+    return p->cb->part_begin(p->ctx, &part);
+}
+
+static int fail(struct multipart_parser* p){
+    p->state = STATE_ERROR;
+    return -1;
+}
+
+int multipart_feed(struct multipart_parser* p, const char* data, size_t len){
+    while(len > 0) {
+        switch(p->state) {
+        case STATE_PREAMBLE:
+        case STATE_BODY: {
+            int found;
+            long used = scan(p, data, len, &found);
+            if(used < 0) return fail(p);
+            data += used;
+            len -= used;
+            if(found) {
+                if(p->state == STATE_BODY && p->cb->part_end(p->ctx) < 0) return fail(p);
+                p->state = STATE_DELIM_TAIL;
+                p->after = 0;
+            }
+            break;
+        }
+        case STATE_DELIM_TAIL: {
+            char c = *data++;
+            len--;
+            if(p->after == 0 && c == '-') p->after = 1;
+            else if(p->after == 1 && c == '-') p->state = STATE_EPILOGUE;
+            else if(p->after == 0 && c == '\r') p->after = 2;
+            else if(p->after == 0 && (c == ' ' || c == '\t')) continue;     // Transport padding
+            else if(p->after == 2 && c == '\n') {
+                p->state = STATE_HEADERS;
+                p->header_len = 0;
+            } else {
+                return fail(p);
+            }
+            break;
+        }
+        case STATE_HEADERS: {
+            // Up to the blank line; a part may have no headers at all
+            while(len > 0) {
+                if(p->header_len + 1 >= sizeof(p->header)) return fail(p);
+                p->header[p->header_len++] = *data++;
+                len--;
+                size_t h = p->header_len;
+                if((h == 2 && memcmp(p->header, "\r\n", 2) == 0) ||
+                   (h >= 4 && memcmp(p->header + h - 4, "\r\n\r\n", 4) == 0)) {
+                    if(h == 2) p->header_len = 0;
+                    else p->header_len -= 2;
+                    p->state = STATE_BODY;
+                    if(begin_part(p) < 0) return fail(p);
+                    break;
+                }
+            }
+            break;
+        }
+        case STATE_EPILOGUE:
+            return 0;
+        default:
+            return -1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,58 @@
+#ifndef MULTIPART_H
+#define MULTIPART_H
+
+#include <stddef.h>
+
+// Streaming multipart/form-data parser (RFC 7578). The body is fed in
+// pieces of any size as it arrives; part contents are handed to callbacks
+// without being collected, so memory stays constant however large the
+// parts are. Delimiters are found with a Horspool search, and a delimiter
+// split across two pieces is completed from the few bytes held back from
+// the first.
+
+#define MULTIPART_BOUNDARY_MAX 70        // RFC 2046 limit
+#define MULTIPART_HEADER_MAX 8192        // Headers of one part
+
+// Headers of a part; empty strings when absent
+struct multipart_part {
+    char name[128];              // Form field
+    char filename[256];          // As sent; only set for file fields
+    char content_type[128];
+};
+
+// Each returns 0 to carry on or -1 to stop parsing
+struct multipart_callbacks {
+    int (*part_begin)(void* ctx, const struct multipart_part* part);
+    int (*part_data)(void* ctx, const char* data, size_t len);
+    int (*part_end)(void* ctx);
+};
+
+struct multipart_parser {
+    int state;
+    const struct multipart_callbacks* cb;
+    void* ctx;
+
+    char delim[MULTIPART_BOUNDARY_MAX + 4];   // "\r\n--" boundary
+    size_t delim_len;
+    unsigned char skip[256];     // Horspool shift per byte
+    char held[MULTIPART_BOUNDARY_MAX + 4];    // Tail that may start a delimiter
+    size_t held_len;
+    int after;                   // Bytes matched after a delimiter ("--" or "\r\n")
+
+    char header[MULTIPART_HEADER_MAX];
+    size_t header_len;
+};
+
+// Copy the boundary parameter of a Content-Type value into out. Returns 0,
+// or -1 if the value is not multipart/form-data with a valid boundary.
+int multipart_boundary(const char* content_type, size_t len, char* out, size_t out_len);
+
+void multipart_init(struct multipart_parser* p, const char* boundary,
+                    const struct multipart_callbacks* cb, void* ctx);
+// Parse the next piece of the body. Returns 0, or -1 if the body is
+// malformed or a callback stopped parsing.
+int multipart_feed(struct multipart_parser* p, const char* data, size_t len);
+// 1 once the closing delimiter has been seen
+int multipart_done(const struct multipart_parser* p);
+
+#endif
@@ -0,0 +1,310 @@
+#include "negative_cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#define ORIGIN_SLOTS 256
+#define URL_SLOTS 1024
+#define PROBE_LIMIT 8                // Slots probed before evicting the stalest
+#define ORIGIN_MAX 272
+#define PARSE_MAX (16 * 1024 + NEGATIVE_BODY_MAX) // Header and body bytes looked at
+
+struct origin_state {
+    char origin[ORIGIN_MAX];         // "host:port"; "" marks an empty slot
+    int dns_failed;
+    long long dns_retry_ms;          // Next lookup allowed at
+    int failures;                    // Consecutive failures
+    int open;
+    long long open_until_ms;         // Next probe allowed at
+    long long used_at_ms;
+};
+
+struct url_entry {
+    char* key;                       // NULL marks an empty slot
+    int status;
+    char content_type[128];
+    char* body;
+    int body_len;                    // -1 if not kept
+    long long expires_ms;
+};
+
+static struct origin_state origins[ORIGIN_SLOTS];
+static struct url_entry urls[URL_SLOTS];
+static pthread_mutex_t negative_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int error_ttl_ms = 0;
+static int dns_ttl_ms = 0;
+static int breaker_failures = 0;
+static int breaker_open_ms = 0;
+
+static __thread unsigned int jitter_seed = 0;
+
+static long long now_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static uint32_t hash_string(const char* s){
+    uint32_t h = 2166136261u;
+    while(*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// ttl_ms scaled by a random factor within +-NEGATIVE_JITTER_PCT
+static long long jittered(int ttl_ms){
+    if(jitter_seed == 0) jitter_seed = (unsigned int)now_ms() ^ (unsigned int)(uintptr_t)&jitter_seed;
+    int pct = 100 - NEGATIVE_JITTER_PCT + rand_r(&jitter_seed) % (2 * NEGATIVE_JITTER_PCT + 1);
+    return (long long)ttl_ms * pct / 100;
+}
+
+void negative_init(int error_ttl, int dns_ttl, int failures, int breaker_open){
+    error_ttl_ms = error_ttl > 0 ? error_ttl * 1000 : 0;
+    dns_ttl_ms = dns_ttl > 0 ? dns_ttl * 1000 : 0;
+    breaker_failures = failures > 0 && breaker_open > 0 ? failures : 0;
+    breaker_open_ms = breaker_open > 0 ? breaker_open * 1000 : 0;
+    if(error_ttl_ms || dns_ttl_ms || breaker_failures) {
+        printf("[NEGCACHE] Errors kept %ds, DNS failures %ds, breaker opens after %d failure(s) for %ds\n",
+               error_ttl, dns_ttl, breaker_failures, breaker_open);
+    }
+}
+
+// Slot for origin, claiming the stalest probed slot if absent (lock held)
+static struct origin_state* find_origin(const char* origin, int create){
+    uint32_t start = hash_string(origin);
+    struct origin_state* empty = NULL;
+    struct origin_state* stalest = NULL;
+    for(int i = 0; i < PROBE_LIMIT; i++) {
+        struct origin_state* slot = &origins[(start + i) % ORIGIN_SLOTS];
+        if(slot->origin[0] == '\0') {
+            if(!empty) empty = slot;
+        } else if(strcmp(slot->origin, origin) == 0) {
+            return slot;
+        } else if(!stalest || slot->used_at_ms < stalest->used_at_ms) {
+            stalest = slot;
+        }
+    }
+    if(!create) return NULL;
+    struct origin_state* slot = empty ? empty : stalest;
+    memset(slot, 0, sizeof(*slot));
+    snprintf(slot->origin, sizeof(slot->origin), "%s", origin);
+    return slot;
+}
+
+static void origin_name(char* out, const char* host, int port){
+    snprintf(out, ORIGIN_MAX, "%s:%d", host, port);
+}
+
+enum origin_verdict negative_origin_check(const char* host, int port){
+    char origin[ORIGIN_MAX];
+    origin_name(origin, host, port);
+    enum origin_verdict verdict = ORIGIN_ALLOW;
+    long long now = now_ms();
+    pthread_mutex_lock(&negative_lock);
+    struct origin_state* s = find_origin(origin, 0);
+    if(s && s->dns_failed) {
+        // The first caller after the TTL looks the name up again; the rest
+        // keep failing until it reports back or another TTL passes
+        if(now < s->dns_retry_ms) verdict = ORIGIN_UNRESOLVED;
+        else s->dns_retry_ms = now + jittered(dns_ttl_ms);
+    } else if(s && s->open) {
+        if(now < s->open_until_ms) {
+            verdict = ORIGIN_OPEN;
+        } else {
+            s->open_until_ms = now + jittered(breaker_open_ms);
+            printf("[NEGCACHE] Probing %s\n", origin);
+        }
+    }
+    pthread_mutex_unlock(&negative_lock);
+    return verdict;
+}
+
+int negative_origin_retry_after(const char* host, int port){
+    char origin[ORIGIN_MAX];
+    origin_name(origin, host, port);
+    long long now = now_ms();
+    long long at = now;
+    pthread_mutex_lock(&negative_lock);
+    struct origin_state* s = find_origin(origin, 0);
+    if(s && s->dns_failed) at = s->dns_retry_ms;
+    else if(s && s->open) at = s->open_until_ms;
+    pthread_mutex_unlock(&negative_lock);
+    int seconds = (int)((at - now + 999) / 1000);
+    return seconds > 0 ? seconds : 1;
+}
+
+void negative_origin_failure(const char* host, int port, enum origin_failure failure){
+    if(failure == ORIGIN_FAIL_DNS ? dns_ttl_ms == 0 : breaker_failures == 0) return;
+    char origin[ORIGIN_MAX];
+    origin_name(origin, host, port);
+    long long now = now_ms();
+    pthread_mutex_lock(&negative_lock);
+    struct origin_state* s = find_origin(origin, 1);
+    s->used_at_ms = now;
+    if(failure == ORIGIN_FAIL_DNS) {
+        if(!s->dns_failed) printf("[NEGCACHE] Not resolving %s again for %ds\n", host, dns_ttl_ms / 1000);
+        s->dns_failed = 1;
+        s->dns_retry_ms = now + jittered(dns_ttl_ms);
+    } else {
+        s->dns_failed = 0;
+        s->failures++;
+        // A failed probe reopens at once; a closed breaker needs a run
+        if(s->open || s->failures >= breaker_failures) {
+            if(!s->open) {
+                printf("[NEGCACHE] Circuit for %s opened after %d failure(s)\n", origin, s->failures);
+            }
+            s->open = 1;
+            s->open_until_ms = now + jittered(breaker_open_ms);
+        }
+    }
+    pthread_mutex_unlock(&negative_lock);
+}
+
+void negative_origin_success(const char* host, int port){
+    char origin[ORIGIN_MAX];
+    origin_name(origin, host, port);
+    pthread_mutex_lock(&negative_lock);
+    struct origin_state* s = find_origin(origin, 0);
+    if(s) {
+        if(s->open) printf("[NEGCACHE] Circuit for %s closed\n", origin);
+        s->dns_failed = 0;
+        s->failures = 0;
+        s->open = 0;
+        s->used_at_ms = now_ms();
+    }
+    pthread_mutex_unlock(&negative_lock);
+}
+
+int negative_status(int status){
+    return error_ttl_ms > 0 && (status == 404 || status == 410 || status >= 500);
+}
+
+// Value of a header in the header block head[0, head_len), or NULL
+static const char* find_header(const char* head, int head_len, const char* name, int* value_len){
+    size_t name_len = strlen(name);
+    const char* end = head + head_len;
+    const char* line = memchr(head, '\n', head_len);
+    while(line && ++line < end) {
+        const char* eol = memchr(line, '\n', end - line);
+        if(!eol) eol = end;
+        if((size_t)(eol - line) > name_len && strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            const char* value = line + name_len + 1;
+            while(value < eol && *value == ' ') value++;
+            const char* value_end = eol;
+            while(value_end > value && (value_end[-1] == '\r' || value_end[-1] == ' ')) value_end--;
+            *value_len = (int)(value_end - value);
+            return value;
+        }
+        line = eol;
+    }
+    return NULL;
+}
+
+static void url_entry_clear(struct url_entry* e){
+    free(e->key);
+    free(e->body);
+    memset(e, 0, sizeof(*e));
+}
+
+void negative_store(const char* key, const struct buffer_chain* raw){
+    if(error_ttl_ms == 0 || raw->len < 12) return;
+    long avail = raw->len < PARSE_MAX ? raw->len : PARSE_MAX;
+    char* flat = malloc(avail);
+    if(!flat) return;
+    chain_copy(raw, 0, flat, avail);
+    const char* head_end = memmem(flat, avail, "\r\n\r\n", 4);
+    if(strncmp(flat, "HTTP/1.", 7) != 0 || !head_end) {
+        free(flat);
+        return;
+    }
+    int head_len = (int)(head_end - flat) + 4;
+
+    struct url_entry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.status = atoi(flat + 9);
+    int value_len = 0;
+    const char* value = find_header(flat, head_len, "Content-Type", &value_len);
+    if(value && value_len < (int)sizeof(entry.content_type)) memcpy(entry.content_type, value, value_len);
+
+    // Keep the body only if it is short, complete and not chunked
+    long body_len = raw->len - head_len;
+    value = find_header(flat, head_len, "Content-Length", &value_len);
+    if(value) {
+        long declared = atol(value);
+        if(declared <= body_len) body_len = declared;
+        else body_len = -1;
+    }
+    if(find_header(flat, head_len, "Transfer-Encoding", &value_len) || body_len > NEGATIVE_BODY_MAX) {
+        body_len = -1;
+    }
+    entry.body_len = -1;
+    if(body_len >= 0) {
+        entry.body = malloc(body_len > 0 ? body_len : 1);
+        if(entry.body) {
+            // From the chain: flat holds at most PARSE_MAX bytes of the response
+            chain_copy(raw, head_len, entry.body, body_len);
+            entry.body_len = (int)body_len;
+        }
+    }
+    free(flat);
+    entry.key = strdup(key);
+    if(!entry.key) {
+        free(entry.body);
+        return;
+    }
+    long long now = now_ms();
+    entry.expires_ms = now + jittered(error_ttl_ms);
+
+    // Same key, else an empty or expired slot, else the one expiring first
+    uint32_t start = hash_string(key);
+    pthread_mutex_lock(&negative_lock);
+    struct url_entry* slot = NULL;
+    for(int i = 0; i < PROBE_LIMIT; i++) {
+        struct url_entry* e = &urls[(start + i) % URL_SLOTS];
+        if(e->key && strcmp(e->key, key) == 0) {
+            slot = e;
+            break;
+        }
+        if(!e->key || e->expires_ms <= now) {
+            if(!slot || slot->key) slot = e;
+        } else if(!slot || (slot->key && e->expires_ms < slot->expires_ms)) {
+            slot = e;
+        }
+    }
+    url_entry_clear(slot);
+    *slot = entry;
+    pthread_mutex_unlock(&negative_lock);
+    printf("[NEGCACHE] Keeping %d for %s\n", entry.status, key);
+}
+
+int negative_lookup(const char* key, struct negative_response* out){
+    if(error_ttl_ms == 0) return 0;
+    uint32_t start = hash_string(key);
+    long long now = now_ms();
+    int found = 0;
+    pthread_mutex_lock(&negative_lock);
+    for(int i = 0; i < PROBE_LIMIT; i++) {
+        struct url_entry* e = &urls[(start + i) % URL_SLOTS];
+        if(!e->key || strcmp(e->key, key) != 0) continue;
+        if(e->expires_ms <= now) {
+            url_entry_clear(e);
+            break;
+        }
+        out->status = e->status;
+        memcpy(out->content_type, e->content_type, sizeof(out->content_type));
+        out->body_len = e->body_len;
+        if(e->body_len > 0) memcpy(out->body, e->body, e->body_len);
+        out->ttl = (int)((e->expires_ms - now + 999) / 1000);
+        found = 1;
+        break;
+    }
+    pthread_mutex_unlock(&negative_lock);
+    return found;
+}
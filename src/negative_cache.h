@@ -0,0 +1,66 @@
+#ifndef NEGATIVE_CACHE_H
+#define NEGATIVE_CACHE_H
+
+#include "buffer_chain.h"
+
+// Short-lived memory of upstream failures, so a broken origin costs one
+// attempt per interval instead of one per request.
+//
+// Per origin (host:port):
+// - A name that failed to resolve is not looked up again for the DNS TTL.
+// - Consecutive connect failures, timeouts and 5xx replies trip a circuit
+//   breaker. While it is open, requests fail fast. Each time the open
+//   interval runs out, one request is let through as a probe; an answer
+//   below 500 closes the breaker, a failure keeps it open for another
+//   interval.
+// Per URL, 404, 410 and 5xx responses are kept for the error TTL and
+// replayed instead of asking the origin again.
+//
+// Every TTL is spread by +-NEGATIVE_JITTER_PCT so entries made together do
+// not all expire together. State is per process, like the upstream address
+// stats.
+
+#define NEGATIVE_BODY_MAX 4096           // Error bodies replayed up to this size
+#define NEGATIVE_JITTER_PCT 10
+
+enum origin_verdict {
+    ORIGIN_ALLOW,
+    ORIGIN_UNRESOLVED,           // The name failed to resolve recently
+    ORIGIN_OPEN,                 // Breaker open; fail fast
+};
+
+enum origin_failure {
+    ORIGIN_FAIL_DNS,
+    ORIGIN_FAIL_CONNECT,
+    ORIGIN_FAIL_RESPONSE,        // Timeout, reset or 5xx
+};
+
+struct negative_response {
+    int status;
+    char content_type[128];      // "" if the origin sent none
+    char body[NEGATIVE_BODY_MAX];
+    int body_len;                // -1 if the body was not kept
+    int ttl;                     // Seconds left
+};
+
+// TTLs in seconds; 0 disables that part. breaker_failures is the run of
+// failures that opens the breaker.
+void negative_init(int error_ttl, int dns_ttl, int breaker_failures, int breaker_open);
+
+// Whether host:port may be contacted. A caller let through once an
+// interval has run out is the probe and should report how it went.
+enum origin_verdict negative_origin_check(const char* host, int port);
+// Seconds until host:port is tried again (at least 1)
+int negative_origin_retry_after(const char* host, int port);
+void negative_origin_failure(const char* host, int port, enum origin_failure failure);
+// The origin answered with a status below 500
+void negative_origin_success(const char* host, int port);
+
+// 1 if responses with status are remembered per URL
+int negative_status(int status);
+// Remember the complete raw response in raw for key
+void negative_store(const char* key, const struct buffer_chain* raw);
+// Returns 1 and fills out if key has a live entry
+int negative_lookup(const char* key, struct negative_response* out);
+
+#endif
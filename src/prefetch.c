@@ -0,0 +1,416 @@
+#include "prefetch.h"
+#include "buffer_chain.h"
+#include "cache.h"
+#include "cluster.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#define PREFETCH_SCAN_MAX (512 * 1024)     // HTML scanned per page
+#define PREFETCH_MAX_LINKS 32              // Resources queued per page
+#define PREFETCH_MAX_OBJECT (4L * 1024 * 1024)
+#define RECENT_SLOTS 1024                  // Recently queued resources
+#define RECENT_WINDOW_NS (60LL * 1000000000LL)
+#define MAX_HOST 256
+#define MAX_PATH 2048
+
+enum job_kind {
+    JOB_PAGE,                    // Scan html for references
+    JOB_RESOURCE,                // Fetch path into the cache
+};
+
+struct prefetch_job {
+    enum job_kind kind;
+    char host[MAX_HOST];
+    int port;
+    char path[MAX_PATH];
+    char* html;                  // JOB_PAGE only
+    long html_len;
+};
+
+struct span {
+    const char* p;
+    int len;
+};
+
+// Bounded ring of jobs shared by pages and the resources found in them
+static struct prefetch_job* queue = NULL;
+static int queue_capacity = 0;
+static int queue_head = 0;
+static int queue_count = 0;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static prefetch_fetcher fetch = NULL;
+
+// Pacing: fetches are admitted no faster than the byte budget refills
+static long budget_bytes_per_sec = 0;
+static long long next_fetch_ns = 0;
+static pthread_mutex_t budget_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Suppresses queueing the same resource from several pages at once
+static struct {
+    uint64_t hash;
+    long long queued_ns;
+} recent[RECENT_SLOTS];
+
+static unsigned long fetched = 0, skipped = 0, dropped = 0;   // Updated atomically
+
+static long long monotonic_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static uint64_t hash_key(const char* key){
+    uint64_t h = 1469598103934665603ULL;
+    for(const unsigned char* p = (const unsigned char*)key; *p; p++) {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Same key create_cache_key builds for a client request
+static void resource_key(const struct prefetch_job* job, char* key, size_t len){
+    snprintf(key, len, "%s:%d%s", job->host, job->port, job->path);
+}
+
+// Queue a job unless the queue is full (queue_lock held)
+static int enqueue(const struct prefetch_job* job){
+    if(queue_count == queue_capacity) {
+        __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    queue[(queue_head + queue_count) % queue_capacity] = *job;
+    queue_count++;
+    pthread_cond_signal(&queue_cond);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// HTML scanning
+// ---------------------------------------------------------------------------
+
+static int span_is(struct span s, const char* word){
+    return (size_t)s.len == strlen(word) && strncasecmp(s.p, word, s.len) == 0;
+}
+
+static int is_space(char c){
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f';
+}
+
+// Parse the next attribute of a tag. Returns the position after it, or
+// NULL at the end of the tag.
+static const char* next_attribute(const char* p, const char* end, struct span* name, struct span* value){
+    while(p < end && (is_space(*p) || *p == '/')) p++;
+    if(p >= end || *p == '>') return NULL;
+
+    name->p = p;
+    while(p < end && !is_space(*p) && *p != '=' && *p != '>' && *p != '/') p++;
+    name->len = p - name->p;
+    value->p = p;
+    value->len = 0;
+    while(p < end && is_space(*p)) p++;
+    if(p >= end || *p != '=') return p;
+
+    p++;
+    while(p < end && is_space(*p)) p++;
+    if(p < end && (*p == '"' || *p == '\'')) {
+        char quote = *p++;
+        value->p = p;
+        while(p < end && *p != quote) p++;
+        value->len = p - value->p;
+        if(p < end) p++;
+    } else {
+        value->p = p;
+        while(p < end && !is_space(*p) && *p != '>') p++;
+        value->len = p - value->p;
+    }
+    return p;
+}
+
+// Only link relations that the page itself loads are worth fetching
+static int fetched_link_rel(struct span rel){
+    char buf[128];
+    snprintf(buf, sizeof(buf), "%.*s", rel.len < 127 ? rel.len : 127, rel.p);
+    return strcasestr(buf, "stylesheet") || strcasestr(buf, "preload") || strcasestr(buf, "icon");
+}
+
+// Remove "." and ".." segments in place (RFC 3986 section 5.2.4)
+static void remove_dot_segments(char* path){
+    char* out = path;
+    const char* in = path;
+    while(*in) {
+        const char* seg_end = strchr(in + 1, '/');
+        if(!seg_end) seg_end = in + strlen(in);
+        size_t seg_len = seg_end - in;
+        if(seg_len == 2 && strncmp(in, "/.", 2) == 0) {
+            if(!*seg_end) *out++ = '/';
+        } else if(seg_len == 3 && strncmp(in, "/..", 3) == 0) {
+            while(out > path && *--out != '/') {
+            }
+            if(!*seg_end) *out++ = '/';
+        } else {
+            memmove(out, in, seg_len);
+            out += seg_len;
+        }
+        in = seg_end;
+    }
+    if(out == path) *out++ = '/';
+    *out = '\0';
+}
+
+// An absolute reference's host[:port] names the page's origin
+static int same_origin(const struct prefetch_job* page, const char* authority, size_t len){
+    char expected[MAX_HOST + 16];
+    snprintf(expected, sizeof(expected), "%s:%d", page->host, page->port);
+    if(len == strlen(expected) && strncasecmp(authority, expected, len) == 0) return 1;
+    // Port 80 may be left out
+    return page->port == 80 && len == strlen(page->host) && strncasecmp(authority, page->host, len) == 0;
+}
+
+// Resolve a reference against the page. Returns 0 and fills the job's path
+// if it is same-origin plain http, -1 otherwise.
+static int resolve_reference(const struct prefetch_job* page, struct span ref, struct prefetch_job* out){
+    char url[MAX_PATH];
+    int n = 0;
+    // Decode &amp; and stop at the fragment
+    for(int i = 0; i < ref.len && n < (int)sizeof(url) - 1; i++) {
+        if(ref.p[i] == '#') break;
+        if(ref.p[i] == '&' && i + 4 < ref.len && strncmp(ref.p + i, "&amp;", 5) == 0) {
+            url[n++] = '&';
+            i += 4;
+            continue;
+        }
+        if((unsigned char)ref.p[i] <= ' ') return -1;
+        url[n++] = ref.p[i];
+    }
+    url[n] = '\0';
+    if(n == 0 || n == (int)sizeof(url) - 1) return -1;
+
+    const char* path = url;
+    if(strncasecmp(url, "http://", 7) == 0 || strncmp(url, "//", 2) == 0) {
+        const char* authority = url + (url[0] == '/' ? 2 : 7);
+        const char* slash = strchr(authority, '/');
+        size_t auth_len = slash ? (size_t)(slash - authority) : strlen(authority);
+        if(!same_origin(page, authority, auth_len)) return -1;
+        path = slash ? slash : "/";
+    } else if(strchr(url, ':') && strcspn(url, ":") < strcspn(url, "/?")) {
+        return -1;               // https:, data:, javascript:, mailto: ...
+    }
+
+    if(path[0] == '/') {
+        snprintf(out->path, sizeof(out->path), "%s", path);
+    } else {
+        // Relative to the page's directory, ignoring its query
+        size_t dir_len = strcspn(page->path, "?");
+        while(dir_len > 0 && page->path[dir_len - 1] != '/') dir_len--;
+        if(dir_len + strlen(path) >= sizeof(out->path)) return -1;
+        memcpy(out->path, page->path, dir_len);
+        strcpy(out->path + dir_len, path);
+    }
+    // Dot segments only apply to the path, not the query
+    char* query = strchr(out->path, '?');
+    char saved[MAX_PATH] = "";
+    if(query) {
+        snprintf(saved, sizeof(saved), "%s", query);
+        *query = '\0';
+    }
+    remove_dot_segments(out->path);
+    if(strlen(out->path) + strlen(saved) >= sizeof(out->path)) return -1;
+    strcat(out->path, saved);
+
+    snprintf(out->host, sizeof(out->host), "%s", page->host);
+    out->port = page->port;
+    out->kind = JOB_RESOURCE;
+    out->html = NULL;
+    return 0;
+}
+
+// The reference a tag loads, if it is one we prefetch
+static int tag_reference(struct span tag, const char* p, const char* end, struct span* ref){
+    int link = span_is(tag, "link");
+    if(!link && !span_is(tag, "script") && !span_is(tag, "img")) return 0;
+
+    struct span name, value, rel = { "", 0 };
+    ref->len = 0;
+    while((p = next_attribute(p, end, &name, &value))) {
+        if(link && span_is(name, "href")) *ref = value;
+        else if(link && span_is(name, "rel")) rel = value;
+        else if(!link && span_is(name, "src")) *ref = value;
+    }
+    if(ref->len == 0) return 0;
+    return !link || fetched_link_rel(rel);
+}
+
+static void scan_page(const struct prefetch_job* page){
+    const char* p = page->html;
+    const char* end = page->html + page->html_len;
+    int queued = 0;
+
+    while(queued < PREFETCH_MAX_LINKS && (p = memchr(p, '<', end - p))) {
+        p++;
+        if(end - p >= 3 && strncmp(p, "!--", 3) == 0) {
+            const char* close = memmem(p, end - p, "-->", 3);
+            if(!close) break;
+            p = close + 3;
+            continue;
+        }
+        struct span tag = { p, 0 };
+        while(p < end && !is_space(*p) && *p != '>' && *p != '/') p++;
+        tag.len = p - tag.p;
+        const char* tag_end = memchr(p, '>', end - p);
+        if(!tag_end) break;
+
+        struct span ref;
+        struct prefetch_job job;
+        if(tag_reference(tag, p, tag_end, &ref) && resolve_reference(page, ref, &job) == 0) {
+            char key[MAX_HOST + MAX_PATH + 16];
+            resource_key(&job, key, sizeof(key));
+            uint64_t h = hash_key(key);
+            long long now = monotonic_ns();
+
+            // Keys another node owns are left to that node
+            if(!cluster_is_local(key) || cache_contains(key)) {
+                __atomic_add_fetch(&skipped, 1, __ATOMIC_RELAXED);
+            } else {
+                pthread_mutex_lock(&queue_lock);
+                int slot = h % RECENT_SLOTS;
+                if(recent[slot].hash == h && now - recent[slot].queued_ns < RECENT_WINDOW_NS) {
+                    __atomic_add_fetch(&skipped, 1, __ATOMIC_RELAXED);
+                } else if(enqueue(&job) == 0) {
+                    recent[slot].hash = h;
+                    recent[slot].queued_ns = now;
+                    queued++;
+                }
+                pthread_mutex_unlock(&queue_lock);
+            }
+        }
+        p = tag_end + 1;
+    }
+    if(queued > 0) {
+        printf("[PREFETCH] Queued %d resource(s) from %s:%d%s\n", queued, page->host, page->port, page->path);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Workers
+// ---------------------------------------------------------------------------
+
+// Wait for the pacing budget, then fetch; the bytes pay for later fetches
+static void fetch_resource(const struct prefetch_job* job){
+    char key[MAX_HOST + MAX_PATH + 16];
+    resource_key(job, key, sizeof(key));
+    if(cache_contains(key)) {
+        __atomic_add_fetch(&skipped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    if(budget_bytes_per_sec > 0) {
+        pthread_mutex_lock(&budget_lock);
+        long long wait = next_fetch_ns - monotonic_ns();
+        pthread_mutex_unlock(&budget_lock);
+        if(wait > 0) {
+            struct timespec ts = { wait / 1000000000LL, wait % 1000000000LL };
+            nanosleep(&ts, NULL);
+        }
+    }
+
+    long bytes = fetch(job->host, job->port, job->path, PREFETCH_MAX_OBJECT);
+    if(bytes > 0 && budget_bytes_per_sec > 0) {
+        pthread_mutex_lock(&budget_lock);
+        long long now = monotonic_ns();
+        if(next_fetch_ns < now) next_fetch_ns = now;
+        next_fetch_ns += bytes * 1000000000LL / budget_bytes_per_sec;
+        pthread_mutex_unlock(&budget_lock);
+    }
+    if(bytes >= 0) __atomic_add_fetch(&fetched, 1, __ATOMIC_RELAXED);
+    printf("[PREFETCH] %s %s (%ld bytes; %lu fetched, %lu skipped, %lu dropped)\n",
+           bytes > 0 ? "Warmed" : "Could not warm", key, bytes > 0 ? bytes : 0, fetched, skipped, dropped);
+}
+
+static void* worker_fn(void* arg){
+    (void)arg;
+    for(;;) {
+        pthread_mutex_lock(&queue_lock);
+        while(queue_count == 0) {
+            pthread_cond_wait(&queue_cond, &queue_lock);
+        }
+        struct prefetch_job job = queue[queue_head];
+        queue_head = (queue_head + 1) % queue_capacity;
+        queue_count--;
+        pthread_mutex_unlock(&queue_lock);
+
+        if(job.kind == JOB_PAGE) {
+            scan_page(&job);
+            free(job.html);
+        } else {
+            fetch_resource(&job);
+        }
+    }
+    return NULL;
+}
+
+int prefetch_init(int workers, int queue_size, long bytes_per_sec, prefetch_fetcher fetcher){
+    if(workers <= 0 || queue_size <= 0 || !fetcher) return 0;
+    queue = calloc(queue_size, sizeof(*queue));
+    if(!queue) {
+        perror("[PREFETCH] Failed to allocate queue");
+        return -1;
+    }
+    queue_capacity = queue_size;
+    budget_bytes_per_sec = bytes_per_sec;
+    fetch = fetcher;
+
+    for(int i = 0; i < workers; i++) {
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, worker_fn, NULL) != 0) {
+            perror("[PREFETCH] Failed to start worker");
+            return -1;
+        }
+        pthread_detach(thread);
+    }
+    printf("[PREFETCH] %d worker(s), queue %d, budget %ld KB/s\n",
+           workers, queue_size, bytes_per_sec >> 10);
+    return 0;
+}
+
+// Set up a page job with room for the first len bytes of the HTML
+static int page_job(struct prefetch_job* job, const char* host, int port, const char* path, long len){
+    if(!queue || !host || !path || len <= 0) return -1;
+    if(strlen(host) >= MAX_HOST || strlen(path) >= MAX_PATH) return -1;
+
+    memset(job, 0, sizeof(*job));
+    job->kind = JOB_PAGE;
+    snprintf(job->host, sizeof(job->host), "%s", host);
+    job->port = port;
+    snprintf(job->path, sizeof(job->path), "%s", path);
+    job->html_len = len < PREFETCH_SCAN_MAX ? len : PREFETCH_SCAN_MAX;
+    job->html = malloc(job->html_len);
+    return job->html ? 0 : -1;
+}
+
+static void queue_page(struct prefetch_job* job){
+    pthread_mutex_lock(&queue_lock);
+    int queued = enqueue(job);
+    pthread_mutex_unlock(&queue_lock);
+    if(queued < 0) free(job->html);
+}
+
+void prefetch_page(const char* host, int port, const char* path, const char* html, long len){
+    struct prefetch_job job;
+    if(page_job(&job, host, port, path, len) < 0) return;
+    memcpy(job.html, html, job.html_len);
+    queue_page(&job);
+}
+
+void prefetch_page_chain(const char* host, int port, const char* path, const struct buffer_chain* html){
+    struct prefetch_job job;
+    if(page_job(&job, host, port, path, html->len) < 0) return;
+    chain_copy(html, 0, job.html, job.html_len);
+    queue_page(&job);
+}
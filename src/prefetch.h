@@ -0,0 +1,27 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+// Predictive prefetch. When a client's GET caches an HTML page, the page
+// is queued for a small pool of background workers. They scan it for
+// same-origin <link>, <script src> and <img src> references and fetch the
+// ones not already cached, so the page's sub-resources are warm before the
+// browser asks for them.
+//
+// The pool size bounds concurrent prefetches, and fetches are paced so that
+// together they stay under a bandwidth budget. When the queue is full, new
+// work is dropped; prefetching is best effort.
+
+// Fetch host:port/path into the cache. Returns the bytes fetched, 0 if the
+// resource was not cached, or -1 if the fetch failed.
+typedef long (*prefetch_fetcher)(const char* host, int port, const char* path, long max_bytes);
+
+// Start the workers. bytes_per_sec of 0 disables pacing.
+int prefetch_init(int workers, int queue_size, long bytes_per_sec, prefetch_fetcher fetcher);
+
+struct buffer_chain;
+
+// Queue an HTML page for scanning; the page is copied. No-op unless started.
+void prefetch_page(const char* host, int port, const char* path, const char* html, long len);
+void prefetch_page_chain(const char* host, int port, const char* path, const struct buffer_chain* html);
+
+#endif
@@ -51,6 +51,15 @@ static char* trim_whitespace(char* str) {
     return str;
 }
 
+// The ':' before the port, skipping a bracketed IPv6 literal ("[::1]:8080")
+static char* port_separator(char* host) {
+    if(*host == '[') {
+        char* close = strchr(host, ']');
+        return close && close[1] == ':' ? close + 1 : NULL;
+    }
+    return strchr(host, ':');
+}
+
 int ParsedRequest_parse(struct ParsedRequest* pr, const char* buffer, int buf_len) {
     if(!pr || !buffer || buf_len <= 0) return -1;
     
@@ -76,15 +85,17 @@ int ParsedRequest_parse(struct ParsedRequest* pr, const char* buffer, int buf_le
     }
     
     // Parse request line
-    char* line = strtok(buf_copy, "\r\n");
+    char* line_pos;
+    char* line = strtok_r(buf_copy, "\r\n", &line_pos);
     if(!line) {
         free(buf_copy);
         return -1;
     }
     
-    char* method = strtok(line, " ");
-    char* url = strtok(NULL, " ");
-    char* version = strtok(NULL, " ");
+    char* request_line_pos;
+    char* method = strtok_r(line, " ", &request_line_pos);
+    char* url = strtok_r(NULL, " ", &request_line_pos);
+    char* version = strtok_r(NULL, " ", &request_line_pos);
     
     if(!method || !url || !version) {
         free(buf_copy);
@@ -101,6 +112,11 @@ int ParsedRequest_parse(struct ParsedRequest* pr, const char* buffer, int buf_le
         return -1;
     }
     
+    // The fragment is for the client alone: it is neither forwarded nor
+    // part of the cache key, which reserves '#' for slice keys
+    char* fragment = strchr(url_copy, '#');
+    if(fragment) *fragment = '\0';
+    
     // Check if URL has protocol
     if(strncmp(url_copy, "http://", 7) == 0) {
         pr->protocol = duplicate_string("http", 4);
@@ -115,7 +131,7 @@ int ParsedRequest_parse(struct ParsedRequest* pr, const char* buffer, int buf_le
         }
         
         // Parse host and port
-        char* port_start = strchr(host_start, ':');
+        char* port_start = port_separator(host_start);
         if(port_start) {
             pr->port = duplicate_string(port_start + 1, strlen(port_start + 1));
             *port_start = '\0';
@@ -134,7 +150,7 @@ int ParsedRequest_parse(struct ParsedRequest* pr, const char* buffer, int buf_le
     
     // Parse headers
     char* header_line;
-    while((header_line = strtok(NULL, "\r\n")) && pr->header_count < MAX_HEADERS) {
+    while((header_line = strtok_r(NULL, "\r\n", &line_pos)) && pr->header_count < MAX_HEADERS) {
         if(strlen(header_line) == 0) break;
         
         pr->headers[pr->header_count] = duplicate_string(header_line, strlen(header_line));
@@ -144,7 +160,7 @@ int ParsedRequest_parse(struct ParsedRequest* pr, const char* buffer, int buf_le
             char* host_value = header_line + 5;
             host_value = trim_whitespace(host_value);
             
-            char* port_sep = strchr(host_value, ':');
+            char* port_sep = port_separator(host_value);
             if(port_sep) {
                 pr->host = duplicate_string(host_value, port_sep - host_value);
                 pr->port = duplicate_string(port_sep + 1, strlen(port_sep + 1));
@@ -205,6 +221,20 @@ int ParsedRequest_unparse(struct ParsedRequest* pr, char* buffer, int buf_len) {
     return written;
 }
 
+const char* ParsedRequest_header(struct ParsedRequest* pr, const char* name) {
+    if(!pr || !name) return NULL;
+    size_t name_len = strlen(name);
+    for(int i = 0; i < pr->header_count; i++) {
+        const char* line = pr->headers[i];
+        if(line && strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            const char* value = line + name_len + 1;
+            while(*value == ' ' || *value == '\t') value++;
+            return value;
+        }
+    }
+    return NULL;
+}
+
 void ParsedRequest_print(struct ParsedRequest* pr) {
     if(!pr) return;
     
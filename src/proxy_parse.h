@@ -36,6 +36,7 @@ struct ParsedRequest* ParsedRequest_create();
 void ParsedRequest_destroy(struct ParsedRequest* pr);
 int ParsedRequest_parse(struct ParsedRequest* pr, const char* buffer, int buf_len);
 int ParsedRequest_unparse(struct ParsedRequest* pr, char* buffer, int buf_len);
+const char* ParsedRequest_header(struct ParsedRequest* pr, const char* name);  // Value or NULL
 void ParsedRequest_print(struct ParsedRequest* pr);
 
 #endif
@@ -0,0 +1,133 @@
+#include "ratelimit.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define PROBE_LIMIT 8            // Slots probed before evicting the stalest
+#define MILLI_TOKENS 1000        // Tokens are stored in thousandths
+
+// 16 bytes per client. state packs the last refill time in ms (high 32
+// bits) with the bucket level in milli-tokens (low 32 bits), so a refill
+// and take is a single compare-and-swap.
+struct bucket_slot {
+    uint32_t ip;                 // 0 marks an empty slot
+    uint32_t reserved;
+    uint64_t state;
+};
+
+static struct bucket_slot* table = NULL;
+static uint32_t table_mask = 0;
+static double refill_per_ms = 0;  // Milli-tokens added per millisecond
+static uint32_t capacity = 0;     // Bucket size in milli-tokens
+static double tokens_per_sec = 0;
+static struct timespec epoch;
+
+static uint32_t now_ms(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)((ts.tv_sec - epoch.tv_sec) * 1000 + (ts.tv_nsec - epoch.tv_nsec) / 1000000);
+}
+
+static uint32_t hash_ip(uint32_t ip){
+    ip ^= ip >> 16;
+    ip *= 0x7feb352d;
+    ip ^= ip >> 15;
+    ip *= 0x846ca68b;
+    ip ^= ip >> 16;
+    return ip;
+}
+
+int ratelimit_init(double rate, int burst, int table_size){
+    if(rate <= 0) return 0;
+
+    // Round the table up to a power of two for mask indexing
+    uint32_t size = 64;
+    while(size < (uint32_t)table_size && size < (1u << 24)) size <<= 1;
+
+    table = calloc(size, sizeof(*table));
+    if(!table) {
+        perror("[RATELIMIT] Failed to allocate bucket table");
+        return -1;
+    }
+    table_mask = size - 1;
+    tokens_per_sec = rate;
+    refill_per_ms = rate;  // rate tokens/s == rate milli-tokens/ms
+    capacity = (uint32_t)(burst > 0 ? burst : 1) * MILLI_TOKENS;
+    clock_gettime(CLOCK_MONOTONIC, &epoch);
+
+    printf("[RATELIMIT] %.1f requests/s per client, burst %d, %u slots (%zu bytes)\n",
+           rate, burst, size, size * sizeof(*table));
+    return 0;
+}
+
+static struct bucket_slot* find_slot(uint32_t ip, uint32_t now){
+    uint32_t start = hash_ip(ip) & table_mask;
+    struct bucket_slot* stalest = NULL;
+    uint32_t stalest_age = 0;
+
+    for(uint32_t i = 0; i < PROBE_LIMIT; i++) {
+        struct bucket_slot* slot = &table[(start + i) & table_mask];
+        uint32_t owner = __atomic_load_n(&slot->ip, __ATOMIC_ACQUIRE);
+        if(owner == ip) return slot;
+
+        if(owner == 0) {
+            uint32_t expected = 0;
+            if(__atomic_compare_exchange_n(&slot->ip, &expected, ip, 0,
+                                           __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(&slot->state, ((uint64_t)now << 32) | capacity, __ATOMIC_RELEASE);
+                return slot;
+            }
+            if(expected == ip) return slot;
+            // Another client claimed it first; it is a candidate like any
+            // occupied slot, so stalest is set once the window is probed
+        }
+
+        uint32_t age = now - (uint32_t)(__atomic_load_n(&slot->state, __ATOMIC_RELAXED) >> 32);
+        if(!stalest || age > stalest_age) {
+            stalest = slot;
+            stalest_age = age;
+        }
+    }
+
+    // Window full: take over the least recently refilled client. A racing
+    // update of the old owner may briefly apply to the new one, which only
+    // costs precision, never safety.
+    __atomic_store_n(&stalest->state, ((uint64_t)now << 32) | capacity, __ATOMIC_RELEASE);
+    __atomic_store_n(&stalest->ip, ip, __ATOMIC_RELEASE);
+    return stalest;
+}
+
+int ratelimit_allow(uint32_t ip, int* retry_after){
+    if(!table || ip == 0) return 1;
+
+    uint32_t now = now_ms();
+    struct bucket_slot* slot = find_slot(ip, now);
+
+    uint64_t old = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+    for(;;) {
+        uint32_t last = (uint32_t)(old >> 32);
+        uint64_t tokens = (uint32_t)old;
+        uint64_t refill = (uint64_t)((uint32_t)(now - last) * refill_per_ms);
+
+        // Only move the refill clock when tokens were actually added, so
+        // slow rates still accumulate fractional progress
+        if(refill > 0) {
+            tokens += refill;
+            if(tokens > capacity) tokens = capacity;
+            last = now;
+        }
+
+        int allowed = tokens >= MILLI_TOKENS;
+        if(allowed) tokens -= MILLI_TOKENS;
+
+        uint64_t updated = ((uint64_t)last << 32) | tokens;
+        if(__atomic_compare_exchange_n(&slot->state, &old, updated, 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            if(!allowed && retry_after) {
+                double wait = (MILLI_TOKENS - tokens) / (tokens_per_sec * MILLI_TOKENS);
+                *retry_after = (int)wait + 1;
+            }
+            return allowed;
+        }
+    }
+}
@@ -0,0 +1,15 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdint.h>
+
+// Per-client-IP token buckets kept in a fixed open-addressing table.
+// Each slot is updated with compare-and-swap, so any thread may call
+// ratelimit_allow without taking a lock.
+int ratelimit_init(double rate, int burst, int table_size);
+
+// Returns 1 if a request from ip (network byte order) may proceed. When it
+// may not, *retry_after is set to the seconds until a token is available.
+int ratelimit_allow(uint32_t ip, int* retry_after);
+
+#endif
@@ -0,0 +1,225 @@
+#include "response.h"
+#include "egress.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+const char* response_status_text(int status){
+    switch(status) {
+        case 100: return "Continue";
+        case 200: return "OK";
+        case 201: return "Created";
+        case 204: return "No Content";
+        case 203: return "Non-Authoritative Information";
+        case 206: return "Partial Content";
+        case 300: return "Multiple Choices";
+        case 301: return "Moved Permanently";
+        case 304: return "Not Modified";
+        case 308: return "Permanent Redirect";
+        case 400: return "Bad Request";
+        case 403: return "Forbidden";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 408: return "Request Timeout";
+        case 412: return "Precondition Failed";
+        case 410: return "Gone";
+        case 413: return "Payload Too Large";
+        case 416: return "Range Not Satisfiable";
+        case 429: return "Too Many Requests";
+        case 500: return "Internal Server Error";
+        case 502: return "Bad Gateway";
+        case 503: return "Service Unavailable";
+        case 504: return "Gateway Timeout";
+        default: return "Error";
+    }
+}
+
+void response_socket_init(int sock){
+    // Responses are written whole or corked, so Nagle only adds latency
+    int on = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+void response_cork(int sock, int on){
+    setsockopt(sock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+static void head_append(struct response* r, const char* fmt, va_list args){
+    if(r->truncated) return;
+    int space = RESPONSE_HEAD_MAX - r->head_len;
+    int n = vsnprintf(r->head + r->head_len, space, fmt, args);
+    if(n < 0 || n >= space) {
+        r->truncated = 1;
+        return;
+    }
+    r->head_len += n;
+}
+
+static void head_printf(struct response* r, const char* fmt, ...){
+    va_list args;
+    va_start(args, fmt);
+    head_append(r, fmt, args);
+    va_end(args);
+}
+
+void response_start(struct response* r, int sock, int status){
+    r->sock = sock;
+    r->head_len = 0;
+    r->truncated = 0;
+    r->segments = 0;
+    r->body_len = 0;
+    r->keep_alive = 0;
+    head_printf(r, "HTTP/1.1 %d %s\r\n", status, response_status_text(status));
+}
+
+void response_header(struct response* r, const char* name, const char* fmt, ...){
+    head_printf(r, "%s: ", name);
+    va_list args;
+    va_start(args, fmt);
+    head_append(r, fmt, args);
+    va_end(args);
+    head_printf(r, "\r\n");
+}
+
+void response_header_block(struct response* r, const char* block, size_t len){
+    if(r->truncated) return;
+    if(len > (size_t)(RESPONSE_HEAD_MAX - r->head_len)) {
+        r->truncated = 1;
+        return;
+    }
+    memcpy(r->head + r->head_len, block, len);
+    r->head_len += len;
+}
+
+void response_body(struct response* r, const void* data, size_t len){
+    if(len == 0) return;
+    if(r->segments == RESPONSE_MAX_SEGMENTS) {
+        r->truncated = 1;
+        return;
+    }
+    r->body[r->segments].iov_base = (void*)data;
+    r->body[r->segments].iov_len = len;
+    r->segments++;
+    r->body_len += len;
+}
+
+// Close the header block for a body of content_length bytes (omitted if < 0)
+static int finish_head(struct response* r, long content_length){
+    if(content_length >= 0) head_printf(r, "Content-Length: %ld\r\n", content_length);
+    if(!r->keep_alive) head_printf(r, "Connection: close\r\n");
+    head_printf(r, "\r\n");
+    if(r->truncated) {
+        printf("[HTTP] Response headers too large, not sent\n");
+        return -1;
+    }
+    return 0;
+}
+
+int response_send(struct response* r){
+    if(finish_head(r, r->body_len) < 0) return -1;
+    struct iovec iov[RESPONSE_MAX_SEGMENTS + 1];
+    iov[0].iov_base = r->head;
+    iov[0].iov_len = r->head_len;
+    memcpy(iov + 1, r->body, r->segments * sizeof(struct iovec));
+    return response_write(r->sock, iov, r->segments + 1);
+}
+
+int response_send_headers(struct response* r, long content_length){
+    if(finish_head(r, content_length) < 0) return -1;
+    return response_write_all(r->sock, r->head, r->head_len);
+}
+
+long response_send_file(struct response* r, file_entry* file){
+    if(finish_head(r, file->file.size) < 0) return -1;
+    // In-memory files go out in one writev; others take several syscalls
+    int cork = file->data == NULL;
+    if(cork) response_cork(r->sock, 1);
+    long sent = file_cache_send(r->sock, file, r->head, r->head_len);
+    if(cork) response_cork(r->sock, 0);
+    return sent;
+}
+
+int response_send_chain(struct response* r, const void* prefix, size_t prefix_len,
+                        const struct buffer_chain* chain){
+    if(finish_head(r, prefix_len + chain->len) < 0) return -1;
+    struct iovec iov[RESPONSE_CHAIN_BATCH + 2];
+    iov[0].iov_base = r->head;
+    iov[0].iov_len = r->head_len;
+    iov[1].iov_base = (void*)prefix;
+    iov[1].iov_len = prefix_len;
+    const struct chain_segment* next = chain->head;
+    int count = 2 + chain_iov(chain, &next, iov + 2, RESPONSE_CHAIN_BATCH);
+    // A chain longer than one batch takes several writes; keep them corked
+    int cork = next != NULL;
+    if(cork) response_cork(r->sock, 1);
+    int result = response_write(r->sock, iov, count);
+    while(result == 0 && next) {
+        count = chain_iov(chain, &next, iov, RESPONSE_CHAIN_BATCH);
+        result = response_write(r->sock, iov, count);
+    }
+    if(cork) response_cork(r->sock, 0);
+    return result;
+}
+
+int response_write_chain(int sock, const struct buffer_chain* chain, long offset, long len){
+    struct iovec iov[RESPONSE_CHAIN_BATCH];
+    int count = 0;
+    int start = chain->start;
+    for(const struct chain_segment* seg = chain->head; seg && len > 0; seg = seg->next, start = 0) {
+        long avail = seg->len - start;
+        if(offset >= avail) {
+            offset -= avail;
+            continue;
+        }
+        long n = avail - offset < len ? avail - offset : len;
+        iov[count].iov_base = (void*)(seg->data + start + offset);
+        iov[count].iov_len = n;
+        count++;
+        len -= n;
+        offset = 0;
+        if(count == RESPONSE_CHAIN_BATCH) {
+            if(response_write(sock, iov, count) < 0) return -1;
+            count = 0;
+        }
+    }
+    return count > 0 ? response_write(sock, iov, count) : 0;
+}
+
+int response_send_status(int sock, int status){
+    struct response r;
+    response_start(&r, sock, status);
+    return response_send(&r);
+}
+
+int response_write(int sock, struct iovec* iov, int count){
+    for(;;) {
+        while(count > 0 && iov->iov_len == 0) {
+            iov++;
+            count--;
+        }
+        if(count == 0) break;
+        ssize_t n = egress_send(sock, iov, count);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return -1;
+        // Skip what was written and resume mid-segment if needed
+        while(count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if(count > 0 && n > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+int response_write_all(int sock, const void* data, size_t len){
+    struct iovec iov = { (void*)data, len };
+    return response_write(sock, &iov, 1);
+}
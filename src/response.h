@@ -0,0 +1,67 @@
+#ifndef RESPONSE_H
+#define RESPONSE_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include "file_cache.h"
+#include "buffer_chain.h"
+
+// Response writer shared by the handlers. The status line and headers are
+// formatted into one buffer, body segments are referenced in place, and the
+// whole response leaves in a single sendmsg, so a small response is a single
+// packet. Sends that take several syscalls (headers followed by a file) run
+// under TCP_CORK so the headers are not pushed out on their own.
+
+#define RESPONSE_HEAD_MAX 2048
+#define RESPONSE_MAX_SEGMENTS 8
+#define RESPONSE_CHAIN_BATCH 256         // Chain segments per gathered write
+
+struct response {
+    int sock;
+    char head[RESPONSE_HEAD_MAX];
+    int head_len;
+    int truncated;               // A header did not fit; the response is not sent
+    struct iovec body[RESPONSE_MAX_SEGMENTS];
+    int segments;
+    long body_len;
+    int keep_alive;              // Omit "Connection: close"
+};
+
+const char* response_status_text(int status);
+
+// Per-connection socket options (TCP_NODELAY); call once after accept
+void response_socket_init(int sock);
+
+void response_start(struct response* r, int sock, int status);
+void response_header(struct response* r, const char* name, const char* fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+// Append preformatted "Name: value\r\n" lines
+void response_header_block(struct response* r, const char* block, size_t len);
+// Append a body segment; data is not copied and must live until the send
+void response_body(struct response* r, const void* data, size_t len);
+
+// Add Content-Length and send everything. Returns 0 or -1.
+int response_send(struct response* r);
+// Send only the headers, for HEAD and 304. content_length describes the
+// body a GET would get; < 0 leaves Content-Length out.
+int response_send_headers(struct response* r, long content_length);
+// Send the headers followed by a cached file as the body. Returns bytes of
+// file content sent, or -1.
+long response_send_file(struct response* r, file_entry* file);
+// Send the headers, then prefix and the chain as the body, gathering up to
+// RESPONSE_CHAIN_BATCH segments per write. Returns 0 or -1.
+int response_send_chain(struct response* r, const void* prefix, size_t prefix_len,
+                        const struct buffer_chain* chain);
+// Write len bytes of chain starting at offset, gathered like
+// response_send_chain. Returns 0 or -1.
+int response_write_chain(int sock, const struct buffer_chain* chain, long offset, long len);
+// Headers-only response with an empty body
+int response_send_status(int sock, int status);
+
+// Write all of iov / data, continuing after partial writes. Returns 0 or -1.
+int response_write(int sock, struct iovec* iov, int count);
+int response_write_all(int sock, const void* data, size_t len);
+
+void response_cork(int sock, int on);
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// SHA-256 (FIPS 180-4), used to address stored chunks by content
+struct sha256_ctx {
+    uint32_t state[8];
+    uint64_t length;             // Bytes hashed so far
+    unsigned char block[64];
+    size_t used;                 // Bytes waiting in block
+};
+
+void sha256_init(struct sha256_ctx* ctx);
+void sha256_update(struct sha256_ctx* ctx, const void* data, size_t len);
+void sha256_final(struct sha256_ctx* ctx, unsigned char digest[32]);
+
+// One-shot digest as 64 lowercase hex characters plus NUL
+void sha256_hex(const void* data, size_t len, char hex[65]);
+
+#endif
@@ -0,0 +1,578 @@
+#include "shm_cache.h"
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#define SHM_MAGIC 0x50584341u      // "PXCA"
+#define SHM_VERSION 2
+#define ALIGN 16
+#define MIN_SPLIT 64               // Smallest free remainder worth keeping
+#define ALLOCATED ((uint64_t)-1)   // next value of a block in use
+#define PIN_SLOTS 64               // Processes that can hold handles at once
+
+// Allocator block header; size includes the header
+struct shm_block {
+    uint64_t size;
+    uint64_t next;                 // Next free block, or ALLOCATED
+};
+
+struct shm_entry {
+    uint64_t hash;
+    uint64_t hash_next;            // Bucket chain
+    uint64_t lru_prev;             // Towards most recently used
+    uint64_t lru_next;             // Towards least recently used
+    int32_t refs;                  // Handles currently pinning the entry
+    int32_t detached;              // Unlinked; freed when refs reaches 0
+    int64_t lru_time;
+    int32_t len;
+    int32_t url_len;
+    int64_t accounted;             // Bytes charged to cache_size
+    int64_t hits;                  // Lookups that found the entry
+    // url (url_len + 1 bytes) followed by data (len + 1 bytes)
+};
+
+// Handles held by one process, so a dead worker's can be written off
+struct shm_pins {
+    int32_t pid;                   // 0 = free
+    int32_t count;
+};
+
+struct shm_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t segment_size;
+    uint64_t generation;           // Bumped whenever the index is reset
+    int32_t quarantined;           // Heap kept for earlier handles; nothing is allocated
+    pthread_mutex_t lock;          // Process-shared, robust
+    uint64_t bucket_count;
+    uint64_t buckets_off;
+    uint64_t heap_off;
+    uint64_t heap_size;
+    uint64_t free_head;
+    uint64_t lru_head;
+    uint64_t lru_tail;
+    int64_t cache_size;
+    int64_t max_size;
+    int64_t max_element;
+    uint64_t entries;
+    struct shm_pins pins[PIN_SLOTS];
+};
+
+// Handle returned by shm_cache_find; data and url point into the segment
+struct shm_handle {
+    cache_element element;
+    uint64_t entry_off;
+    uint64_t generation;
+    int slot;                      // Entry of hdr->pins charged for the handle
+};
+
+static char* base = NULL;
+static struct shm_header* hdr = NULL;
+static int segment_fd = -1;
+
+#define PTR(off) ((void*)(base + (off)))
+#define OFF(ptr) ((uint64_t)((char*)(ptr) - base))
+#define ENTRY(off) ((struct shm_entry*)PTR(off))
+
+static uint64_t align_up(uint64_t v){
+    return (v + ALIGN - 1) & ~(uint64_t)(ALIGN - 1);
+}
+
+static uint64_t hash_url(const char* url){
+    uint64_t h = 1469598103934665603ULL;  // FNV-1a
+    for(; *url; url++) {
+        h ^= (unsigned char)*url;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static uint64_t* buckets(){
+    return (uint64_t*)PTR(hdr->buckets_off);
+}
+
+static char* entry_url(struct shm_entry* e){
+    return (char*)(e + 1);
+}
+
+static char* entry_data(struct shm_entry* e){
+    return entry_url(e) + e->url_len + 1;
+}
+
+// ---------------------------------------------------------------------------
+// Allocator: address-ordered first-fit free list with coalescing
+// ---------------------------------------------------------------------------
+
+static uint64_t shm_alloc(uint64_t bytes){
+    uint64_t total = align_up(bytes + sizeof(struct shm_block));
+    uint64_t prev = 0, cur = hdr->free_head;
+    while(cur) {
+        struct shm_block* b = PTR(cur);
+        if(b->size >= total) {
+            if(b->size - total >= MIN_SPLIT) {
+                // Carve from the end so the free list links stay put
+                b->size -= total;
+                struct shm_block* taken = PTR(cur + b->size);
+                taken->size = total;
+                taken->next = ALLOCATED;
+                return OFF(taken) + sizeof(struct shm_block);
+            }
+            if(prev) ((struct shm_block*)PTR(prev))->next = b->next;
+            else hdr->free_head = b->next;
+            b->next = ALLOCATED;
+            return cur + sizeof(struct shm_block);
+        }
+        prev = cur;
+        cur = b->next;
+    }
+    return 0;
+}
+
+static void shm_free(uint64_t off){
+    uint64_t blk_off = off - sizeof(struct shm_block);
+    struct shm_block* blk = PTR(blk_off);
+
+    uint64_t prev = 0, cur = hdr->free_head;
+    while(cur && cur < blk_off) {
+        prev = cur;
+        cur = ((struct shm_block*)PTR(cur))->next;
+    }
+
+    blk->next = cur;
+    if(prev) ((struct shm_block*)PTR(prev))->next = blk_off;
+    else hdr->free_head = blk_off;
+
+    // Merge with the following block, then with the preceding one
+    if(cur && blk_off + blk->size == cur) {
+        struct shm_block* next = PTR(cur);
+        blk->size += next->size;
+        blk->next = next->next;
+    }
+    if(prev) {
+        struct shm_block* p = PTR(prev);
+        if(prev + p->size == blk_off) {
+            p->size += blk->size;
+            p->next = blk->next;
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Index
+// ---------------------------------------------------------------------------
+
+// One free block over the whole heap
+static void rebuild_heap(){
+    struct shm_block* heap = PTR(hdr->heap_off);
+    heap->size = hdr->heap_size;
+    heap->next = 0;
+    hdr->free_head = hdr->heap_off;
+    hdr->quarantined = 0;
+}
+
+static long pinned(){
+    long count = 0;
+    for(int i = 0; i < PIN_SLOTS; i++) {
+        if(hdr->pins[i].pid) count += hdr->pins[i].count;
+    }
+    return count;
+}
+
+// Empty the index. Handles from before the reset still point into the heap,
+// so while any are held the heap is quarantined rather than reused: lookups
+// miss, adds are skipped, and the last release rebuilds it.
+static void reset_index(){
+    memset(buckets(), 0, hdr->bucket_count * sizeof(uint64_t));
+    hdr->free_head = 0;
+    hdr->lru_head = 0;
+    hdr->lru_tail = 0;
+    hdr->cache_size = 0;
+    hdr->entries = 0;
+    hdr->generation++;
+    if(pinned() > 0) hdr->quarantined = 1;
+    else rebuild_heap();
+}
+
+// Slot in hdr->pins for this process, claimed on first use. Caller holds
+// the lock.
+static int pin_slot(){
+    static int slot = -1;          // Inherited across fork, hence the pid check
+    int32_t pid = getpid();
+    if(slot >= 0 && hdr->pins[slot].pid == pid) return slot;
+    slot = -1;
+    for(int i = 0; i < PIN_SLOTS; i++) {
+        if(hdr->pins[i].pid == pid) return slot = i;
+        if(slot < 0 && hdr->pins[i].pid == 0) slot = i;
+    }
+    if(slot >= 0) {
+        hdr->pins[slot].pid = pid;
+        hdr->pins[slot].count = 0;
+    }
+    return slot;
+}
+
+static void shm_lock(){
+    trace_begin(TRACE_CACHE_LOCK);
+    int r = pthread_mutex_lock(&hdr->lock);
+    trace_end(TRACE_CACHE_LOCK);
+    if(r == EOWNERDEAD) {
+        // A worker died mid-update; the index cannot be trusted, start over
+        printf("[SHM CACHE] Previous lock owner died, resetting shared cache\n");
+        reset_index();
+        pthread_mutex_consistent(&hdr->lock);
+    }
+}
+
+static void shm_unlock(){
+    pthread_mutex_unlock(&hdr->lock);
+}
+
+static void lru_unlink(struct shm_entry* e){
+    if(e->lru_prev) ENTRY(e->lru_prev)->lru_next = e->lru_next;
+    else hdr->lru_head = e->lru_next;
+    if(e->lru_next) ENTRY(e->lru_next)->lru_prev = e->lru_prev;
+    else hdr->lru_tail = e->lru_prev;
+    e->lru_prev = e->lru_next = 0;
+}
+
+static void lru_push_front(struct shm_entry* e){
+    uint64_t off = OFF(e);
+    e->lru_prev = 0;
+    e->lru_next = hdr->lru_head;
+    if(hdr->lru_head) ENTRY(hdr->lru_head)->lru_prev = off;
+    hdr->lru_head = off;
+    if(!hdr->lru_tail) hdr->lru_tail = off;
+}
+
+static struct shm_entry* lookup(const char* url, uint64_t h, uint64_t** link_out){
+    uint64_t* link = &buckets()[h & (hdr->bucket_count - 1)];
+    while(*link) {
+        struct shm_entry* e = ENTRY(*link);
+        if(e->hash == h && strcmp(entry_url(e), url) == 0) {
+            if(link_out) *link_out = link;
+            return e;
+        }
+        link = &e->hash_next;
+    }
+    return NULL;
+}
+
+// Remove an entry from the index; its memory goes once nobody pins it
+static void unlink_entry(struct shm_entry* e, uint64_t* link){
+    *link = e->hash_next;
+    lru_unlink(e);
+    hdr->cache_size -= e->accounted;
+    hdr->entries--;
+    if(e->refs > 0) e->detached = 1;
+    else shm_free(OFF(e));
+}
+
+static int evict_lru(){
+    if(!hdr->lru_tail) return 0;
+    struct shm_entry* e = ENTRY(hdr->lru_tail);
+    uint64_t* link;
+    if(!lookup(entry_url(e), e->hash, &link)) return 0;
+    printf("[SHM CACHE] Removing URL from cache: %s, freed %lld bytes\n", entry_url(e), (long long)e->accounted);
+    unlink_entry(e, link);
+    return 1;
+}
+
+// ---------------------------------------------------------------------------
+// Public API
+// ---------------------------------------------------------------------------
+
+int shm_cache_init(size_t segment_bytes, long max_size, long max_element){
+    segment_fd = memfd_create("proxy_cache", MFD_CLOEXEC);
+    if(segment_fd < 0) {
+        perror("[SHM CACHE] memfd_create failed");
+        return -1;
+    }
+    if(ftruncate(segment_fd, segment_bytes) != 0) {
+        perror("[SHM CACHE] ftruncate failed");
+        close(segment_fd);
+        segment_fd = -1;
+        return -1;
+    }
+    base = mmap(NULL, segment_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, segment_fd, 0);
+    if(base == MAP_FAILED) {
+        perror("[SHM CACHE] mmap failed");
+        close(segment_fd);
+        segment_fd = -1;
+        base = NULL;
+        return -1;
+    }
+
+    hdr = (struct shm_header*)base;
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->magic = SHM_MAGIC;
+    hdr->version = SHM_VERSION;
+    hdr->segment_size = segment_bytes;
+    hdr->max_size = max_size;
+    hdr->max_element = max_element;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&hdr->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    // One bucket per 4 KB of segment, rounded to a power of two
+    uint64_t bucket_count = 1024;
+    while(bucket_count < segment_bytes / 4096) bucket_count <<= 1;
+    hdr->bucket_count = bucket_count;
+    hdr->buckets_off = align_up(sizeof(*hdr));
+    hdr->heap_off = align_up(hdr->buckets_off + bucket_count * sizeof(uint64_t));
+    if(hdr->heap_off + 4096 > segment_bytes) {
+        printf("[SHM CACHE] Segment too small\n");
+        return -1;
+    }
+    hdr->heap_size = (segment_bytes - hdr->heap_off) & ~(uint64_t)(ALIGN - 1);
+    reset_index();
+
+    printf("[SHM CACHE] Shared cache segment: %zu bytes, %llu buckets\n",
+           segment_bytes, (unsigned long long)bucket_count);
+    return 0;
+}
+
+int shm_cache_enabled(void){
+    return hdr != NULL;
+}
+
+int shm_cache_fd(void){
+    return segment_fd;
+}
+
+cache_element* shm_cache_find(const char* url){
+    if(!url) return NULL;
+    uint64_t h = hash_url(url);
+
+    struct shm_handle* handle = malloc(sizeof(*handle));
+    if(!handle) return NULL;
+
+    shm_lock();
+    struct shm_entry* e = lookup(url, h, NULL);
+    int slot = e ? pin_slot() : -1;
+    if(slot < 0) {
+        shm_unlock();
+        free(handle);
+        printf("[SHM CACHE] URL not found in cache: %s\n", url);
+        return NULL;
+    }
+    e->refs++;
+    hdr->pins[slot].count++;
+    e->hits++;
+    e->lru_time = time(NULL);
+    lru_unlink(e);
+    lru_push_front(e);
+
+    memset(handle, 0, sizeof(*handle));
+    handle->element.data = entry_data(e);
+    handle->element.len = e->len;
+    handle->element.url = entry_url(e);
+    handle->element.lru_time_track = e->lru_time;
+    handle->element.refs = 1;
+    handle->element.hits = e->hits;
+    handle->element.shared = handle;
+    handle->entry_off = OFF(e);
+    handle->generation = hdr->generation;
+    handle->slot = slot;
+    shm_unlock();
+
+    printf("[SHM CACHE] Found URL: %s, updated LRU time\n", url);
+    return &handle->element;
+}
+
+int shm_cache_contains(const char* url){
+    uint64_t h = hash_url(url);
+    shm_lock();
+    int found = lookup(url, h, NULL) != NULL;
+    shm_unlock();
+    return found;
+}
+
+void shm_cache_release(cache_element* element){
+    struct shm_handle* handle = element->shared;
+    shm_lock();
+    // After a reset the entry no longer exists; only the handle is ours
+    if(handle->generation == hdr->generation) {
+        struct shm_entry* e = ENTRY(handle->entry_off);
+        if(--e->refs == 0 && e->detached) shm_free(handle->entry_off);
+    }
+    // A reaped worker's slot may have been taken over since
+    if(hdr->pins[handle->slot].pid == (int32_t)getpid()) hdr->pins[handle->slot].count--;
+    if(hdr->quarantined && pinned() == 0) {
+        printf("[SHM CACHE] Last earlier handle released, shared cache usable again\n");
+        rebuild_heap();
+    }
+    shm_unlock();
+    free(handle);
+}
+
+int shm_cache_add(const char* data, int size, const char* url){
+    struct iovec iov = { (void*)data, (size_t)size };
+    return shm_cache_addv(&iov, 1, url);
+}
+
+int shm_cache_addv(const struct iovec* iov, int count, const char* url){
+    if(!iov || !url) return 0;
+    long gathered = 0;
+    for(int i = 0; i < count; i++) gathered += iov[i].iov_len;
+    if(gathered <= 0 || gathered > INT32_MAX) return 0;
+    int size = (int)gathered;
+
+    int url_len = strlen(url);
+    uint64_t bytes = sizeof(struct shm_entry) + url_len + 1 + size + 1;
+    if((int64_t)bytes > hdr->max_element) {
+        printf("[SHM CACHE] Element size exceeds maximum (%llu bytes), skipping cache: %s\n",
+               (unsigned long long)bytes, url);
+        return 0;
+    }
+    uint64_t h = hash_url(url);
+
+    shm_lock();
+    if(hdr->quarantined) {
+        shm_unlock();
+        printf("[SHM CACHE] Segment quarantined after a reset, skipping cache: %s\n", url);
+        return 0;
+    }
+    uint64_t* link;
+    struct shm_entry* existing = lookup(url, h, &link);
+    if(existing) unlink_entry(existing, link);
+
+    while(hdr->cache_size + (int64_t)bytes > hdr->max_size && evict_lru());
+
+    uint64_t off;
+    while(!(off = shm_alloc(bytes))) {
+        if(!evict_lru()) {
+            shm_unlock();
+            printf("[SHM CACHE] Segment full, skipping cache: %s\n", url);
+            return 0;
+        }
+    }
+
+    struct shm_entry* e = ENTRY(off);
+    memset(e, 0, sizeof(*e));
+    e->hash = h;
+    e->len = size;
+    e->url_len = url_len;
+    e->lru_time = time(NULL);
+    e->accounted = bytes;
+    memcpy(entry_url(e), url, url_len + 1);
+    char* w = entry_data(e);
+    for(int i = 0; i < count; i++) {
+        memcpy(w, iov[i].iov_base, iov[i].iov_len);
+        w += iov[i].iov_len;
+    }
+    *w = '\0';
+
+    uint64_t* bucket = &buckets()[h & (hdr->bucket_count - 1)];
+    e->hash_next = *bucket;
+    *bucket = off;
+    lru_push_front(e);
+    hdr->cache_size += bytes;
+    hdr->entries++;
+    long long total = hdr->cache_size;
+    shm_unlock();
+
+    printf("[SHM CACHE] %s URL in cache: %s, size: %d bytes, total cache: %lld bytes\n",
+           existing ? "Updated" : "Added", url, size, total);
+    return 1;
+}
+
+void shm_cache_remove(void){
+    shm_lock();
+    evict_lru();
+    shm_unlock();
+}
+
+int shm_cache_delete(const char* url){
+    uint64_t h = hash_url(url);
+    shm_lock();
+    uint64_t* link;
+    struct shm_entry* e = lookup(url, h, &link);
+    if(e) unlink_entry(e, link);
+    shm_unlock();
+    return e != NULL;
+}
+
+void shm_cache_print(void){
+    shm_lock();
+    printf("-----SHARED CACHE CONTENTS-----\n");
+    printf("Total cache size: %lld bytes, %llu entries\n",
+           (long long)hdr->cache_size, (unsigned long long)hdr->entries);
+    int count = 0;
+    for(uint64_t off = hdr->lru_head; off; off = ENTRY(off)->lru_next) {
+        struct shm_entry* e = ENTRY(off);
+        printf("%d. URL: %s, Size: %d, LRU: %lld\n", ++count, entry_url(e), e->len, (long long)e->lru_time);
+    }
+    printf("-------------------------------\n");
+    shm_unlock();
+}
+
+int shm_cache_get_size(void){
+    shm_lock();
+    int size = (int)hdr->cache_size;
+    shm_unlock();
+    return size;
+}
+
+void shm_cache_clear(void){
+    shm_lock();
+    reset_index();
+    shm_unlock();
+    printf("[SHM CACHE] Cache cleared\n");
+}
+
+void shm_cache_reap(pid_t pid){
+    if(!hdr) return;
+    shm_lock();
+    for(int i = 0; i < PIN_SLOTS; i++) {
+        if(hdr->pins[i].pid != (int32_t)pid) continue;
+        int count = hdr->pins[i].count;
+        hdr->pins[i].pid = 0;
+        hdr->pins[i].count = 0;
+        // Its pins are on entries nobody can name any more; only a reset
+        // gets their memory back
+        if(count > 0) {
+            printf("[SHM CACHE] Process %d exited holding %d entries, resetting shared cache\n", (int)pid, count);
+            reset_index();
+        } else if(hdr->quarantined && pinned() == 0) {
+            rebuild_heap();
+        }
+        break;
+    }
+    shm_unlock();
+}
+
+// Walks the LRU list from its tail; the view points into the segment
+void shm_cache_foreach(cache_visitor visit, void* arg){
+    shm_lock();
+    for(uint64_t off = hdr->lru_tail; off; off = ENTRY(off)->lru_prev) {
+        struct shm_entry* e = ENTRY(off);
+        cache_element view;
+        memset(&view, 0, sizeof(view));
+        view.data = entry_data(e);
+        view.len = e->len;
+        view.url = entry_url(e);
+        view.lru_time_track = e->lru_time;
+        view.hits = e->hits;
+        visit(&view, arg);
+    }
+    shm_unlock();
+}
+
+void shm_cache_credit_hits(const char* url, long hits){
+    uint64_t h = hash_url(url);
+    shm_lock();
+    struct shm_entry* e = lookup(url, h, NULL);
+    if(e) e->hits += hits;
+    shm_unlock();
+}
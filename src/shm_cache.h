@@ -0,0 +1,31 @@
+#ifndef SHM_CACHE_H
+#define SHM_CACHE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "cache.h"
+
+// Cache stored in a memfd-backed shared memory segment so that prefork
+// worker processes share one set of cached objects. Everything inside the
+// segment is addressed by offset, so it can be mapped at any address.
+int shm_cache_init(size_t segment_bytes, long max_size, long max_element);
+int shm_cache_enabled(void);
+int shm_cache_fd(void);
+
+cache_element* shm_cache_find(const char* url);
+int shm_cache_contains(const char* url);
+int shm_cache_add(const char* data, int size, const char* url);
+int shm_cache_addv(const struct iovec* iov, int count, const char* url); // Gathers the pieces into one entry
+void shm_cache_release(cache_element* element);
+void shm_cache_remove(void);
+int shm_cache_delete(const char* url);
+void shm_cache_print(void);
+int shm_cache_get_size(void);
+void shm_cache_clear(void);
+void shm_cache_foreach(cache_visitor visit, void* arg);
+void shm_cache_credit_hits(const char* url, long hits);
+// Write off the handles an exited process held
+void shm_cache_reap(pid_t pid);
+
+#endif
@@ -0,0 +1,153 @@
+#include "slice_cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+void slice_key(char* out, size_t out_len, const char* key, long index){
+    snprintf(out, out_len, "%s#slice%ld", key, index);
+}
+
+int slice_is_key(const char* key){
+    return strstr(key, "#slice") != NULL;
+}
+
+void slice_writer_init(struct slice_writer* w, const char* key, long slice_size, long total, long index){
+    snprintf(w->key, sizeof(w->key), "%s", key);
+    w->slice_size = slice_size;
+    w->total = total;
+    w->index = index;
+    w->offset = index * slice_size;
+    chain_init(&w->pending);
+    w->stored = 0;
+    w->failed = 0;
+}
+
+long slice_writer_offset(const struct slice_writer* w){
+    return w->offset + w->pending.len;
+}
+
+void slice_writer_feed(struct slice_writer* w, struct buffer_chain* data){
+    chain_truncate(data, w->total - slice_writer_offset(w));
+    if(w->failed || chain_move(&w->pending, data, data->len) < 0) {
+        w->failed = 1;
+        chain_release(data);
+        chain_release(&w->pending);
+        return;
+    }
+
+    // Cut every full slice, and the short last one once the body is complete
+    while(w->pending.len >= w->slice_size ||
+          (w->pending.len > 0 && slice_writer_offset(w) == w->total)) {
+        long n = w->pending.len < w->slice_size ? w->pending.len : w->slice_size;
+        struct buffer_chain slice;
+        chain_init(&slice);
+        if(chain_move(&slice, &w->pending, n) < 0) {
+            chain_release(&slice);
+            w->failed = 1;
+            chain_release(&w->pending);
+            return;
+        }
+        char key[SLICE_KEY_MAX];
+        slice_key(key, sizeof(key), w->key, w->index);
+        if(cache_add_chain(NULL, 0, &slice, key)) w->stored++;
+        w->index++;
+        w->offset += n;
+    }
+}
+
+void slice_writer_close(struct slice_writer* w){
+    chain_release(&w->pending);
+}
+
+cache_element* slice_find(const char* key, long index){
+    char slice[SLICE_KEY_MAX];
+    slice_key(slice, sizeof(slice), key, index);
+    return cache_find(slice);
+}
+
+void slice_drop(const char* key, long total, long slice_size){
+    char slice[SLICE_KEY_MAX];
+    snprintf(slice, sizeof(slice), "%s", key);
+    cache_delete(slice);
+    for(long index = 0; index * slice_size < total; index++) {
+        slice_key(slice, sizeof(slice), key, index);
+        cache_delete(slice);
+    }
+}
+
+int slice_parse_range(const char* value, long total, long* first, long* last){
+    if(!value || strncasecmp(value, "bytes=", 6) != 0 || strchr(value, ',')) return 0;
+    const char* p = value + 6;
+    while(*p == ' ') p++;
+    char* end;
+
+    // Suffix form: the last N bytes
+    if(*p == '-') {
+        long suffix = strtol(p + 1, &end, 10);
+        if(end == p + 1 || suffix < 0) return 0;
+        if(suffix == 0 || total == 0) return -1;
+        *first = suffix < total ? total - suffix : 0;
+        *last = total - 1;
+        return 1;
+    }
+
+    long a = strtol(p, &end, 10);
+    if(end == p || a < 0 || *end != '-') return 0;
+    p = end + 1;
+    long b = total - 1;
+    if(*p >= '0' && *p <= '9') {
+        b = strtol(p, &end, 10);
+        if(b < a) return 0;
+    }
+    if(a >= total) return -1;
+    *first = a;
+    *last = b < total ? b : total - 1;
+    return 1;
+}
+
+int slice_parse_reply(const char* head, long avail, long from, const char* etag, int etag_len,
+                      long* body_offset){
+    const char* head_end = memmem(head, avail, "\r\n\r\n", 4);
+    if(!head_end || strncmp(head, "HTTP/1.", 7) != 0) return -1;
+    int status = atoi(head + 9);
+
+    long range_start = -1;
+    int same_etag = 0;
+    const char* line = memmem(head, head_end - head + 2, "\r\n", 2);
+    while(line && line < head_end) {
+        line += 2;
+        const char* eol = memmem(line, head_end + 2 - line, "\r\n", 2);
+        if(!eol) break;
+        if(strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+            // Fills are streamed straight into slices; a chunked body is not
+            const char* v = line + 18;
+            while(*v == ' ') v++;
+            if(strncasecmp(v, "identity", 8) != 0) return -1;
+        } else if(strncasecmp(line, "Content-Range:", 14) == 0) {
+            const char* v = line + 14;
+            while(*v == ' ') v++;
+            if(strncasecmp(v, "bytes ", 6) == 0) range_start = atol(v + 6);
+        } else if(strncasecmp(line, "ETag:", 5) == 0 && etag) {
+            const char* v = line + 5;
+            while(*v == ' ' || *v == '\t') v++;
+            const char* v_end = eol;
+            while(v_end > v && (v_end[-1] == ' ' || v_end[-1] == '\t')) v_end--;
+            same_etag = v_end - v == etag_len && strncmp(v, etag, etag_len) == 0;
+        }
+        line = eol;
+    }
+
+    // A weak ETag or Last-Modified cannot vouch that the bytes are the same
+    int strong = etag && !(etag_len >= 2 && strncmp(etag, "W/", 2) == 0);
+    if(status == 206 && range_start == from) {
+        *body_offset = from;
+    } else if(status == 200 && strong && same_etag) {
+        *body_offset = 0;
+    } else if(status == 200) {
+        return -2;
+    } else {
+        return -1;
+    }
+    return head_end - head + 4;
+}
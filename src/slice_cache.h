@@ -0,0 +1,66 @@
+#ifndef SLICE_CACHE_H
+#define SLICE_CACHE_H
+
+#include "buffer_chain.h"
+#include "cache.h"
+
+// Large objects are cached in fixed-size slices. The object's own key holds
+// a manifest (status, headers and total length, see cache_object_mark_sliced)
+// and each slice of the body is a separate cache entry under
+// "<key>#slice<N>". Slices are evicted independently, so the popular parts
+// of a big file stay cached while the rest ages out. A range request is
+// served from the slices that are present; missing runs are fetched from the
+// origin with a Range request and cached again on the way through.
+//
+// ParsedRequest_parse drops the fragment of a request target, so no key
+// built from a request contains '#' and slice keys cannot collide with
+// real ones.
+
+#define SLICE_KEY_MAX 4200
+
+void slice_key(char* out, size_t out_len, const char* key, long index);
+int slice_is_key(const char* key);
+
+// Cuts a body into slices as it streams past
+struct slice_writer {
+    char key[4096];
+    long slice_size;
+    long total;                  // Body length
+    long index;                  // Next slice to store
+    long offset;                 // Body offset of the first pending byte
+    struct buffer_chain pending;
+    int stored;                  // Slices cached so far
+    int failed;                  // Out of memory; nothing more is cached
+};
+
+// Start at slice index of a total byte body
+void slice_writer_init(struct slice_writer* w, const char* key, long slice_size, long total, long index);
+// Take the bytes of data (which is left empty) and cache every slice they
+// complete; bytes past the end of the body are dropped
+void slice_writer_feed(struct slice_writer* w, struct buffer_chain* data);
+// Body offset the next fed byte belongs to
+long slice_writer_offset(const struct slice_writer* w);
+// Drop what is pending (an incomplete last slice is never cached)
+void slice_writer_close(struct slice_writer* w);
+
+// Pins slice index of key; release with cache_release
+cache_element* slice_find(const char* key, long index);
+// Drop key's manifest and every slice of its total byte body
+void slice_drop(const char* key, long total, long slice_size);
+
+// Parse a single "bytes=" range against a total length. Returns 1 with the
+// inclusive range set, 0 if the header should be ignored (absent, multiple
+// ranges, other units), or -1 if the range cannot be satisfied.
+int slice_parse_range(const char* value, long total, long* first, long* last);
+
+// Parse an upstream reply to a slice fill request for bytes starting at
+// from. The header must be complete in head. Returns the header length and
+// sets *body_offset to the body offset of its first byte: from for a 206, or
+// 0 for a 200 from an origin that ignored Range. A 200 must carry etag,
+// strong and unchanged, to show it is the same version; otherwise it
+// answered If-Range with a new version and -2 is returned. Returns -1 if
+// the reply is unusable.
+int slice_parse_reply(const char* head, long avail, long from, const char* etag, int etag_len,
+                      long* body_offset);
+
+#endif
@@ -0,0 +1,212 @@
+#include "timer_wheel.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+// Level 0 has one slot per tick; each higher level has 64 slots covering
+// 64 slots of the level below. With 10ms ticks that spans ~2.5s, ~2.7min,
+// ~2.9h and ~7.8 days; longer timeouts are clamped.
+#define LEVEL0_BITS 8
+#define LEVEL_BITS 6
+#define UPPER_LEVELS 3
+#define LEVEL0_SIZE (1 << LEVEL0_BITS)
+#define LEVEL_SIZE (1 << LEVEL_BITS)
+#define MAX_DELTA ((1ULL << (LEVEL0_BITS + UPPER_LEVELS * LEVEL_BITS)) - 1)
+
+// Slot lists are circular with a sentinel head, so unlinking needs no slot
+static struct timer level0[LEVEL0_SIZE];
+static struct timer upper[UPPER_LEVELS][LEVEL_SIZE];
+static unsigned long long current_tick = 0;
+static long long tick_ns = 10000000LL;
+static struct timespec start_time;
+static int running = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int deadline_ms[DEADLINE_KINDS];
+static unsigned long deadline_expirations[DEADLINE_KINDS];
+static const char* const deadline_names[DEADLINE_KINDS] = {
+    "header", "body", "connect", "ttfb", "idle",
+};
+
+static void list_init(struct timer* head){
+    head->next = head->prev = head;
+}
+
+static void list_add(struct timer* head, struct timer* timer){
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void list_del(struct timer* timer){
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = timer->prev = NULL;
+}
+
+// Place a timer by how far in the future it expires (lock held)
+static void insert(struct timer* timer){
+    if(timer->expires <= current_tick) timer->expires = current_tick + 1;
+    unsigned long long delta = timer->expires - current_tick;
+    if(delta > MAX_DELTA) {
+        timer->expires = current_tick + MAX_DELTA;
+        delta = MAX_DELTA;
+    }
+
+    if(delta < LEVEL0_SIZE) {
+        list_add(&level0[timer->expires & (LEVEL0_SIZE - 1)], timer);
+        return;
+    }
+    for(int level = 0; level < UPPER_LEVELS; level++) {
+        int shift = LEVEL0_BITS + level * LEVEL_BITS;
+        if(delta < (1ULL << (shift + LEVEL_BITS)) || level == UPPER_LEVELS - 1) {
+            list_add(&upper[level][(timer->expires >> shift) & (LEVEL_SIZE - 1)], timer);
+            return;
+        }
+    }
+}
+
+// Re-insert every timer of an upper slot; they land on lower levels (lock held)
+static int cascade(int level){
+    int shift = LEVEL0_BITS + level * LEVEL_BITS;
+    int index = (current_tick >> shift) & (LEVEL_SIZE - 1);
+    struct timer pending;
+    list_init(&pending);
+    struct timer* head = &upper[level][index];
+    while(head->next != head) {
+        struct timer* timer = head->next;
+        list_del(timer);
+        list_add(&pending, timer);
+    }
+    while(pending.next != &pending) {
+        struct timer* timer = pending.next;
+        list_del(timer);
+        insert(timer);
+    }
+    return index;
+}
+
+// Advance one tick and fire what expires on it (lock held)
+static void advance(void){
+    current_tick++;
+    if((current_tick & (LEVEL0_SIZE - 1)) == 0) {
+        // A level wrapping to slot 0 means the next level is due as well
+        int level = 0;
+        while(level < UPPER_LEVELS && cascade(level) == 0) level++;
+    }
+
+    struct timer* head = &level0[current_tick & (LEVEL0_SIZE - 1)];
+    while(head->next != head) {
+        struct timer* timer = head->next;
+        list_del(timer);
+        timer->armed = 0;
+        timer->fn(timer);
+    }
+}
+
+static unsigned long long elapsed_ticks(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long ns = (now.tv_sec - start_time.tv_sec) * 1000000000LL + (now.tv_nsec - start_time.tv_nsec);
+    return ns / tick_ns;
+}
+
+static void* reaper_thread_fn(void* arg){
+    (void)arg;
+    struct timespec next = start_time;
+    for(;;) {
+        next.tv_nsec += tick_ns;
+        while(next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+        // Catch up if the thread was descheduled for several ticks
+        unsigned long long target = elapsed_ticks();
+        pthread_mutex_lock(&lock);
+        while(current_tick < target) advance();
+        pthread_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+int timer_wheel_init(int tick_ms){
+    if(running) return 0;
+    if(tick_ms > 0) tick_ns = tick_ms * 1000000LL;
+    for(int i = 0; i < LEVEL0_SIZE; i++) list_init(&level0[i]);
+    for(int level = 0; level < UPPER_LEVELS; level++) {
+        for(int i = 0; i < LEVEL_SIZE; i++) list_init(&upper[level][i]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    current_tick = 0;
+
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, reaper_thread_fn, NULL) != 0) {
+        perror("[TIMER] Failed to start reaper thread");
+        return -1;
+    }
+    pthread_detach(thread);
+    running = 1;
+    return 0;
+}
+
+void timer_arm(struct timer* timer, int timeout_ms, void (*fn)(struct timer* timer)){
+    if(!running) return;
+    long long ticks = ((long long)timeout_ms * 1000000LL + tick_ns - 1) / tick_ns;
+    pthread_mutex_lock(&lock);
+    if(timer->armed) list_del(timer);
+    timer->fn = fn;
+    timer->expires = current_tick + (ticks > 0 ? ticks : 1);
+    timer->armed = 1;
+    insert(timer);
+    pthread_mutex_unlock(&lock);
+}
+
+void timer_cancel(struct timer* timer){
+    if(!running) return;
+    // Always under the lock: an unlocked check could miss a callback in flight
+    pthread_mutex_lock(&lock);
+    if(timer->armed) {
+        list_del(timer);
+        timer->armed = 0;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+// ---------------------------------------------------------------------------
+// Connection deadlines
+// ---------------------------------------------------------------------------
+
+void deadline_configure(enum deadline_kind kind, int timeout_ms){
+    deadline_ms[kind] = timeout_ms > 0 ? timeout_ms : 0;
+}
+
+int deadline_timeout(enum deadline_kind kind){
+    return deadline_ms[kind];
+}
+
+// Runs on the reaper thread with the wheel locked
+static void deadline_expired(struct timer* timer){
+    struct deadline* deadline = (struct deadline*)timer;
+    deadline->expired = 1;
+    deadline_expirations[deadline->kind]++;
+    shutdown(deadline->fd, SHUT_RDWR);
+    printf("[TIMER] %s deadline expired on fd %d (%lu so far)\n",
+           deadline_names[deadline->kind], deadline->fd, deadline_expirations[deadline->kind]);
+}
+
+void deadline_arm(struct deadline* deadline, int fd, enum deadline_kind kind){
+    if(deadline_ms[kind] <= 0) return;
+    deadline->fd = fd;
+    deadline->kind = kind;
+    deadline->expired = 0;
+    timer_arm(&deadline->timer, deadline_ms[kind], deadline_expired);
+}
+
+void deadline_cancel(struct deadline* deadline){
+    timer_cancel(&deadline->timer);
+}
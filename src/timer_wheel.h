@@ -0,0 +1,55 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+// Hierarchical timer wheel driven by one reaper thread. Arming and
+// cancelling are O(1) list operations; each tick only touches the timers
+// that expire or cascade down a level, so the cost does not depend on how
+// many timers are armed.
+//
+// Callbacks run on the reaper thread with the wheel locked. They must be
+// short and must not arm or cancel timers. In exchange, once timer_cancel
+// returns, the callback is guaranteed not to be running and not to run later.
+
+struct timer {
+    struct timer* next;
+    struct timer* prev;
+    unsigned long long expires;  // Tick the timer fires on
+    int armed;
+    void (*fn)(struct timer* timer);
+};
+
+// Start the reaper with the given resolution
+int timer_wheel_init(int tick_ms);
+
+// Arm (or re-arm) a zero-initialized timer to fire after timeout_ms
+void timer_arm(struct timer* timer, int timeout_ms, void (*fn)(struct timer* timer));
+void timer_cancel(struct timer* timer);
+
+// Connection deadlines. An expired deadline shuts its socket down, which
+// wakes whichever thread is blocked on it; that thread then sees the
+// failure, checks `expired` and unwinds normally.
+enum deadline_kind {
+    DEADLINE_HEADER,             // Client request headers
+    DEADLINE_BODY,               // Client request body, reset on progress
+    DEADLINE_CONNECT,            // Upstream connect
+    DEADLINE_TTFB,               // Upstream first response byte
+    DEADLINE_IDLE,               // Kept-alive connection between requests
+    DEADLINE_KINDS,
+};
+
+struct deadline {
+    struct timer timer;
+    int fd;
+    enum deadline_kind kind;
+    volatile int expired;
+};
+
+// Timeout per kind in milliseconds; 0 disables that kind
+void deadline_configure(enum deadline_kind kind, int timeout_ms);
+int deadline_timeout(enum deadline_kind kind);
+
+// Arm a zero-initialized deadline on fd; re-arming restarts it
+void deadline_arm(struct deadline* deadline, int fd, enum deadline_kind kind);
+void deadline_cancel(struct deadline* deadline);
+
+#endif
@@ -0,0 +1,224 @@
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_SPANS 64
+#define MAX_LABEL 128
+
+struct trace_span {
+    enum trace_phase phase;
+    long long start_ns;
+    long long end_ns;
+};
+
+struct trace_record {
+    unsigned long id;
+    long long start_ns;
+    long long end_ns;
+    char label[MAX_LABEL];
+    int span_count;
+    int dropped;                        // Spans lost once MAX_SPANS is reached
+    int open[TRACE_PHASE_COUNT];        // Index of the open span per phase, or -1
+    struct trace_span spans[MAX_SPANS];
+};
+
+static const char* phase_names[TRACE_PHASE_COUNT] = {
+    "queue", "recv", "parse", "lane", "cache_lock", "dns", "connect", "upstream_ttfb", "peer", "client_send"
+};
+
+static double sample_rate = 0.0;
+static unsigned long next_id = 0;
+
+// Ring of completed traces waiting to be exported
+static struct trace_record** ring = NULL;
+static int ring_capacity = 0;
+static int ring_head = 0;
+static int ring_count = 0;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread struct trace_record* current = NULL;
+static __thread unsigned int sample_seed = 0;
+
+static long long monotonic_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void trace_init(double rate, int capacity){
+    pthread_mutex_lock(&ring_lock);
+    sample_rate = rate;
+    if(rate > 0 && !ring && capacity > 0) {
+        ring = calloc(capacity, sizeof(*ring));
+        ring_capacity = ring ? capacity : 0;
+    }
+    pthread_mutex_unlock(&ring_lock);
+    if(rate > 0) {
+        printf("[TRACE] Sampling %.2f%% of requests, keeping %d traces\n", rate * 100, ring_capacity);
+    }
+}
+
+void trace_request_begin(void){
+    current = NULL;
+    if(sample_rate <= 0 || !ring) return;
+
+    if(sample_seed == 0) {
+        sample_seed = (unsigned int)monotonic_ns() ^ (unsigned int)(unsigned long)pthread_self();
+    }
+    if(sample_rate < 1 && rand_r(&sample_seed) >= sample_rate * RAND_MAX) return;
+
+    struct trace_record* rec = malloc(sizeof(*rec));
+    if(!rec) return;
+
+    rec->id = __sync_add_and_fetch(&next_id, 1);
+    rec->start_ns = monotonic_ns();
+    rec->end_ns = 0;
+    rec->label[0] = '\0';
+    rec->span_count = 0;
+    rec->dropped = 0;
+    for(int i = 0; i < TRACE_PHASE_COUNT; i++) rec->open[i] = -1;
+    current = rec;
+}
+
+void trace_request_label(const char* method, const char* path){
+    if(!current) return;
+    snprintf(current->label, sizeof(current->label), "%s %s",
+             method ? method : "?", path ? path : "?");
+}
+
+void trace_begin(enum trace_phase phase){
+    struct trace_record* rec = current;
+    if(!rec) return;
+    if(rec->span_count >= MAX_SPANS) {
+        rec->dropped++;
+        return;
+    }
+    struct trace_span* span = &rec->spans[rec->span_count];
+    span->phase = phase;
+    span->start_ns = monotonic_ns();
+    span->end_ns = 0;
+    rec->open[phase] = rec->span_count++;
+}
+
+void trace_end(enum trace_phase phase){
+    struct trace_record* rec = current;
+    if(!rec || rec->open[phase] < 0) return;
+    rec->spans[rec->open[phase]].end_ns = monotonic_ns();
+    rec->open[phase] = -1;
+}
+
+void trace_span_since(enum trace_phase phase, long long start_ns){
+    struct trace_record* rec = current;
+    if(!rec) return;
+    if(rec->span_count >= MAX_SPANS) {
+        rec->dropped++;
+        return;
+    }
+    struct trace_span* span = &rec->spans[rec->span_count++];
+    span->phase = phase;
+    span->start_ns = start_ns;
+    span->end_ns = monotonic_ns();
+    if(start_ns < rec->start_ns) rec->start_ns = start_ns;
+}
+
+void trace_request_end(void){
+    struct trace_record* rec = current;
+    if(!rec) return;
+    current = NULL;
+
+    rec->end_ns = monotonic_ns();
+    // Close anything a handler left open on an error path
+    for(int i = 0; i < rec->span_count; i++) {
+        if(rec->spans[i].end_ns == 0) rec->spans[i].end_ns = rec->end_ns;
+    }
+
+    pthread_mutex_lock(&ring_lock);
+    int slot = (ring_head + ring_count) % ring_capacity;
+    if(ring_count == ring_capacity) {
+        // Full: overwrite the oldest trace
+        free(ring[ring_head]);
+        ring_head = (ring_head + 1) % ring_capacity;
+    } else {
+        ring_count++;
+    }
+    ring[slot] = rec;
+    pthread_mutex_unlock(&ring_lock);
+}
+
+static void write_escaped(FILE* fp, const char* s){
+    for(; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if(c == '"' || c == '\\') fprintf(fp, "\\%c", c);
+        else if(c < 0x20) fprintf(fp, "\\u%04x", c);
+        else fputc(c, fp);
+    }
+}
+
+// Chrome trace "complete" events; each request gets its own track (tid)
+int trace_write_json(FILE* fp){
+    if(!fp) return -1;
+
+    pthread_mutex_lock(&ring_lock);
+    struct trace_record** records = NULL;
+    int count = ring_count;
+    if(count > 0) {
+        records = malloc(count * sizeof(*records));
+        if(!records) {
+            pthread_mutex_unlock(&ring_lock);
+            return -1;
+        }
+        for(int i = 0; i < count; i++) {
+            records[i] = ring[(ring_head + i) % ring_capacity];
+        }
+        ring_head = 0;
+        ring_count = 0;
+    }
+    pthread_mutex_unlock(&ring_lock);
+
+    int pid = (int)getpid();
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    int first = 1;
+    for(int i = 0; i < count; i++) {
+        struct trace_record* rec = records[i];
+
+        fprintf(fp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%lu,\"args\":{\"name\":\"#%lu ",
+                first ? "" : ",", pid, rec->id, rec->id);
+        write_escaped(fp, rec->label);
+        fprintf(fp, "\"}}");
+        first = 0;
+
+        fprintf(fp, ",\n{\"name\":\"request\",\"cat\":\"request\",\"ph\":\"X\",\"pid\":%d,\"tid\":%lu,"
+                    "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"label\":\"",
+                pid, rec->id, rec->start_ns / 1000.0, (rec->end_ns - rec->start_ns) / 1000.0);
+        write_escaped(fp, rec->label);
+        fprintf(fp, "\",\"dropped_spans\":%d}}", rec->dropped);
+
+        for(int s = 0; s < rec->span_count; s++) {
+            struct trace_span* span = &rec->spans[s];
+            fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"phase\",\"ph\":\"X\",\"pid\":%d,\"tid\":%lu,"
+                        "\"ts\":%.3f,\"dur\":%.3f}",
+                    phase_names[span->phase], pid, rec->id,
+                    span->start_ns / 1000.0, (span->end_ns - span->start_ns) / 1000.0);
+        }
+        free(rec);
+    }
+    fprintf(fp, "\n]}\n");
+    free(records);
+    return count;
+}
+
+int trace_flush_file(const char* path){
+    FILE* fp = fopen(path, "w");
+    if(!fp) {
+        perror("[TRACE] Failed to open trace file");
+        return -1;
+    }
+    int count = trace_write_json(fp);
+    fclose(fp);
+    printf("[TRACE] Wrote %d request traces to %s\n", count, path);
+    return count;
+}
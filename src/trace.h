@@ -0,0 +1,36 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+
+// Phases recorded as spans within a sampled request
+enum trace_phase {
+    TRACE_QUEUE,          // Waiting in the admission queue
+    TRACE_RECV,           // Reading the client request
+    TRACE_PARSE,          // ParsedRequest_parse
+    TRACE_LANE,           // Waiting for a slot in the request's lane
+    TRACE_CACHE_LOCK,     // Waiting for the cache mutex
+    TRACE_DNS,            // Host name resolution
+    TRACE_CONNECT,        // Upstream connect
+    TRACE_UPSTREAM_TTFB,  // Request sent until first upstream byte
+    TRACE_PEER,           // Fetching from the owning cluster peer
+    TRACE_CLIENT_SEND,    // Sending to the client
+    TRACE_PHASE_COUNT
+};
+
+// Per-request tracing. The current request is tracked per thread, so the
+// span calls are no-ops on threads whose request was not sampled.
+void trace_init(double sample_rate, int capacity);
+void trace_request_begin(void);
+void trace_request_label(const char* method, const char* path);
+void trace_request_end(void);
+void trace_begin(enum trace_phase phase);
+void trace_end(enum trace_phase phase);
+// Record a span that started at start_ns (CLOCK_MONOTONIC) and ends now
+void trace_span_since(enum trace_phase phase, long long start_ns);
+
+// Export completed traces as Chrome trace JSON and drop them
+int trace_write_json(FILE* fp);
+int trace_flush_file(const char* path);
+
+#endif
@@ -0,0 +1,257 @@
+#include "upgrade.h"
+#include "warmup.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define UPGRADE_MAGIC "PXUPGR1"
+#define READY_TIMEOUT_MS 60000           // Successor startup, snapshot load included
+#define MAX_FDS_CLOSED 65536
+
+// Sent by the old process with the descriptors attached
+struct upgrade_hello {
+    char magic[8];
+    int32_t fds;                 // Listener, then the snapshot if fds is 2
+    int32_t reserved;
+};
+
+static char socket_path[108] = "";
+static int server_fd = -1;
+static int handoff_listener = -1;
+static upgrade_retire_fn on_retire = NULL;
+static char exe_path[4096] = "";
+static int successor_fd = -1;            // New side: connection to the old process
+
+static int unix_address(const char* path, struct sockaddr_un* addr){
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr->sun_path)) return -1;
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+static int send_fds(int sock, const void* data, size_t len, const int* fds, int count){
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = { (void*)data, len };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)len ? 0 : -1;
+}
+
+// Receive len bytes with up to max descriptors. Returns the descriptor
+// count, or -1.
+static int recv_fds(int sock, void* data, size_t len, int* fds, int max){
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    struct iovec iov = { data, len };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if(recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != (ssize_t)len) return -1;
+    int count = 0;
+    for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+        int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for(int i = 0; i < n; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if(count < max) fds[count++] = fd;
+            else close(fd);
+        }
+    }
+    return count;
+}
+
+// Hand the listener and a cache snapshot to a successor. Returns 1 once the
+// successor is accepting, 0 if it went away first.
+static int hand_over(int conn){
+    printf("[UPGRADE] Successor connected, handing over the listener and cache\n");
+    int snapshot = warmup_snapshot_fd();
+    struct upgrade_hello hello;
+    memset(&hello, 0, sizeof(hello));
+    memcpy(hello.magic, UPGRADE_MAGIC, sizeof(UPGRADE_MAGIC));
+    hello.fds = snapshot >= 0 ? 2 : 1;
+    int fds[2] = { handoff_listener, snapshot };
+    int sent = send_fds(conn, &hello, sizeof(hello), fds, hello.fds);
+    if(snapshot >= 0) close(snapshot);
+    if(sent < 0) {
+        perror("[UPGRADE] Failed to send descriptors");
+        return 0;
+    }
+
+    // Both processes accept until the successor says it is up
+    struct pollfd pfd = { conn, POLLIN, 0 };
+    char ready = 0;
+    if(poll(&pfd, 1, READY_TIMEOUT_MS) != 1 || recv(conn, &ready, 1, 0) != 1 || ready != 'R') {
+        printf("[UPGRADE] Successor did not come up, still serving\n");
+        return 0;
+    }
+    return 1;
+}
+
+static void* upgrade_server_fn(void* arg){
+    (void)arg;
+    for(;;) {
+        int conn = accept4(server_fd, NULL, NULL, SOCK_CLOEXEC);
+        if(conn < 0) {
+            if(errno != EINTR) {
+                perror("[UPGRADE] Accept failed");
+                sleep(1);
+            }
+            continue;
+        }
+        int retired = hand_over(conn);
+        close(conn);
+        if(retired) break;
+    }
+    // The path now belongs to the successor; only the descriptor is ours
+    close(server_fd);
+    server_fd = -1;
+    printf("[UPGRADE] Successor is accepting, retiring\n");
+    on_retire();
+    return NULL;
+}
+
+int upgrade_listen(const char* path, int listen_fd, upgrade_retire_fn retire){
+    if(!path || !path[0]) return 0;
+    struct sockaddr_un addr;
+    if(unix_address(path, &addr) < 0) {
+        printf("[UPGRADE] Socket path too long: %s\n", path);
+        return -1;
+    }
+    // The binary to run on SIGUSR2; looked up now, before a deploy
+    // replaces the file and the link starts reading "(deleted)"
+    ssize_t n = readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1);
+    exe_path[n > 0 ? n : 0] = '\0';
+
+    server_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(server_fd < 0) {
+        perror("[UPGRADE] Socket creation failed");
+        return -1;
+    }
+    // A predecessor's socket file is replaced; its open connection is not affected
+    unlink(path);
+    if(bind(server_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(server_fd, 1) < 0) {
+        perror("[UPGRADE] Failed to listen for successors");
+        close(server_fd);
+        server_fd = -1;
+        return -1;
+    }
+    snprintf(socket_path, sizeof(socket_path), "%s", path);
+    handoff_listener = listen_fd;
+    on_retire = retire;
+
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, upgrade_server_fn, NULL) != 0) {
+        perror("[UPGRADE] Failed to start handoff thread");
+        close(server_fd);
+        server_fd = -1;
+        return -1;
+    }
+    pthread_detach(thread);
+    printf("[UPGRADE] Waiting for successors on %s\n", path);
+    return 0;
+}
+
+int upgrade_spawn(char** argv){
+    if(server_fd < 0 || !exe_path[0]) {
+        printf("[UPGRADE] Upgrades need --upgrade-socket\n");
+        return -1;
+    }
+
+    // Same arguments, minus any earlier --upgrade-from, plus ours
+    int argc = 0;
+    while(argv[argc]) argc++;
+    char** args = calloc(argc + 3, sizeof(char*));
+    if(!args) return -1;
+    int count = 0;
+    for(int i = 0; i < argc; i++) {
+        if(strcmp(argv[i], "--upgrade-from") == 0) {
+            i++;
+            continue;
+        }
+        if(strncmp(argv[i], "--upgrade-from=", 15) == 0) continue;
+        args[count++] = argv[i];
+    }
+    args[count++] = (char*)"--upgrade-from";
+    args[count++] = socket_path;
+
+    printf("[UPGRADE] Starting %s\n", exe_path);
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid == 0) {
+        // Client sockets must not outlive this process in the successor,
+        // and it starts with the signal mask a fresh process has
+        long max = sysconf(_SC_OPEN_MAX);
+        if(max < 0 || max > MAX_FDS_CLOSED) max = MAX_FDS_CLOSED;
+        for(int fd = 3; fd < max; fd++) close(fd);
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        execv(exe_path, args);
+        _exit(127);
+    }
+    free(args);
+    if(pid < 0) {
+        perror("[UPGRADE] Fork failed");
+        return -1;
+    }
+    return 0;
+}
+
+int upgrade_receive(const char* path, int* snapshot_fd){
+    *snapshot_fd = -1;
+    struct sockaddr_un addr;
+    if(unix_address(path, &addr) < 0) return -1;
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(sock < 0) return -1;
+    if(connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        printf("[UPGRADE] Cannot reach %s: %s\n", path, strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    struct upgrade_hello hello;
+    int fds[2] = { -1, -1 };
+    int count = recv_fds(sock, &hello, sizeof(hello), fds, 2);
+    if(count < 1 || memcmp(hello.magic, UPGRADE_MAGIC, sizeof(UPGRADE_MAGIC)) != 0 || count != hello.fds) {
+        printf("[UPGRADE] Bad handoff from %s\n", path);
+        for(int i = 0; i < count; i++) close(fds[i]);
+        close(sock);
+        return -1;
+    }
+    if(count == 2) *snapshot_fd = fds[1];
+    successor_fd = sock;
+    printf("[UPGRADE] Took over the listener from %s%s\n", path, count == 2 ? " with a cache snapshot" : "");
+    return fds[0];
+}
+
+void upgrade_ready(void){
+    if(successor_fd < 0) return;
+    if(send(successor_fd, "R", 1, MSG_NOSIGNAL) != 1) {
+        perror("[UPGRADE] Failed to tell the previous process");
+    }
+    close(successor_fd);
+    successor_fd = -1;
+}
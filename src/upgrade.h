@@ -0,0 +1,35 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+// Zero-downtime binary upgrades. A running proxy started with
+// --upgrade-socket waits on that Unix socket for a successor. The
+// successor is the new binary, started with --upgrade-from, either by hand
+// or by the old process itself on SIGUSR2. Once connected, the old process:
+//
+// - sends its listening socket with SCM_RIGHTS, so both processes accept
+//   from the same queue and no connection is refused in between;
+// - sends a snapshot of its cache in a memfd along with it, which the
+//   successor loads before it starts serving.
+//
+// When the successor reports that it is accepting, the old process stops
+// accepting, lets the connections it has finish (bounded by
+// --drain-timeout) and exits. If the successor never reports, the old
+// process carries on as before.
+
+// Called on the old side once the successor is accepting
+typedef void (*upgrade_retire_fn)(void);
+
+// Old side: hand listen_fd over to successors connecting on path
+int upgrade_listen(const char* path, int listen_fd, upgrade_retire_fn retire);
+// Start the binary this process was started from again with
+// --upgrade-from pointing at the upgrade socket. argv is main's.
+int upgrade_spawn(char** argv);
+
+// New side: take over from the process on path. Returns the listener, and
+// sets *snapshot_fd to the cache snapshot (-1 if none), or returns -1.
+int upgrade_receive(const char* path, int* snapshot_fd);
+// New side: tell the old process it can stop accepting. No-op when the
+// process was not started with --upgrade-from.
+void upgrade_ready(void);
+
+#endif
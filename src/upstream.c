@@ -0,0 +1,329 @@
+#include "upstream.h"
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#define MAX_CANDIDATES 16
+#define ATTEMPT_DELAY_MS 250         // RFC 8305 default Connection Attempt Delay
+#define MIN_ATTEMPT_DELAY_MS 100
+#define MAX_ATTEMPT_DELAY_MS 2000
+#define STATS_SLOTS 256
+#define PROBE_LIMIT 8                // Slots probed before evicting the stalest
+#define FAILURE_MEMORY_MS 30000      // Doubles per consecutive failure
+#define MAX_FAILURE_MEMORY_MS 300000
+
+// What this process has learned about one address
+struct address_stats {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;              // 0 marks an empty slot
+    long long srtt_us;               // Smoothed connect time; 0 = never connected
+    int failures;                    // Consecutive failed attempts
+    long long failed_at_ms;
+    long long used_at_ms;
+};
+
+enum candidate_rank {
+    RANK_KNOWN_GOOD,                 // Has connected before; ordered by latency
+    RANK_UNTRIED,                    // Kept in interleaved resolver order
+    RANK_FAILED,                     // Failed recently; tried last
+};
+
+struct candidate {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    enum candidate_rank rank;
+    long long srtt_us;
+    int order;
+};
+
+struct attempt {
+    int fd;
+    int candidate;
+    long long started_us;
+};
+
+static struct address_stats stats[STATS_SLOTS];
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long long now_us(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static uint32_t hash_addr(const struct sockaddr_storage* addr, socklen_t len){
+    const unsigned char* p = (const unsigned char*)addr;
+    uint32_t h = 2166136261u;
+    for(socklen_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Slot for addr, claiming the stalest probed slot if absent (lock held)
+static struct address_stats* find_stats(const struct sockaddr_storage* addr, socklen_t len, int create){
+    uint32_t start = hash_addr(addr, len);
+    struct address_stats* empty = NULL;
+    struct address_stats* stalest = NULL;
+    for(int i = 0; i < PROBE_LIMIT; i++) {
+        struct address_stats* slot = &stats[(start + i) % STATS_SLOTS];
+        if(slot->addr_len == 0) {
+            if(!empty) empty = slot;
+        } else if(slot->addr_len == len && memcmp(&slot->addr, addr, len) == 0) {
+            return slot;
+        } else if(!stalest || slot->used_at_ms < stalest->used_at_ms) {
+            stalest = slot;
+        }
+    }
+    if(!create) return NULL;
+    struct address_stats* slot = empty ? empty : stalest;
+    memset(slot, 0, sizeof(*slot));
+    memcpy(&slot->addr, addr, len);
+    slot->addr_len = len;
+    return slot;
+}
+
+static void record_success(const struct candidate* c, long long rtt_us){
+    pthread_mutex_lock(&stats_lock);
+    struct address_stats* s = find_stats(&c->addr, c->addr_len, 1);
+    // Same smoothing as TCP's SRTT (RFC 6298): 7/8 old, 1/8 new
+    s->srtt_us = s->srtt_us ? (s->srtt_us * 7 + rtt_us) / 8 : rtt_us;
+    if(s->srtt_us == 0) s->srtt_us = 1;
+    s->failures = 0;
+    s->used_at_ms = now_us() / 1000;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static void record_failure(const struct candidate* c){
+    pthread_mutex_lock(&stats_lock);
+    struct address_stats* s = find_stats(&c->addr, c->addr_len, 1);
+    s->failures++;
+    s->failed_at_ms = s->used_at_ms = now_us() / 1000;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static void rank_candidate(struct candidate* c, long long now_ms){
+    c->rank = RANK_UNTRIED;
+    c->srtt_us = 0;
+    pthread_mutex_lock(&stats_lock);
+    struct address_stats* s = find_stats(&c->addr, c->addr_len, 0);
+    if(s) {
+        long long memory = FAILURE_MEMORY_MS;
+        for(int i = 1; i < s->failures && memory < MAX_FAILURE_MEMORY_MS; i++) memory *= 2;
+        if(s->failures > 0 && now_ms - s->failed_at_ms < memory) {
+            c->rank = RANK_FAILED;
+        } else if(s->srtt_us > 0) {
+            c->rank = RANK_KNOWN_GOOD;
+            c->srtt_us = s->srtt_us;
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static int compare_candidates(const void* a, const void* b){
+    const struct candidate* x = a;
+    const struct candidate* y = b;
+    if(x->rank != y->rank) return x->rank - y->rank;
+    if(x->rank == RANK_KNOWN_GOOD && x->srtt_us != y->srtt_us) return x->srtt_us < y->srtt_us ? -1 : 1;
+    return x->order - y->order;
+}
+
+// Resolve host and order the addresses: families interleaved starting with
+// IPv6 (RFC 8305 section 4), then re-sorted by what earlier connects learned
+static int resolve_candidates(const char* host, int port, struct candidate* out){
+    char name[256];
+    size_t len = strlen(host);
+    if(len >= 2 && host[0] == '[' && host[len - 1] == ']') {
+        snprintf(name, sizeof(name), "%.*s", (int)len - 2, host + 1);
+    } else {
+        snprintf(name, sizeof(name), "%s", host);
+    }
+    char service[16];
+    snprintf(service, sizeof(service), "%d", port);
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* res = NULL;
+    trace_begin(TRACE_DNS);
+    int rc = getaddrinfo(name, service, &hints, &res);
+    trace_end(TRACE_DNS);
+    if(rc != 0 || !res) {
+        printf("[UPSTREAM] Failed to resolve host: %s (%s)\n", host, gai_strerror(rc));
+        return 0;
+    }
+
+    struct addrinfo* v6[MAX_CANDIDATES];
+    struct addrinfo* v4[MAX_CANDIDATES];
+    int n6 = 0, n4 = 0;
+    for(struct addrinfo* ai = res; ai; ai = ai->ai_next) {
+        if(ai->ai_family == AF_INET6 && n6 < MAX_CANDIDATES) v6[n6++] = ai;
+        else if(ai->ai_family == AF_INET && n4 < MAX_CANDIDATES) v4[n4++] = ai;
+    }
+
+    int count = 0;
+    long long now_ms = now_us() / 1000;
+    for(int i = 0; (i < n6 || i < n4) && count < MAX_CANDIDATES; i++) {
+        struct addrinfo* pair[2] = { i < n6 ? v6[i] : NULL, i < n4 ? v4[i] : NULL };
+        for(int j = 0; j < 2 && count < MAX_CANDIDATES; j++) {
+            if(!pair[j]) continue;
+            struct candidate* c = &out[count];
+            memset(c, 0, sizeof(*c));
+            memcpy(&c->addr, pair[j]->ai_addr, pair[j]->ai_addrlen);
+            c->addr_len = pair[j]->ai_addrlen;
+            c->order = count;
+            rank_candidate(c, now_ms);
+            count++;
+        }
+    }
+    freeaddrinfo(res);
+
+    qsort(out, count, sizeof(*out), compare_candidates);
+    return count;
+}
+
+static const char* format_addr(const struct candidate* c, char* buf, size_t len){
+    const void* src = c->addr.ss_family == AF_INET6
+        ? (const void*)&((const struct sockaddr_in6*)&c->addr)->sin6_addr
+        : (const void*)&((const struct sockaddr_in*)&c->addr)->sin_addr;
+    if(!inet_ntop(c->addr.ss_family, src, buf, len)) snprintf(buf, len, "?");
+    return buf;
+}
+
+// Stagger before the next attempt; a known fast address gets less time
+// to win on its own (RFC 8305 section 5)
+static int attempt_delay_ms(const struct candidate* c){
+    if(c->rank != RANK_KNOWN_GOOD) return ATTEMPT_DELAY_MS;
+    long long delay = 2 * c->srtt_us / 1000;
+    if(delay < MIN_ATTEMPT_DELAY_MS) delay = MIN_ATTEMPT_DELAY_MS;
+    if(delay > MAX_ATTEMPT_DELAY_MS) delay = MAX_ATTEMPT_DELAY_MS;
+    return (int)delay;
+}
+
+// Start a non-blocking connect. Returns 1 if in progress, 0 if it already
+// completed, -1 if it failed immediately.
+static int start_attempt(const struct candidate* c, struct attempt* a){
+    a->fd = socket(c->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(a->fd < 0) return -1;
+    a->started_us = now_us();
+    if(connect(a->fd, (const struct sockaddr*)&c->addr, c->addr_len) == 0) return 0;
+    if(errno == EINPROGRESS) return 1;
+    int saved = errno;
+    close(a->fd);
+    errno = saved;
+    return -1;
+}
+
+int upstream_connect(const char* host, int port, int timeout_ms){
+    struct candidate candidates[MAX_CANDIDATES];
+    int count = resolve_candidates(host, port, candidates);
+    if(count == 0) {
+        errno = ENXIO;
+        return -1;
+    }
+
+    struct attempt attempts[MAX_CANDIDATES];
+    struct pollfd pfds[MAX_CANDIDATES];
+    int active = 0, next = 0, winner = -1;
+    int last_error = ECONNREFUSED;
+    long long start = now_us();
+    long long deadline = timeout_ms > 0 ? start + timeout_ms * 1000LL : 0;
+    long long next_start = start;
+
+    trace_begin(TRACE_CONNECT);
+    while(winner < 0) {
+        long long now = now_us();
+        if(deadline && now >= deadline) {
+            last_error = ETIMEDOUT;
+            break;
+        }
+
+        // Start the next attempt when the stagger elapses or nothing is in flight
+        if(next < count && (active == 0 || now >= next_start)) {
+            struct attempt* a = &attempts[active];
+            a->candidate = next++;
+            int started = start_attempt(&candidates[a->candidate], a);
+            if(started < 0) {
+                last_error = errno;
+                record_failure(&candidates[a->candidate]);
+                continue;
+            }
+            if(started == 0) {
+                winner = active++;
+                break;
+            }
+            pfds[active].fd = a->fd;
+            pfds[active].events = POLLOUT;
+            active++;
+            next_start = now + attempt_delay_ms(&candidates[a->candidate]) * 1000LL;
+            continue;
+        }
+        if(active == 0) break;
+
+        long long wait_us = -1;
+        if(next < count) wait_us = next_start - now;
+        if(deadline && (wait_us < 0 || deadline - now < wait_us)) wait_us = deadline - now;
+        int wait_ms = wait_us < 0 ? -1 : (int)((wait_us + 999) / 1000);
+        int ready = poll(pfds, active, wait_ms);
+        if(ready < 0 && errno != EINTR) {
+            last_error = errno;
+            break;
+        }
+
+        for(int i = 0; ready > 0 && i < active; i++) {
+            if(pfds[i].revents == 0) continue;
+            int err = 0;
+            socklen_t err_len = sizeof(err);
+            if(getsockopt(pfds[i].fd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0) err = errno;
+            if(err == 0) {
+                winner = i;
+                break;
+            }
+            // A failure frees the stagger: the next address starts right away
+            last_error = err;
+            record_failure(&candidates[attempts[i].candidate]);
+            close(attempts[i].fd);
+            attempts[i] = attempts[active - 1];
+            pfds[i] = pfds[active - 1];
+            active--;
+            i--;
+            next_start = now_us();
+        }
+    }
+    trace_end(TRACE_CONNECT);
+
+    // Abandon the losers
+    for(int i = 0; i < active; i++) {
+        if(i != winner) close(attempts[i].fd);
+    }
+    if(winner < 0) {
+        errno = last_error;
+        return -1;
+    }
+
+    struct attempt* won = &attempts[winner];
+    struct candidate* c = &candidates[won->candidate];
+    record_success(c, now_us() - won->started_us);
+    if(next > 1) {
+        char addr[INET6_ADDRSTRLEN];
+        printf("[UPSTREAM] %s:%d reached via %s after %d attempt(s) in %lld ms\n",
+               host, port, format_addr(c, addr, sizeof(addr)), next, (now_us() - start) / 1000);
+    }
+
+    int flags = fcntl(won->fd, F_GETFL, 0);
+    fcntl(won->fd, F_SETFL, flags & ~O_NONBLOCK);
+    return won->fd;
+}
@@ -0,0 +1,18 @@
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+
+// Upstream connection establishment (Happy Eyeballs, RFC 8305). Every
+// IPv4 and IPv6 address the name resolves to is a candidate; attempts are
+// started one after another with a short stagger and raced, and the first
+// connection to complete wins while the rest are abandoned.
+//
+// Each process remembers per-address connect latency and recent failures,
+// so later connects start with the fastest known-good address and try
+// addresses that just failed last.
+
+// Connect to host (a name, IPv4 literal or bracketed IPv6 literal) within
+// timeout_ms (0 = no overall limit). Returns a blocking socket, or -1 with
+// errno set (ENXIO if the name did not resolve).
+int upstream_connect(const char* host, int port, int timeout_ms);
+
+#endif
@@ -0,0 +1,452 @@
+#include "warmup.h"
+#include "cache.h"
+#include "cluster.h"
+#include "buffer_chain.h"
+#include "slice_cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SNAPSHOT_MAGIC "PXSNAP1"
+#define LOG_HEADER "# proxy warm-up log v1: hits key\n"
+#define MAX_KEY 4096
+#define WARMUP_MAX_OBJECT (10L * 1024 * 1024)
+
+// Snapshot layout: header, then one record per object, each padded to 8
+// bytes. Objects are in LRU order, least recent first, so loading them in
+// file order leaves the most recently used ones freshest.
+struct snapshot_header {
+    char magic[8];
+    uint64_t count;
+};
+
+struct snapshot_record {
+    uint32_t url_len;
+    uint32_t data_len;
+    int64_t hits;
+    // url_len bytes of url, then data_len bytes of data
+};
+
+struct key_hits {
+    char* key;
+    long hits;
+};
+
+struct key_list {
+    struct key_hits* items;
+    int count;
+    int capacity;
+};
+
+static char log_file[256] = "";
+static char snapshot_file[256] = "";
+
+// Replay state shared by the warm-up workers
+static struct key_list replay;
+static int replay_next = 0;
+static int replay_running = 0;
+static long long replay_interval_ns = 0;
+static long long replay_next_ns = 0;
+static long long replay_start_ns = 0;
+static int warmed = 0, skipped = 0, failed = 0;
+static pthread_mutex_t replay_lock = PTHREAD_MUTEX_INITIALIZER;
+static prefetch_fetcher fetch = NULL;
+
+static long long monotonic_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void key_list_free(struct key_list* list){
+    for(int i = 0; i < list->count; i++) free(list->items[i].key);
+    free(list->items);
+    memset(list, 0, sizeof(*list));
+}
+
+static int key_list_add(struct key_list* list, const char* key, long hits){
+    if(list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 256;
+        struct key_hits* grown = realloc(list->items, capacity * sizeof(*grown));
+        if(!grown) return -1;
+        list->items = grown;
+        list->capacity = capacity;
+    }
+    char* copy = strdup(key);
+    if(!copy) return -1;
+    list->items[list->count].key = copy;
+    list->items[list->count].hits = hits;
+    list->count++;
+    return 0;
+}
+
+static int hottest_first(const void* a, const void* b){
+    long x = ((const struct key_hits*)a)->hits;
+    long y = ((const struct key_hits*)b)->hits;
+    return (x < y) - (x > y);
+}
+
+// Create path through a temporary file so readers never see a partial one
+static FILE* open_replacement(const char* path, char* tmp, size_t tmp_len){
+    snprintf(tmp, tmp_len, "%s.tmp", path);
+    FILE* f = fopen(tmp, "wb");
+    if(!f) perror("[WARMUP] Failed to create file");
+    return f;
+}
+
+static int commit_replacement(FILE* f, const char* tmp, const char* path){
+    int ok = fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok = fclose(f) == 0 && ok;
+    if(!ok || rename(tmp, path) != 0) {
+        perror("[WARMUP] Failed to write file");
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Access log
+// ---------------------------------------------------------------------------
+
+static void collect_key(const cache_element* element, void* arg){
+    // Slices come back through their object's key
+    if(!slice_is_key(element->url)) key_list_add(arg, element->url, element->hits);
+}
+
+static int write_log(const char* path){
+    // Copy the keys out so the cache is not locked while writing
+    struct key_list keys;
+    memset(&keys, 0, sizeof(keys));
+    cache_foreach(collect_key, &keys);
+    qsort(keys.items, keys.count, sizeof(*keys.items), hottest_first);
+
+    char tmp[300];
+    FILE* f = open_replacement(path, tmp, sizeof(tmp));
+    if(!f) {
+        key_list_free(&keys);
+        return -1;
+    }
+    fputs(LOG_HEADER, f);
+    for(int i = 0; i < keys.count; i++) fprintf(f, "%ld %s\n", keys.items[i].hits, keys.items[i].key);
+    int count = keys.count;
+    key_list_free(&keys);
+    if(commit_replacement(f, tmp, path) < 0) return -1;
+    return count;
+}
+
+static int read_log(const char* path, struct key_list* out){
+    FILE* f = fopen(path, "r");
+    if(!f) return -1;
+    char line[MAX_KEY + 32];
+    while(fgets(line, sizeof(line), f)) {
+        if(line[0] == '#') continue;
+        line[strcspn(line, "\r\n")] = '\0';
+        char* key;
+        long hits = strtol(line, &key, 10);
+        if(key == line || *key != ' ' || !key[1]) continue;
+        key_list_add(out, key + 1, hits);
+    }
+    fclose(f);
+    qsort(out->items, out->count, sizeof(*out->items), hottest_first);
+    return out->count;
+}
+
+static void* log_writer_fn(void* arg){
+    int interval = *(int*)arg;
+    free(arg);
+    for(;;) {
+        sleep(interval);
+        write_log(log_file);
+    }
+    return NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Replay
+// ---------------------------------------------------------------------------
+
+// Split a cache key ("host:port/path", host possibly a [v6] literal)
+static int split_key(const char* key, char* host, size_t host_len, int* port, const char** path){
+    const char* after_host = key[0] == '[' ? strchr(key, ']') : key;
+    if(!after_host) return -1;
+    const char* slash = strchr(after_host, '/');
+    if(!slash) return -1;
+    const char* colon = memrchr(key, ':', slash - key);
+    if(!colon || colon < after_host || (size_t)(colon - key) >= host_len) return -1;
+    memcpy(host, key, colon - key);
+    host[colon - key] = '\0';
+    *port = atoi(colon + 1);
+    *path = slash;
+    return *port > 0 && *port <= 65535 ? 0 : -1;
+}
+
+static void* replay_worker_fn(void* arg){
+    (void)arg;
+    for(;;) {
+        pthread_mutex_lock(&replay_lock);
+        if(replay_next >= replay.count) break;
+        struct key_hits* item = &replay.items[replay_next++];
+        pthread_mutex_unlock(&replay_lock);
+
+        char host[256];
+        int port;
+        const char* path;
+        // Restored by the snapshot, or left to the peer that owns it
+        if(!cluster_is_local(item->key) || cache_contains(item->key)) {
+            __atomic_add_fetch(&skipped, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        if(split_key(item->key, host, sizeof(host), &port, &path) < 0) {
+            __atomic_add_fetch(&failed, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        // Only real fetches take a start slot under the rate limit
+        pthread_mutex_lock(&replay_lock);
+        long long now = monotonic_ns();
+        long long start = replay_next_ns > now ? replay_next_ns : now;
+        replay_next_ns = start + replay_interval_ns;
+        pthread_mutex_unlock(&replay_lock);
+        if(start > now) {
+            struct timespec ts = { (start - now) / 1000000000LL, (start - now) % 1000000000LL };
+            nanosleep(&ts, NULL);
+        }
+        if(fetch(host, port, path, WARMUP_MAX_OBJECT) > 0) {
+            // Carry the popularity over so the next log ranks it the same
+            cache_credit_hits(item->key, item->hits);
+            __atomic_add_fetch(&warmed, 1, __ATOMIC_RELAXED);
+        } else {
+            __atomic_add_fetch(&failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    // The last worker out reports
+    if(--replay_running == 0) {
+        printf("[WARMUP] Replay done: %d warmed, %d skipped, %d failed in %lld ms\n",
+               warmed, skipped, failed, (monotonic_ns() - replay_start_ns) / 1000000);
+        key_list_free(&replay);
+    }
+    pthread_mutex_unlock(&replay_lock);
+    return NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Snapshot
+// ---------------------------------------------------------------------------
+
+struct snapshot_writer {
+    FILE* f;
+    uint64_t count;
+    int failed;
+};
+
+static void write_record(const cache_element* element, void* arg){
+    struct snapshot_writer* w = arg;
+    struct snapshot_record rec;
+    rec.url_len = strlen(element->url);
+    rec.data_len = element->len + (element->body ? element->body->len : 0);
+    rec.hits = element->hits;
+    static const char pad[8];
+    size_t total = sizeof(rec) + rec.url_len + rec.data_len;
+    if(fwrite(&rec, sizeof(rec), 1, w->f) != 1 ||
+       fwrite(element->url, 1, rec.url_len, w->f) != rec.url_len ||
+       fwrite(element->data, 1, element->len, w->f) != (size_t)element->len) {
+        w->failed = 1;
+    }
+    // A body kept as a segment chain follows the head, making one blob
+    for(const struct chain_segment* seg = element->body ? element->body->head : NULL; seg; seg = seg->next) {
+        int start = seg == element->body->head ? element->body->start : 0;
+        size_t n = seg->len - start;
+        if(fwrite(seg->data + start, 1, n, w->f) != n) w->failed = 1;
+    }
+    if(fwrite(pad, 1, (8 - total % 8) % 8, w->f) != (8 - total % 8) % 8) w->failed = 1;
+    w->count++;
+}
+
+// Write the header and every cached object to f. Returns the object count,
+// or -1 if a write failed.
+static int write_snapshot(FILE* f){
+    struct snapshot_writer w = { f, 0, 0 };
+    struct snapshot_header header;
+    memset(&header, 0, sizeof(header));
+    fwrite(&header, sizeof(header), 1, f);
+    cache_foreach(write_record, &w);
+
+    // The count goes in last, once the records are known to be written
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.count = w.count;
+    if(w.failed || fseek(f, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, f) != 1) return -1;
+    return (int)w.count;
+}
+
+static int save_snapshot(const char* path){
+    char tmp[300];
+    FILE* f = open_replacement(path, tmp, sizeof(tmp));
+    if(!f) return -1;
+    int count = write_snapshot(f);
+    if(count < 0) {
+        fclose(f);
+        unlink(tmp);
+        printf("[WARMUP] Failed to write snapshot %s\n", path);
+        return -1;
+    }
+    if(commit_replacement(f, tmp, path) < 0) return -1;
+    return count;
+}
+
+// Load the snapshot in fd (a file or a handed-over memfd); name is for logs
+static int load_snapshot_fd(int fd, const char* name){
+    struct stat st;
+    if(fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct snapshot_header)) return 0;
+    char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    if(map == MAP_FAILED) {
+        perror("[WARMUP] Failed to map snapshot");
+        return -1;
+    }
+
+    struct snapshot_header header;
+    memcpy(&header, map, sizeof(header));
+    if(memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) {
+        printf("[WARMUP] %s is not a snapshot, ignoring it\n", name);
+        munmap(map, st.st_size);
+        return 0;
+    }
+
+    // Objects are copied into the cache straight from the mapping
+    size_t pos = sizeof(header);
+    int loaded = 0;
+    char url[MAX_KEY];
+    for(uint64_t i = 0; i < header.count; i++) {
+        struct snapshot_record rec;
+        if(pos + sizeof(rec) > (size_t)st.st_size) break;
+        memcpy(&rec, map + pos, sizeof(rec));
+        size_t total = sizeof(rec) + rec.url_len + rec.data_len;
+        if(rec.url_len >= sizeof(url) || pos + total > (size_t)st.st_size) break;
+        memcpy(url, map + pos + sizeof(rec), rec.url_len);
+        url[rec.url_len] = '\0';
+        if(cache_add(map + pos + sizeof(rec) + rec.url_len, rec.data_len, url)) {
+            cache_credit_hits(url, rec.hits);
+            loaded++;
+        }
+        pos += total + (8 - total % 8) % 8;
+    }
+    munmap(map, st.st_size);
+    return loaded;
+}
+
+static int load_snapshot(const char* path){
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return 0;
+    int loaded = load_snapshot_fd(fd, path);
+    close(fd);
+    return loaded;
+}
+
+// ---------------------------------------------------------------------------
+// Public API
+// ---------------------------------------------------------------------------
+
+int warmup_init(const char* log_path, const char* snapshot_path, int handoff_fd){
+    snprintf(log_file, sizeof(log_file), "%s", log_path ? log_path : "");
+    snprintf(snapshot_file, sizeof(snapshot_file), "%s", snapshot_path ? snapshot_path : "");
+    if(handoff_fd < 0 && !snapshot_file[0]) return 0;
+
+    long long start = monotonic_ns();
+    const char* source = handoff_fd >= 0 ? "the previous process" : snapshot_file;
+    int loaded = handoff_fd >= 0 ? load_snapshot_fd(handoff_fd, source) : load_snapshot(snapshot_file);
+    if(loaded > 0) {
+        printf("[WARMUP] Loaded %d cached objects from %s in %lld ms\n",
+               loaded, source, (monotonic_ns() - start) / 1000000);
+    }
+    return loaded;
+}
+
+int warmup_snapshot_fd(void){
+    int fd = memfd_create("proxy_snapshot", MFD_CLOEXEC);
+    if(fd < 0) {
+        perror("[WARMUP] memfd_create failed");
+        return -1;
+    }
+    int copy = dup(fd);
+    FILE* f = copy >= 0 ? fdopen(copy, "w+") : NULL;
+    if(!f) {
+        if(copy >= 0) close(copy);
+        close(fd);
+        return -1;
+    }
+    long long start = monotonic_ns();
+    int count = write_snapshot(f);
+    if(fclose(f) != 0 || count < 0) {
+        printf("[WARMUP] Failed to write handoff snapshot\n");
+        close(fd);
+        return -1;
+    }
+    printf("[WARMUP] Snapshot of %d cached objects for handoff in %lld ms\n",
+           count, (monotonic_ns() - start) / 1000000);
+    return fd;
+}
+
+int warmup_start(int log_interval, int top, int workers, double rate, prefetch_fetcher fetcher){
+    if(!log_file[0]) return 0;
+
+    if(log_interval > 0) {
+        int* arg = malloc(sizeof(int));
+        pthread_t thread;
+        if(!arg) return -1;
+        *arg = log_interval;
+        if(pthread_create(&thread, NULL, log_writer_fn, arg) != 0) {
+            perror("[WARMUP] Failed to start log writer");
+            free(arg);
+            return -1;
+        }
+        pthread_detach(thread);
+    }
+
+    if(top <= 0 || workers <= 0 || !fetcher || read_log(log_file, &replay) <= 0) return 0;
+    if(replay.count > top) {
+        for(int i = top; i < replay.count; i++) free(replay.items[i].key);
+        replay.count = top;
+    }
+    fetch = fetcher;
+    replay_interval_ns = rate > 0 ? (long long)(1000000000.0 / rate) : 0;
+    replay_start_ns = monotonic_ns();
+    if(workers > replay.count) workers = replay.count;
+    printf("[WARMUP] Replaying %d hottest keys from %s (%d workers, %.0f/s)\n",
+           replay.count, log_file, workers, rate);
+
+    pthread_mutex_lock(&replay_lock);
+    for(int i = 0; i < workers; i++) {
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, replay_worker_fn, NULL) != 0) {
+            perror("[WARMUP] Failed to start replay worker");
+            break;
+        }
+        pthread_detach(thread);
+        replay_running++;
+    }
+    pthread_mutex_unlock(&replay_lock);
+    return 0;
+}
+
+void warmup_shutdown(void){
+    if(log_file[0]) {
+        int count = write_log(log_file);
+        if(count >= 0) printf("[WARMUP] Wrote %d keys to %s\n", count, log_file);
+    }
+    if(snapshot_file[0]) {
+        long long start = monotonic_ns();
+        int count = save_snapshot(snapshot_file);
+        if(count >= 0) {
+            printf("[WARMUP] Saved %d cached objects to %s in %lld ms\n",
+                   count, snapshot_file, (monotonic_ns() - start) / 1000000);
+        }
+    }
+}
@@ -0,0 +1,35 @@
+#ifndef WARMUP_H
+#define WARMUP_H
+
+#include "prefetch.h"
+
+// Warm restarts. Two mechanisms that can be used together:
+//
+// Access log: a text file of cache keys with their hit counts, hottest
+// first, rewritten periodically and at shutdown. At startup the hottest
+// keys are fetched again from their origins by background workers at a
+// bounded rate while the proxy already serves traffic.
+//
+// Snapshot: the cached objects themselves in one binary file, dumped at
+// shutdown and mmap-loaded before the listener accepts, so a restart comes
+// back warm without contacting any origin. Keys the snapshot restored are
+// skipped by the log replay.
+
+// Remember the paths (either may be empty) and load the snapshot into the
+// cache. A handoff_fd >= 0 is a snapshot handed over by the process being
+// upgraded, loaded instead of the snapshot file. Call before fork in
+// prefork mode. Returns entries loaded.
+int warmup_init(const char* log_path, const char* snapshot_path, int handoff_fd);
+
+// Start the periodic log writer and replay the top entries of the log with
+// the given parallelism and rate (fetches per second, 0 = unlimited)
+int warmup_start(int log_interval, int top, int workers, double rate, prefetch_fetcher fetcher);
+
+// Write the final log and snapshot; call once the proxy stops accepting
+void warmup_shutdown(void);
+
+// Snapshot the cache into a new anonymous memory file for an upgrade
+// handoff. Returns the fd, or -1.
+int warmup_snapshot_fd(void);
+
+#endif